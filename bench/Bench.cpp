@@ -0,0 +1,631 @@
+/// @file Bench.cpp
+/// @brief Benchmark and accuracy regression harness
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <memory>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "Fixture.hpp"
+#include "FrameSource.hpp"
+#include "SyncLoop.hpp"
+#include "SyncInstructions.hpp"
+#include "FeatureBackend.hpp"
+#include "avhelpers.hpp"
+#include "IMhelpers.hpp"
+#include "PDFSlides.hpp"
+#include "Profiler.hpp"
+#include "util.hpp"
+
+using std::string;
+using cv::Mat;
+using namespace slidesync;
+
+/// @brief Benchmark settings
+struct BenchOptions
+{
+	/// @brief Number of synthetic slides
+	unsigned int nslides;
+	
+	/// @brief Random seed of the synthetic fixture
+	uint64_t seed;
+	
+	/// @brief Name of the keypoint detection and matching backend
+	string features;
+	
+	/// @brief Directory for every generated file
+	string workdir;
+	
+	/// @brief Name of the JSON report file; empty for none
+	string jsonfname;
+	
+	/// @brief Recorded footage filename; empty for the synthetic fixture
+	string footagefname;
+	
+	/// @brief Recorded slides filename
+	string slidesfname;
+	
+	/// @brief Ground truth synchronization of the recorded footage
+	string truthfname;
+	
+	/// @brief Minimum fraction of frames assigned the right slide
+	double min_accuracy;
+	
+	/// @brief Maximum mean slide change error, in frames
+	double max_error;
+	
+	/// @brief Number of frames to encode in the encoder benchmark; zero to skip it
+	unsigned int encode_frames;
+};
+
+/// @brief Slide change detection quality
+struct Accuracy
+{
+	/// @brief Fraction of frames assigned the right slide
+	double frames;
+	
+	/// @brief Mean distance from a true slide change to its detection, in frames
+	double mean_error;
+	
+	/// @brief Largest distance from a true slide change to its detection, in frames
+	unsigned int max_error;
+	
+	/// @brief Number of true slide changes without a detection
+	unsigned int missed;
+	
+	/// @brief Number of detected slide changes without a true one
+	unsigned int spurious;
+};
+
+/// @brief Seconds elapsed since a time point
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// @brief Peak resident memory of this process so far, in megabytes
+/// 
+/// The peak covers the whole process, so it never goes down from one stage to the next.
+static double peak_rss()
+{
+	struct rusage usage;
+	
+	getrusage(RUSAGE_SELF, &usage);
+	
+#if defined(__APPLE__)
+	return usage.ru_maxrss / (1024.0 * 1024.0);  // bytes on macOS
+#else
+	return usage.ru_maxrss / 1024.0;  // kilobytes on Linux
+#endif
+}
+
+/// @brief Slide shown at every frame according to some instructions
+/// 
+/// @param[in] instructions Synchronization instructions.
+/// @param[in] length Number of frames.
+/// @returns Slide index shown at every frame.
+static std::vector<unsigned int> timeline(SyncInstructions& instructions, unsigned int length)
+{
+	std::vector<unsigned int> slides(length, 0);
+	unsigned int              slide     = 0;
+	unsigned int              timestamp = 0;
+	unsigned int              frame     = 0;
+	
+	for (auto instr = instructions.cbegin(); instr != instructions.cend(); instr++) {
+		timestamp = (instr->relative) ? timestamp + instr->timestamp : instr->timestamp;
+		
+		for (; frame < std::min(timestamp, length); frame++) {
+			slides[frame] = slide;
+		}
+		
+		switch (instr->code) {
+		case SyncInstructionCode::Next:
+			slide += 1;
+			break;
+		
+		case SyncInstructionCode::Previous:
+			slide -= (slide > 0) ? 1 : 0;
+			break;
+		
+		case SyncInstructionCode::GoTo:
+			slide = instr->data;
+			break;
+		
+		default:
+			break;
+		}
+	}
+	
+	for (; frame < length; frame++) {
+		slides[frame] = slide;
+	}
+	
+	return slides;
+}
+
+/// @brief Frames where the shown slide changes, and the slide it changes to
+static std::vector<SlideChange> changes(const std::vector<unsigned int>& slides)
+{
+	std::vector<SlideChange> list;
+	
+	for (unsigned int i = 1; i < slides.size(); i++) {
+		if (slides[i] != slides[i - 1]) {
+			list.push_back(SlideChange{i, slides[i]});
+		}
+	}
+	
+	return list;
+}
+
+/// @brief Compare detected instructions against the ground truth
+/// 
+/// A true slide change is detected if there is a change to the same slide close enough;
+/// each detection accounts for a single true change.
+/// 
+/// @param[in] detected Detected instructions.
+/// @param[in] truth Ground truth instructions.
+/// @param[in] length Number of frames.
+/// @param[in] tolerance Largest distance between a change and its detection, in frames.
+/// @returns Detection quality.
+static Accuracy score(SyncInstructions& detected, SyncInstructions& truth, unsigned int length,
+                      unsigned int tolerance)
+{
+	std::vector<unsigned int> detected_slides  = timeline(detected, length);
+	std::vector<unsigned int> true_slides      = timeline(truth,    length);
+	std::vector<SlideChange>  detected_changes = changes(detected_slides);
+	std::vector<SlideChange>  true_changes     = changes(true_slides);
+	std::vector<bool>         used(detected_changes.size(), false);
+	
+	Accuracy     accuracy = {0, 0, 0, 0, 0};
+	unsigned int correct  = 0;
+	unsigned int found    = 0;
+	double       total    = 0;
+	
+	for (unsigned int i = 0; i < length; i++) {
+		correct += (detected_slides[i] == true_slides[i]) ? 1 : 0;
+	}
+	
+	accuracy.frames = (length > 0) ? (double) correct / length : 1;
+	
+	for (const SlideChange& change : true_changes) {
+		int          best  = -1;
+		unsigned int error = tolerance + 1;
+		
+		for (unsigned int k = 0; k < detected_changes.size(); k++) {
+			unsigned int distance = (detected_changes[k].frame > change.frame) ?
+			                            detected_changes[k].frame - change.frame :
+			                            change.frame - detected_changes[k].frame;
+			
+			if (!used[k] && detected_changes[k].slide == change.slide && distance < error) {
+				best  = k;
+				error = distance;
+			}
+		}
+		
+		if (best < 0) {
+			accuracy.missed += 1;
+			continue;
+		}
+		
+		used[best] = true;
+		found     += 1;
+		total     += error;
+		
+		accuracy.max_error = std::max(accuracy.max_error, error);
+	}
+	
+	accuracy.mean_error = (found > 0) ? total / found : 0;
+	accuracy.spurious   = std::count(used.begin(), used.end(), false);
+	
+	return accuracy;
+}
+
+/// @brief Read a pdf into grayscale slides fitting a frame, through the application's own reader
+/// 
+/// The output slides are read at the output resolution too, as the application does. Nothing is
+/// cached, so every run renders every page.
+/// 
+/// @param[in] filename PDF slides filename.
+/// @param[in] width Frame width.
+/// @param[in] height Frame height.
+/// @param[out] slides Grayscale slides.
+/// @returns True if successful; otherwise, false.
+static bool read_slides(const string& filename, int width, int height, std::vector<Mat>& slides)
+{
+	uint64_t                  filehash;
+	std::vector<Mat>          slides_hires;
+	std::vector<uint64_t>     pagehashes;
+	std::vector<SlidesTarget> targets;
+	
+	if (!hash_file(filename, filehash)) {
+		return false;
+	}
+	
+	targets.push_back({width, height, true,  "", &slides});
+	targets.push_back({1920,  1080,   false, "", &slides_hires});
+	
+	readpdf(filename, filehash, "", targets, pagehashes);
+	
+	return !slides.empty();
+}
+
+/// @brief Write a synthetic deck into a pdf file
+static bool write_deck(const string& filename, const std::vector<Mat>& deck)
+{
+	std::vector<std::vector<unsigned char>> pages(deck.size());
+	
+	for (unsigned int i = 0; i < deck.size(); i++) {
+		Mat rgba;
+		
+		cv::cvtColor(deck[i], rgba, cv::COLOR_BGR2RGBA);
+		pages[i].assign(rgba.data, rgba.data + rgba.total() * rgba.elemSize());
+	}
+	
+	return pdf_write(filename, pages, deck[0].cols, deck[0].rows, 96);
+}
+
+/// @brief Print the usage message
+static void usage(const char* program)
+{
+	std::cerr << "Usage: " << program << " [options]" << std::endl
+	          << "  --nslides N         number of synthetic slides (default 12)" << std::endl
+	          << "  --seed N            synthetic fixture seed (default 1)" << std::endl
+	          << "  --features NAME     keypoint backend (default brisk)" << std::endl
+	          << "  --workdir DIR       directory for generated files (default slidesync_bench.d)" << std::endl
+	          << "  --json FILE         write the results as JSON" << std::endl
+	          << "  --footage FILE      benchmark a recorded footage instead of the synthetic one" << std::endl
+	          << "  --slides FILE       slides pdf of the recorded footage" << std::endl
+	          << "  --truth FILE        ground truth sync file of the recorded footage" << std::endl
+	          << "  --min-accuracy X    fail if fewer frames than this fraction get the right slide" << std::endl
+	          << "  --max-error N       fail if the mean slide change error is above N frames" << std::endl
+	          << "  --encode-frames N   frames for the encoder benchmark, zero to skip (default 300)" << std::endl;
+}
+
+/// @brief Parse the command line
+/// 
+/// @param[in] argc Number of arguments.
+/// @param[in] argv Arguments.
+/// @param[out] options Parsed settings.
+/// @returns True if successful; otherwise, false.
+static bool parse(int argc, char* argv[], BenchOptions& options)
+{
+	options.nslides       = 12;
+	options.seed          = 1;
+	options.features      = "brisk";
+	options.workdir       = "slidesync_bench.d";
+	options.min_accuracy  = 0;
+	options.max_error     = -1;
+	options.encode_frames = 300;
+	
+	for (int i = 1; i < argc; i++) {
+		string option = argv[i];
+		
+		if (i + 1 >= argc) {
+			return false;
+		}
+		
+		string value = argv[++i];
+		
+		if (option == "--nslides") {
+			options.nslides = std::stoul(value);
+		}
+		else if (option == "--seed") {
+			options.seed = std::stoull(value);
+		}
+		else if (option == "--features") {
+			options.features = value;
+		}
+		else if (option == "--workdir") {
+			options.workdir = value;
+		}
+		else if (option == "--json") {
+			options.jsonfname = value;
+		}
+		else if (option == "--footage") {
+			options.footagefname = value;
+		}
+		else if (option == "--slides") {
+			options.slidesfname = value;
+		}
+		else if (option == "--truth") {
+			options.truthfname = value;
+		}
+		else if (option == "--min-accuracy") {
+			options.min_accuracy = std::stod(value);
+		}
+		else if (option == "--max-error") {
+			options.max_error = std::stod(value);
+		}
+		else if (option == "--encode-frames") {
+			options.encode_frames = std::stoul(value);
+		}
+		else {
+			return false;
+		}
+	}
+	
+	if (!options.footagefname.empty() && (options.slidesfname.empty() || options.truthfname.empty())) {
+		std::cerr << "A recorded footage requires --slides and --truth" << std::endl;
+		return false;
+	}
+	
+	if (options.footagefname.empty() && options.nslides < 3) {
+		std::cerr << "The synthetic fixture requires at least three slides" << std::endl;
+		return false;
+	}
+	
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	BenchOptions options;
+	
+	try {
+		if (!parse(argc, argv, options)) {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	catch (const std::exception& e) {
+		usage(argv[0]);
+		return 2;
+	}
+	
+	if (!backend_factory(options.features)) {
+		std::cerr << "Unknown feature backend '" << options.features << "'" << std::endl;
+		return 2;
+	}
+	
+	Magick::InitializeMagick(argv[0]);
+	libav::initialize_ffmpeg();
+	
+	mkdir(options.workdir.c_str(), 0755);
+	
+	const int framewidth  = 1280;
+	const int frameheight = 720;
+	
+	std::vector<Mat>             deck;
+	std::vector<Mat>             slides;
+	std::unique_ptr<FrameSource> footage;
+	std::unique_ptr<FrameSource> probe;
+	SyncInstructions             truth(0);
+	string                       slidesfname = options.slidesfname;
+	
+	// fixture
+	
+	if (options.footagefname.empty()) {
+		deck        = synthetic_deck(options.nslides, 1024, 768, options.seed);
+		slidesfname = options.workdir + std::pathsep + "deck.pdf";
+		
+		SyntheticFootage* synthetic = new SyntheticFootage(&deck, framewidth, frameheight, 30, options.seed);
+		
+		footage.reset(synthetic);
+		probe.reset(new SyntheticFootage(&deck, framewidth, frameheight, 30, options.seed));
+		truth = synthetic->Truth();
+		
+		if (!write_deck(slidesfname, deck)) {
+			std::cerr << "Can't write the synthetic deck; slide reading won't be measured" << std::endl;
+			slidesfname.clear();
+		}
+	}
+	else {
+		footage = open_framesource(options.footagefname);
+		probe   = open_framesource(options.footagefname);
+		
+		if (footage == nullptr || !std::ifstream(options.truthfname).is_open()) {
+			std::cerr << "Can't open the recorded footage or its ground truth" << std::endl;
+			return 2;
+		}
+		
+		truth = SyncInstructions::Load(options.truthfname);
+	}
+	
+	int width  = footage->Width();
+	int height = footage->Height();
+	
+	// slide reading
+	
+	double read_seconds = -1;
+	
+	if (!slidesfname.empty()) {
+		auto start = std::chrono::steady_clock::now();
+		
+		if (read_slides(slidesfname, width, height, slides)) {
+			read_seconds = seconds_since(start);
+		}
+		else {
+			slides.clear();
+		}
+	}
+	
+	double read_rss = peak_rss();
+	
+	if (slides.empty()) {
+		if (deck.empty()) {
+			std::cerr << "Can't read any slide" << std::endl;
+			return 2;
+		}
+		
+		// the pdf round trip failed; the fixture is still usable
+		for (const Mat& page : deck) {
+			double scale = std::min(((double) width) / page.cols, ((double) height) / page.rows);
+			Mat    resized;
+			Mat    gray;
+			
+			cv::resize(page, resized, cv::Size((int) std::round(page.cols * scale),
+			                                   (int) std::round(page.rows * scale)), 0, 0, cv::INTER_AREA);
+			cv::cvtColor(resized, gray, cv::COLOR_BGR2GRAY);
+			slides.push_back(gray);
+		}
+	}
+	
+	// synchronization
+	
+	string   cachefname = options.workdir + std::pathsep + "raw.sync";
+	Profiler profiler;
+	
+	std::remove(cachefname.c_str());
+	
+	SyncLoop syncloop(footage.get(), &slides, cachefname);
+	
+	syncloop.SetProbe(probe.get());
+	syncloop.SetFeatureBackend(backend_factory(options.features));
+	syncloop.SetProfiler(&profiler);
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	syncloop.Run();
+	
+	double           sync_seconds = seconds_since(start);
+	double           sync_rss     = peak_rss();
+	unsigned int     length       = footage->Length();
+	SyncInstructions detected     = syncloop.GetSyncInstructions();
+	Accuracy         accuracy     = score(detected, truth, length, (unsigned int) std::round(3 * footage->Framerate()));
+	double           sync_fps     = length / sync_seconds;
+	double           realtime     = sync_fps / footage->Framerate();
+	
+	// encoding
+	
+	double       encode_fps     = -1;
+	unsigned int encoded_frames = 0;
+	
+	if (options.encode_frames > 0) {
+		libav::EncoderConfig config;
+		string               videofname = options.workdir + std::pathsep + "encode.mp4";
+		Mat                  canvas(720, 1280, CV_8UC3);
+		cv::RNG              rng(options.seed);
+		
+		config.holdframes = false;
+		
+		try {
+			libav::VideoEncoder encoder(videofname, 1280, 720, 30, config);
+			
+			start = std::chrono::steady_clock::now();
+			
+			// distinct frames, so nothing can be skipped
+			for (unsigned int i = 0; i < options.encode_frames; i++) {
+				const Mat& page = (deck.empty()) ? slides[i % slides.size()] : deck[i % deck.size()];
+				Mat        color;
+				
+				if (page.channels() == 1) {
+					cv::cvtColor(page, color, cv::COLOR_GRAY2BGR);
+				}
+				else {
+					color = page;
+				}
+				
+				cv::resize(color, canvas, canvas.size());
+				cv::circle(canvas, cv::Point(rng.uniform(0, 1280), rng.uniform(0, 720)), 40,
+				           cv::Scalar(0, 0, 255), -1);
+				
+				// the image is only converted until it is given a duration
+				encoder << canvas << 1u;
+			}
+			
+			encoder.Close();
+			encode_fps = options.encode_frames / seconds_since(start);
+			
+			// a converted but never encoded frame would go unnoticed in the speed alone
+			encoded_frames = libav::VideoDecoder(videofname).Length();
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Can't benchmark the encoder: " << e.what() << std::endl;
+		}
+	}
+	
+	double encode_rss = peak_rss();
+	
+	// report
+	
+	std::cout << "slide reading       " << ((read_seconds >= 0) ? std::to_string(read_seconds) + " s" : "n/a")
+	          << " (" << slides.size() << " slides)" << std::endl
+	          << "synchronization     " << sync_fps << " fps, " << realtime << "x realtime ("
+	          << length << " frames in " << sync_seconds << " s)" << std::endl
+	          << "frame accuracy      " << 100 * accuracy.frames << " %" << std::endl
+	          << "change error        " << accuracy.mean_error << " frames mean, " << accuracy.max_error
+	          << " frames max" << std::endl
+	          << "missed changes      " << accuracy.missed << std::endl
+	          << "spurious changes    " << accuracy.spurious << std::endl
+	          << "encoding            " << ((encode_fps >= 0) ? std::to_string(encode_fps) + " fps" : "n/a")
+	          << std::endl
+	          << "peak memory so far  " << read_rss << " MB after reading, " << sync_rss << " MB after synchronizing, "
+	          << encode_rss << " MB after encoding" << std::endl;
+	
+	if (!options.jsonfname.empty()) {
+		std::ofstream json(options.jsonfname);
+		
+		json << "{" << std::endl
+		     << "  \"fixture\": \"" << ((options.footagefname.empty()) ? "synthetic" : "recorded") << "\"," << std::endl
+		     << "  \"features\": \"" << options.features << "\"," << std::endl
+		     << "  \"frames\": " << length << "," << std::endl
+		     << "  \"slides\": " << slides.size() << "," << std::endl
+		     << "  \"read_seconds\": " << read_seconds << "," << std::endl
+		     << "  \"sync_seconds\": " << sync_seconds << "," << std::endl
+		     << "  \"sync_fps\": " << sync_fps << "," << std::endl
+		     << "  \"realtime_factor\": " << realtime << "," << std::endl
+		     << "  \"frame_accuracy\": " << accuracy.frames << "," << std::endl
+		     << "  \"mean_change_error\": " << accuracy.mean_error << "," << std::endl
+		     << "  \"max_change_error\": " << accuracy.max_error << "," << std::endl
+		     << "  \"missed_changes\": " << accuracy.missed << "," << std::endl
+		     << "  \"spurious_changes\": " << accuracy.spurious << "," << std::endl
+		     << "  \"encode_fps\": " << encode_fps << "," << std::endl
+		     << "  \"encoded_frames\": " << encoded_frames << "," << std::endl
+		     << "  \"cumulative_peak_rss_mb\": {\"read\": " << read_rss << ", \"sync\": " << sync_rss
+		     << ", \"encode\": " << encode_rss << "}" << std::endl
+		     << "}" << std::endl;
+		
+		profiler.SaveSummary(options.workdir + std::pathsep + "profile.json");
+	}
+	
+	// regression thresholds
+	
+	int status = 0;
+	
+	if (accuracy.frames < options.min_accuracy) {
+		std::cerr << "Frame accuracy below " << 100 * options.min_accuracy << " %" << std::endl;
+		status = 1;
+	}
+	
+	if (options.max_error >= 0 && (accuracy.mean_error > options.max_error || accuracy.missed > 0)) {
+		std::cerr << "Slide changes missed or further than " << options.max_error << " frames" << std::endl;
+		status = 1;
+	}
+	
+	if (encode_fps >= 0 && encoded_frames != options.encode_frames) {
+		std::cerr << "The encoder benchmark wrote " << encoded_frames << " of " << options.encode_frames
+		          << " frames" << std::endl;
+		status = 1;
+	}
+	
+	return status;
+}
@@ -0,0 +1,312 @@
+/// @file Fixture.cpp
+/// @brief Synthetic presentation recordings with known slide changes
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+
+#include "Fixture.hpp"
+#include "SyncInstructions.hpp"
+
+using std::string;
+
+namespace slidesync
+{
+
+/// @brief Random word of lowercase letters
+static string random_word(cv::RNG& rng)
+{
+	string word(rng.uniform(2, 10), ' ');
+	
+	for (char& c : word) {
+		c = 'a' + rng.uniform(0, 26);
+	}
+	
+	return word;
+}
+
+std::vector<Mat> synthetic_deck(unsigned int nslides, int width, int height, uint64_t seed)
+{
+	std::vector<Mat> deck;
+	
+	for (unsigned int k = 0; k < nslides; k++) {
+		cv::RNG rng(seed * 7919 + k);
+		Mat     slide(height, width, CV_8UC3, cv::Scalar(255, 255, 255));
+		
+		double unit = height / 768.0;  // layouts are designed for 768 pixel high slides
+		
+		cv::putText(slide, "Slide " + std::to_string(k + 1) + ": " + random_word(rng),
+		            cv::Point(60 * unit, 100 * unit), cv::FONT_HERSHEY_DUPLEX, 2 * unit,
+		            cv::Scalar(90, 40, 20), (int) std::max(1.0, 3 * unit), cv::LINE_AA);
+		
+		// a column of text lines, leaving the right side for a figure
+		int nlines = rng.uniform(5, 9);
+		
+		for (int i = 0; i < nlines; i++) {
+			string line = "- ";
+			
+			while (line.size() < 28) {
+				line += random_word(rng) + " ";
+			}
+			
+			cv::putText(slide, line, cv::Point(80 * unit, (190 + 60 * i) * unit), cv::FONT_HERSHEY_SIMPLEX,
+			            unit, cv::Scalar(30, 30, 30), (int) std::max(1.0, 2 * unit), cv::LINE_AA);
+		}
+		
+		int nshapes = rng.uniform(3, 7);
+		
+		for (int i = 0; i < nshapes; i++) {
+			cv::Point  center(rng.uniform((int) (650 * unit), width - (int) (60 * unit)),
+			                  rng.uniform((int) (180 * unit), (int) (450 * unit)));
+			cv::Scalar color(rng.uniform(0, 200), rng.uniform(0, 200), rng.uniform(0, 200));
+			int        size = rng.uniform((int) (20 * unit), (int) (70 * unit));
+			
+			if (rng.uniform(0, 2) == 0) {
+				cv::circle(slide, center, size, color, -1, cv::LINE_AA);
+			}
+			else {
+				cv::rectangle(slide, center - cv::Point(size, size / 2), center + cv::Point(size, size / 2),
+				              color, -1, cv::LINE_AA);
+			}
+		}
+		
+		// bar chart
+		int nbars = rng.uniform(4, 9);
+		int left  = (int) (650 * unit);
+		int right = width - (int) (60 * unit);
+		int base  = height - (int) (60 * unit);
+		int step  = (right - left) / nbars;
+		
+		for (int i = 0; i < nbars; i++) {
+			int top = base - rng.uniform((int) (40 * unit), (int) (200 * unit));
+			
+			cv::rectangle(slide, cv::Point(left + i * step + 4, top), cv::Point(left + (i + 1) * step - 4, base),
+			              cv::Scalar(rng.uniform(50, 250), rng.uniform(50, 250), 40), -1);
+		}
+		
+		cv::line(slide, cv::Point(left, base), cv::Point(right, base), cv::Scalar(0, 0, 0), 2);
+		
+		deck.push_back(slide);
+	}
+	
+	return deck;
+}
+
+SyntheticFootage::SyntheticFootage(const std::vector<Mat>* slides, unsigned int width, unsigned int height,
+                                   double framerate, uint64_t seed)
+	: slides(slides),
+	  width(width),
+	  height(height),
+	  framerate(framerate),
+	  seed(seed),
+	  schedule(),
+	  length(0),
+	  background(height, width, CV_8UC3, cv::Scalar(45, 50, 55)),
+	  position(0)
+{
+	cv::RNG rng(seed);
+	
+	unsigned int nslides = slides->size();
+	unsigned int frame   = 0;
+	unsigned int slide   = 0;
+	bool         back    = false;
+	bool         jump    = false;
+	
+	// mostly forward, but a step back and a jump exercise every kind of instruction
+	while (true) {
+		schedule.push_back(SlideChange{frame, slide});
+		frame += (unsigned int) std::round(framerate * rng.uniform(6.0, 14.0));
+		
+		if (!back && slide == nslides / 3) {
+			slide -= 1;
+			back   = true;
+		}
+		else if (!jump && slide == (2 * nslides) / 3 && slide + 2 < nslides) {
+			slide += 2;
+			jump   = true;
+		}
+		else if (slide + 1 < nslides) {
+			slide += 1;
+		}
+		else {
+			break;
+		}
+	}
+	
+	length = frame;
+	
+	// room clutter, so the screen is not the only thing with keypoints
+	for (int i = 0; i < 40; i++) {
+		cv::Point  corner(rng.uniform(0, (int) width), rng.uniform(0, (int) height));
+		cv::Point  size(rng.uniform(10, 120), rng.uniform(10, 120));
+		cv::Scalar color(rng.uniform(20, 120), rng.uniform(20, 120), rng.uniform(20, 120));
+		
+		cv::rectangle(background, corner, corner + size, color, -1);
+	}
+}
+
+const std::vector<SlideChange>& SyntheticFootage::Schedule() const
+{
+	return schedule;
+}
+
+SyncInstructions SyntheticFootage::Truth() const
+{
+	SyncInstructions truth(slides->size(), (unsigned int) std::round(framerate));
+	
+	for (unsigned int i = 1; i < schedule.size(); i++) {
+		if (schedule[i].slide == schedule[i - 1].slide + 1) {
+			truth.Next(schedule[i].frame);
+		}
+		else if (schedule[i].slide + 1 == schedule[i - 1].slide) {
+			truth.Previous(schedule[i].frame);
+		}
+		else {
+			truth.GoTo(schedule[i].frame, schedule[i].slide);
+		}
+	}
+	
+	truth.End(length);
+	
+	return truth;
+}
+
+/// @brief Check if a frame comes before a slide change
+static bool before(unsigned int frame, const SlideChange& change)
+{
+	return frame < change.frame;
+}
+
+Mat SyntheticFootage::Render(unsigned int index) const
+{
+	const double pi = 3.14159265358979323846;
+	
+	auto current = std::upper_bound(schedule.begin(), schedule.end(), index, before) - 1;
+	
+	unsigned int slide = current->slide;
+	const Mat&   image = (*slides)[slide];
+	double       t     = index / framerate;
+	
+	// slow drift and zoom of a handheld or badly fixed camera
+	double dx   = width  * (0.03 * std::sin(2 * pi * t / 17) + 0.015 * std::sin(2 * pi * t / 5.3));
+	double dy   = height * (0.025 * std::sin(2 * pi * t / 11));
+	double zoom = 1 + 0.05 * std::sin(2 * pi * t / 23);
+	
+	// the screen covers the middle of the frame, seen slightly from the left and below
+	double cx = width  / 2.0 + dx;
+	double cy = height / 2.0 + dy;
+	double hw = 0.36 * width  * zoom;
+	double hh = hw * image.rows / image.cols;
+	
+	cv::Point2f source[4] = {{0, 0}, {(float) image.cols, 0}, {(float) image.cols, (float) image.rows},
+	                         {0, (float) image.rows}};
+	cv::Point2f target[4] = {{(float) (cx - hw),        (float) (cy - hh * 0.96)},
+	                         {(float) (cx + hw * 0.97), (float) (cy - hh)},
+	                         {(float) (cx + hw),        (float) (cy + hh)},
+	                         {(float) (cx - hw * 0.98), (float) (cy + hh * 0.98)}};
+	
+	Mat frame = background.clone();
+	
+	cv::warpPerspective(image, frame, cv::getPerspectiveTransform(source, target), frame.size(),
+	                    cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+	
+	// every third slide, the presenter walks across the lower part of the screen halfway through it
+	unsigned int start = current->frame;
+	unsigned int end   = (current + 1 != schedule.end()) ? (current + 1)->frame : length;
+	double       phase = (double) (index - start) / (end - start);
+	
+	if (slide % 3 == 1 && phase > 0.3 && phase < 0.7) {
+		double     x    = (cx - hw) + 2 * hw * (phase - 0.3) / 0.4;
+		cv::Scalar dark(60, 40, 30);
+		
+		cv::ellipse(frame, cv::Point(x, cy + 0.25 * hh), cv::Size(0.06 * hw, 0.08 * hh), 0, 0, 360, dark, -1);
+		cv::rectangle(frame, cv::Point(x - 0.12 * hw, cy + 0.35 * hh), cv::Point(x + 0.12 * hw, height), dark, -1);
+	}
+	
+	Mat noise(frame.size(), CV_16SC3);
+	Mat noisy;
+	
+	cv::RNG rng(seed * 1000003 + index);
+	rng.fill(noise, cv::RNG::NORMAL, cv::Scalar::all(0), cv::Scalar::all(3));
+	
+	frame.convertTo(noisy, CV_16SC3);
+	noisy += noise;
+	noisy.convertTo(frame, CV_8UC3);
+	
+	return frame;
+}
+
+unsigned int SyntheticFootage::Length() const
+{
+	return length;
+}
+
+double SyntheticFootage::Framerate() const
+{
+	return framerate;
+}
+
+unsigned int SyntheticFootage::Width() const
+{
+	return width;
+}
+
+unsigned int SyntheticFootage::Height() const
+{
+	return height;
+}
+
+unsigned int SyntheticFootage::Position() const
+{
+	return position;
+}
+
+bool SyntheticFootage::Read(Mat& frame)
+{
+	if (position >= length) {
+		frame = Mat();
+		return false;
+	}
+	
+	frame     = Render(position);
+	position += 1;
+	
+	return true;
+}
+
+void SyntheticFootage::Skip(unsigned int n)
+{
+	position = std::min(position + n, length);
+}
+
+bool SyntheticFootage::Seek(unsigned int index)
+{
+	if (index > length) {
+		return false;
+	}
+	
+	position = index;
+	
+	return true;
+}
+
+}
@@ -0,0 +1,129 @@
+/// @file Fixture.hpp
+/// @brief Synthetic presentation recordings with known slide changes header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIXTURE_HPP
+#define FIXTURE_HPP 1
+
+#include <vector>
+#include <cstdint>
+
+#include <opencv2/opencv.hpp>
+
+#include "FrameSource.hpp"
+#include "SyncInstructions.hpp"
+
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Moment the presentation moves to a slide
+struct SlideChange
+{
+	/// @brief Frame index
+	unsigned int frame;
+	
+	/// @brief Slide index
+	unsigned int slide;
+};
+
+/// @brief Render a deck of distinctive synthetic slides
+/// 
+/// Every slide has a title, lines of random text, shapes and a bar chart, all seeded, so
+/// the same arguments always give the same deck.
+/// 
+/// @param[in] nslides Number of slides.
+/// @param[in] width Slide width.
+/// @param[in] height Slide height.
+/// @param[in] seed Random seed.
+/// @returns Slides, in 8-8-8-bit BGR format.
+std::vector<Mat> synthetic_deck(unsigned int nslides, int width, int height, uint64_t seed);
+
+/// @brief Recording of a projected synthetic deck, rendered on demand
+/// 
+/// The slides follow a schedule of mostly forward changes, with a step back and a jump, while
+/// the camera drifts and zooms slowly, a presenter occasionally walks in front of the screen,
+/// and every frame gets some sensor noise. Every frame only depends on its index, so seeking
+/// is exact and cheap.
+class SyntheticFootage : public FrameSource
+{
+private:
+	/// @brief Slides observer reference
+	const std::vector<Mat>* slides;
+	
+	/// @brief Frame width
+	unsigned int width;
+	
+	/// @brief Frame height
+	unsigned int height;
+	
+	/// @brief Number of frames per second
+	double framerate;
+	
+	/// @brief Random seed
+	uint64_t seed;
+	
+	/// @brief Slide changes, in order, starting at frame zero
+	std::vector<SlideChange> schedule;
+	
+	/// @brief Number of frames
+	unsigned int length;
+	
+	/// @brief Room around the screen, shared by every frame
+	Mat background;
+	
+	/// @brief Index of the next frame
+	unsigned int position;
+	
+public:
+	/// @brief Construct a SyntheticFootage
+	/// 
+	/// @param[in] slides Slides, in 8-8-8-bit BGR format; at least three.
+	/// @param[in] width Frame width.
+	/// @param[in] height Frame height.
+	/// @param[in] framerate Number of frames per second.
+	/// @param[in] seed Random seed, for the schedule and the noise.
+	SyntheticFootage(const std::vector<Mat>* slides, unsigned int width, unsigned int height,
+	                 double framerate, uint64_t seed);
+	
+	/// @brief Get the slide changes, starting with the first slide at frame zero
+	const std::vector<SlideChange>& Schedule() const;
+	
+	/// @brief Get the ground truth synchronization
+	SyncInstructions Truth() const;
+	
+	/// @brief Render a frame
+	/// 
+	/// @param[in] index Frame index.
+	/// @returns Frame, in 8-8-8-bit BGR format.
+	Mat Render(unsigned int index) const;
+	
+	virtual unsigned int Length() const override;
+	virtual double Framerate() const override;
+	virtual unsigned int Width() const override;
+	virtual unsigned int Height() const override;
+	virtual unsigned int Position() const override;
+	virtual bool Read(Mat& frame) override;
+	virtual void Skip(unsigned int n) override;
+	virtual bool Seek(unsigned int index) override;
+};
+
+}
+
+#endif
@@ -0,0 +1,124 @@
+/// @file BoundedQueue.hpp
+/// @brief Thread-safe fixed-capacity FIFO queue header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BOUNDEDQUEUE_HPP
+#define BOUNDEDQUEUE_HPP 1
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+
+namespace slidesync
+{
+
+/// @brief Thread-safe FIFO queue with a maximum capacity
+/// 
+/// Producers block while the queue is full and consumers block while it is empty,
+/// so a fast stage can never run arbitrarily far ahead of a slow one. Closing the
+/// queue wakes everyone up: further pushes are rejected and pops drain the remaining
+/// elements before failing.
+template <typename T>
+class BoundedQueue
+{
+private:
+	/// @brief Queued elements
+	std::deque<T> elements;
+	
+	/// @brief Maximum number of queued elements
+	unsigned int capacity;
+	
+	/// @brief Whether the queue has been closed
+	bool closed;
+	
+	/// @brief Lock for every internal member
+	std::mutex lock;
+	
+	/// @brief Signal for consumers waiting on an empty queue
+	std::condition_variable notempty;
+	
+	/// @brief Signal for producers waiting on a full queue
+	std::condition_variable notfull;
+	
+public:
+	/// @brief Construct an empty BoundedQueue
+	/// 
+	/// @param[in] capacity Maximum number of queued elements. Must be positive.
+	BoundedQueue(unsigned int capacity)
+		: elements(), capacity(capacity), closed(false), lock(), notempty(), notfull() {}
+	
+	/// @brief Copy constructor. Deleted
+	BoundedQueue(const BoundedQueue& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	BoundedQueue& operator=(const BoundedQueue& that) = delete;
+	
+	/// @brief Append an element, waiting for space if the queue is full
+	/// 
+	/// @param[in] element Element to append.
+	/// @returns True if successful; false if the queue has been closed.
+	bool Push(T element)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		notfull.wait(guard, [this] { return closed || elements.size() < capacity; });
+		
+		if (closed) {
+			return false;
+		}
+		
+		elements.push_back(std::move(element));
+		notempty.notify_one();
+		
+		return true;
+	}
+	
+	/// @brief Remove the oldest element, waiting for one if the queue is empty
+	/// 
+	/// @param[out] element Removed element.
+	/// @returns True if successful; false if the queue has been closed and there are no elements left.
+	bool Pop(T& element)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		notempty.wait(guard, [this] { return closed || !elements.empty(); });
+		
+		if (elements.empty()) {
+			return false;
+		}
+		
+		element = std::move(elements.front());
+		elements.pop_front();
+		notfull.notify_one();
+		
+		return true;
+	}
+	
+	/// @brief Close the queue and wake up every waiting thread
+	void Close()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		closed = true;
+		notempty.notify_all();
+		notfull.notify_all();
+	}
+};
+
+}
+
+#endif
@@ -18,6 +18,8 @@
 // limitations under the License.
 
 #include <memory>
+#include <vector>
+#include <cstring>
 
 #include <opencv2/opencv.hpp>
 
@@ -33,8 +35,10 @@
 #include "OpenGL/glu.h"
 #include "OpenGL/gl.h"
 #else
+#define GL_GLEXT_PROTOTYPES 1
 #include <GL/glu.h>
 #include <GL/gl.h>
+#include <GL/glext.h>
 #endif
 
 #include "CVCanvas.hpp"
@@ -51,20 +55,10 @@ wxEND_EVENT_TABLE()
 namespace slidesync
 {
 
-Mat CVCanvas::Frame()
-{
-	return frame;
-}
-
-void CVCanvas::SetFrame(const Mat& frame)
-{
-	this->frame = frame;
-}
-
 CVCanvas::CVCanvas(wxFrame* parent, wxWindowID id, wxGLAttributes canvas_attributes,
                    wxGLContextAttrs context_attributes)
-	: wxGLCanvas(parent, canvas_attributes, id), frame(), width(0), height(0), textureID(0),
-	  context(new wxGLContext(this, nullptr, &context_attributes))
+	: wxGLCanvas(parent, canvas_attributes, id), width(0), height(0), textureID(0), bufferIDs{0, 0},
+	  next_buffer(0), outlines(), context(new wxGLContext(this, nullptr, &context_attributes))
 {
 	
     SetBackgroundStyle(wxBG_STYLE_CUSTOM);
@@ -77,8 +71,7 @@ void CVCanvas::Initialize(int width, int height)
 	
 	SetCurrent(*context);
 	
-	frame.create(height, width, CV_8UC4);
-	frame = cv::Vec4b(0, 0, 0, 255);
+	Mat black(height, width, CV_8UC4, cv::Scalar(0, 0, 0, 255));
 	
 	glEnable(GL_TEXTURE_2D);
 	
@@ -97,30 +90,85 @@ void CVCanvas::Initialize(int width, int height)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0); 
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, frame.data);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, black.data);
+	
+	// large enough for the widest supported format
+	glGenBuffers(2, bufferIDs);
+	
+	for (GLuint buffer : bufferIDs) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, width * height * 4, nullptr, GL_STREAM_DRAW);
+	}
+	
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
-bool CVCanvas::UpdateGL()
+bool CVCanvas::UpdateGL(const Mat& frame, const std::vector<QuadOutline>& outlines)
 {
+	GLenum format;
+	
+	switch (frame.type()) {
+	case CV_8UC1:
+		format = GL_LUMINANCE;
+		break;
+	
+	case CV_8UC3:
+		format = GL_BGR;
+		break;
+	
+	case CV_8UC4:
+		format = GL_RGBA;
+		break;
+	
+	default:
+		return false;
+	}
+	
+	if (frame.cols != width || frame.rows != height) {
+		return false;
+	}
+	
 	SetCurrent(*context);
 	
-	if (frame.cols != width || frame.rows != height || frame.type() != CV_8UC4) {
+	GLuint buffer  = bufferIDs[next_buffer];
+	size_t rowsize = width * frame.elemSize();
+	
+	next_buffer = (next_buffer + 1) % 2;
+	
+	// alternating buffers, the one written now is not the one the previous upload may still read
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, width * height * 4, nullptr, GL_STREAM_DRAW);
+	
+	unsigned char* pixels = static_cast<unsigned char*>(glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY));
+	
+	if (pixels == nullptr) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 		return false;
 	}
 	
+	if (frame.isContinuous()) {
+		std::memcpy(pixels, frame.data, rowsize * height);
+	}
+	else {
+		for (int i = 0; i < height; i++) {
+			std::memcpy(pixels + i * rowsize, frame.ptr(i), rowsize);
+		}
+	}
+	
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	
+	// with a pixel buffer bound, the data argument is an offset into it and the call returns right away
 	glBindTexture(GL_TEXTURE_2D, textureID);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, frame.data);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, nullptr);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	
+	this->outlines = outlines;
+	
 	RenderNow();
 	
 	return true;
 }
 
-bool CVCanvas::UpdateGL(const Mat& frame)
-{
-	this->frame = frame;
-	return UpdateGL();
-}
-
 void CVCanvas::RenderNow()
 {
 	wxClientDC dc(this);
@@ -163,6 +211,9 @@ void CVCanvas::render(wxDC& dc)
 	
 	prepare_viewport(0, 0, size.x, size.y);
 	
+	// the texture is modulated by the current color, which the outlines change
+	glColor4f(1, 1, 1, 1);
+	
 	glBegin(GL_QUADS);
 	glTexCoord2f(0, 0); glVertex2f(0,      0);
 	glTexCoord2f(0, 1); glVertex2f(0,      size.y);
@@ -170,6 +221,27 @@ void CVCanvas::render(wxDC& dc)
 	glTexCoord2f(1, 0); glVertex2f(size.x, 0);
 	glEnd();
 	
+	if (!outlines.empty() && width > 0 && height > 0) {
+		float scalex = (float) size.x / width;
+		float scaley = (float) size.y / height;
+		
+		glDisable(GL_TEXTURE_2D);
+		
+		for (const QuadOutline& outline : outlines) {
+			glColor4ub(outline.color[0], outline.color[1], outline.color[2], outline.color[3]);
+			
+			glBegin(GL_LINE_LOOP);
+			
+			for (const cv::Point2f& vertex : outline.vertices) {
+				glVertex2f(vertex.x * scalex, vertex.y * scaley);
+			}
+			
+			glEnd();
+		}
+		
+		glEnable(GL_TEXTURE_2D);
+	}
+	
 	SwapBuffers();
 }
 
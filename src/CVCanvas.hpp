@@ -21,6 +21,7 @@
 #define CVCANVAS_HPP 1
 
 #include <memory>
+#include <vector>
 
 #include <opencv2/opencv.hpp>
 
@@ -36,10 +37,14 @@
 #include "OpenGL/glu.h"
 #include "OpenGL/gl.h"
 #else
+#define GL_GLEXT_PROTOTYPES 1
 #include <GL/glu.h>
 #include <GL/gl.h>
+#include <GL/glext.h>
 #endif
 
+#include "ProcessLoop.hpp"
+
 using std::string;
 using cv::Mat;
 
@@ -47,12 +52,13 @@ namespace slidesync
 {
 
 /// @brief OpenCV + OpenGL rendered inside wxWidgets
+/// 
+/// Frames are uploaded in their own format through a pair of pixel buffer objects, so the
+/// caller only pays for a copy into driver memory while the previous transfer may still be
+/// running, and outlines are drawn as lines over the texture instead of into the pixels.
 class CVCanvas : public wxGLCanvas
 {
 private:
-	/// @brief Frame as an OpenCV matrix structure
-	Mat frame;
-	
 	/// @brief Frame width
 	int width;
 	
@@ -62,18 +68,21 @@ private:
 	/// @brief OpenGL texture ID
 	GLuint textureID;
 	
+	/// @brief OpenGL pixel buffer object IDs, used alternately for the uploads
+	GLuint bufferIDs[2];
+	
+	/// @brief Index of the pixel buffer object for the next upload
+	unsigned int next_buffer;
+	
+	/// @brief Outlines drawn over the current frame, in frame pixel coordinates
+	std::vector<QuadOutline> outlines;
+	
 	/// @brief OpenGL context
 	std::unique_ptr<wxGLContext> context;
 	
 public:
-	/// @brief Get a copy of the internal frame
-	Mat Frame();
-	
-	/// @brief Set the internal frame to a given value
-	void SetFrame(const Mat& frame);
-	
 	/// @brief Construct a CVCanvas
-	///
+	/// 
 	/// @param[in] parent Parent view element.
 	/// @param[in] id View element ID.
 	/// @param[in] canvas_attributes Arguments for the wxGLCanvas construction.
@@ -87,17 +96,15 @@ public:
 	/// @param[in] height Frame height.
 	void Initialize(int width, int height);
 	
-	/// @brief Update the OpenGL texture to display the current OpenCV frame
+	/// @brief Update the OpenGL texture to display an OpenCV frame
 	/// 
-	/// @returns True if successful, false otherwise. The operation will fail if the current frame
-	///          has a different size than specified at initialization or if it is not 8-bit RGBA.
-	bool UpdateGL();
-	
-	/// @brief Update the OpenCV frame and update the OpenGL texture to display it
+	/// The frame is not kept, so it can be modified or released right afterwards.
 	/// 
-	/// @returns True if successful, false otherwise. The operation will fail if the frame
-	///          has a different size than specified at initialization or if it is not 8-bit RGBA.
-	bool UpdateGL(const Mat& frame);
+	/// @param[in] frame Frame, in 8-bit grayscale, BGR or RGBA format.
+	/// @param[in] outlines Outlines to draw over the frame, in frame pixel coordinates.
+	/// @returns True if successful, false otherwise. The operation will fail if the frame has a
+	///          different size than specified at initialization or an unsupported format.
+	bool UpdateGL(const Mat& frame, const std::vector<QuadOutline>& outlines = std::vector<QuadOutline>());
 	
 	/// @brief Render to screen now, without waiting for the event loop
 	void RenderNow();
@@ -111,7 +118,7 @@ private:
 	
 	/// @brief Render the OpenGL texture to the screen
 	void render(wxDC& evt);
-
+	
 protected:
 	/// @brief Declaration of event signal routing table for CVCanvas
 	wxDECLARE_EVENT_TABLE();
@@ -0,0 +1,287 @@
+/// @file FeatureBackend.cpp
+/// @brief Keypoint extraction and matching backends
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <iterator>
+
+#include <opencv2/opencv.hpp>
+
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
+#include <opencv2/cudafeatures2d.hpp>
+#endif
+
+#include "FeatureBackend.hpp"
+#include "ThreadPool.hpp"
+
+using std::vector;
+using std::string;
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief BRISK detection threshold
+static const int brisk_threshold = 30;
+
+/// @brief BRISK detection octaves
+static const int brisk_octaves = 3;
+
+/// @brief BRISK sampling pattern scale
+static const float brisk_patternscale = 1.0f;
+
+/// @brief Maximum number of ORB keypoints per image
+static const int orb_features = 2000;
+
+/// @brief Minimum number of query descriptors per task when matching on several threads
+static const int min_chunkrows = 256;
+
+FeatureBackend::FeatureBackend()
+	: resident(),
+	  nthreads(1) {}
+
+FeatureBackend::~FeatureBackend() {}
+
+void FeatureBackend::SetResident(const vector<Mat>& descriptors)
+{
+	resident = descriptors;
+}
+
+void FeatureBackend::KnnMatchResident(unsigned int index, const Mat& train,
+                                      vector<vector<cv::DMatch>>& matches, int k)
+{
+	KnnMatch(resident[index], train, matches, k);
+}
+
+void FeatureBackend::SetThreads(unsigned int nthreads)
+{
+	this->nthreads = nthreads;
+}
+
+/// @brief Feature backend running on the CPU, around any OpenCV detector
+/// 
+/// Large matchings are split by query rows over a thread pool of SetThreads() workers, created the
+/// first time it is needed, since most instances (e.g. in the extraction workers) never match anything.
+class CPUBackend : public FeatureBackend
+{
+private:
+	/// @brief Backend configuration identifier
+	string key;
+	
+	/// @brief Keypoint detector and descriptor
+	cv::Ptr<cv::Feature2D> detector;
+	
+	/// @brief Brute force Hamming matcher
+	cv::Ptr<cv::DescriptorMatcher> matcher;
+	
+	/// @brief Matching workers
+	std::unique_ptr<ThreadPool> pool;
+	
+	/// @brief Guard for the creation of pool
+	std::once_flag poolonce;
+	
+public:
+	/// @brief Construct a CPUBackend
+	/// 
+	/// @param[in] key Backend configuration identifier.
+	/// @param[in] detector Keypoint detector and descriptor; its descriptors must be binary.
+	CPUBackend(const string& key, cv::Ptr<cv::Feature2D> detector)
+		: key(key),
+		  detector(detector),
+		  matcher(cv::DescriptorMatcher::create("BruteForce-Hamming")),
+		  pool(),
+		  poolonce() {}
+	
+	virtual string Key() const override
+	{
+		return key;
+	}
+	
+	virtual void Detect(const Mat& image, vector<cv::KeyPoint>& keypoints, Mat& descriptors) override
+	{
+		detector->detectAndCompute(image, cv::noArray(), keypoints, descriptors);
+	}
+	
+	virtual void KnnMatch(const Mat& query, const Mat& train, vector<vector<cv::DMatch>>& matches, int k) override
+	{
+		// the matcher clones itself for every explicit train set, so this is safe to call concurrently
+		if (nthreads <= 1 || query.rows < 2 * min_chunkrows) {
+			matcher->knnMatch(query, train, matches, k);
+			return;
+		}
+		
+		std::call_once(poolonce, [this] { pool.reset(new ThreadPool(nthreads)); });
+		
+		unsigned int                       nchunks = std::min<unsigned int>(pool->Size(), query.rows / min_chunkrows);
+		vector<vector<vector<cv::DMatch>>> chunks(nchunks);
+		
+		pool->ParallelFor(nchunks, [&](unsigned int i) {
+			int start = i       * query.rows / nchunks;
+			int end   = (i + 1) * query.rows / nchunks;
+			
+			matcher->knnMatch(query.rowRange(start, end), train, chunks[i], k);
+			
+			for (vector<cv::DMatch>& neighbors : chunks[i]) {
+				for (cv::DMatch& match : neighbors) {
+					match.queryIdx += start;
+				}
+			}
+		});
+		
+		matches.clear();
+		
+		for (vector<vector<cv::DMatch>>& chunk : chunks) {
+			std::move(chunk.begin(), chunk.end(), std::back_inserter(matches));
+		}
+	}
+};
+
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
+
+/// @brief Feature backend running ORB and brute force matching on a CUDA device
+/// 
+/// Resident descriptors are uploaded once and stay on the device. The last train set is kept
+/// there too, so matching one frame against several slides only uploads the frame once.
+/// The device calls are serialized, since they all share the default stream.
+class CUDABackend : public FeatureBackend
+{
+private:
+	/// @brief Keypoint detector and descriptor
+	cv::Ptr<cv::cuda::ORB> detector;
+	
+	/// @brief Brute force Hamming matcher
+	cv::Ptr<cv::cuda::DescriptorMatcher> matcher;
+	
+	/// @brief Resident descriptors, on the device
+	vector<cv::cuda::GpuMat> resident_device;
+	
+	/// @brief Last train set, on the host
+	/// 
+	/// Holding a reference keeps its buffer from being reused by another matrix,
+	/// so a matching data pointer always means the same descriptors.
+	Mat lasttrain;
+	
+	/// @brief Last train set, on the device
+	cv::cuda::GpuMat lasttrain_device;
+	
+	/// @brief Lock for the device and the cached train set
+	std::mutex lock;
+	
+public:
+	/// @brief Construct a CUDABackend
+	CUDABackend()
+		: detector(cv::cuda::ORB::create(orb_features)),
+		  matcher(cv::cuda::DescriptorMatcher::createBFMatcher(cv::NORM_HAMMING)),
+		  resident_device(),
+		  lasttrain(),
+		  lasttrain_device(),
+		  lock() {}
+	
+	virtual string Key() const override
+	{
+		return "CUDA ORB " + std::to_string(orb_features);
+	}
+	
+	virtual void Detect(const Mat& image, vector<cv::KeyPoint>& keypoints, Mat& descriptors) override
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		cv::cuda::GpuMat image_device(image);
+		cv::cuda::GpuMat descriptors_device;
+		
+		detector->detectAndCompute(image_device, cv::noArray(), keypoints, descriptors_device);
+		descriptors_device.download(descriptors);
+	}
+	
+	virtual void KnnMatch(const Mat& query, const Mat& train, vector<vector<cv::DMatch>>& matches, int k) override
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		matcher->knnMatch(cv::cuda::GpuMat(query), upload_train(train), matches, k);
+	}
+	
+	virtual void SetResident(const vector<Mat>& descriptors) override
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		resident = descriptors;
+		resident_device.clear();
+		
+		for (const Mat& set : descriptors) {
+			resident_device.push_back(cv::cuda::GpuMat(set));
+		}
+	}
+	
+	virtual void KnnMatchResident(unsigned int index, const Mat& train,
+	                              vector<vector<cv::DMatch>>& matches, int k) override
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		matcher->knnMatch(resident_device[index], upload_train(train), matches, k);
+	}
+	
+private:
+	/// @brief Get a train set on the device, uploading it only if it is not the last one
+	/// 
+	/// Must be called with the lock held.
+	const cv::cuda::GpuMat& upload_train(const Mat& train)
+	{
+		if (train.data != lasttrain.data || train.rows != lasttrain.rows || train.cols != lasttrain.cols) {
+			lasttrain = train;
+			lasttrain_device.upload(train);
+		}
+		
+		return lasttrain_device;
+	}
+};
+
+#endif
+
+BackendFactory backend_factory(const string& name)
+{
+	if (name == "brisk") {
+		return [] {
+			return std::unique_ptr<FeatureBackend>(new CPUBackend("BRISK " + std::to_string(brisk_threshold) + " " +
+			                                                               std::to_string(brisk_octaves)   + " " +
+			                                                               std::to_string(brisk_patternscale),
+			                                                      cv::BRISK::create(brisk_threshold, brisk_octaves,
+			                                                                        brisk_patternscale)));
+		};
+	}
+	
+	if (name == "orb") {
+		return [] {
+			return std::unique_ptr<FeatureBackend>(new CPUBackend("ORB " + std::to_string(orb_features),
+			                                                      cv::ORB::create(orb_features)));
+		};
+	}
+	
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
+	if (name == "cuda" && cv::cuda::getCudaEnabledDeviceCount() > 0) {
+		return [] { return std::unique_ptr<FeatureBackend>(new CUDABackend()); };
+	}
+#endif
+	
+	return BackendFactory();
+}
+
+}
@@ -0,0 +1,120 @@
+/// @file FeatureBackend.hpp
+/// @brief Keypoint extraction and matching backends header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FEATUREBACKEND_HPP
+#define FEATUREBACKEND_HPP 1
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include <opencv2/opencv.hpp>
+
+using std::string;
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Keypoint detector, descriptor and matcher, working together
+/// 
+/// The descriptors are always binary (CV_8U) and compared by Hamming distance.
+/// 
+/// A set of "resident" descriptors, i.e. those of the slides, can be handed to the backend once, so
+/// backends with their own memory (e.g. a GPU) don't have to transfer them again for every frame.
+class FeatureBackend
+{
+public:
+	/// @brief Construct a FeatureBackend matching on the calling thread only
+	FeatureBackend();
+	
+	/// @brief Destruct this FeatureBackend
+	virtual ~FeatureBackend();
+	
+	/// @brief Get an identifier of the backend configuration
+	/// 
+	/// Keypoints from backends with different identifiers are not interchangeable.
+	virtual string Key() const = 0;
+	
+	/// @brief Detect keypoints in an image and compute their descriptors
+	/// 
+	/// @param[in] image Grayscale image.
+	/// @param[out] keypoints Detected keypoints.
+	/// @param[out] descriptors Corresponding keypoint descriptors.
+	virtual void Detect(const Mat& image, std::vector<cv::KeyPoint>& keypoints, Mat& descriptors) = 0;
+	
+	/// @brief Find the k nearest train descriptors for every query descriptor
+	/// 
+	/// Safe to call concurrently.
+	/// 
+	/// @param[in] query Query descriptors.
+	/// @param[in] train Train descriptors.
+	/// @param[out] matches Up to k matches for each query descriptor, nearest first.
+	/// @param[in] k Number of neighbors.
+	virtual void KnnMatch(const Mat& query, const Mat& train,
+	                      std::vector<std::vector<cv::DMatch>>& matches, int k) = 0;
+	
+	/// @brief Keep a set of descriptors at hand to be used as queries later
+	/// 
+	/// @param[in] descriptors Descriptors of each set, e.g. of each slide.
+	virtual void SetResident(const std::vector<Mat>& descriptors);
+	
+	/// @brief Find the k nearest train descriptors for every descriptor of a resident set
+	/// 
+	/// Safe to call concurrently.
+	/// 
+	/// @param[in] index Index of the resident set, as given to SetResident().
+	/// @param[in] train Train descriptors.
+	/// @param[out] matches Up to k matches for each resident descriptor, nearest first.
+	/// @param[in] k Number of neighbors.
+	virtual void KnnMatchResident(unsigned int index, const Mat& train,
+	                              std::vector<std::vector<cv::DMatch>>& matches, int k);
+	
+	/// @brief Set the number of threads a single large matching may be split over
+	/// 
+	/// Must be called before any matching. Every concurrent matching shares the same threads, so
+	/// this bounds the matching threads of the backend as a whole.
+	/// 
+	/// @param[in] nthreads Number of threads; one (the default) or zero to match on the calling thread.
+	virtual void SetThreads(unsigned int nthreads);
+	
+protected:
+	/// @brief Resident descriptors, kept on the host
+	std::vector<Mat> resident;
+	
+	/// @brief Number of threads a single matching may be split over
+	unsigned int nthreads;
+};
+
+/// @brief Feature backend constructor
+typedef std::function<std::unique_ptr<FeatureBackend>()> BackendFactory;
+
+/// @brief Get the constructor of a feature backend by name
+/// 
+/// Available backends are "brisk" (default), "orb" and, if OpenCV was built with
+/// CUDA support, "cuda" (ORB on the GPU).
+/// 
+/// @param[in] name Backend name.
+/// @returns Backend constructor; empty if there is no such backend in this build.
+BackendFactory backend_factory(const string& name);
+
+}
+
+#endif
@@ -0,0 +1,328 @@
+/// @file FeatureCache.cpp
+/// @brief Persistent slide keypoint storage
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "FeatureCache.hpp"
+#include "util.hpp"
+
+using std::vector;
+using std::string;
+using cv::Mat;
+
+namespace slidesync
+{
+
+// File layout (native endianness, since the cache never leaves the machine):
+// 
+//     CacheHeader
+//     uint32_t    offsets[nslides + 1]   first keypoint index of each slide, plus total count
+//     (padding to a multiple of block_alignment)
+//     cv::Point2f points[total]
+//     (padding to a multiple of block_alignment)
+//     uint8_t     descriptors[total][descriptor_size]
+// 
+// which is exactly the in-memory layout of a FeatureStore, so the file is mapped as is.
+
+/// @brief Magic number identifying feature cache files ("SSFC")
+static const uint32_t cache_magic = 0x43465353;
+
+/// @brief Feature cache format version
+static const uint32_t cache_version = 2;
+
+/// @brief Alignment of the packed blocks in the cache file, in bytes
+static const size_t block_alignment = 16;
+
+/// @brief Feature cache file header
+struct CacheHeader
+{
+	/// @brief Magic number
+	uint32_t magic;
+	
+	/// @brief Format version
+	uint32_t version;
+	
+	/// @brief Slides and detector identifier
+	uint64_t key;
+	
+	/// @brief Number of slides
+	uint32_t nslides;
+	
+	/// @brief Width of every descriptor, in bytes
+	uint32_t descriptor_size;
+};
+
+/// @brief Position of every block in a feature cache file
+struct CacheLayout
+{
+	/// @brief Start of the slide offsets
+	size_t offsets_start;
+	
+	/// @brief Start of the keypoint positions
+	size_t points_start;
+	
+	/// @brief Start of the descriptors
+	size_t descriptors_start;
+	
+	/// @brief Size of the whole file
+	size_t size;
+};
+
+/// @brief Round a file position up to the alignment of the packed blocks
+static size_t align(size_t position)
+{
+	return (position + block_alignment - 1) / block_alignment * block_alignment;
+}
+
+/// @brief Compute the position of every block in a feature cache file
+/// 
+/// @param[in] nslides Number of slides.
+/// @param[in] total Total number of keypoints.
+/// @param[in] descriptor_size Width of every descriptor, in bytes.
+/// @returns Cache layout.
+static CacheLayout cache_layout(size_t nslides, size_t total, size_t descriptor_size)
+{
+	CacheLayout layout;
+	
+	layout.offsets_start     = sizeof (CacheHeader);
+	layout.points_start      = align(layout.offsets_start + (nslides + 1) * sizeof (uint32_t));
+	layout.descriptors_start = align(layout.points_start  + total * sizeof (cv::Point2f));
+	layout.size              = layout.descriptors_start + total * descriptor_size;
+	
+	return layout;
+}
+
+PointSet::PointSet()
+	: base(nullptr),
+	  stride(sizeof (cv::Point2f)),
+	  count(0) {}
+
+PointSet::PointSet(const vector<cv::KeyPoint>& keypoints)
+	: base((keypoints.empty()) ? nullptr : reinterpret_cast<const char*>(&keypoints[0].pt)),
+	  stride(sizeof (cv::KeyPoint)),
+	  count(keypoints.size()) {}
+
+PointSet::PointSet(const cv::Point2f* points, size_t count)
+	: base(reinterpret_cast<const char*>(points)),
+	  stride(sizeof (cv::Point2f)),
+	  count(count) {}
+
+FeatureStore::FeatureStore()
+	: storage(),
+	  offsets(1, 0),
+	  points(nullptr),
+	  descriptors() {}
+
+FeatureStore::FeatureStore(const vector<vector<cv::KeyPoint>>& keypoints, const vector<Mat>& descriptors)
+	: storage(),
+	  offsets(1, 0),
+	  points(nullptr),
+	  descriptors()
+{
+	int descriptor_size = 0;
+	
+	for (unsigned int i = 0; i < keypoints.size(); i++) {
+		const Mat& slide_descriptors = descriptors.at(i);
+		
+		if (slide_descriptors.rows != (int) keypoints[i].size()) {
+			throw std::invalid_argument("Slide descriptors don't match their keypoints");
+		}
+		
+		if (!slide_descriptors.empty()) {
+			if (slide_descriptors.type() != CV_8U ||
+			    (descriptor_size != 0 && descriptor_size != slide_descriptors.cols)) {
+				throw std::invalid_argument("Slide descriptors must all be 8-bit and the same width");
+			}
+			
+			descriptor_size = slide_descriptors.cols;
+		}
+		
+		offsets.push_back(offsets.back() + keypoints[i].size());
+	}
+	
+	std::shared_ptr<vector<cv::Point2f>> packed(new vector<cv::Point2f>());
+	
+	packed->reserve(offsets.back());
+	
+	for (const vector<cv::KeyPoint>& slide_keypoints : keypoints) {
+		for (const cv::KeyPoint& keypoint : slide_keypoints) {
+			packed->push_back(keypoint.pt);
+		}
+	}
+	
+	storage = packed;
+	points  = packed->data();
+	
+	if (offsets.back() > 0 && descriptor_size > 0) {
+		this->descriptors.create(offsets.back(), descriptor_size, CV_8U);
+		
+		for (unsigned int i = 0; i < keypoints.size(); i++) {
+			if (!descriptors[i].empty()) {
+				descriptors[i].copyTo(this->descriptors.rowRange(offsets[i], offsets[i + 1]));
+			}
+		}
+	}
+}
+
+unsigned int FeatureStore::Size() const
+{
+	return offsets.size() - 1;
+}
+
+unsigned int FeatureStore::Count(unsigned int slide) const
+{
+	return offsets[slide + 1] - offsets[slide];
+}
+
+PointSet FeatureStore::Points(unsigned int slide) const
+{
+	return PointSet(points + offsets[slide], Count(slide));
+}
+
+Mat FeatureStore::Descriptors(unsigned int slide) const
+{
+	if (descriptors.empty()) {
+		return Mat();
+	}
+	
+	return descriptors.rowRange(offsets[slide], offsets[slide + 1]);
+}
+
+const Mat& FeatureStore::AllDescriptors() const
+{
+	return descriptors;
+}
+
+const vector<uint32_t>& FeatureStore::Offsets() const
+{
+	return offsets;
+}
+
+bool FeatureStore::Load(const string& filename, uint64_t key)
+{
+	size_t                      size;
+	std::shared_ptr<const void> file = map_file(filename, size);
+	
+	if (file == nullptr || size < sizeof (CacheHeader)) {
+		return false;
+	}
+	
+	const char* data = static_cast<const char*>(file.get());
+	
+	CacheHeader header;
+	std::memcpy(&header, data, sizeof (CacheHeader));
+	
+	if (header.magic != cache_magic || header.version != cache_version || header.key != key) {
+		return false;
+	}
+	
+	size_t offsets_end = sizeof (CacheHeader) + (header.nslides + 1) * sizeof (uint32_t);
+	
+	if (offsets_end > size) {
+		return false;
+	}
+	
+	vector<uint32_t> file_offsets(header.nslides + 1);
+	std::memcpy(&file_offsets[0], data + sizeof (CacheHeader), (header.nslides + 1) * sizeof (uint32_t));
+	
+	size_t      total  = file_offsets[header.nslides];
+	CacheLayout layout = cache_layout(header.nslides, total, header.descriptor_size);
+	
+	if (layout.size != size || file_offsets[0] != 0) {
+		return false;
+	}
+	
+	for (unsigned int i = 0; i < header.nslides; i++) {
+		if (file_offsets[i] > file_offsets[i + 1]) {
+			return false;
+		}
+	}
+	
+	storage = file;
+	offsets = file_offsets;
+	points  = reinterpret_cast<const cv::Point2f*>(data + layout.points_start);
+	
+	if (total > 0 && header.descriptor_size > 0) {
+		descriptors = Mat(total, header.descriptor_size, CV_8U, const_cast<char*>(data + layout.descriptors_start));
+	}
+	else {
+		descriptors = Mat();
+	}
+	
+	return true;
+}
+
+bool FeatureStore::Save(const string& filename, uint64_t key) const
+{
+	CacheHeader header;
+	
+	header.magic           = cache_magic;
+	header.version         = cache_version;
+	header.key             = key;
+	header.nslides         = Size();
+	header.descriptor_size = descriptors.cols;
+	
+	size_t      total  = offsets.back();
+	CacheLayout layout = cache_layout(header.nslides, total, header.descriptor_size);
+	
+	// write to a temporary file first, so an interrupted write never leaves a corrupt cache behind
+	string        tmpfname = filename + ".tmp";
+	std::ofstream file(tmpfname, std::ios::binary | std::ios::trunc);
+	
+	if (!file.is_open()) {
+		return false;
+	}
+	
+	const char padding[block_alignment] = {0};
+	
+	file.write(reinterpret_cast<const char*>(&header), sizeof (CacheHeader));
+	file.write(reinterpret_cast<const char*>(&offsets[0]), offsets.size() * sizeof (uint32_t));
+	file.write(padding, layout.points_start - (layout.offsets_start + offsets.size() * sizeof (uint32_t)));
+	
+	if (total > 0) {
+		file.write(reinterpret_cast<const char*>(points), total * sizeof (cv::Point2f));
+	}
+	
+	file.write(padding, layout.descriptors_start - (layout.points_start + total * sizeof (cv::Point2f)));
+	
+	for (int k = 0; k < descriptors.rows; k++) {
+		file.write(reinterpret_cast<const char*>(descriptors.ptr(k)), header.descriptor_size);
+	}
+	
+	file.close();
+	
+	if (!file) {
+		std::remove(tmpfname.c_str());
+		return false;
+	}
+	
+	return std::rename(tmpfname.c_str(), filename.c_str()) == 0;
+}
+
+}
@@ -0,0 +1,153 @@
+/// @file FeatureCache.hpp
+/// @brief Persistent slide keypoint storage header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FEATURECACHE_HPP
+#define FEATURECACHE_HPP 1
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+#include <opencv2/opencv.hpp>
+
+using std::string;
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Read-only view over a sequence of points, e.g. the positions of some keypoints
+/// 
+/// The points don't have to be contiguous, only evenly spaced, so both packed point
+/// arrays and the positions inside a cv::KeyPoint array can be viewed without copies.
+class PointSet
+{
+private:
+	/// @brief Address of the first point
+	const char* base;
+	
+	/// @brief Distance between consecutive points, in bytes
+	size_t stride;
+	
+	/// @brief Number of points
+	size_t count;
+	
+public:
+	/// @brief Construct an empty PointSet
+	PointSet();
+	
+	/// @brief Construct a PointSet over the positions of some keypoints
+	/// 
+	/// @param[in] keypoints Keypoints. They must outlive the PointSet.
+	PointSet(const std::vector<cv::KeyPoint>& keypoints);
+	
+	/// @brief Construct a PointSet over a packed point array
+	/// 
+	/// @param[in] points First point. The array must outlive the PointSet.
+	/// @param[in] count Number of points.
+	PointSet(const cv::Point2f* points, size_t count);
+	
+	/// @brief Get the number of points
+	size_t Size() const
+	{
+		return count;
+	}
+	
+	/// @brief Get a point
+	const cv::Point2f& operator[](size_t index) const
+	{
+		return *reinterpret_cast<const cv::Point2f*>(base + index * stride);
+	}
+};
+
+/// @brief Slide keypoints of a whole deck, packed into contiguous blocks
+/// 
+/// Every descriptor lives in a single matrix and every keypoint position in a single point array, with
+/// the slides one after another, so scanning the deck streams through memory. Only the positions of the
+/// keypoints are kept, since nothing else is needed to match them.
+/// 
+/// The cache file has the same layout, so a loaded FeatureStore maps the file directly instead of
+/// copying it; the mapping is released with the last copy of the FeatureStore.
+class FeatureStore
+{
+private:
+	/// @brief Owner of the memory the blocks live in, either a file mapping or a heap buffer
+	std::shared_ptr<const void> storage;
+	
+	/// @brief First keypoint index of each slide, plus the total count
+	std::vector<uint32_t> offsets;
+	
+	/// @brief Keypoint positions of every slide
+	const cv::Point2f* points;
+	
+	/// @brief Keypoint descriptors of every slide, one per row
+	Mat descriptors;
+	
+public:
+	/// @brief Construct an empty FeatureStore
+	FeatureStore();
+	
+	/// @brief Construct a FeatureStore by packing separate slide keypoints
+	/// 
+	/// @param[in] keypoints Keypoints for each slide.
+	/// @param[in] descriptors Corresponding keypoint descriptors for each slide. They must all share
+	///                        the same 8-bit type and width, or be empty.
+	/// @throws std::invalid_argument if the descriptors don't match the keypoints or each other.
+	FeatureStore(const std::vector<std::vector<cv::KeyPoint>>& keypoints, const std::vector<Mat>& descriptors);
+	
+	/// @brief Get the number of slides
+	unsigned int Size() const;
+	
+	/// @brief Get the number of keypoints of a slide
+	unsigned int Count(unsigned int slide) const;
+	
+	/// @brief Get the keypoint positions of a slide
+	PointSet Points(unsigned int slide) const;
+	
+	/// @brief Get the keypoint descriptors of a slide, as a view into the packed block
+	Mat Descriptors(unsigned int slide) const;
+	
+	/// @brief Get the keypoint descriptors of every slide, as a single block
+	const Mat& AllDescriptors() const;
+	
+	/// @brief Get the first keypoint index of each slide in the packed blocks, plus the total count
+	const std::vector<uint32_t>& Offsets() const;
+	
+	/// @brief Map precomputed slide keypoints from a cache file
+	/// 
+	/// @param[in] filename Name of the cache file.
+	/// @param[in] key Identifier of the slides and keypoint detector configuration the cache is expected
+	///                to describe. The cache is rejected if it was generated with a different key.
+	/// @returns True if successful; false if the file doesn't exist, is corrupt or has a different key.
+	///          This FeatureStore is only modified if successful.
+	bool Load(const string& filename, uint64_t key);
+	
+	/// @brief Write the slide keypoints to a cache file
+	/// 
+	/// @param[in] filename Name of the cache file.
+	/// @param[in] key Identifier of the slides and keypoint detector configuration.
+	/// @returns True if successful; otherwise, false.
+	bool Save(const string& filename, uint64_t key) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,305 @@
+/// @file FeaturePipeline.cpp
+/// @brief Multi-threaded frame decoding and feature extraction
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "FeaturePipeline.hpp"
+#include "BoundedQueue.hpp"
+#include "FrameSource.hpp"
+#include "Profiler.hpp"
+
+using std::vector;
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Choose a number of feature extraction threads appropriate for this machine
+static unsigned int default_nworkers()
+{
+	// leave a core for the decoder and another one for the consumer
+	unsigned int ncores = std::thread::hardware_concurrency();
+	
+	return (ncores > 3) ? ncores - 2 : 1;
+}
+
+FeaturePipeline::FeaturePipeline(FrameSource* footage, unsigned int length, unsigned int frameskip,
+                                 bool keepframes, BackendFactory create_backend,
+                                 float gatethreshold, double scale, unsigned int nworkers,
+                                 Profiler* profiler)
+	: footage(footage),
+	  length(length),
+	  frameskip(frameskip),
+	  keepframes(keepframes),
+	  create_backend(create_backend),
+	  gatethreshold(gatethreshold),
+	  scale(scale),
+	  profiler(profiler),
+	  gateregion(),
+	  gateregion_changed(false),
+	  anchor(),
+	  nworkers((nworkers > 0) ? nworkers : default_nworkers()),
+	  window(2 * this->nworkers),
+	  decoded(window),
+	  ready(),
+	  next_index(0),
+	  stopped(false),
+	  lock(),
+	  changed(),
+	  threads()
+{
+	threads.push_back(std::thread(&FeaturePipeline::decode, this));
+	
+	for (unsigned int i = 0; i < this->nworkers; i++) {
+		threads.push_back(std::thread(&FeaturePipeline::extract, this));
+	}
+}
+
+FeaturePipeline::~FeaturePipeline()
+{
+	stop();
+}
+
+void FeaturePipeline::Pop(FrameFeatures& features)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [this] { return stopped || ready.count(next_index) > 0; });
+	
+	auto next = ready.find(next_index);
+	
+	if (next == ready.end()) {  // only when stopped
+		features           = FrameFeatures();
+		features.last      = true;
+		features.unchanged = false;
+		return;
+	}
+	
+	features = next->second;
+	
+	// the end-of-stream marker stays in place for any further call
+	if (!features.last) {
+		ready.erase(next);
+		next_index += 1;
+		changed.notify_all();
+	}
+}
+
+void FeaturePipeline::SetGateRegion(const cv::Rect& region)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	gateregion         = region;
+	gateregion_changed = true;
+}
+
+void FeaturePipeline::Extract(FrameFeatures& features, FeatureBackend& backend, double scale)
+{
+	cv::cvtColor(features.frame, features.gray, cv::COLOR_BGR2GRAY);
+	
+	if (scale < 1) {
+		features.fullgray = features.gray;
+		cv::resize(features.fullgray, features.gray, cv::Size(), scale, scale, cv::INTER_AREA);
+	}
+	
+	backend.Detect(features.gray, features.keypoints, features.descriptors);
+}
+
+void FeaturePipeline::SetFrameskip(unsigned int frameskip)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	this->frameskip = frameskip;
+}
+
+bool FeaturePipeline::gate(const Mat& frame)
+{
+	cv::Rect region;
+	
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		region = gateregion;
+		
+		if (gateregion_changed) {
+			anchor             = Mat();
+			gateregion_changed = false;
+		}
+	}
+	
+	region &= cv::Rect(0, 0, frame.cols, frame.rows);
+	
+	if (region.area() == 0) {
+		region = cv::Rect(0, 0, frame.cols, frame.rows);
+	}
+	
+	// area averaging over large cells cancels out sensor and compression noise,
+	// but a new line of text still shifts the cells it covers
+	Mat thumbnail;
+	
+	cv::resize(frame(region), thumbnail, cv::Size(gate_width, gate_height), 0, 0, cv::INTER_AREA);
+	cv::cvtColor(thumbnail, thumbnail, cv::COLOR_BGR2GRAY);
+	
+	if (!anchor.empty()) {
+		Mat    diff;
+		double maxdiff;
+		
+		cv::absdiff(thumbnail, anchor, diff);
+		cv::minMaxLoc(diff, nullptr, &maxdiff);
+		
+		if (maxdiff <= gatethreshold) {
+			return true;
+		}
+	}
+	
+	anchor = thumbnail;
+	
+	return false;
+}
+
+void FeaturePipeline::decode()
+{
+	unsigned int coarse_index = 0;
+	
+	while (true) {
+		FrameFeatures features;
+		
+		features.coarse_index = coarse_index;
+		features.frame_index  = footage->Position();
+		features.last         = false;
+		features.unchanged    = false;
+		
+		if (features.frame_index < length) {
+			ScopedTimer timer(profiler, "decode");
+			footage->Read(features.frame);
+			
+			// live streams return their latest frame, which may be past the requested one
+			if (footage->Live() && !features.frame.empty()) {
+				features.frame_index = footage->Position() - 1;
+			}
+		}
+		
+		if (features.frame.empty()) {
+			features.last = true;
+			
+			// the marker skips the extraction stage, but can't overtake the frames before it
+			deliver(features);
+			break;
+		}
+		
+		unsigned int skip;
+		
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			skip = frameskip;
+		}
+		
+		footage->Skip(skip);
+		coarse_index += 1;
+		
+		bool unchanged;
+		
+		{
+			ScopedTimer timer(profiler, "gate");
+			unchanged = gatethreshold > 0 && gate(features.frame);
+		}
+		
+		if (unchanged) {
+			// nothing to extract, so it skips the workers just like the end-of-stream marker
+			features.unchanged = true;
+			
+			if (!deliver(features)) {  // stopped
+				return;
+			}
+			
+			continue;
+		}
+		
+		if (!decoded.Push(features)) {  // closed
+			return;
+		}
+	}
+	
+	decoded.Close();
+}
+
+void FeaturePipeline::extract()
+{
+	std::unique_ptr<FeatureBackend> backend = create_backend();
+	FrameFeatures                   features;
+	
+	while (decoded.Pop(features)) {
+		{
+			ScopedTimer timer(profiler, "extract");
+			Extract(features, *backend, scale);
+		}
+		
+		if (!keepframes) {
+			features.frame = Mat();
+		}
+		
+		deliver(features);
+	}
+}
+
+bool FeaturePipeline::deliver(FrameFeatures features)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	
+	// bound the reordering buffer; the frame the consumer is waiting for is always accepted,
+	// so this can't deadlock
+	changed.wait(guard, [this, &features] { return stopped || features.coarse_index < next_index + window; });
+	
+	if (stopped) {
+		return false;
+	}
+	
+	ready.emplace(features.coarse_index, std::move(features));
+	changed.notify_all();
+	
+	return true;
+}
+
+void FeaturePipeline::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		stopped = true;
+		changed.notify_all();
+	}
+	
+	decoded.Close();
+	
+	for (unsigned int i = 0; i < threads.size(); i++) {
+		if (threads[i].joinable()) {
+			threads[i].join();
+		}
+	}
+	
+	threads.clear();
+}
+
+}
@@ -0,0 +1,243 @@
+/// @file FeaturePipeline.hpp
+/// @brief Multi-threaded frame decoding and feature extraction header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FEATUREPIPELINE_HPP
+#define FEATUREPIPELINE_HPP 1
+
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include <opencv2/opencv.hpp>
+
+#include "BoundedQueue.hpp"
+#include "FrameSource.hpp"
+#include "FeatureBackend.hpp"
+#include "Profiler.hpp"
+
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Footage frame with its precomputed keypoints
+struct FrameFeatures
+{
+	/// @brief Sequence number in the subsampled footage
+	unsigned int coarse_index;
+	
+	/// @brief Frame index in the footage
+	unsigned int frame_index;
+	
+	/// @brief True if this is the end-of-stream marker instead of a frame
+	/// 
+	/// The marker's frame_index is the first index that could not be read.
+	bool last;
+	
+	/// @brief True if the frame is nearly identical to the last one with extracted features
+	/// 
+	/// Such frames skip the extraction, so they have no grayscale version nor keypoints,
+	/// but they always keep the original frame in case the consumer needs them anyway.
+	bool unchanged;
+	
+	/// @brief Original frame, only kept if requested or unchanged
+	Mat frame;
+	
+	/// @brief Grayscale frame, at the working resolution
+	Mat gray;
+	
+	/// @brief Grayscale frame at the footage resolution, only if the working resolution is lower
+	Mat fullgray;
+	
+	/// @brief Keypoints in the grayscale frame
+	std::vector<cv::KeyPoint> keypoints;
+	
+	/// @brief Corresponding keypoint descriptors
+	Mat descriptors;
+};
+
+/// @brief Staged decode -> feature extraction pipeline
+/// 
+/// A decoder thread reads every (frameskip + 1)-th frame of the footage into a bounded queue,
+/// while a pool of workers converts them to grayscale and extracts their keypoints ahead of time.
+/// The results are handed to the consumer strictly in frame order, so the sequential part of the
+/// tracking only waits when the workers can't keep up. The number of frames in flight is bounded,
+/// so memory stays constant regardless of the footage length.
+/// 
+/// Optionally, the decoder compares a small thumbnail of each frame (restricted to a region of
+/// interest, e.g. the slide) to that of the last frame sent for extraction, and frames that barely
+/// changed skip the extraction stage altogether.
+class FeaturePipeline
+{
+private:
+	/// @brief Width of the scene change thumbnails
+	static const int gate_width = 64;
+	
+	/// @brief Height of the scene change thumbnails
+	static const int gate_height = 48;
+	
+
+	/// @brief Video input observer reference, owned by the decoder thread while running
+	FrameSource* footage;
+	
+	/// @brief Footage length
+	unsigned int length;
+	
+	/// @brief Number of frames to skip between decoded frames
+	unsigned int frameskip;
+	
+	/// @brief Whether to keep the original frames alongside their grayscale version
+	bool keepframes;
+	
+	/// @brief Feature backend constructor, called once per worker
+	BackendFactory create_backend;
+	
+	/// @brief Largest thumbnail pixel difference of an unchanged frame, in gray levels; zero to disable the gate
+	float gatethreshold;
+	
+	/// @brief Ratio between the working resolution, where keypoints are extracted, and the footage resolution
+	double scale;
+	
+	/// @brief Profiler observer reference; null to disable profiling
+	Profiler* profiler;
+	
+	/// @brief Region of interest for the scene change comparison; empty for the whole frame
+	cv::Rect gateregion;
+	
+	/// @brief Whether gateregion changed since the decoder last read it
+	bool gateregion_changed;
+	
+	/// @brief Thumbnail of the last frame sent for extraction. Decoder thread only
+	Mat anchor;
+	
+	/// @brief Number of feature extraction threads
+	unsigned int nworkers;
+	
+	/// @brief Maximum number of frames in flight at each stage
+	unsigned int window;
+	
+	/// @brief Decoded frames waiting for feature extraction
+	BoundedQueue<FrameFeatures> decoded;
+	
+	/// @brief Finished frames waiting for the consumer, by coarse index
+	std::map<unsigned int, FrameFeatures> ready;
+	
+	/// @brief Coarse index of the next frame the consumer expects
+	unsigned int next_index;
+	
+	/// @brief Whether the pipeline is being torn down
+	bool stopped;
+	
+	/// @brief Lock for ready, next_index, stopped, frameskip and the gate region
+	std::mutex lock;
+	
+	/// @brief Signal for changes in ready, next_index or stopped
+	std::condition_variable changed;
+	
+	/// @brief Decoder and worker threads
+	std::vector<std::thread> threads;
+	
+public:
+	/// @brief Construct and start a FeaturePipeline
+	/// 
+	/// @param[in] footage Recording of the presentation, positioned at the first frame to decode.
+	///                    It must not be accessed by anyone else until the pipeline is destroyed.
+	/// @param[in] length Footage length.
+	/// @param[in] frameskip Number of frames to skip between decoded frames.
+	/// @param[in] keepframes Whether to keep the original frames, e.g. for display.
+	/// @param[in] create_backend Feature backend constructor.
+	/// @param[in] gatethreshold Largest thumbnail pixel difference, in gray levels, for a frame to be
+	///                          considered unchanged and skip the extraction; zero to extract every frame.
+	/// @param[in] scale Ratio between the working resolution, where keypoints are extracted, and the
+	///                  footage resolution; one to work at the footage resolution.
+	/// @param[in] nworkers Number of feature extraction threads; zero to choose automatically.
+	/// @param[in] profiler Profiler for the decoding, gating and extraction stages; null to disable.
+	FeaturePipeline(FrameSource* footage, unsigned int length, unsigned int frameskip,
+	                bool keepframes, BackendFactory create_backend,
+	                float gatethreshold = 0, double scale = 1, unsigned int nworkers = 0,
+	                Profiler* profiler = nullptr);
+	
+	/// @brief Copy constructor. Deleted
+	FeaturePipeline(const FeaturePipeline& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	FeaturePipeline& operator=(const FeaturePipeline& that) = delete;
+	
+	/// @brief Stop every thread and destruct this FeaturePipeline
+	~FeaturePipeline();
+	
+	/// @brief Get the next frame in order, waiting for it if it is not ready yet
+	/// 
+	/// @param[out] features Next frame and its keypoints. After the last frame, the end-of-stream
+	///                      marker is returned (repeatedly, if called again).
+	void Pop(FrameFeatures& features);
+	
+	/// @brief Restrict the scene change comparison to a region of the frame
+	/// 
+	/// Frames already decoded keep their previous classification. The next frame
+	/// after a region change is always sent for extraction.
+	/// 
+	/// @param[in] region Region of interest; empty for the whole frame.
+	void SetGateRegion(const cv::Rect& region);
+	
+	/// @brief Change the number of frames to skip between decoded frames
+	/// 
+	/// Frames already decoded keep their previous spacing.
+	/// 
+	/// @param[in] frameskip Number of frames to skip.
+	void SetFrameskip(unsigned int frameskip);
+	
+	/// @brief Convert a frame to grayscale at the working resolution and extract its keypoints
+	/// 
+	/// @param[inout] features Frame, with its original image set. The rest of fields are filled.
+	/// @param[in] backend Feature backend.
+	/// @param[in] scale Ratio between the working resolution and the footage resolution.
+	static void Extract(FrameFeatures& features, FeatureBackend& backend, double scale);
+	
+private:
+	/// @brief Check if a frame is nearly identical to the last one sent for extraction
+	/// 
+	/// Otherwise, the frame becomes the new reference for the comparison.
+	/// 
+	/// @param[in] frame Decoded frame.
+	/// @returns True if the frame is unchanged; otherwise, false.
+	bool gate(const Mat& frame);
+	
+	/// @brief Decoder thread routine
+	void decode();
+	
+	/// @brief Feature extraction thread routine
+	void extract();
+	
+	/// @brief Make a finished frame available to the consumer, waiting if it is too far ahead
+	/// 
+	/// @param[in] features Finished frame.
+	/// @returns True if delivered; false if the pipeline was stopped.
+	bool deliver(FrameFeatures features);
+	
+	/// @brief Stop every thread
+	void stop();
+};
+
+}
+
+#endif
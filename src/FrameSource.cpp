@@ -0,0 +1,457 @@
+/// @file FrameSource.cpp
+/// @brief Footage frame access
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <memory>
+#include <string>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <limits>
+#include <algorithm>
+#include <cctype>
+
+#include <opencv2/opencv.hpp>
+
+#include "FrameSource.hpp"
+#include "avhelpers.hpp"
+
+using std::string;
+using cv::Mat;
+
+namespace slidesync
+{
+
+// FrameSource definitions
+
+FrameSource::~FrameSource() = default;
+
+bool FrameSource::Live() const
+{
+	return false;
+}
+
+// CaptureSource definitions
+
+CaptureSource::CaptureSource(const string& filename)
+	: capture(filename, cv::CAP_ANY),
+	  position(0) {}
+
+bool CaptureSource::IsOpened() const
+{
+	return capture.isOpened();
+}
+
+unsigned int CaptureSource::Length() const
+{
+	return (unsigned int) capture.get(cv::CAP_PROP_FRAME_COUNT);
+}
+
+double CaptureSource::Framerate() const
+{
+	return capture.get(cv::CAP_PROP_FPS);
+}
+
+unsigned int CaptureSource::Width() const
+{
+	return (unsigned int) capture.get(cv::CAP_PROP_FRAME_WIDTH);
+}
+
+unsigned int CaptureSource::Height() const
+{
+	return (unsigned int) capture.get(cv::CAP_PROP_FRAME_HEIGHT);
+}
+
+unsigned int CaptureSource::Position() const
+{
+	return position;
+}
+
+bool CaptureSource::Read(Mat& frame)
+{
+	if (!capture.read(frame) || frame.empty()) {
+		return false;
+	}
+	
+	position += 1;
+	
+	return true;
+}
+
+void CaptureSource::Skip(unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++) {
+		capture.grab();
+	}
+	
+	position += n;
+}
+
+bool CaptureSource::Seek(unsigned int index)
+{
+	if (!capture.set(cv::CAP_PROP_POS_FRAMES, index)) {
+		return false;
+	}
+	
+	position = index;
+	
+	return true;
+}
+
+// DecoderSource definitions
+
+DecoderSource::DecoderSource(const string& filename, bool keyframesonly)
+	: decoder(filename),
+	  keyframesonly(keyframesonly) {}
+
+unsigned int DecoderSource::Length() const
+{
+	return decoder.Length();
+}
+
+double DecoderSource::Framerate() const
+{
+	return decoder.Framerate();
+}
+
+unsigned int DecoderSource::Width() const
+{
+	return decoder.Width();
+}
+
+unsigned int DecoderSource::Height() const
+{
+	return decoder.Height();
+}
+
+unsigned int DecoderSource::Position() const
+{
+	return decoder.Position();
+}
+
+bool DecoderSource::Read(Mat& frame)
+{
+	return decoder.Read(frame);
+}
+
+void DecoderSource::Skip(unsigned int n)
+{
+	unsigned int target   = decoder.Position() + n;
+	unsigned int keyframe = decoder.KeyframeBefore(target);
+	
+	// no keyframe in between: decoding the frames in between is the only way
+	if (keyframe <= decoder.Position()) {
+		decoder.Skip(n);
+	}
+	else {
+		decoder.Seek(target, !keyframesonly);
+	}
+}
+
+bool DecoderSource::Seek(unsigned int index)
+{
+	return decoder.Seek(index, true);
+}
+
+// StreamSource definitions
+
+/// @brief Open a capture by stream URL, device path, or camera index
+static cv::VideoCapture open_capture(const string& name)
+{
+	if (!name.empty() && std::all_of(name.begin(), name.end(), [] (char c) { return std::isdigit(c); })) {
+		return cv::VideoCapture(std::stoi(name));
+	}
+	
+	return cv::VideoCapture(name, cv::CAP_ANY);
+}
+
+StreamSource::StreamSource(const string& name)
+	: capture(open_capture(name)),
+	  framerate(capture.get(cv::CAP_PROP_FPS)),
+	  width((unsigned int) capture.get(cv::CAP_PROP_FRAME_WIDTH)),
+	  height((unsigned int) capture.get(cv::CAP_PROP_FRAME_HEIGHT)),
+	  latest(),
+	  grabbed(0),
+	  position(0),
+	  dropped(0),
+	  ended(!capture.isOpened()),
+	  stopped(false),
+	  lock(),
+	  changed(),
+	  grabber()
+{
+	if (!ended) {
+		grabber = std::thread(&StreamSource::grab, this);
+	}
+}
+
+StreamSource::~StreamSource()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopped = true;
+	}
+	
+	// the grabber notices after the frame it is waiting for, which live streams produce continuously
+	if (grabber.joinable()) {
+		grabber.join();
+	}
+}
+
+bool StreamSource::IsOpened() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	return !ended || grabbed > 0;
+}
+
+unsigned int StreamSource::Dropped() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	return dropped;
+}
+
+unsigned int StreamSource::Length() const
+{
+	return std::numeric_limits<unsigned int>::max();
+}
+
+double StreamSource::Framerate() const
+{
+	return framerate;
+}
+
+unsigned int StreamSource::Width() const
+{
+	return width;
+}
+
+unsigned int StreamSource::Height() const
+{
+	return height;
+}
+
+unsigned int StreamSource::Position() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	return position;
+}
+
+bool StreamSource::Read(Mat& frame)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [this] { return ended || grabbed > position; });
+	
+	if (grabbed <= position) {  // only when ended
+		return false;
+	}
+	
+	// every frame produced since the last read but this one is lost
+	dropped  += grabbed - 1 - position;
+	position  = grabbed;
+	frame     = latest;
+	
+	return true;
+}
+
+void StreamSource::Skip(unsigned int n)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	position += n;
+}
+
+bool StreamSource::Seek(unsigned int index)
+{
+	return index == Position();
+}
+
+bool StreamSource::Live() const
+{
+	return true;
+}
+
+void StreamSource::grab()
+{
+	while (true) {
+		// a new matrix each time, since the reader may still hold the previous one
+		Mat  frame;
+		bool success = capture.read(frame) && !frame.empty();
+		
+		std::lock_guard<std::mutex> guard(lock);
+		
+		if (!success || stopped) {
+			ended = true;
+			changed.notify_all();
+			return;
+		}
+		
+		latest   = frame;
+		grabbed += 1;
+		changed.notify_all();
+	}
+}
+
+FeedSource::FeedSource(unsigned int width, unsigned int height, double framerate, unsigned int capacity)
+	: framerate(framerate),
+	  width(width),
+	  height(height),
+	  backlog(),
+	  capacity(std::max(capacity, 1u)),
+	  pushed(0),
+	  position(0),
+	  closed(false),
+	  lock(),
+	  changed() {}
+
+unsigned int FeedSource::Push(const Mat& frame)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	
+	unsigned int index = pushed;
+	
+	pushed += 1;
+	
+	// the reader may skip this frame while it waits
+	changed.wait(guard, [&] { return closed || index < position || backlog.size() < capacity; });
+	
+	if (closed || index < position) {
+		return index;
+	}
+	
+	backlog.emplace_back(index, frame);
+	changed.notify_all();
+	
+	return index;
+}
+
+void FeedSource::Close()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	closed = true;
+	changed.notify_all();
+}
+
+unsigned int FeedSource::Length() const
+{
+	return std::numeric_limits<unsigned int>::max();
+}
+
+double FeedSource::Framerate() const
+{
+	return framerate;
+}
+
+unsigned int FeedSource::Width() const
+{
+	return width;
+}
+
+unsigned int FeedSource::Height() const
+{
+	return height;
+}
+
+unsigned int FeedSource::Position() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	return position;
+}
+
+bool FeedSource::Read(Mat& frame)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [this] { return closed || !backlog.empty(); });
+	
+	if (backlog.empty()) {  // only when closed
+		return false;
+	}
+	
+	position = backlog.front().first + 1;
+	frame    = backlog.front().second;
+	
+	backlog.pop_front();
+	changed.notify_all();
+	
+	return true;
+}
+
+void FeedSource::Skip(unsigned int n)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	position += n;
+	discard();
+}
+
+bool FeedSource::Seek(unsigned int index)
+{
+	return index == Position();
+}
+
+bool FeedSource::Live() const
+{
+	return true;
+}
+
+void FeedSource::discard()
+{
+	while (!backlog.empty() && backlog.front().first < position) {
+		backlog.pop_front();
+	}
+	
+	changed.notify_all();
+}
+
+// Global functions
+
+std::unique_ptr<FrameSource> open_framesource(const string& filename, bool keyframesonly)
+{
+	try {
+		return std::unique_ptr<FrameSource>(new DecoderSource(filename, keyframesonly));
+	}
+	catch (const libav::avexception& e) {
+		std::cerr << "Can't index footage (" << e.what() << "), falling back to sequential access" << std::endl;
+	}
+	
+	std::unique_ptr<CaptureSource> capture(new CaptureSource(filename));
+	
+	if (!capture->IsOpened()) {
+		return nullptr;
+	}
+	
+	return std::move(capture);
+}
+
+std::unique_ptr<FrameSource> open_stream(const string& name)
+{
+	std::unique_ptr<StreamSource> stream(new StreamSource(name));
+	
+	if (!stream->IsOpened()) {
+		return nullptr;
+	}
+	
+	return std::move(stream);
+}
+
+}
@@ -0,0 +1,346 @@
+/// @file FrameSource.hpp
+/// @brief Footage frame access header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FRAMESOURCE_HPP
+#define FRAMESOURCE_HPP 1
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <utility>
+
+#include <opencv2/opencv.hpp>
+
+#include "avhelpers.hpp"
+
+using std::string;
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Sequential reader of video frames which can also move to any frame
+class FrameSource
+{
+public:
+	/// @brief Destruct this FrameSource
+	virtual ~FrameSource();
+	
+	/// @brief Get the number of frames in the video
+	virtual unsigned int Length() const = 0;
+	
+	/// @brief Get the number of frames per second
+	virtual double Framerate() const = 0;
+	
+	/// @brief Get the frame width
+	virtual unsigned int Width() const = 0;
+	
+	/// @brief Get the frame height
+	virtual unsigned int Height() const = 0;
+	
+	/// @brief Get the index of the frame the next call to Read() will return
+	/// 
+	/// After a successful Read(), the index of the frame read is Position() - 1.
+	virtual unsigned int Position() const = 0;
+	
+	/// @brief Read the next frame
+	/// 
+	/// @param[out] frame Frame, in 8-8-8-bit BGR format.
+	/// @returns True if successful; otherwise (e.g. at the end of the video), false.
+	virtual bool Read(Mat& frame) = 0;
+	
+	/// @brief Discard a number of frames
+	/// 
+	/// Sources may land on a nearby frame instead, if that is much cheaper; Position() tells where.
+	/// 
+	/// @param[in] n Number of frames to discard.
+	virtual void Skip(unsigned int n) = 0;
+	
+	/// @brief Move exactly to a frame
+	/// 
+	/// @param[in] index Frame index.
+	/// @returns True if successful; otherwise, false.
+	virtual bool Seek(unsigned int index) = 0;
+	
+	/// @brief Check if this is a live stream, which can't seek and has no known length
+	virtual bool Live() const;
+};
+
+/// @brief Frame source backed by OpenCV, which can open more kinds of inputs
+/// 
+/// Skipping decodes every frame and seeking relies on the backend's (often approximate) support.
+class CaptureSource : public FrameSource
+{
+private:
+	/// @brief Video input
+	cv::VideoCapture capture;
+	
+	/// @brief Index of the next frame
+	unsigned int position;
+	
+public:
+	/// @brief Construct a CaptureSource reading from the file with the given name
+	/// 
+	/// @param[in] filename Name of the video file.
+	CaptureSource(const string& filename);
+	
+	/// @brief Check if the video could be opened
+	bool IsOpened() const;
+	
+	virtual unsigned int Length() const override;
+	virtual double Framerate() const override;
+	virtual unsigned int Width() const override;
+	virtual unsigned int Height() const override;
+	virtual unsigned int Position() const override;
+	virtual bool Read(Mat& frame) override;
+	virtual void Skip(unsigned int n) override;
+	virtual bool Seek(unsigned int index) override;
+};
+
+/// @brief Frame source backed by the FFMPEG library and a keyframe index
+/// 
+/// Long skips seek to the closest keyframe before the target instead of decoding every frame
+/// in between, so the decoding cost is proportional to the number of frames read rather than
+/// the length of the video.
+class DecoderSource : public FrameSource
+{
+private:
+	/// @brief Video input
+	libav::VideoDecoder decoder;
+	
+	/// @brief Whether skips may land on the last keyframe before the target, which is only decoded
+	bool keyframesonly;
+	
+public:
+	/// @brief Construct a DecoderSource reading from the file with the given name
+	/// 
+	/// @param[in] filename Name of the video file.
+	/// @param[in] keyframesonly If true, skips land on the last keyframe before their target when
+	///                          there is one, for coarse scanning; otherwise, skips are exact.
+	DecoderSource(const string& filename, bool keyframesonly = false);
+	
+	virtual unsigned int Length() const override;
+	virtual double Framerate() const override;
+	virtual unsigned int Width() const override;
+	virtual unsigned int Height() const override;
+	virtual unsigned int Position() const override;
+	virtual bool Read(Mat& frame) override;
+	virtual void Skip(unsigned int n) override;
+	virtual bool Seek(unsigned int index) override;
+};
+
+/// @brief Frame source reading a live stream, e.g. a camera or an RTSP feed
+/// 
+/// A grabber thread reads every frame as soon as it arrives and only keeps the latest one, so a
+/// slow reader drops frames instead of falling behind the stream. Frame indices count every frame
+/// the stream produced, dropped or not, so they keep measuring time.
+class StreamSource : public FrameSource
+{
+private:
+	/// @brief Video input, owned by the grabber thread
+	cv::VideoCapture capture;
+	
+	/// @brief Number of frames per second
+	double framerate;
+	
+	/// @brief Frame width
+	unsigned int width;
+	
+	/// @brief Frame height
+	unsigned int height;
+	
+	/// @brief Latest frame
+	Mat latest;
+	
+	/// @brief Number of frames grabbed so far
+	unsigned int grabbed;
+	
+	/// @brief Index of the earliest frame the next call to Read() may return
+	unsigned int position;
+	
+	/// @brief Number of frames never returned by Read()
+	unsigned int dropped;
+	
+	/// @brief Whether the stream has ended
+	bool ended;
+	
+	/// @brief Whether this source is being torn down
+	bool stopped;
+	
+	/// @brief Lock for latest, grabbed, position, dropped, ended and stopped
+	mutable std::mutex lock;
+	
+	/// @brief Signal for new frames or the end of the stream
+	std::condition_variable changed;
+	
+	/// @brief Grabber thread
+	std::thread grabber;
+	
+public:
+	/// @brief Construct a StreamSource and start grabbing frames
+	/// 
+	/// @param[in] name Stream URL (e.g. rtsp://...), device path, or camera index.
+	StreamSource(const string& name);
+	
+	/// @brief Copy constructor. Deleted
+	StreamSource(const StreamSource& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	StreamSource& operator=(const StreamSource& that) = delete;
+	
+	/// @brief Stop grabbing and destruct this StreamSource
+	~StreamSource();
+	
+	/// @brief Check if the stream could be opened
+	bool IsOpened() const;
+	
+	/// @brief Get the number of frames dropped so far
+	unsigned int Dropped() const;
+	
+	/// @brief Get the largest possible length, since the stream has no known end
+	virtual unsigned int Length() const override;
+	
+	virtual double Framerate() const override;
+	virtual unsigned int Width() const override;
+	virtual unsigned int Height() const override;
+	virtual unsigned int Position() const override;
+	
+	/// @brief Read the latest frame, waiting for it if it has already been read or skipped
+	virtual bool Read(Mat& frame) override;
+	
+	/// @brief Wait until n more frames have been produced before the next read
+	virtual void Skip(unsigned int n) override;
+	
+	/// @brief Move to a frame; streams only succeed for the current position
+	virtual bool Seek(unsigned int index) override;
+	
+	virtual bool Live() const override;
+	
+private:
+	/// @brief Grabber thread routine
+	void grab();
+};
+
+/// @brief Live frame source fed by its owner, e.g. with decoded frames kept in memory
+/// 
+/// Frames are indexed in the order they are pushed. Skipped frames are discarded as soon as
+/// they arrive, and pushing blocks while the small backlog of unread frames is full, so a
+/// producer can't run ahead of the reader.
+class FeedSource : public FrameSource
+{
+private:
+	/// @brief Number of frames per second
+	double framerate;
+	
+	/// @brief Frame width
+	unsigned int width;
+	
+	/// @brief Frame height
+	unsigned int height;
+	
+	/// @brief Unread frames and their indices, in order
+	std::deque<std::pair<unsigned int, Mat>> backlog;
+	
+	/// @brief Largest number of unread frames
+	unsigned int capacity;
+	
+	/// @brief Number of frames pushed so far
+	unsigned int pushed;
+	
+	/// @brief Index of the earliest frame the next call to Read() may return
+	unsigned int position;
+	
+	/// @brief Whether the producer has pushed its last frame
+	bool closed;
+	
+	/// @brief Lock for backlog, pushed, position and closed
+	mutable std::mutex lock;
+	
+	/// @brief Signal for new frames, read frames or the end of the feed
+	std::condition_variable changed;
+	
+public:
+	/// @brief Construct an empty FeedSource
+	/// 
+	/// @param[in] width Frame width.
+	/// @param[in] height Frame height.
+	/// @param[in] framerate Number of frames per second.
+	/// @param[in] capacity Largest number of unread frames before pushing blocks.
+	FeedSource(unsigned int width, unsigned int height, double framerate, unsigned int capacity = 4);
+	
+	/// @brief Copy constructor. Deleted
+	FeedSource(const FeedSource& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	FeedSource& operator=(const FeedSource& that) = delete;
+	
+	/// @brief Append a frame, waiting while the backlog is full
+	/// 
+	/// @param[in] frame New frame; the source keeps a reference, so it must not be modified afterwards.
+	/// @returns Index of the frame.
+	unsigned int Push(const Mat& frame);
+	
+	/// @brief Signal that no more frames will be pushed
+	/// 
+	/// Reads return the remaining backlog and then fail.
+	void Close();
+	
+	/// @brief Get the largest possible length, since the feed has no known end
+	virtual unsigned int Length() const override;
+	
+	virtual double Framerate() const override;
+	virtual unsigned int Width() const override;
+	virtual unsigned int Height() const override;
+	virtual unsigned int Position() const override;
+	
+	/// @brief Read the next frame, waiting for it to be pushed
+	virtual bool Read(Mat& frame) override;
+	
+	/// @brief Discard the next n frames, pushed or not
+	virtual void Skip(unsigned int n) override;
+	
+	/// @brief Move to a frame; feeds only succeed for the current position
+	virtual bool Seek(unsigned int index) override;
+	
+	virtual bool Live() const override;
+	
+private:
+	/// @brief Drop every unread frame before the position; the lock must be held
+	void discard();
+};
+
+/// @brief Open the best available frame source for a video file
+/// 
+/// @param[in] filename Name of the video file.
+/// @param[in] keyframesonly Whether skips may land on keyframes, if supported.
+/// @returns Frame source, or null if the file can't be opened.
+std::unique_ptr<FrameSource> open_framesource(const string& filename, bool keyframesonly = false);
+
+/// @brief Open a live stream
+/// 
+/// @param[in] name Stream URL, device path, or camera index.
+/// @returns Frame source, or null if the stream can't be opened.
+std::unique_ptr<FrameSource> open_stream(const string& name);
+
+}
+
+#endif
@@ -18,36 +18,302 @@
 // limitations under the License.
 
 #include <string>
+#include <vector>
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <cstdio>
 
 #include "ProcessLoop.hpp"
 #include "GenLoop.hpp"
 #include "util.hpp"
 #include "avhelpers.hpp"
+#include "Profiler.hpp"
 
 using std::string;
 
 namespace slidesync
 {
 
-GenLoop::GenLoop(std::vector<Mat>* slides, const SyncInstructions& instructions, const string& filename)
+// CompositeConfig definitions
+
+CompositeConfig::CompositeConfig()
+	: layout(CompositeLayout::None),
+	  inset(0.3) {}
+
+// SlideImageCache definitions
+
+SlideImageCache::SlideImageCache(std::vector<Mat>* slides, const std::vector<GenSegment>& segments,
+                                 size_t capacity, Profiler* profiler)
 	: slides(slides),
+	  images(slides->size()),
+	  remaining(slides->size(), 0),
+	  recent(),
+	  capacity(capacity),
+	  profiler(profiler),
+	  lock()
+{
+	for (const GenSegment& segment : segments) {
+		remaining[segment.slide] += 1;
+	}
+}
+
+libav::EncoderImage SlideImageCache::Get(unsigned int slide, libav::VideoEncoder& encoder)
+{
+	Mat source;
+	
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		if (remaining[slide] > 0) {
+			remaining[slide] -= 1;
+		}
+		
+		if (!images[slide].Empty()) {
+			libav::EncoderImage image = images[slide];
+			
+			recent.remove(slide);
+			recent.push_front(slide);
+			retire(slide);
+			
+			profile_count(profiler, "cached_slides");
+			
+			return image;
+		}
+		
+		// a shallow copy, so the image survives this slide being retired by another thread meanwhile
+		source = (*slides)[slide];
+	}
+	
+	libav::EncoderImage image;
+	
+	{
+		ScopedTimer timer(profiler, "convert");
+		image = encoder.Convert(source);
+	}
+	
+	profile_count(profiler, "converted_slides");
+	
+	std::lock_guard<std::mutex> guard(lock);
+	
+	// another thread may have converted it too, in which case either copy will do
+	if (images[slide].Empty() && remaining[slide] > 0) {
+		images[slide] = image;
+		recent.push_front(slide);
+		
+		while (recent.size() > capacity) {
+			images[recent.back()] = libav::EncoderImage();
+			recent.pop_back();
+		}
+	}
+	
+	retire(slide);
+	
+	return image;
+}
+
+void SlideImageCache::retire(unsigned int slide)
+{
+	if (remaining[slide] > 0) {
+		return;
+	}
+	
+	if (!images[slide].Empty()) {
+		images[slide] = libav::EncoderImage();
+		recent.remove(slide);
+	}
+	
+	(*slides)[slide].release();
+}
+
+// GenLoop definitions
+
+/// @brief Space between the picture-in-picture footage and the frame border, as a fraction of the width
+static const double inset_margin = 0.02;
+
+/// @brief Name of the temporary file for a chunk of the output video
+/// 
+/// The extension is kept, since it determines the container format.
+/// 
+/// @param[in] filename Name of the output video file.
+/// @param[in] index Chunk index.
+/// @returns Chunk filename.
+static string chunk_filename(const string& filename, unsigned int index)
+{
+	size_t dot   = filename.find_last_of('.');
+	size_t slash = filename.find_last_of("/\\");
+	
+	if (dot == string::npos || (slash != string::npos && dot < slash)) {
+		dot = filename.size();
+	}
+	
+	return filename.substr(0, dot) + ".part" + std::to_string(index) + filename.substr(dot);
+}
+
+GenLoop::GenLoop(std::vector<Mat>* slides, const SyncInstructions& instructions, const string& filename,
+                 const libav::EncoderConfig& config, unsigned int nthreads, Profiler* profiler)
+	: ProcessLoop(),
+	  slides(slides),
+	  width((slides != nullptr && slides->size() > 0) ? (*slides)[0].cols : 0),
+	  height((slides != nullptr && slides->size() > 0) ? (*slides)[0].rows : 0),
 	  instructions(instructions),
-	  instructions_it(this->instructions.cbegin()),
-	  timestamp(0),
-	  slide(0),
-	  encoder(filename,
-	          (slides != nullptr && slides->size() > 0) ? (*slides)[0].cols : 0,
-	          (slides != nullptr && slides->size() > 0) ? (*slides)[0].rows : 0,
-	          instructions.Framerate()),
-	  processor(&GenLoop::writeframe),
-	  processing(false)
-{
-	if (instructions_it == this->instructions.cend()) {
+	  filename(filename),
+	  config(config),
+	  audio(config.audio),
+	  segments(),
+	  cache(nullptr),
+	  segment_index(0),
+	  encoder(nullptr),
+	  footage(nullptr),
+	  footage_rect(),
+	  slide_rect(),
+	  canvas(),
+	  slide_uses(),
+	  segment_frame(0),
+	  chunk_starts(),
+	  chunk_fnames(),
+	  pool(nullptr),
+	  chunk_tasks(),
+	  chunks_done(0),
+	  next_footage(),
+	  profiler(profiler),
+	  verbose(false),
+	  processor(&GenLoop::writeframe)
+{
+	if (this->instructions.cbegin() == this->instructions.cend()) {
+		processor = &GenLoop::idle;
+		finish();
 		return;
 	}
 	
+	build_segments();
+	cache.reset(new SlideImageCache(slides, segments, cache_capacity, profiler));
+	this->config.holdframes = true;
+	
+	if (this->config.framerate.num <= 0 || this->config.framerate.den <= 0) {
+		this->config.framerate = libav::FrameRate{instructions.Framerate(), 1};
+	}
+	
+	if (nthreads == 0) {
+		nthreads = std::thread::hardware_concurrency();
+	}
+	
+	// hardware encoders are fast enough on their own and only allow a few sessions
+	if (libav::hardware_encoder(config)) {
+		nthreads = 1;
+	}
+	
+	unsigned int nchunks = std::min<size_t>(nthreads, segments.size() / min_chunksegments);
+	
+	if (nchunks <= 1) {
+		encoder.reset(new libav::VideoEncoder(filename, width, height, instructions.Framerate(), this->config));
+		return;
+	}
+	
+	// chunks are balanced by segment count, since each held segment costs about the same to encode
+	this->config.audio.clear();
+	
+	for (unsigned int i = 0; i <= nchunks; i++) {
+		chunk_starts.push_back(i * segments.size() / nchunks);
+	}
+	
+	pool.reset(new ThreadPool(nchunks));
+	
+	for (unsigned int i = 0; i < nchunks; i++) {
+		chunk_fnames.push_back(chunk_filename(filename, i));
+		
+		string       fname = chunk_fnames[i];
+		unsigned int start = chunk_starts[i];
+		unsigned int end   = chunk_starts[i + 1];
+		
+		chunk_tasks.push_back(pool->Submit([this, fname, start, end] { encode_segments(fname, start, end); }));
+	}
+	
+	processor = &GenLoop::waitchunks;
+}
+
+GenLoop::GenLoop(std::vector<Mat>* slides, FrameSource* footage, const SyncInstructions& instructions,
+                 const string& filename, const CompositeConfig& composite, const libav::EncoderConfig& config,
+                 Profiler* profiler)
+	: ProcessLoop(),
+	  slides(slides),
+	  width(0),
+	  height(0),
+	  instructions(instructions),
+	  filename(filename),
+	  config(config),
+	  audio(config.audio),
+	  segments(),
+	  cache(nullptr),
+	  segment_index(0),
+	  encoder(nullptr),
+	  footage(footage),
+	  footage_rect(),
+	  slide_rect(),
+	  canvas(),
+	  slide_uses((slides != nullptr) ? slides->size() : 0, 0),
+	  segment_frame(0),
+	  chunk_starts(),
+	  chunk_fnames(),
+	  pool(nullptr),
+	  chunk_tasks(),
+	  chunks_done(0),
+	  next_footage(),
+	  profiler(profiler),
+	  verbose(false),
+	  processor(&GenLoop::writecomposite)
+{
+	if (this->instructions.cbegin() == this->instructions.cend()) {
+		processor = &GenLoop::idle;
+		finish();
+		return;
+	}
+	
+	layout(composite);
+	build_segments();
+	
+	for (const GenSegment& segment : segments) {
+		slide_uses[segment.slide] += 1;
+	}
+	
+	if (!footage->Seek(0)) {
+		throw std::runtime_error("Can't rewind the footage to compose it");
+	}
+	
+	// the footage changes every frame, so there is nothing to hold
+	this->config.holdframes = false;
+	
+	if (this->config.framerate.num <= 0 || this->config.framerate.den <= 0) {
+		this->config.framerate = libav::FrameRate{instructions.Framerate(), 1};
+	}
+	
+	encoder.reset(new libav::VideoEncoder(filename, width, height, instructions.Framerate(), this->config));
+	
+	// a single worker decodes the next frame while the current one is composed and encoded
+	pool.reset(new ThreadPool(1));
+	next_footage = pool->Submit([this] { return decode_footage(); });
+}
+
+void GenLoop::SetVerbose(bool verbose)
+{
+	this->verbose = verbose;
+}
+
+void GenLoop::Step()
+{
+	(this->*processor)();
+}
+
+void GenLoop::build_segments()
+{
+	auto         instructions_it = instructions.cbegin();
+	unsigned int timestamp       = 0;
+	unsigned int slide           = 0;
+	
 	// do not add the first frame if the first instruction sets a new first frame
 	if (instructions_it->timestamp == 0) {
 		switch (instructions_it->code) {
@@ -63,77 +329,268 @@ GenLoop::GenLoop(std::vector<Mat>* slides, const SyncInstructions& instructions,
 		}
 	}
 	
-	encoder << (*slides)[slide];
+	for (; instructions_it != instructions.cend(); ++instructions_it) {
+		int delta = (instructions_it->relative) ? instructions_it->timestamp :
+		                                          instructions_it->timestamp - timestamp;
+		
+		// do not execute overlapping instructions, otherwise the result could be
+		// the wrong length, e.g. 1000 overlapping instructions in a 2-frame video
+		// will be at least 1000 frames of output
+		if (delta == 0) {
+			continue;
+		}
+		
+		// the slide is on screen until the frame right before the instruction, so the output
+		// is as long as the footage and stays in sync with its audio
+		segments.push_back(GenSegment{slide, (unsigned int) delta, timestamp});
+		
+		switch (instructions_it->code) {
+		case SyncInstructionCode::Next:
+			slide += 1;
+			break;
+			
+		case SyncInstructionCode::Previous:
+			slide -= 1;
+			break;
+			
+		case SyncInstructionCode::GoTo:
+			slide = instructions_it->data;
+			break;
+			
+		default:
+			break;
+		}
+		
+		timestamp = instructions_it->timestamp;
+	}
+}
+
+void GenLoop::layout(const CompositeConfig& composite)
+{
+	if (slides == nullptr || slides->empty() || footage == nullptr || footage->Width() == 0 ||
+	    footage->Height() == 0) {
+		throw std::invalid_argument("Composing requires slides and footage");
+	}
+	
+	int slide_width    = (*slides)[0].cols;
+	int slide_height   = (*slides)[0].rows;
+	int footage_width  = footage->Width();
+	int footage_height = footage->Height();
+	
+	switch (composite.layout) {
+	case CompositeLayout::SideBySide:
+		{
+			int scaled_width = (int) std::round((double) footage_width * slide_height / footage_height);
+			
+			footage_rect = cv::Rect(0, 0, scaled_width, slide_height);
+			slide_rect   = cv::Rect(scaled_width, 0, slide_width, slide_height);
+		}
+		break;
+		
+	case CompositeLayout::PictureInPicture:
+		{
+			if (composite.inset <= 0 || composite.inset >= 1) {
+				throw std::invalid_argument("The footage picture must be narrower than the output");
+			}
+			
+			int margin       = (int) std::round(inset_margin * slide_width);
+			int inset_width  = (int) std::round(composite.inset * slide_width);
+			int inset_height = (int) std::round((double) inset_width * footage_height / footage_width);
+			
+			// a tall footage on wide slides is fit to the height instead
+			if (inset_height > slide_height - 2 * margin) {
+				inset_height = slide_height - 2 * margin;
+				inset_width  = (int) std::round((double) inset_height * footage_width / footage_height);
+			}
+			
+			if (inset_width <= 0 || inset_height <= 0) {
+				throw std::invalid_argument("The slides are too small for a footage picture");
+			}
+			
+			slide_rect   = cv::Rect(0, 0, slide_width, slide_height);
+			footage_rect = cv::Rect(slide_width - margin - inset_width, slide_height - margin - inset_height,
+			                        inset_width, inset_height);
+		}
+		break;
+		
+	default:
+		throw std::invalid_argument("Unknown composite layout");
+	}
+	
+	cv::Rect bounds = footage_rect | slide_rect;
+	
+	// chroma subsampling needs an even size
+	width  = bounds.width  + bounds.width  % 2;
+	height = bounds.height + bounds.height % 2;
+	canvas = Mat(height, width, CV_8UC3, cv::Scalar::all(0));
 }
 
-void GenLoop::Notify()
+Mat GenLoop::decode_footage() const
 {
-	if (processing) {
-		return;
+	ScopedTimer timer(profiler, "decode");
+	Mat         frame;
+	Mat         resized;
+	
+	if (!footage->Read(frame)) {
+		return Mat();
 	}
 	
-	processing = true;
-	(this->*processor)();
-	processing = false;
+	int interpolation = (footage_rect.width < frame.cols) ? cv::INTER_AREA : cv::INTER_LINEAR;
+	
+	cv::resize(frame, resized, footage_rect.size(), 0, 0, interpolation);
+	
+	return resized;
+}
+
+void GenLoop::encode_segments(const string& fname, unsigned int start, unsigned int end) const
+{
+	ScopedTimer         timer(profiler, "encode_chunk");
+	libav::VideoEncoder chunk(fname, width, height, instructions.Framerate(), config);
+	
+	for (unsigned int i = start; i < end; i++) {
+		chunk << cache->Get(segments[i].slide, chunk);
+		chunk << segments[i].length;
+		
+		profile_count(profiler, "encoded_segments");
+		profile_count(profiler, "encoded_frames", segments[i].length);
+	}
+	
+	chunk.Close();
 }
 
 void GenLoop::writeframe()
 {
-	if (instructions_it == instructions.cend()) {
+	if (segment_index >= segments.size()) {
 		processor = &GenLoop::idle;
 		
-		LoopEvent loopfinished(LoopFinishedEvent);
-		wxPostEvent(this, loopfinished);
+		encoder->Close();
+		finish();
 		return;
 	}
 	
-	int delta = (instructions_it->relative) ? instructions_it->timestamp :
-	                                          instructions_it->timestamp - timestamp;
+	const GenSegment& segment = segments[segment_index++];
+	
+	if (verbose) {
+		std::cout << "Encoding... [" << index2timestamp(segment.timestamp, instructions.Framerate()) << "]\n";
+	}
+	
+	// the encoder holds the slide on screen, so the whole segment costs a single encoded frame
+	ScopedTimer timer(profiler, "encode");
+	
+	(*encoder) << cache->Get(segment.slide, *encoder);
+	(*encoder) << segment.length;
 	
-	// do not execute overlapping instructions, otherwise the result could be
-	// the wrong length, e.g. 1000 overlapping instructions in a 2-frame video
-	// will be at least 1000 frames of output
-	if (delta == 0) {
-		++instructions_it;
+	profile_count(profiler, "encoded_segments");
+	profile_count(profiler, "encoded_frames", segment.length);
+}
+
+void GenLoop::writecomposite()
+{
+	if (segment_index >= segments.size()) {
+		processor = &GenLoop::idle;
+		
+		encoder->Close();
+		finish();
 		return;
 	}
 	
-	const unsigned int logtime     = 8;
-	unsigned int       remaining   = delta - 1;
-	unsigned int       frame_index = timestamp;
-	unsigned int       framerate   = instructions.Framerate();
+	const GenSegment& segment = segments[segment_index];
 	
-	for (; remaining > logtime; remaining -= logtime, frame_index += logtime) {
-		std::cout << "Encoding... [" << index2timestamp(frame_index, framerate) << "]" << std::endl;
-		encoder << logtime;
+	// the slide only changes between segments, so it is drawn once and every frame just blits the footage
+	if (segment_frame == 0) {
+		if (verbose) {
+			std::cout << "Encoding... [" << index2timestamp(segment.timestamp, instructions.Framerate()) << "]\n";
+		}
 		
-		wxTheApp->Yield();
+		ScopedTimer timer(profiler, "draw_slide");
+		
+		(*slides)[segment.slide].copyTo(canvas(slide_rect));
+		
+		slide_uses[segment.slide] -= 1;
+		
+		if (slide_uses[segment.slide] == 0) {
+			(*slides)[segment.slide].release();
+		}
+		
+		profile_count(profiler, "encoded_segments");
 	}
 	
-	std::cout << "Encoding... [" << index2timestamp(frame_index, framerate) << "]" << std::endl;
-	encoder << remaining;
+	// rethrows any decoding error
+	Mat picture = next_footage.get();
 	
-	switch (instructions_it->code) {
-	case SyncInstructionCode::Next:
-		slide += 1;
-		break;
+	segment_frame += 1;
+	
+	if (segment_frame >= segment.length) {
+		segment_frame  = 0;
+		segment_index += 1;
+	}
+	
+	if (segment_index < segments.size()) {
+		next_footage = pool->Submit([this] { return decode_footage(); });
+	}
+	
+	// past the end of the footage, the frame keeps whatever it showed there
+	if (!picture.empty()) {
+		ScopedTimer timer(profiler, "blit");
+		picture.copyTo(canvas(footage_rect));
+	}
+	
+	ScopedTimer timer(profiler, "encode");
+	
+	(*encoder) << canvas;
+	(*encoder) << 1u;
+	
+	profile_count(profiler, "encoded_frames");
+}
+
+void GenLoop::waitchunks()
+{
+	unsigned int nchunks = chunk_tasks.size();
+	
+	if (chunks_done < nchunks) {
+		if (chunk_tasks[chunks_done].wait_for(std::chrono::milliseconds(40)) != std::future_status::ready) {
+			yield();
+			return;
+		}
 		
-	case SyncInstructionCode::Previous:
-		slide -= 1;
-		break;
+		// rethrows any encoding error
+		chunk_tasks[chunks_done].get();
 		
-	case SyncInstructionCode::GoTo:
-		slide = instructions_it->data;
-		break;
+		std::cout << "Encoding... [" << index2timestamp(segments[chunk_starts[chunks_done]].timestamp,
+		                                                instructions.Framerate()) << "] "
+		          << "chunk " << (chunks_done + 1) << "/" << nchunks << std::endl;
 		
-	default:
-		break;
+		chunks_done += 1;
+		return;
+	}
+	
+	pool.reset(nullptr);
+	
+	std::vector<unsigned int> lengths;
+	
+	for (unsigned int i = 0; i < nchunks; i++) {
+		unsigned int length = 0;
+		
+		for (unsigned int k = chunk_starts[i]; k < chunk_starts[i + 1]; k++) {
+			length += segments[k].length;
+		}
+		
+		lengths.push_back(length);
+	}
+	
+	std::cout << "Concatenating " << nchunks << " chunks..." << std::endl;
+	
+	{
+		ScopedTimer timer(profiler, "concatenate");
+		libav::concatenate(chunk_fnames, lengths, config.framerate, filename, audio);
 	}
 	
-	encoder << (*slides)[slide];
+	for (const string& fname : chunk_fnames) {
+		std::remove(fname.c_str());
+	}
 	
-	timestamp = instructions_it->timestamp;
-	++instructions_it;
+	processor = &GenLoop::idle;
+	finish();
 }
 
 void GenLoop::idle() {}
@@ -21,17 +21,19 @@
 #define GENLOOP_HPP 1
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <list>
+#include <mutex>
+#include <future>
 
 #include <opencv2/opencv.hpp>
 
-#include <wx/wxprec.h>
- 
-#ifndef WX_PRECOMP
-	#include <wx/wx.h>
-#endif
-
 #include "ProcessLoop.hpp"
 #include "SyncInstructions.hpp"
+#include "ThreadPool.hpp"
+#include "FrameSource.hpp"
+#include "Profiler.hpp"
 #include "avhelpers.hpp"
 
 using std::string;
@@ -45,51 +47,279 @@ class GenLoop;
 /// @brief Internal video generation processor function pointer
 typedef void (GenLoop::*GenProcessorFn)();
 
+/// @brief Stretch of the output video showing a single slide
+struct GenSegment
+{
+	/// @brief Slide index
+	unsigned int slide;
+	
+	/// @brief Number of frames the slide is on screen
+	unsigned int length;
+	
+	/// @brief Timestamp of the instruction that starts the segment
+	unsigned int timestamp;
+};
+
+/// @brief Arrangement of the footage and the slides in the output video
+enum class CompositeLayout
+{
+	/// @brief Only the slides, without the footage
+	None,
+	
+	/// @brief Footage to the left of the slides, both at the full output height
+	SideBySide,
+	
+	/// @brief Slides filling the frame, with a small picture of the footage in their lower right corner
+	PictureInPicture
+};
+
+/// @brief Settings for composing the footage and the slides into the output video
+struct CompositeConfig
+{
+	/// @brief Arrangement of the footage and the slides
+	CompositeLayout layout;
+	
+	/// @brief Width of the footage picture, as a fraction of the output width, for picture-in-picture
+	double inset;
+	
+	/// @brief Construct a CompositeConfig for a slides-only output
+	CompositeConfig();
+};
+
+/// @brief Encoder-ready slide images, converted on first use and kept while they are recently used
+/// 
+/// Decks often go back and forth between a few slides, which are then converted only once. The
+/// segments are known beforehand, so every slide is dropped, its BGR image included, as soon as
+/// its last segment has been encoded, and memory shrinks as the video progresses instead of
+/// holding every page for the whole run. Safe to use from several encoding threads at once.
+class SlideImageCache
+{
+private:
+	/// @brief Observer reference for the slides in BGR format; released after their last use
+	std::vector<Mat>* slides;
+	
+	/// @brief Converted image of each slide; empty if not cached
+	std::vector<libav::EncoderImage> images;
+	
+	/// @brief Number of segments of each slide still to be encoded
+	std::vector<unsigned int> remaining;
+	
+	/// @brief Cached slides, most recently used first
+	std::list<unsigned int> recent;
+	
+	/// @brief Maximum number of cached images
+	size_t capacity;
+	
+	/// @brief Profiler observer reference; null to disable profiling
+	Profiler* profiler;
+	
+	/// @brief Lock for every member
+	std::mutex lock;
+	
+public:
+	/// @brief Construct a SlideImageCache
+	/// 
+	/// @param[in] slides Slides in BGR format, released as they are used for the last time.
+	/// @param[in] segments Every segment that will be encoded, in any order.
+	/// @param[in] capacity Maximum number of cached images.
+	/// @param[in] profiler Profiler for the conversions; null to disable.
+	SlideImageCache(std::vector<Mat>* slides, const std::vector<GenSegment>& segments, size_t capacity,
+	                Profiler* profiler = nullptr);
+	
+	/// @brief Get the image of a slide for its next segment
+	/// 
+	/// @param[in] slide Slide index.
+	/// @param[in] encoder Encoder to convert the slide for, if it is not cached; every encoder
+	///                    using the cache must have the same settings.
+	/// @returns Converted slide image.
+	libav::EncoderImage Get(unsigned int slide, libav::VideoEncoder& encoder);
+	
+private:
+	/// @brief Drop a slide if it has no segments left; the lock must be held
+	void retire(unsigned int slide);
+};
+
 /// @brief Generate a video file from a slides file and a synchronization file. Core loop
+/// 
+/// Every segment is a single slide held on screen, independent of the others, so the
+/// video can be split into chunks of consecutive segments which are encoded in parallel
+/// into temporary files and then concatenated into the output without re-encoding.
+/// 
+/// The footage can also be composed with the slides into every frame, in a single pass: the
+/// footage is decoded one frame ahead of the encoder and blitted onto a canvas which already
+/// holds the current slide, redrawn only when the slide changes.
 class GenLoop : public ProcessLoop
 {
 private:
+	/// @brief Minimum number of segments per chunk; smaller chunks are not worth a separate file
+	static const unsigned int min_chunksegments = 4;
+	
+	/// @brief Maximum number of converted slides kept for their later segments
+	static const unsigned int cache_capacity = 16;
+	
 	/// @brief Observer reference for the list of slides to use for the slideshow
 	std::vector<Mat>* slides;
 	
+	/// @brief Output video width
+	unsigned int width;
+	
+	/// @brief Output video height
+	unsigned int height;
+	
 	/// @brief Description of the slideshow transition times
 	SyncInstructions instructions;
 	
-	/// @brief Iterator over the instructin list
-	SyncInstructions::const_iterator instructions_it;
+	/// @brief Name of the output video file
+	string filename;
 	
-	/// @brief Timestamp of the previous instruction
-	unsigned int timestamp;
+	/// @brief Settings for every encoder
+	libav::EncoderConfig config;
 	
-	/// @brief Slide index after the previous instruction
-	unsigned int slide;
+	/// @brief Name of the file to copy the audio track from; empty for a video-only output
+	/// 
+	/// Chunks are video-only, so the audio is copied while they are concatenated.
+	string audio;
+	
+	/// @brief Sequence of slides that make up the video
+	std::vector<GenSegment> segments;
+	
+	/// @brief Converted slides, shared by every encoder
+	std::unique_ptr<SlideImageCache> cache;
+	
+	/// @brief Index of the next segment to encode sequentially
+	unsigned int segment_index;
+	
+	/// @brief Video encoder stream to file, when encoding sequentially
+	std::unique_ptr<libav::VideoEncoder> encoder;
+	
+	/// @brief Footage observer reference, composed into every frame; null for a slides-only output
+	FrameSource* footage;
+	
+	/// @brief Region of the output frame showing the footage
+	cv::Rect footage_rect;
+	
+	/// @brief Region of the output frame showing the slide
+	cv::Rect slide_rect;
+	
+	/// @brief Output frame being composed, holding the slide of the current segment
+	Mat canvas;
 	
-	/// @brief Video encoder stream to file
-	libav::VideoEncoder encoder;
+	/// @brief Number of segments of each slide still to be composed
+	std::vector<unsigned int> slide_uses;
+	
+	/// @brief Number of frames of the current segment already composed
+	unsigned int segment_frame;
+	
+	/// @brief Index of the first segment of each chunk, plus an end marker
+	std::vector<unsigned int> chunk_starts;
+	
+	/// @brief Temporary file of each chunk
+	std::vector<string> chunk_fnames;
+	
+	/// @brief Workers encoding the chunks
+	std::unique_ptr<ThreadPool> pool;
+	
+	/// @brief Completion of each chunk encoding task
+	std::vector<std::future<void>> chunk_tasks;
+	
+	/// @brief Number of finished chunks
+	unsigned int chunks_done;
+	
+	/// @brief Next footage frame, resized to the footage region; empty past the end of the footage
+	std::future<Mat> next_footage;
+	
+	/// @brief Profiler observer reference; null to disable profiling
+	Profiler* profiler;
+	
+	/// @brief Whether to print a line for every encoded segment
+	bool verbose;
 	
 	/// @brief Video generation processor
 	/// 
 	/// References the main routine which will be called periodically.
 	GenProcessorFn processor;
 	
-	/// @brief Flag indicating if the loop is currently processing a frame or not
-	bool processing;
-	
 public:
 	/// @brief Construct a GenLoop
 	/// 
-	/// @param[in] slides List of slides to use for the slideshow.
+	/// @param[in] slides List of slides to use for the slideshow; every image is released once it's
+	///                   no longer needed.
 	/// @param[in] instructions Description of the slideshow transition times.
 	/// @param[in] filename Name of the output video file.
-	GenLoop(std::vector<Mat>* slides, const SyncInstructions& instructions, const string& filename);
+	/// @param[in] config Encoder settings; frames are always held, regardless of config.holdframes. The
+	///                   frame rate should be the exact one of the footage, so the output stays in sync
+	///                   with it, e.g. to copy its audio.
+	/// @param[in] nthreads Maximum number of chunks encoded in parallel; zero to use every core.
+	/// @param[in] profiler Profiler for the encoding stages; null to disable. Given here, since the
+	///                     chunks start encoding right away.
+	GenLoop(std::vector<Mat>* slides, const SyncInstructions& instructions, const string& filename,
+	        const libav::EncoderConfig& config = libav::EncoderConfig(), unsigned int nthreads = 0,
+	        Profiler* profiler = nullptr);
+	
+	/// @brief Construct a GenLoop composing the footage and the slides into every frame
+	/// 
+	/// Every footage frame is encoded, with the slide it was synchronized to, so the output is as
+	/// long as the synchronized footage. The output size follows the layout: side by side, as high
+	/// as the slides with the footage scaled to that height; picture-in-picture, as large as the slides.
+	/// 
+	/// @param[in] slides List of slides to use for the slideshow; every image is released once it's
+	///                   no longer needed.
+	/// @param[in] footage Footage the instructions were found on; it is rewound and read sequentially
+	///                    from another thread, so it must not be used until this loop finishes.
+	/// @param[in] instructions Description of the slideshow transition times.
+	/// @param[in] filename Name of the output video file.
+	/// @param[in] composite Layout of the output frames; not CompositeLayout::None.
+	/// @param[in] config Encoder settings; frames are never held, regardless of config.holdframes. The
+	///                   frame rate should be the exact one of the footage.
+	/// @param[in] profiler Profiler for the decoding and encoding stages; null to disable.
+	/// @throws std::invalid_argument if the layout is not valid for these slides and footage.
+	/// @throws std::runtime_error if the footage can't be rewound.
+	GenLoop(std::vector<Mat>* slides, FrameSource* footage, const SyncInstructions& instructions,
+	        const string& filename, const CompositeConfig& composite,
+	        const libav::EncoderConfig& config = libav::EncoderConfig(), Profiler* profiler = nullptr);
+	
+	/// @brief Print a line for every encoded segment, or only the progress of every chunk
+	/// 
+	/// @param[in] verbose Whether to print every segment.
+	void SetVerbose(bool verbose);
+	
+	/// @brief Write the frames up to the next instruction to file
+	virtual void Step() override;
 	
-	/// @brief Recurrent action. Writes another frame to file
-	virtual void Notify();
-
 private:
-	/// @brief Main processing stage. Write a frame to file
+	/// @brief Split the instructions into segments
+	void build_segments();
+	
+	/// @brief Encode a range of segments into a standalone video file
+	/// 
+	/// Runs on the thread pool, so it must not touch any mutable member but the slide cache.
+	/// 
+	/// @param[in] fname Name of the output video file.
+	/// @param[in] start Index of the first segment.
+	/// @param[in] end Index past the last segment.
+	void encode_segments(const string& fname, unsigned int start, unsigned int end) const;
+	
+	/// @brief Place the footage and the slides in the output frame, and set its size
+	/// 
+	/// @param[in] composite Layout of the output frames.
+	void layout(const CompositeConfig& composite);
+	
+	/// @brief Read the next footage frame and resize it to the footage region
+	/// 
+	/// Runs on the thread pool, so it must not touch any mutable member but the footage.
+	/// 
+	/// @returns Resized frame; empty past the end of the footage.
+	Mat decode_footage() const;
+	
+	/// @brief Main processing stage. Write a segment to file
 	void writeframe();
 	
+	/// @brief Composing processing stage. Write a frame of footage and slide to file
+	void writecomposite();
+	
+	/// @brief Parallel processing stage. Wait for the chunks and concatenate them
+	void waitchunks();
+	
 	/// @brief Idle processing stage. Do nothing
 	/// 
 	/// Usually entered when the work has finished or
@@ -18,6 +18,8 @@
 // limitations under the License.
 
 #include <vector>
+#include <list>
+#include <string>
 
 #include <Magick++.h>
 
@@ -54,17 +56,30 @@ void imageDelete(Image* image)
 namespace slidesync
 {
 
-std::vector<Magick::Image*> readpdf_im(const string& filename, int framewidth, int frameheight)
+unsigned int pdf_pagecount(const string& filename)
 {
-	std::list<Magick::Image>    slides_list;
-	std::vector<Magick::Image*> slides;
+	std::list<Magick::Image> pages;
+	Magick::ReadOptions      pdfoptions;
+	
+	// pinging skips the pixel data; only the metadata (and in particular, the page count) is read
+	pdfoptions.ping(true);
+	
+	try {
+		Magick::readImages(&pages, filename, pdfoptions);
+	}
+	catch (const Magick::Exception& e) {
+		return 0;
+	}
 	
+	return pages.size();
+}
+
+bool pdf_fitdensity(const string& filename, int framewidth, int frameheight, float& density)
+{
 	// reading pdf with an appropriate resolution
 	// 
-	// options.density controls the quality of the result.
-	// To have an appropiately antialised image, density should
-	// be 2x or 4x the "normal" density (where normal is proportional to size)
-	// but magick++ doesn't seem to give any way to read the
+	// the density controls the quality of the result, but
+	// magick++ doesn't seem to give any way to read the
 	// original density directly from file, so it's not
 	// easy to make calculations with it.
 	// 
@@ -88,42 +103,86 @@ std::vector<Magick::Image*> readpdf_im(const string& filename, int framewidth, i
 	
 	pdfoptions.density(Magick::Geometry(testresolution, testresolution));
 	
-	Magick::readImages(&for_metadata, filename + "[0]", pdfoptions);
-	Magick::Image first = *(for_metadata.begin());
+	try {
+		Magick::readImages(&for_metadata, filename + "[0]", pdfoptions);
+	}
+	catch (const Magick::Exception& e) {
+		return false;
+	}
+	
+	if (for_metadata.empty()) {
+		return false;
+	}
+	
+	const Magick::Image& first = for_metadata.front();
 	
 	int testwidth  = first.size().width();
 	int testheight = first.size().height();
 	
 	if (testwidth < 4 || testheight < 4) {  // ill-formed file (huge resolution), not supported
-		return slides;
+		return false;
 	}
 	
-	float resolution = 0;
-	
 	// fit the slides bounding box to the frame
 	if (((float) framewidth) / testwidth < ((float) frameheight) / testheight) {
 		// pagewidth = width / resolution is constant and then solve for resolution
-		resolution = ((float) testresolution) * framewidth / testwidth;
+		density = ((float) testresolution) * framewidth / testwidth;
 	}
 	else {
-		resolution = ((float) testresolution) * frameheight / testheight;
+		density = ((float) testresolution) * frameheight / testheight;
 	}
 	
-	const int antialias = 4;
-	pdfoptions.density(Magick::Geometry(antialias * resolution, antialias * resolution));
+	return true;
+}
+
+bool readpdf_page(const string& filename, unsigned int page, float density,
+                  std::vector<unsigned char>& rgba, int& width, int& height)
+{
+	Magick::ReadOptions      pdfoptions;
+	std::list<Magick::Image> pages;
+	
+	pdfoptions.density(Magick::Geometry(density, density));
 	
-	Magick::readImages(&slides_list, filename, pdfoptions);
+	try {
+		Magick::readImages(&pages, filename + "[" + std::to_string(page) + "]", pdfoptions);
+		
+		if (pages.empty()) {
+			return false;
+		}
+		
+		Magick::Image& image = pages.front();
+		
+		width  = image.size().width();
+		height = image.size().height();
+		
+		rgba.resize(4 * width * height);
+		image.write(0, 0, width, height, "RGBA", MagickCore::CharPixel, &rgba[0]);
+	}
+	catch (const Magick::Exception& e) {
+		return false;
+	}
 	
-	// turn the list into another one (vector for efficiency) of pointers instead
-	// images, which are opaque to the user of this function, allowing them
-	// to use this function without including the ImageMagick headers
-	for (auto slide = slides_list.begin(); slide != slides_list.end(); slide++) {
-		slide->resize(Magick::Geometry(framewidth, frameheight));
+	return true;
+}
+
+bool pdf_write(const string& filename, const std::vector<std::vector<unsigned char>>& pages,
+               int width, int height, float density)
+{
+	std::list<Magick::Image> images;
+	
+	try {
+		for (unsigned int i = 0; i < pages.size(); i++) {
+			images.emplace_back(width, height, "RGBA", MagickCore::CharPixel, &pages[i][0]);
+			images.back().density(Magick::Point(density, density));
+		}
 		
-		slides.push_back(new Magick::Image(*slide));
+		Magick::writeImages(images.begin(), images.end(), filename);
+	}
+	catch (const Magick::Exception& e) {
+		return false;
 	}
 	
-	return slides;
+	return true;
 }
 
 }
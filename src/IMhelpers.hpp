@@ -80,13 +80,45 @@ void imageDelete(Image* image);
 namespace slidesync
 {
 
-/// @brief read a pdf file into ImageMagick images
-/// @remarks Remember to delete all the images using the appropriate imageDelete().
+/// @brief Count the pages in a pdf file
+/// 
+/// @param[in] filename PDF slides filename.
+/// @returns Number of pages; zero if the file can't be read.
+unsigned int pdf_pagecount(const string& filename);
+
+/// @brief Find the pdf rendering density which fits the first page into a frame
 /// 
 /// @param[in] filename PDF slides filename.
 /// @param[in] framewidth Width of a footage frame for size reference.
 /// @param[in] frameheight Height of a footage frame for size reference.
-std::vector<Magick::Image*> readpdf_im(const string& filename, int framewidth, int frameheight);
+/// @param[out] density Rendering density, in dots per inch.
+/// @returns True if successful; false if the file can't be read or is ill-formed.
+bool pdf_fitdensity(const string& filename, int framewidth, int frameheight, float& density);
+
+/// @brief Rasterize a single pdf page into a memory buffer
+/// 
+/// Only this page is decoded, so different pages can be rendered concurrently.
+/// 
+/// @param[in] filename PDF slides filename.
+/// @param[in] page Zero-based page index.
+/// @param[in] density Rendering density, in dots per inch.
+/// @param[out] rgba 8-bit RGBA pixels, row by row with no padding.
+/// @param[out] width Page width in pixels.
+/// @param[out] height Page height in pixels.
+/// @returns True if successful; otherwise, false.
+bool readpdf_page(const string& filename, unsigned int page, float density,
+                  std::vector<unsigned char>& rgba, int& width, int& height);
+
+/// @brief Write equally sized pages into a pdf file
+/// 
+/// @param[in] filename PDF output filename.
+/// @param[in] pages 8-bit RGBA pixels of every page, row by row with no padding.
+/// @param[in] width Page width in pixels.
+/// @param[in] height Page height in pixels.
+/// @param[in] density Page density, in dots per inch.
+/// @returns True if successful; otherwise, false.
+bool pdf_write(const string& filename, const std::vector<std::vector<unsigned char>>& pages,
+               int width, int height, float density);
 
 }
 
@@ -0,0 +1,139 @@
+/// @file LoopTimer.cpp
+/// @brief Event-driven ProcessLoop runner
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <vector>
+#include <chrono>
+
+#include <opencv2/opencv.hpp>
+
+#include <wx/wxprec.h>
+#include <wx/timer.h>
+ 
+#ifndef WX_PRECOMP
+	#include <wx/wx.h>
+#endif
+
+#include "ProcessLoop.hpp"
+#include "LoopTimer.hpp"
+#include "CVCanvas.hpp"
+
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Definition of the event fired when the loop finishes processing the data
+wxDEFINE_EVENT(LoopFinishedEvent, LoopEvent);
+
+// LoopEvent definitions
+
+LoopEvent::LoopEvent(wxEventType type, int id)
+	: wxEvent(id, type) {}
+
+LoopEvent::LoopEvent(const LoopEvent& that)
+	: wxEvent(that){}
+
+wxEvent* LoopEvent::Clone() const
+{
+	return new LoopEvent(*this);
+}
+
+// LoopTimer definitions
+
+LoopTimer::LoopTimer(CVCanvas* canvas)
+	: wxTimer(), loop(nullptr), canvas(canvas), processing(false), preview_interval(), last_shown()
+{
+	SetPreviewRate(5);
+}
+
+void LoopTimer::SetCanvas(CVCanvas* canvas)
+{
+	this->canvas = canvas;
+}
+
+void LoopTimer::SetPreviewRate(double rate)
+{
+	preview_interval = (rate > 0) ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+	                                    std::chrono::duration<double>(1 / rate)) :
+	                                std::chrono::steady_clock::duration::zero();
+}
+
+void LoopTimer::SetLoop(ProcessLoop* loop)
+{
+	if (this->loop != nullptr) {
+		this->loop->SetObserver(nullptr);
+	}
+	
+	this->loop = loop;
+	
+	if (loop != nullptr) {
+		loop->SetObserver(this);
+	}
+}
+
+void LoopTimer::Notify()
+{
+	if (processing || loop == nullptr || loop->Finished()) {
+		return;
+	}
+	
+	processing = true;
+	loop->Step();
+	processing = false;
+	
+	// a stopped timer means the window has been closed in the meantime; nobody is waiting for the event
+	if (loop->Finished() && IsRunning()) {
+		Stop();
+		
+		LoopEvent loopfinished(LoopFinishedEvent);
+		wxPostEvent(this, loopfinished);
+	}
+}
+
+void LoopTimer::Yield()
+{
+	wxTheApp->Yield(true);
+}
+
+bool LoopTimer::Watching()
+{
+	if (canvas == nullptr || !IsRunning() || !canvas->IsShownOnScreen()) {
+		return false;
+	}
+	
+	wxTopLevelWindow* window = dynamic_cast<wxTopLevelWindow*>(wxGetTopLevelParent(canvas));
+	
+	if (window != nullptr && window->IsIconized()) {
+		return false;
+	}
+	
+	return std::chrono::steady_clock::now() - last_shown >= preview_interval;
+}
+
+void LoopTimer::Show(const Mat& image, const std::vector<QuadOutline>& outlines)
+{
+	// if someone stopped the timer, it is probable the window has been destroyed in one of the Yield()
+	// calls, so canvas is no longer valid and this would segfault; bail out
+	if (canvas != nullptr && IsRunning() && !image.empty()) {
+		canvas->UpdateGL(image, outlines);
+		last_shown = std::chrono::steady_clock::now();
+	}
+}
+
+}
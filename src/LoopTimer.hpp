@@ -0,0 +1,121 @@
+/// @file LoopTimer.hpp
+/// @brief Event-driven ProcessLoop runner header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LOOPTIMER_HPP
+#define LOOPTIMER_HPP 1
+
+#include <vector>
+#include <chrono>
+
+#include <opencv2/opencv.hpp>
+
+#include <wx/wxprec.h>
+#include <wx/timer.h>
+ 
+#ifndef WX_PRECOMP
+	#include <wx/wx.h>
+#endif
+
+#include "ProcessLoop.hpp"
+#include "CVCanvas.hpp"
+
+using cv::Mat;
+
+namespace slidesync
+{
+
+class LoopEvent;
+
+/// @brief Declaration of the event fired when the loop finishes processing the data
+wxDECLARE_EVENT(LoopFinishedEvent, LoopEvent);
+
+/// @brief Tag for events coming from the LoopTimer
+class LoopEvent : public wxEvent
+{
+public:
+	/// @brief Construct a LoopEvent object
+	LoopEvent(wxEventType type, int id = 0);
+	
+	/// @brief Copy constructor. Copies any owned data
+	LoopEvent(const LoopEvent& that);
+	
+	/// @brief Create a new deep copy of this event
+	virtual wxEvent* Clone() const override;
+};
+
+/// @brief Periodic driver for a ProcessLoop inside a wxWidgets application
+/// 
+/// Executes one loop step per timer tick and observes the loop, forwarding its intermediate
+/// results to a canvas and keeping the user interface responsive between long operations.
+/// Results are only taken at the preview rate, and not at all while the canvas is hidden, so
+/// the preview costs about the same however fast the loop runs.
+/// When the loop finishes, the timer stops and a LoopFinishedEvent is fired.
+class LoopTimer : public wxTimer, public LoopObserver
+{
+private:
+	/// @brief Driven loop observer reference
+	ProcessLoop* loop;
+	
+	/// @brief OpenGL canvas observer reference
+	CVCanvas* canvas;
+	
+	/// @brief Flag indicating if the loop is currently processing a step or not
+	bool processing;
+	
+	/// @brief Minimum time between intermediate results drawn into the canvas
+	std::chrono::steady_clock::duration preview_interval;
+	
+	/// @brief Time the last intermediate result was drawn into the canvas
+	std::chrono::steady_clock::time_point last_shown;
+	
+public:
+	/// @brief Construct a LoopTimer
+	/// 
+	/// @param[in] canvas OpenGL canvas to draw the intermediate results; null to discard them.
+	LoopTimer(CVCanvas* canvas);
+	
+	/// @brief Set the internal canvas
+	void SetCanvas(CVCanvas* canvas);
+	
+	/// @brief Set the maximum number of intermediate results drawn per second
+	/// 
+	/// @param[in] rate Number of results per second; zero to draw every result.
+	void SetPreviewRate(double rate);
+	
+	/// @brief Set the driven loop and observe it
+	/// 
+	/// @param[in] loop Loop to drive; null to drive nothing.
+	void SetLoop(ProcessLoop* loop);
+	
+	/// @brief Recurrent action. Executes a loop step
+	virtual void Notify() override;
+	
+	/// @brief Process pending user interface events
+	virtual void Yield() override;
+	
+	/// @brief Check if the canvas is visible and the preview rate allows another result
+	virtual bool Watching() override;
+	
+	/// @brief Draw an intermediate result into the canvas
+	virtual void Show(const Mat& image, const std::vector<QuadOutline>& outlines) override;
+};
+
+}
+
+#endif
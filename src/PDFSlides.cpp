@@ -0,0 +1,253 @@
+/// @file PDFSlides.cpp
+/// @brief Presentation slides rasterization
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+
+#include "PDFSlides.hpp"
+#include "IMhelpers.hpp"
+#include "ThreadPool.hpp"
+#include "util.hpp"
+
+using std::string;
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Density used to fingerprint the pages, in dots per inch
+/// 
+/// Low enough for every page to render quickly, but high enough for a
+/// single changed character to change some pixels.
+static const float fingerprint_density = 72;
+
+/// @brief Fingerprint every page of a pdf file, from its index file if it is up to date
+/// 
+/// Pages can't be told apart without rendering them, so the fingerprint of a page is the hash of
+/// its pixels at a low density; pages which look the same get the same fingerprint.
+/// 
+/// @param[in] filename PDF slides filename.
+/// @param[in] filehash Hash of the contents of the pdf file.
+/// @param[in] indexfname Name of the index file, which holds the fingerprints of the last pdf file read;
+///                       empty for none.
+/// @param[out] pagehashes Fingerprint of every page; zero for the unreadable ones.
+/// @param[in] pool Worker threads to render the pages.
+static void fingerprint_pdf(const string& filename, uint64_t filehash, const string& indexfname,
+                            std::vector<uint64_t>& pagehashes, ThreadPool& pool)
+{
+	std::vector<uint64_t> index;
+	
+	// the first line of the index is the hash of the whole file
+	if (!indexfname.empty() && read_hashes(indexfname, index) && !index.empty() && index[0] == filehash) {
+		pagehashes.assign(index.begin() + 1, index.end());
+		return;
+	}
+	
+	pagehashes.assign(pdf_pagecount(filename), 0);
+	
+	pool.ParallelFor(pagehashes.size(), [&](unsigned int page) {
+		std::vector<unsigned char> buffer;
+		int                        width;
+		int                        height;
+		
+		if (!readpdf_page(filename, page, fingerprint_density, buffer, width, height)) {
+			return;
+		}
+		
+		int32_t  size[2] = {width, height};
+		uint64_t hash    = hash_bytes(size, sizeof (size));
+		
+		pagehashes[page] = hash_bytes(&buffer[0], buffer.size(), hash);
+	});
+	
+	index.assign(1, filehash);
+	index.insert(index.end(), pagehashes.begin(), pagehashes.end());
+	
+	if (!indexfname.empty() && !write_hashes(indexfname, index)) {
+		std::cerr << "Can't write slides index file" << std::endl;
+	}
+}
+
+/// @brief Name of the cached version of a page, which only depends on its contents
+/// 
+/// @param[in] cache_directory Directory containing the cached slides.
+/// @param[in] pagehash Fingerprint of the page.
+/// @returns Cached page filename.
+static string cache_filename(const string& cache_directory, uint64_t pagehash)
+{
+	return cache_directory + std::pathsep + hash_hex(pagehash) + ".png";
+}
+
+void readpdf(const string& filename, uint64_t filehash, const string& indexfname,
+             std::vector<SlidesTarget>& targets, std::vector<uint64_t>& pagehashes)
+{
+	ThreadPool pool;
+	
+	fingerprint_pdf(filename, filehash, indexfname, pagehashes, pool);
+	
+	unsigned int npages = pagehashes.size();
+	
+	// read from cache if possible
+	
+	for (unsigned int i = 0; i < targets.size(); i++) {
+		const SlidesTarget& target = targets[i];
+		std::vector<Mat>&   slides = *target.slides;
+		
+		slides.assign(npages, Mat());
+		
+		if (target.cache_directory.empty()) {
+			continue;
+		}
+		
+		pool.ParallelFor(npages, [&](unsigned int page) {
+			slides[page] = cv::imread(cache_filename(target.cache_directory, pagehashes[page]),
+			                          (target.grayscale) ? CV_LOAD_IMAGE_GRAYSCALE : CV_LOAD_IMAGE_COLOR);
+		});
+	}
+	
+	// otherwise go to the source, once per distinct page
+	
+	std::vector<unsigned int>        missing;
+	std::map<uint64_t, unsigned int> first;  // first page with each fingerprint
+	
+	for (unsigned int page = 0; page < npages; page++) {
+		bool cached = pagehashes[page] != 0;
+		
+		for (unsigned int i = 0; i < targets.size(); i++) {
+			cached = cached && !(*targets[i].slides)[page].empty();
+		}
+		
+		if (!cached && pagehashes[page] != 0 && first.insert({pagehashes[page], page}).second) {
+			missing.push_back(page);
+		}
+	}
+	
+	float density = 0;
+	
+	if (!missing.empty()) {
+		for (unsigned int i = 0; i < targets.size(); i++) {
+			float target_density;
+			
+			if (pdf_fitdensity(filename, targets[i].framewidth, targets[i].frameheight, target_density)) {
+				density = std::max(density, target_density);
+			}
+		}
+	}
+	
+	// to have an appropiately antialised image, density should
+	// be 2x or 4x the "normal" density (where normal is proportional to size)
+	const int antialias = 4;
+	
+	if (density > 0) {
+		std::cout << "Rendering " << missing.size() << " of " << npages << " slides" << std::endl;
+		
+		pool.ParallelFor(missing.size(), [&](unsigned int k) {
+			unsigned int               page = missing[k];
+			std::vector<unsigned char> buffer;
+			int                        width;
+			int                        height;
+			
+			if (!readpdf_page(filename, page, antialias * density, buffer, width, height)) {
+				return;
+			}
+			
+			// page_rgba is only a OpenCV wrapper around the buffer.
+			// It doesn't own the memory (which will be freed at the end of this function);
+			// resize() is required to copy the buffer into a memory-owning OpenCV matrix
+			Mat page_rgba(height, width, CV_8UC4, &buffer[0]);
+			
+			for (unsigned int i = 0; i < targets.size(); i++) {
+				Mat& slide = (*targets[i].slides)[page];
+				
+				if (!slide.empty()) {
+					continue;
+				}
+				
+				// fit the page inside the frame, keeping its aspect ratio
+				double scale = std::min(((double) targets[i].framewidth)  / width,
+				                        ((double) targets[i].frameheight) / height);
+				
+				cv::Size size((int) std::round(width * scale), (int) std::round(height * scale));
+				Mat      resized;
+				
+				cv::resize(page_rgba, resized, size, 0, 0, cv::INTER_AREA);
+				cv::cvtColor(resized, slide, (targets[i].grayscale) ? cv::COLOR_RGBA2GRAY : cv::COLOR_RGBA2BGR);
+				
+				if (!targets[i].cache_directory.empty()) {
+					cv::imwrite(cache_filename(targets[i].cache_directory, pagehashes[page]), slide);
+				}
+			}
+		});
+	}
+	
+	// repeated pages share the rendering of the first one
+	for (unsigned int page = 0; page < npages; page++) {
+		auto original = first.find(pagehashes[page]);
+		
+		for (unsigned int i = 0; i < targets.size() && original != first.end(); i++) {
+			std::vector<Mat>& slides = *targets[i].slides;
+			
+			if (slides[page].empty()) {
+				slides[page] = slides[original->second];
+			}
+		}
+	}
+	
+	// unreadable pages and inconsistent page sizes are not supported; every
+	// target drops the same pages, so slide indices agree between them
+	
+	std::vector<uint64_t> consistent_hashes;
+	
+	for (unsigned int page = 0; page < npages; page++) {
+		bool consistent = true;
+		
+		for (unsigned int i = 0; i < targets.size(); i++) {
+			const std::vector<Mat>& slides = *targets[i].slides;
+			const Mat&              slide  = slides[page];
+			
+			consistent = consistent && !slide.empty() &&
+			             (consistent_hashes.empty() || slide.size() == slides[0].size());
+		}
+		
+		if (consistent) {
+			for (unsigned int i = 0; i < targets.size(); i++) {
+				std::vector<Mat>& slides = *targets[i].slides;
+				
+				slides[consistent_hashes.size()] = slides[page];
+			}
+			
+			consistent_hashes.push_back(pagehashes[page]);
+		}
+	}
+	
+	pagehashes = consistent_hashes;
+	
+	for (unsigned int i = 0; i < targets.size(); i++) {
+		targets[i].slides->resize(pagehashes.size());
+	}
+}
+
+}
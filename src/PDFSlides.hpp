@@ -0,0 +1,76 @@
+/// @file PDFSlides.hpp
+/// @brief Presentation slides rasterization header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PDFSLIDES_HPP
+#define PDFSLIDES_HPP 1
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <opencv2/opencv.hpp>
+
+using std::string;
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Requested rasterized version of the presentation slides
+struct SlidesTarget
+{
+	/// @brief Width of a footage frame for size reference
+	int framewidth;
+	
+	/// @brief Height of a footage frame for size reference
+	int frameheight;
+	
+	/// @brief Read the image in grayscale instead of RGB
+	bool grayscale;
+	
+	/// @brief Existing directory to find/save a cache for this conversion; empty for no cache
+	string cache_directory;
+	
+	/// @brief Output slides
+	std::vector<Mat>* slides;
+};
+
+/// @brief read a pdf file into OpenCV matrices
+/// 
+/// Every page is cached under its fingerprint, so when the pdf file changes, e.g. to
+/// fix a typo or insert a slide, only the pages which actually changed are rendered
+/// again. The rest are rendered page by page in parallel: each page is rasterized
+/// once, at the highest density required, and then scaled down to every target
+/// missing it.
+/// 
+/// Cached pages which are no longer in the pdf file are left in place; the caller
+/// decides when to remove them.
+/// 
+/// @param[in] filename PDF slides filename.
+/// @param[in] filehash Hash of the contents of the pdf file.
+/// @param[in] indexfname Name of the file to keep the page fingerprints in; empty to
+///                       fingerprint every page again.
+/// @param[inout] targets Requested versions of the slides.
+/// @param[out] pagehashes Fingerprint of every slide read.
+void readpdf(const string& filename, uint64_t filehash, const string& indexfname,
+             std::vector<SlidesTarget>& targets, std::vector<uint64_t>& pagehashes);
+
+}
+
+#endif
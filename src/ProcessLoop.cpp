@@ -17,30 +17,81 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <wx/wxprec.h>
-#include <wx/timer.h>
- 
-#ifndef WX_PRECOMP
-	#include <wx/wx.h>
-#endif
+#include <vector>
+
+#include <opencv2/opencv.hpp>
 
 #include "ProcessLoop.hpp"
 
+using cv::Mat;
+
 namespace slidesync
 {
 
-/// @brief Definition of the event fired when the loop finishes processing the data
-wxDEFINE_EVENT(LoopFinishedEvent, LoopEvent);
+// LoopObserver definitions
+
+LoopObserver::~LoopObserver() = default;
+
+void LoopObserver::Yield() {}
+
+bool LoopObserver::Watching()
+{
+	return false;
+}
+
+void LoopObserver::Show(const Mat& image, const std::vector<QuadOutline>& outlines) {}
+
+// ProcessLoop definitions
+
+ProcessLoop::ProcessLoop()
+	: observer(nullptr), finished(false) {}
+
+ProcessLoop::~ProcessLoop() = default;
+
+void ProcessLoop::SetObserver(LoopObserver* observer)
+{
+	this->observer = observer;
+}
+
+bool ProcessLoop::Finished() const
+{
+	return finished;
+}
+
+void ProcessLoop::Run()
+{
+	while (!finished) {
+		Step();
+	}
+}
 
-LoopEvent::LoopEvent(wxEventType type, int id)
-	: wxEvent(id, type) {}
+bool ProcessLoop::observed() const
+{
+	return observer != nullptr;
+}
 
-LoopEvent::LoopEvent(const LoopEvent& that)
-	: wxEvent(that){}
+bool ProcessLoop::watched() const
+{
+	return observer != nullptr && observer->Watching();
+}
+
+void ProcessLoop::yield()
+{
+	if (observer != nullptr) {
+		observer->Yield();
+	}
+}
+
+void ProcessLoop::show(const Mat& image, const std::vector<QuadOutline>& outlines)
+{
+	if (observer != nullptr) {
+		observer->Show(image, outlines);
+	}
+}
 
-wxEvent* LoopEvent::Clone() const
+void ProcessLoop::finish()
 {
-	return new LoopEvent(*this);
+	finished = true;
 }
 
 }
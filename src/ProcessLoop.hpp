@@ -20,36 +20,110 @@
 #ifndef PROCESSLOOP_HPP
 #define PROCESSLOOP_HPP 1
 
-#include <wx/wxprec.h>
-#include <wx/timer.h>
- 
-#ifndef WX_PRECOMP
-	#include <wx/wx.h>
-#endif
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+using cv::Mat;
 
 namespace slidesync
 {
 
-/// @brief Tag base class
-class ProcessLoop : public wxTimer {};
-
-class LoopEvent;
+/// @brief Closed quadrilateral outline drawn over an intermediate result
+struct QuadOutline
+{
+	/// @brief Vertices, in order, in image pixel coordinates
+	cv::Point2f vertices[4];
+	
+	/// @brief Line color, in RGBA order
+	cv::Scalar color;
+};
 
-/// @brief Declaration of the event fired when the loop finishes processing the data
-wxDECLARE_EVENT(LoopFinishedEvent, LoopEvent);
+/// @brief Optional spectator of a ProcessLoop
+/// 
+/// Processing loops do not depend on any user interface; instead, they report
+/// their progress to an observer, if there is one. The default implementation
+/// ignores every notification, so headless runs do not pay for visualization.
+class LoopObserver
+{
+public:
+	/// @brief Destruct this LoopObserver
+	virtual ~LoopObserver();
+	
+	/// @brief Give the observer a chance to process its own events between long operations
+	virtual void Yield();
+	
+	/// @brief Check if the observer would display an intermediate result right now
+	/// 
+	/// Lets the observer display fewer results than the loop produces, e.g. at a fixed rate,
+	/// without the loop preparing the ones it would discard.
+	virtual bool Watching();
+	
+	/// @brief Display an intermediate result
+	/// 
+	/// @param[in] image 8-bit grayscale, BGR or RGBA image describing the current state of the loop.
+	///                  It must not be modified, since it may be shared with the loop.
+	/// @param[in] outlines Outlines to draw over the image.
+	virtual void Show(const Mat& image, const std::vector<QuadOutline>& outlines);
+};
 
-/// @brief Tag for events coming from the ProcessLoop hierarchy
-class LoopEvent : public wxEvent
+/// @brief Video processing abstract loop
+/// 
+/// A loop is a sequence of steps which are executed until the loop declares itself finished.
+/// It can be driven by a periodic event source, such as a LoopTimer in an interactive application,
+/// or by Run(), which executes the steps as a tight loop without any event handling.
+class ProcessLoop
 {
+private:
+	/// @brief Observer reference, possibly null
+	LoopObserver* observer;
+	
+	/// @brief Whether the loop has finished processing the data
+	bool finished;
+	
 public:
-	/// @brief Construct a LoopEvent object
-	LoopEvent(wxEventType type, int id = 0);
+	/// @brief Construct a ProcessLoop with no observer
+	ProcessLoop();
+	
+	/// @brief Destruct this ProcessLoop
+	virtual ~ProcessLoop();
+	
+	/// @brief Set the observer which will be notified of the loop progress
+	/// 
+	/// @param[in] observer Observer reference; null to run unobserved.
+	void SetObserver(LoopObserver* observer);
+	
+	/// @brief Check if the loop has finished processing the data
+	bool Finished() const;
+	
+	/// @brief Execute a single processing step
+	virtual void Step() = 0;
+	
+	/// @brief Execute processing steps until the loop is finished
+	void Run();
+	
+protected:
+	/// @brief Check if there is any observer attached to this loop
+	/// 
+	/// Visualization-only work should be skipped when unobserved.
+	bool observed() const;
+	
+	/// @brief Check if the observer would display an intermediate result right now
+	/// 
+	/// Preparing an intermediate result should be skipped otherwise.
+	bool watched() const;
+	
+	/// @brief Let the observer process its events, if there is one
+	void yield();
 	
-	/// @brief Copy constructor. Copies any owned data
-	LoopEvent(const LoopEvent& that);
+	/// @brief Send an intermediate result to the observer, if there is one
+	/// 
+	/// @param[in] image 8-bit grayscale, BGR or RGBA image describing the current state of the loop.
+	/// @param[in] outlines Outlines to draw over the image.
+	void show(const Mat& image, const std::vector<QuadOutline>& outlines = std::vector<QuadOutline>());
 	
-	/// @brief Create a new deep copy of this event
-	virtual wxEvent* Clone() const override;
+	/// @brief Mark the loop as finished
+	void finish();
 };
 
 }
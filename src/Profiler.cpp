@@ -0,0 +1,201 @@
+/// @file Profiler.cpp
+/// @brief Processing stage timers and counters
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+
+#include "Profiler.hpp"
+
+namespace slidesync
+{
+
+/// @brief Number of microseconds in a duration
+static uint64_t microseconds(ProfileClock::duration duration)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+/// @brief Milliseconds in a number of microseconds, for printing
+static double milliseconds(uint64_t us)
+{
+	return us / 1000.0;
+}
+
+/// @brief Histogram bucket of a measurement
+/// 
+/// @param[in] us Measurement, in microseconds.
+/// @returns Index i such that the measurement is under 2^(i + 1) but not under 2^i microseconds.
+static unsigned int bucket(uint64_t us)
+{
+	unsigned int i = 0;
+	
+	while (us > 1 && i < 31) {
+		us >>= 1;
+		i  += 1;
+	}
+	
+	return i;
+}
+
+Profiler::Profiler(bool tracing)
+	: origin(ProfileClock::now()), stages(), counters(), tracing(tracing), events(), threads(), lock() {}
+
+void Profiler::Record(const char* stage, ProfileClock::time_point start, ProfileClock::time_point end)
+{
+	uint64_t duration = microseconds(end - start);
+	
+	std::lock_guard<std::mutex> guard(lock);
+	
+	auto inserted = stages.emplace(stage, StageStats{0, 0, std::numeric_limits<uint64_t>::max(), 0, {0}});
+	
+	StageStats& stats = inserted.first->second;
+	
+	stats.count                       += 1;
+	stats.total                       += duration;
+	stats.min                          = std::min(stats.min, duration);
+	stats.max                          = std::max(stats.max, duration);
+	stats.histogram[bucket(duration)] += 1;
+	
+	if (tracing) {
+		auto thread = threads.emplace(std::this_thread::get_id(), threads.size());
+		
+		events.push_back(TraceEvent{stage, microseconds(start - origin), duration, thread.first->second});
+	}
+}
+
+void Profiler::Count(const char* counter, uint64_t n)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	counters[counter] += n;
+}
+
+bool Profiler::SaveSummary(const string& filename) const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	std::ofstream               file(filename);
+	
+	// using "\n" instead of std::endl, since flushing every line is slow and pointless here
+	file << "{\n";
+	file << "  \"stages\": {";
+	
+	bool first = true;
+	
+	for (const auto& stage : stages) {
+		const StageStats& stats = stage.second;
+		
+		file << ((first) ? "\n" : ",\n");
+		file << "    \"" << stage.first << "\": {";
+		file << "\"count\": "    << stats.count                                   << ", ";
+		file << "\"total_ms\": " << milliseconds(stats.total)                     << ", ";
+		file << "\"mean_ms\": "  << milliseconds(stats.total) / stats.count       << ", ";
+		file << "\"min_ms\": "   << milliseconds(stats.min)                       << ", ";
+		file << "\"max_ms\": "   << milliseconds(stats.max)                       << ", ";
+		file << "\"histogram_us\": {";
+		
+		// only the occupied buckets, keyed by their upper bound
+		bool firstbucket = true;
+		
+		for (unsigned int i = 0; i < 32; i++) {
+			if (stats.histogram[i] > 0) {
+				file << ((firstbucket) ? "" : ", ") << "\"<" << (uint64_t(2) << i) << "\": " << stats.histogram[i];
+				firstbucket = false;
+			}
+		}
+		
+		file << "}}";
+		first = false;
+	}
+	
+	file << "\n  },\n";
+	file << "  \"counters\": {";
+	
+	first = true;
+	
+	for (const auto& counter : counters) {
+		file << ((first) ? "\n" : ",\n");
+		file << "    \"" << counter.first << "\": " << counter.second;
+		first = false;
+	}
+	
+	file << "\n  }\n";
+	file << "}\n";
+	
+	file.close();
+	
+	return !file.fail();
+}
+
+bool Profiler::SaveTrace(const string& filename) const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	if (!tracing) {
+		return false;
+	}
+	
+	std::ofstream file(filename);
+	
+	file << "{\"traceEvents\": [";
+	
+	for (unsigned int i = 0; i < events.size(); i++) {
+		const TraceEvent& event = events[i];
+		
+		file << ((i == 0) ? "\n" : ",\n");
+		file << "{\"name\": \"" << event.stage << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+		     << ", \"ts\": " << event.start << ", \"dur\": " << event.duration << "}";
+	}
+	
+	file << "\n]}\n";
+	
+	file.close();
+	
+	return !file.fail();
+}
+
+ScopedTimer::ScopedTimer(Profiler* profiler, const char* stage)
+	: profiler(profiler), stage(stage), start()
+{
+	if (profiler != nullptr) {
+		start = ProfileClock::now();
+	}
+}
+
+ScopedTimer::~ScopedTimer()
+{
+	if (profiler != nullptr) {
+		profiler->Record(stage, start, ProfileClock::now());
+	}
+}
+
+void profile_count(Profiler* profiler, const char* counter, uint64_t n)
+{
+	if (profiler != nullptr) {
+		profiler->Count(counter, n);
+	}
+}
+
+}
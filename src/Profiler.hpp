@@ -0,0 +1,186 @@
+/// @file Profiler.hpp
+/// @brief Processing stage timers and counters header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROFILER_HPP
+#define PROFILER_HPP 1
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+using std::string;
+
+namespace slidesync
+{
+
+/// @brief Clock used for every measurement
+typedef std::chrono::steady_clock ProfileClock;
+
+/// @brief Accumulated timings of a processing stage
+struct StageStats
+{
+	/// @brief Number of measurements
+	uint64_t count;
+	
+	/// @brief Sum of every measurement, in microseconds
+	uint64_t total;
+	
+	/// @brief Shortest measurement, in microseconds
+	uint64_t min;
+	
+	/// @brief Longest measurement, in microseconds
+	uint64_t max;
+	
+	/// @brief Number of measurements under 2^(i + 1) microseconds, for every bucket i
+	///        (only the ones not counted by the previous bucket)
+	uint64_t histogram[32];
+};
+
+/// @brief Single timed interval, for the Chrome trace
+struct TraceEvent
+{
+	/// @brief Stage name
+	const char* stage;
+	
+	/// @brief Start time since the profiler was constructed, in microseconds
+	uint64_t start;
+	
+	/// @brief Duration, in microseconds
+	uint64_t duration;
+	
+	/// @brief Index of the thread that measured it, in order of appearance
+	unsigned int thread;
+};
+
+/// @brief Thread-safe collection of stage timings and event counters
+/// 
+/// Stages and counters are named by string literals, which must outlive the profiler.
+/// Every measurement costs a lock and a map lookup, so stages should be per-frame
+/// operations or coarser, not inner loops.
+class Profiler
+{
+private:
+	/// @brief Construction time, the origin of the trace
+	ProfileClock::time_point origin;
+	
+	/// @brief Timings of every stage
+	std::map<string, StageStats> stages;
+	
+	/// @brief Value of every counter
+	std::map<string, uint64_t> counters;
+	
+	/// @brief Whether every interval is kept for the trace
+	bool tracing;
+	
+	/// @brief Every interval measured so far, if tracing
+	std::vector<TraceEvent> events;
+	
+	/// @brief Index of every thread seen so far
+	std::map<std::thread::id, unsigned int> threads;
+	
+	/// @brief Lock for every member
+	mutable std::mutex lock;
+	
+public:
+	/// @brief Construct an empty Profiler
+	/// 
+	/// @param[in] tracing Keep every interval to export a Chrome trace, not only the summary.
+	Profiler(bool tracing = false);
+	
+	/// @brief Copy constructor. Deleted
+	Profiler(const Profiler& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	Profiler& operator=(const Profiler& that) = delete;
+	
+	/// @brief Add a measurement to a stage
+	/// 
+	/// @param[in] stage Stage name.
+	/// @param[in] start Start of the interval.
+	/// @param[in] end End of the interval.
+	void Record(const char* stage, ProfileClock::time_point start, ProfileClock::time_point end);
+	
+	/// @brief Increase a counter
+	/// 
+	/// @param[in] counter Counter name.
+	/// @param[in] n Increment.
+	void Count(const char* counter, uint64_t n = 1);
+	
+	/// @brief Write the stage timings and counters as JSON
+	/// 
+	/// @param[in] filename Name of the output file.
+	/// @returns True if successful; otherwise, false.
+	bool SaveSummary(const string& filename) const;
+	
+	/// @brief Write every measured interval in the Chrome trace event format
+	/// 
+	/// Only available if the profiler was constructed with tracing enabled. The file can be
+	/// opened in chrome://tracing or similar viewers.
+	/// 
+	/// @param[in] filename Name of the output file.
+	/// @returns True if successful; otherwise, false.
+	bool SaveTrace(const string& filename) const;
+};
+
+/// @brief Measure a stage from construction to destruction
+/// 
+/// Does nothing when given a null profiler, so instrumented code doesn't need to check.
+class ScopedTimer
+{
+private:
+	/// @brief Profiler observer reference; null to disable
+	Profiler* profiler;
+	
+	/// @brief Stage name
+	const char* stage;
+	
+	/// @brief Start of the interval
+	ProfileClock::time_point start;
+	
+public:
+	/// @brief Construct a ScopedTimer and start measuring
+	/// 
+	/// @param[in] profiler Profiler to record the measurement in; null to disable.
+	/// @param[in] stage Stage name.
+	ScopedTimer(Profiler* profiler, const char* stage);
+	
+	/// @brief Copy constructor. Deleted
+	ScopedTimer(const ScopedTimer& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	ScopedTimer& operator=(const ScopedTimer& that) = delete;
+	
+	/// @brief Record the measurement and destruct this ScopedTimer
+	~ScopedTimer();
+};
+
+/// @brief Increase a counter of a profiler, if any
+/// 
+/// @param[in] profiler Profiler observer reference; null to do nothing.
+/// @param[in] counter Counter name.
+/// @param[in] n Increment.
+void profile_count(Profiler* profiler, const char* counter, uint64_t n = 1);
+
+}
+
+#endif
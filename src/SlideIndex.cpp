@@ -0,0 +1,116 @@
+/// @file SlideIndex.cpp
+/// @brief Slide retrieval index
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "SlideIndex.hpp"
+
+using std::vector;
+using cv::Mat;
+
+namespace slidesync
+{
+
+SlideIndex::SlideIndex()
+	: matcher(),
+	  owners(),
+	  weights() {}
+
+void SlideIndex::Build(const FeatureStore& features)
+{
+	matcher.release();
+	owners .clear();
+	weights.assign(features.Size(), 0);
+	
+	// the packed block already is a single merged table, which keeps every
+	// lookup independent of the number of slides
+	const Mat& merged = features.AllDescriptors();
+	
+	// LSH needs at least a neighbor to compare against
+	if (merged.rows < 2) {
+		return;
+	}
+	
+	for (unsigned int i = 0; i < features.Size(); i++) {
+		unsigned int count = features.Count(i);
+		
+		owners.insert(owners.end(), count, i);
+		
+		if (count > 0) {
+			weights[i] = 1 / std::sqrt((double) count);
+		}
+	}
+	
+	matcher = cv::makePtr<cv::FlannBasedMatcher>(cv::makePtr<cv::flann::LshIndexParams>(lsh_tables, lsh_keysize,
+	                                                                                    lsh_probes));
+	
+	matcher->add(vector<Mat>{merged});
+	matcher->train();
+}
+
+bool SlideIndex::Empty() const
+{
+	return owners.empty();
+}
+
+vector<unsigned int> SlideIndex::Rank(const Mat& descriptors, unsigned int count)
+{
+	vector<unsigned int> ranking;
+	
+	if (Empty() || descriptors.empty() || count == 0) {
+		return ranking;
+	}
+	
+	vector<vector<cv::DMatch>> neighbors;
+	vector<double>             scores(weights.size(), 0);
+	
+	matcher->knnMatch(descriptors, neighbors, 2);
+	
+	// LSH may not find two neighbors for every descriptor; those can't pass the ratio test
+	for (const vector<cv::DMatch>& pair : neighbors) {
+		if (pair.size() < 2 || pair[0].distance >= max_voteratio * pair[1].distance) {
+			continue;
+		}
+		
+		unsigned int slide = owners[pair[0].trainIdx];
+		
+		scores[slide] += weights[slide];
+	}
+	
+	for (unsigned int i = 0; i < scores.size(); i++) {
+		if (scores[i] > 0) {
+			ranking.push_back(i);
+		}
+	}
+	
+	std::stable_sort(ranking.begin(), ranking.end(),
+	          [&scores] (unsigned int a, unsigned int b) { return scores[a] > scores[b]; });
+	
+	if (ranking.size() > count) {
+		ranking.resize(count);
+	}
+	
+	return ranking;
+}
+
+}
@@ -0,0 +1,89 @@
+/// @file SlideIndex.hpp
+/// @brief Slide retrieval index header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SLIDEINDEX_HPP
+#define SLIDEINDEX_HPP 1
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "FeatureCache.hpp"
+
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Index over the keypoint descriptors of every slide, to find which slides a frame most likely shows
+/// 
+/// Every slide descriptor is stored in a single multi-probe LSH table (binary descriptors, Hamming
+/// distance), so looking up the nearest neighbors of a frame's descriptors doesn't depend on
+/// the size of the deck. Each distinctive neighbor is a vote for the slide it came from; the
+/// ranking is only a shortlist and still needs geometric verification.
+class SlideIndex
+{
+private:
+	/// @brief Number of LSH hash tables
+	static const unsigned int lsh_tables = 6;
+	
+	/// @brief Number of descriptor bits hashed into each table key
+	static const unsigned int lsh_keysize = 12;
+	
+	/// @brief Number of neighboring buckets explored in each table (multi-probe level)
+	static const unsigned int lsh_probes = 2;
+	
+	/// @brief Maximum ratio between best and second neighbor's distance to count a vote
+	static constexpr float max_voteratio = 0.8;
+	
+	/// @brief Approximate nearest neighbor matcher holding every slide descriptor
+	cv::Ptr<cv::FlannBasedMatcher> matcher;
+	
+	/// @brief Slide each indexed descriptor belongs to
+	std::vector<unsigned int> owners;
+	
+	/// @brief Vote weight for each slide
+	/// 
+	/// Slides with many keypoints would otherwise collect votes from any frame.
+	std::vector<double> weights;
+	
+public:
+	/// @brief Construct an empty SlideIndex
+	SlideIndex();
+	
+	/// @brief Index the descriptors of every slide, replacing any previous contents
+	/// 
+	/// @param[in] features Keypoints of every slide. Their descriptors must be binary (CV_8U).
+	void Build(const FeatureStore& features);
+	
+	/// @brief Check if the index has no descriptors
+	bool Empty() const;
+	
+	/// @brief Rank the slides by likeness to a frame
+	/// 
+	/// @param[in] descriptors Keypoint descriptors of the frame.
+	/// @param[in] count Maximum number of slides to return.
+	/// @returns Indices of the slides that got any votes, best first. Empty if the
+	///          index or the descriptors are.
+	std::vector<unsigned int> Rank(const Mat& descriptors, unsigned int count);
+};
+
+}
+
+#endif
@@ -20,8 +20,19 @@
 #include <string>
 #include <memory>
 #include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
 #include <vector>
 #include <list>
+#include <map>
+#include <set>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
 
 #include <opencv2/opencv.hpp>
 
@@ -29,6 +40,7 @@
 #include <wx/cmdline.h>
 #include <wx/sizer.h>
 #include <wx/dir.h>
+#include <wx/filename.h>
  
 #ifndef WX_PRECOMP
 	#include <wx/wx.h>
@@ -37,16 +49,22 @@
 #include "SlideSync.hpp"
 #include "CVCanvas.hpp"
 #include "ProcessLoop.hpp"
+#include "LoopTimer.hpp"
 #include "SyncLoop.hpp"
+#include "FeatureBackend.hpp"
 #include "GenLoop.hpp"
 #include "avhelpers.hpp"
 #include "IMhelpers.hpp"
+#include "PDFSlides.hpp"
+#include "ThreadPool.hpp"
+#include "Profiler.hpp"
 #include "util.hpp"
 
 using std::string;
 using cv::Mat;
 
 using slidesync::SlideSyncApp;
+using slidesync::SlideSyncConsoleApp;
 using slidesync::SlideSyncWindow;
 
 /// @brief Event signal routing table for SlideSyncWindow
@@ -55,7 +73,26 @@ wxBEGIN_EVENT_TABLE(SlideSyncWindow, wxFrame)
 	EVT_MENU(wxID_ABOUT, SlideSyncWindow::onabout)
 wxEND_EVENT_TABLE()
 
-wxIMPLEMENT_APP(SlideSyncApp);
+wxIMPLEMENT_APP_NO_MAIN(SlideSyncApp);
+
+/// @brief Main entry point
+/// 
+/// The graphical application is used by default. The --headless switch (and --merge, --batch or
+/// --convert) selects the console application instead, which must be chosen before wxWidgets
+/// initializes, since initializing the graphical toolkit requires a display.
+int main(int argc, char** argv)
+{
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+		
+		if (arg == "--headless" || arg == "--merge" || arg.find("--batch") == 0 || arg.find("--convert") == 0) {
+			wxApp::SetInstance(new SlideSyncConsoleApp());
+			break;
+		}
+	}
+	
+	return wxEntry(argc, argv);
+}
 
 
 namespace slidesync
@@ -63,9 +100,8 @@ namespace slidesync
 
 // SlideSyncWindow definitions
 
-SlideSyncWindow::SlideSyncWindow(const wxString& title, const wxPoint& pos,
-                                 std::unique_ptr<ProcessLoop>* processloop)
-	: wxFrame(NULL, wxID_ANY, title, pos, wxDefaultSize), canvas(nullptr), processloop(processloop)
+SlideSyncWindow::SlideSyncWindow(const wxString& title, const wxPoint& pos, LoopTimer* looptimer)
+	: wxFrame(NULL, wxID_ANY, title, pos, wxDefaultSize), canvas(nullptr), looptimer(looptimer)
 {
 	wxMenu* menufile = new wxMenu();
 	menufile->Append(wxID_EXIT);
@@ -96,15 +132,15 @@ SlideSyncWindow::SlideSyncWindow(const wxString& title, const wxPoint& pos,
 	SetAutoLayout(true);
 }
 
-void SlideSyncWindow::SetProcessLoop(std::unique_ptr<ProcessLoop>* processloop)
+void SlideSyncWindow::SetLoopTimer(LoopTimer* looptimer)
 {
-	this->processloop = processloop;
+	this->looptimer = looptimer;
 }
 
 bool SlideSyncWindow::Destroy()
 {
-	if ((*processloop) != nullptr) {
-		(*processloop)->Stop();
+	if (looptimer != nullptr) {
+		looptimer->Stop();
 	}
 	return wxFrame::Destroy();
 }
@@ -119,209 +155,964 @@ void SlideSyncWindow::onabout(wxCommandEvent& event)
 	wxMessageBox("SlideSync 0.1\nby Angelo Falchetti", "About SlideSync", wxOK | wxICON_INFORMATION);
 }
 
-// SlideSyncApp definitions
+// SyncJob definitions
 
-/// @brief read a pdf file into OpenCV matrices
+/// @brief Remove the cached slides which are not pages of the current pdf file
 /// 
-/// @param[in] filename PDF slides filename.
-/// @param[in] framewidth Width of a footage frame for size reference.
-/// @param[in] frameheight Height of a footage frame for size reference.
-/// @param[in] cache_directory Directory to find/save a cache for this conversion.
-/// @param[in] grayscale Read the image in grayscale instead of RGB.
-std::vector<Mat> readpdf(string filename, int framewidth, int frameheight,
-                         string cache_directory, bool grayscale)
+/// @param[in] cache_directory Directory containing the cached slides.
+/// @param[in] pagehashes Fingerprint of every current page.
+static void prunecache(const string& cache_directory, const std::vector<uint64_t>& pagehashes)
 {
-	std::vector<Mat> slides;
+	if (cache_directory.empty() || !wxDir::Exists(cache_directory)) {
+		return;
+	}
 	
-	// read from cache if possible
+	std::set<string> current;
+	wxArrayString    files;
 	
-	if (!wxDir::Exists(cache_directory)) {
-		wxDir::Make(cache_directory);
+	for (uint64_t pagehash : pagehashes) {
+		current.insert(hash_hex(pagehash) + ".png");
 	}
 	
-	wxDir cachedir(cache_directory);
+	wxDir::GetAllFiles(cache_directory, &files, "*.png", wxDIR_FILES);
 	
-	if (cachedir.IsOpened()) {
-		wxArrayString files;
+	for (unsigned int i = 0; i < files.GetCount(); i++) {
+		if (current.count(wxFileName(files.Item(i)).GetFullName().ToStdString()) == 0) {
+			wxRemoveFile(files.Item(i));
+		}
+	}
+}
+
+/// @brief Seconds of footage each shard synchronizes before its range, so it has settled by then
+static const double shard_overlap = 30;
+
+/// @brief Name of a per-shard intermediate file
+/// 
+/// @param[in] name File name without sharding, e.g. "raw.sync".
+/// @param[in] shard Shard index, from zero.
+/// @param[in] nshards Number of shards; one to return the name unchanged.
+/// @returns Shard file name, e.g. "raw-2of8.sync".
+static string shard_filename(const string& name, unsigned int shard, unsigned int nshards)
+{
+	if (nshards <= 1) {
+		return name;
+	}
+	
+	size_t dot = name.find_last_of('.');
+	
+	if (dot == string::npos) {
+		dot = name.size();
+	}
+	
+	return name.substr(0, dot) + "-" + std::to_string(shard + 1) + "of" + std::to_string(nshards) +
+	       name.substr(dot);
+}
+
+bool SyncJob::Load()
+{
+	return OpenFootage() && LoadSlides();
+}
+
+bool SyncJob::OpenFootage()
+{
+	if (live) {
+		// a stream can't be probed, so slide changes are only located up to the frames actually processed
+		std::cout << "Opening footage stream '" << videofname << "'" << std::endl;
+		footage = open_stream(videofname);
+		
+		if (footage == nullptr) {
+			std::cerr << "Can't open footage stream" << std::endl;
+			return false;
+		}
+	}
+	else {
+		std::cout << "Reading footage file '" << videofname << "'" << std::endl;
+		footage = open_framesource(videofname, keyframesonly);
 		
-		wxDir::GetAllFiles(cache_directory, &files, "*.png");
+		if (footage == nullptr) {
+			std::cerr << "Can't open footage video file" << std::endl;
+			return false;
+		}
 		
-		files.Sort(compare_lexiconumerical);
+		probe = open_framesource(videofname);
 		
-		if (files.GetCount() > 0) {
-			for (unsigned int i = 0; i < files.GetCount(); i++) {
-				Mat slide = cv::imread(files.Item(i).ToStdString(), (grayscale) ? CV_LOAD_IMAGE_GRAYSCALE :
-				                                                                  CV_LOAD_IMAGE_COLOR);
-				
-				slides.push_back(slide);
-			}
-			
-			return slides;
+		if (probe == nullptr) {
+			std::cerr << "Can't seek footage video file; slide changes will be less precise" << std::endl;
 		}
 	}
 	
-	// otherwise go to the source
+	return true;
+}
+
+bool SyncJob::LoadSlides()
+{
+	unsigned int width  = footage->Width();
+	unsigned int height = footage->Height();
+	
+	unsigned int width_hires  = 1920;
+	unsigned int height_hires = 1080;
 	
-	std::vector<Magick::Image*> slides_im = readpdf_im(filename, framewidth, frameheight);
+	if (!wxDir::Exists(intermediatedir)) {
+		wxDir::Make(intermediatedir);
+	}
 	
-	Magick::Image* first = *(slides_im.begin());
+	string slides_directory = intermediatedir + std::pathsep + "slides";
 	
-	int width  = imageWidth(first);
-	int height = imageHeight(first);
+	if (!wxDir::Exists(slides_directory)) {
+		wxDir::Make(slides_directory);
+	}
 	
-	std::vector<unsigned char> buffer(4 * width * height);
-	Mat cv_frame(height, width, CV_8UC4, &buffer[0]);
+	std::cout << "Reading PDF slides file '" << slidesfname << "'" << std::endl << std::flush;
 	
-	for (unsigned int i = 0; i < slides_im.size(); i++) {
-		Magick::Image* slide_im = slides_im[i];
+	if (!hash_file(slidesfname, slideshash)) {
+		std::cerr << "Can't read slides file" << std::endl;
+		return false;
+	}
+	
+	std::vector<SlidesTarget> targets;
+	
+	// tracking at a lower resolution keeps the full one around for refinement
+	if (workwidth > 0 && workwidth < width) {
+		unsigned int workheight = (unsigned int) round((double) height * workwidth / width);
 		
-		if (width  != imageWidth(slide_im) ||
-		    height != imageHeight(slide_im)) {
-			// inconsistent page size, not supported
-			continue;
+		targets.push_back({(int) workwidth, (int) workheight, true,
+		                   slides_directory + std::pathsep + "gray-" + std::to_string(workwidth), &slides});
+		targets.push_back({(int) width, (int) height, true, slides_directory + std::pathsep + "gray", &slides_full});
+	}
+	else {
+		targets.push_back({(int) width, (int) height, true, slides_directory + std::pathsep + "gray", &slides});
+	}
+	
+	targets.push_back({(int) width_hires, (int) height_hires, false, slides_directory + std::pathsep + "hires",
+	                   &slides_hires});
+	
+	// without a cache directory, the slides are just rendered every time
+	for (SlidesTarget& target : targets) {
+		if (!wxDir::Exists(target.cache_directory)) {
+			wxDir::Make(target.cache_directory);
 		}
 		
-		Magick::imageWrite(slide_im, 0, 0, width, height, "RGBA",
-		                   MagickCore::StorageType_::CharPixel, &buffer[0]);
-		
-		// cv_frame is only a OpenCV wrapper around the buffer.
-		// It doesn't own the memory (which will be freed at the end of this function);
-		// clone() or cvtColor() is required to copy the buffer into a memory-owning OpenCV matrix
+		if (!wxDir::Exists(target.cache_directory)) {
+			target.cache_directory.clear();
+		}
+	}
+	
+	readpdf(slidesfname, slideshash, slides_directory + std::pathsep + "pages.txt", targets, pagehashes);
+	std::cout << "PDF reading complete" << std::endl;
+	
+	for (const SlidesTarget& target : targets) {
+		prunecache(target.cache_directory, pagehashes);
+	}
+	
+	if (slides.size() == 0 || slides_hires.size() == 0) {
+		std::cerr << "Can't read any slide" << std::endl;
+		return false;
+	}
+	
+	return true;
+}
+
+std::unique_ptr<SyncLoop> SyncJob::CreateSyncLoop()
+{
+	string slides_directory = intermediatedir + std::pathsep + "slides";
+	
+	std::unique_ptr<SyncLoop> syncloop(new SyncLoop(footage.get(), &slides, intermediatedir + std::pathsep +
+	                                                shard_filename("raw.sync", shard, nshards)));
+	
+	if (nshards > 1) {
+		unsigned int length  = footage->Length();
+		unsigned int start   = (unsigned int) ((uint64_t) length *  shard      / nshards);
+		unsigned int end     = (unsigned int) ((uint64_t) length * (shard + 1) / nshards);
+		unsigned int overlap = (unsigned int) round(footage->Framerate() * shard_overlap);
 		
-		Mat slide;
+		syncloop->SetRange((start > overlap) ? start - overlap : 0, end);
+	}
+	
+	if (probe != nullptr) {
+		syncloop->SetProbe(probe.get());
+	}
+	
+	syncloop->SetFeatureBackend(backend_factory(features));
+	
+	if (!slides_full.empty()) {
+		syncloop->SetWorkingResolution((double) workwidth / footage->Width(), &slides_full);
+	}
+	
+	string gray_directory = slides_directory + std::pathsep +
+	                        ((slides_full.empty()) ? string("gray") : "gray-" + std::to_string(workwidth));
+	
+	syncloop->SetFeatureCache(gray_directory + std::pathsep + "features.bin", slideshash);
+	syncloop->SetPageHashes(pagehashes);
+	
+	syncloop->SetProfiler(profiler.get());
+	syncloop->SetVerbose(verbose);
+	syncloop->SetThreads(threads);
+	
+	if (live) {
+		syncloop->SetLiveOutput(outsyncfname);
+	}
+	else {
+		syncloop->SetCheckpoint(intermediatedir + std::pathsep + shard_filename("checkpoint.yml", shard, nshards));
+	}
+	
+	return syncloop;
+}
+
+std::unique_ptr<GenLoop> SyncJob::CreateGenLoop(const SyncInstructions& instructions)
+{
+	libav::EncoderConfig config = encoder;
+	
+	// the output follows the footage frame by frame, so it must run at exactly the same rate
+	if (!live && !libav::video_framerate(videofname, config.framerate)) {
+		std::cerr << "Can't read the exact footage frame rate, rounding it" << std::endl;
+	}
+	
+	if (copyaudio && live) {
+		std::cerr << "The audio of a live stream can't be copied, the output will be silent" << std::endl;
+	}
+	else if (copyaudio) {
+		config.audio = videofname;
+	}
+	
+	std::unique_ptr<GenLoop> genloop;
+	
+	if (composite.layout != CompositeLayout::None && live) {
+		std::cerr << "A live stream can't be composed after the fact, the output will only show the slides"
+		          << std::endl;
+	}
+	
+	if (composite.layout != CompositeLayout::None && !live) {
+		genloop.reset(new GenLoop(&slides_hires, footage.get(), instructions, outvideofname, composite, config,
+		                          profiler.get()));
+	}
+	else {
+		genloop.reset(new GenLoop(&slides_hires, instructions, outvideofname, config, threads, profiler.get()));
+	}
+	
+	genloop->SetVerbose(verbose);
+	
+	return genloop;
+}
+
+void SyncJob::SaveProfile() const
+{
+	if (profiler == nullptr) {
+		return;
+	}
+	
+	if (!profilefname.empty() && !profiler->SaveSummary(profilefname)) {
+		std::cerr << "Can't write profiling summary" << std::endl;
+	}
+	
+	if (!tracefname.empty() && !profiler->SaveTrace(tracefname)) {
+		std::cerr << "Can't write profiling trace" << std::endl;
+	}
+}
+
+bool SyncJob::SaveSync(const SyncInstructions& instructions) const
+{
+	if (live) {
+		return true;
+	}
+	
+	if (!instructions.Save(outsyncfname)) {
+		std::cerr << "Can't write synchronization file" << std::endl;
+		return false;
+	}
+	
+	return true;
+}
+
+bool SyncJob::MergeShards() const
+{
+	std::vector<SyncInstructions> shards;
+	
+	for (const string& fname : shardfnames) {
+		if (!wxFileExists(fname)) {
+			std::cerr << "Can't open shard synchronization file '" << fname << "'" << std::endl;
+			return false;
+		}
 		
-		cv::cvtColor(cv_frame, slide, (grayscale) ? cv::COLOR_RGBA2GRAY : cv::COLOR_RGBA2BGR);
-		slides.push_back(slide);
+		try {
+			shards.push_back(SyncInstructions::Load(fname));
+		}
+		catch (const std::ios_base::failure& e) {
+			std::cerr << "Can't parse shard synchronization file '" << fname << "'" << std::endl;
+			return false;
+		}
 	}
 	
-	for (unsigned int i = 0; i < slides_im.size(); i++) {
-		Magick::imageDelete(slides_im[i]);
+	SyncInstructions merged(0);
+	
+	try {
+		merged = SyncInstructions::Merge(shards);
+	}
+	catch (const std::invalid_argument& e) {
+		std::cerr << "Can't merge shards: " << e.what() << std::endl;
+		return false;
 	}
 	
-	// only save if the cachedir was opened successfully
+	if (!SaveSync(merged)) {
+		return false;
+	}
 	
-	if (cachedir.IsOpened()) {
-		for (unsigned int i = 0; i < slides.size(); i++) {
-			cv::imwrite(cache_directory + std::pathsep + "slide-" +
-			            std::to_string(i + 1) + ".png", slides[i]);
+	if (!intermediatedir.empty()) {
+		if (!wxDir::Exists(intermediatedir)) {
+			wxDir::Make(intermediatedir);
 		}
+		
+		string cachefname = intermediatedir + std::pathsep + "raw.sync";
+		
+		merged.Save(cachefname);
+		
+		// the slides the shards were tracked with are unknown, so any older fingerprints don't apply
+		std::remove((cachefname + ".pages").c_str());
 	}
 	
-	return slides;
+	std::cout << "Merged " << shards.size() << " shards" << std::endl;
+	
+	return true;
 }
 
-bool SlideSyncApp::OnInit()
+bool SyncJob::ConvertSync() const
 {
-	wxApp::OnInit();
+	if (!wxFileExists(convertfname)) {
+		std::cerr << "Can't open synchronization file '" << convertfname << "'" << std::endl;
+		return false;
+	}
 	
-	std::cout << "Initializing..." << std::endl;
-	appstate = SyncAppState::Initializing;
+	SyncInstructions instructions(0);
 	
-	std::cout << "Reading footage file '" << videofname << "'" << std::endl;
-	footage.open(videofname, cv::CAP_ANY);
+	try {
+		instructions = SyncInstructions::Load(convertfname);
+	}
+	catch (const std::ios_base::failure& e) {
+		std::cerr << "Can't parse synchronization file '" << convertfname << "'" << std::endl;
+		return false;
+	}
 	
-	if (!footage.isOpened()) {
-		std::cerr << "Can't open footage video file" << std::endl;
+	if (!instructions.Save(outsyncfname)) {
+		std::cerr << "Can't write synchronization file" << std::endl;
 		return false;
 	}
 	
-	unsigned int width  = (unsigned int) footage.get(cv::CAP_PROP_FRAME_WIDTH);
-	unsigned int height = (unsigned int) footage.get(cv::CAP_PROP_FRAME_HEIGHT);
+	std::cout << "Converted " << instructions.Count() << " instructions" << std::endl;
 	
-	unsigned int width_hires  = 1920;
-	unsigned int height_hires = 1080;
+	return true;
+}
+
+/// @brief Split a line of a batch manifest into its tab-separated fields
+static std::vector<string> manifest_fields(const string& line)
+{
+	std::vector<string> fields;
+	size_t              start = 0;
 	
-	Magick::InitializeMagick(argv[0]);
-	libav::initialize_ffmpeg();
+	while (start <= line.size()) {
+		size_t end = line.find('\t', start);
+		
+		if (end == string::npos) {
+			end = line.size();
+		}
+		
+		fields.push_back(line.substr(start, end - start));
+		start = end + 1;
+	}
 	
-	string slides_directory = intermediatedir + std::pathsep + "slides";
+	// trailing tabs or carriage returns are not part of the last name
+	while (!fields.empty() && !fields.back().empty() && std::isspace(fields.back().back())) {
+		fields.back().pop_back();
+	}
 	
-	if (!wxDir::Exists(slides_directory)) {
-		wxDir::Make(slides_directory);
+	while (!fields.empty() && fields.back().empty()) {
+		fields.pop_back();
 	}
 	
-	std::cout << "Reading PDF slides file '" << slidesfname << "'" << std::endl << std::flush;
-	slides       = readpdf(slidesfname, width, height, slides_directory + std::pathsep + "gray", true);
-	slides_hires = readpdf(slidesfname, width_hires, height_hires, slides_directory + std::pathsep + "hires", false);
-	std::cout << "PDF reading complete" << std::endl;
+	return fields;
+}
+
+/// @brief Run a single batch job, sharing its deck with the others
+/// 
+/// @param[inout] job Job description, with its settings but no resources yet.
+/// @param[inout] decks Decks loaded so far, by slides filename and footage resolution.
+/// @param[in] deckslock Lock for the decks map, not its contents.
+/// @returns True if successful; otherwise, false.
+static bool run_batch_job(SyncJob& job, std::map<string, std::shared_ptr<SharedDeck>>& decks,
+                          std::mutex& deckslock)
+{
+	if (!job.OpenFootage()) {
+		return false;
+	}
+	
+	if (!wxDir::Exists(job.intermediatedir)) {
+		wxDir::Make(job.intermediatedir);
+	}
 	
-	window = new SlideSyncWindow("SlideSync", wxDefaultPosition, nullptr);
+	// the same pdf is rasterized differently for each frame size
+	string key = job.slidesfname + "@" + std::to_string(job.footage->Width()) + "x" +
+	             std::to_string(job.footage->Height());
 	
-	window->SetClientSize(width, height);
-	window->Show(true);
+	std::shared_ptr<SharedDeck> deck;
 	
-	window->canvas->Initialize(width, height);
+	{
+		std::lock_guard<std::mutex> guard(deckslock);
+		std::shared_ptr<SharedDeck>& entry = decks[key];
+		
+		if (entry == nullptr) {
+			entry.reset(new SharedDeck());
+			entry->loaded = false;
+		}
+		
+		deck = entry;
+	}
+	
+	std::unique_ptr<SyncLoop> syncloop;
+	
+	{
+		// the first job on a deck loads it while the others on it wait
+		std::lock_guard<std::mutex> guard(deck->lock);
+		
+		if (deck->loaded) {
+			// matrices share their pixels, so these are not copies of the slides
+			job.slides       = deck->slides;
+			job.slides_full  = deck->slides_full;
+			job.slides_hires = deck->slides_hires;
+			job.slideshash   = deck->slideshash;
+			job.pagehashes   = deck->pagehashes;
+			
+			syncloop = job.CreateSyncLoop();
+			syncloop->SetSlideFeatures(deck->features);
+		}
+		else {
+			if (!job.LoadSlides()) {
+				return false;
+			}
+			
+			syncloop = job.CreateSyncLoop();
+			
+			deck->slides       = job.slides;
+			deck->slides_full  = job.slides_full;
+			deck->slides_hires = job.slides_hires;
+			deck->slideshash   = job.slideshash;
+			deck->pagehashes   = job.pagehashes;
+			deck->features     = syncloop->GetSlideFeatures();
+			deck->loaded       = true;
+		}
+	}
 	
-	processloop = std::unique_ptr<ProcessLoop>(new SyncLoop(window->canvas, &footage, &slides,
-	                                                        intermediatedir + std::pathsep + "raw.sync"));
-	window->SetProcessLoop(&processloop);
+	syncloop->Run();
 	
-	processloop->Bind(LoopFinishedEvent, &SlideSyncApp::OnSyncFinished, this);
+	SyncInstructions instructions = syncloop->GetSyncInstructions();
 	
-	appstate = SyncAppState::Synchronizing;
-	window->SetStatusText("Synchronizing");
+	syncloop.reset(nullptr);
 	
-	std::cout << "Synchronizing..." << std::endl;
+	if (!job.SaveSync(instructions)) {
+		return false;
+	}
 	
-	processloop->Start(40);
+	if (!job.outvideofname.empty()) {
+		job.CreateGenLoop(instructions)->Run();
+	}
+	
+	std::cout << "Finished '" << job.videofname << "'" << std::endl;
 	
 	return true;
 }
 
-void SlideSyncApp::OnInitCmdLine(wxCmdLineParser& parser)
+bool run_batch(const SyncJob& settings)
 {
-	parser.AddLongOption("footage", "Input recording of the presentation", wxCMD_LINE_VAL_STRING, wxCMD_LINE_SPLIT_UNIX);
-	parser.AddLongOption("slides",  "Input presentation slides file",      wxCMD_LINE_VAL_STRING, wxCMD_LINE_SPLIT_UNIX);
-	parser.AddLongOption("sync",    "Output synchronization file",         wxCMD_LINE_VAL_STRING, wxCMD_LINE_SPLIT_UNIX);
-	parser.AddLongOption("output",  "Output synchronized video file",      wxCMD_LINE_VAL_STRING, wxCMD_LINE_SPLIT_UNIX);
+	std::ifstream manifest(settings.batchfname);
+	
+	if (!manifest.is_open()) {
+		std::cerr << "Can't open batch manifest '" << settings.batchfname << "'" << std::endl;
+		return false;
+	}
+	
+	std::vector<std::unique_ptr<SyncJob>> jobs;
+	string                                line;
+	
+	for (unsigned int lineno = 1; std::getline(manifest, line); lineno++) {
+		std::vector<string> fields = manifest_fields(line);
+		
+		if (fields.empty() || fields[0][0] == '#') {
+			continue;
+		}
+		
+		if (fields.size() < 3 || fields.size() > 4) {
+			std::cerr << "Batch manifest line " << lineno << ": expected footage, slides, sync "
+			          << "and optionally output, separated by tabs" << std::endl;
+			return false;
+		}
+		
+		std::unique_ptr<SyncJob> job(new SyncJob());
+		
+		job->videofname      = fields[0];
+		job->slidesfname     = fields[1];
+		job->outsyncfname    = fields[2];
+		job->outvideofname   = (fields.size() > 3) ? fields[3] : string();
+		job->intermediatedir = job->videofname + ".d";
+		job->keyframesonly   = settings.keyframesonly;
+		job->live            = false;
+		job->shard           = 0;
+		job->nshards         = 1;
+		job->merge           = false;
+		job->verbose         = settings.verbose;
+		job->workwidth       = settings.workwidth;
+		job->features        = settings.features;
+		job->encoder         = settings.encoder;
+		job->copyaudio       = settings.copyaudio;
+		job->composite       = settings.composite;
+		
+		jobs.push_back(std::move(job));
+	}
+	
+	unsigned int ncores = std::max(std::thread::hardware_concurrency(), 1u);
+	unsigned int njobs  = std::min<unsigned int>((settings.njobs > 0) ? settings.njobs : ncores, jobs.size());
+	
+	if (njobs == 0) {
+		std::cerr << "Empty batch manifest" << std::endl;
+		return false;
+	}
+	
+	// each job gets its share of the cores, so the jobs don't fight over them
+	for (auto& job : jobs) {
+		job->threads = std::max(ncores / njobs, 1u);
+	}
+	
+	std::cout << "Processing " << jobs.size() << " recordings, " << njobs << " at a time" << std::endl;
+	
+	std::map<string, std::shared_ptr<SharedDeck>> decks;
+	std::mutex                                    deckslock;
+	std::vector<std::future<bool>>                results;
+	ThreadPool                                    pool(njobs);
+	
+	for (auto& job : jobs) {
+		SyncJob* current = job.get();
+		
+		results.push_back(pool.Submit([current, &decks, &deckslock] {
+			return run_batch_job(*current, decks, deckslock);
+		}));
+	}
+	
+	unsigned int nfailed = 0;
+	
+	for (unsigned int i = 0; i < results.size(); i++) {
+		bool success = false;
+		
+		try {
+			success = results[i].get();
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Batch job '" << jobs[i]->videofname << "' failed: " << e.what() << std::endl;
+		}
+		
+		if (!success) {
+			std::cerr << "Can't process '" << jobs[i]->videofname << "'" << std::endl;
+			nfailed += 1;
+		}
+	}
+	
+	std::cout << "Batch finished: " << (jobs.size() - nfailed) << " of " << jobs.size() << " recordings"
+	          << std::endl;
+	
+	return nfailed == 0;
 }
 
-bool SlideSyncApp::OnCmdLineParsed(wxCmdLineParser& parser)
+void configure_cmdline(wxCmdLineParser& parser)
+{
+	parser.AddLongOption("footage",  "Input recording of the presentation", wxCMD_LINE_VAL_STRING, wxCMD_LINE_SPLIT_UNIX);
+	parser.AddLongOption("slides",   "Input presentation slides file",      wxCMD_LINE_VAL_STRING, wxCMD_LINE_SPLIT_UNIX);
+	parser.AddLongOption("sync",     "Output synchronization file",         wxCMD_LINE_VAL_STRING, wxCMD_LINE_SPLIT_UNIX);
+	parser.AddLongOption("output",   "Output synchronized video file",      wxCMD_LINE_VAL_STRING, wxCMD_LINE_SPLIT_UNIX);
+	parser.AddLongSwitch("headless", "Run without user interface");
+	parser.AddLongSwitch("keyframes", "Scan steady stretches of the footage through its keyframes only");
+	parser.AddLongSwitch("live",      "Footage is a live stream (URL, device or camera index); log the sync as it runs");
+	parser.AddLongOption("shard",     "Only synchronize the k-th of N time ranges of the footage, given as k/N");
+	parser.AddLongSwitch("merge",     "Merge the given shard synchronization files, in order, into --sync");
+	parser.AddLongOption("batch",     "Process every recording of this manifest (footage, slides, sync, output per line)");
+	parser.AddLongOption("convert",   "Rewrite this sync file as --sync, in the binary format if that ends in .bsync");
+	parser.AddLongOption("jobs",      "Number of batch recordings processed at once; one per core by default",
+	                     wxCMD_LINE_VAL_NUMBER);
+	parser.AddLongSwitch("verbose",   "Print every processed frame and encoded segment");
+	parser.AddLongOption("preview",   "Maximum number of tracking frames previewed per second (default 5); 0 for all",
+	                     wxCMD_LINE_VAL_DOUBLE);
+	parser.AddLongOption("profile",   "Write a JSON summary of the stage timings and counters to this file");
+	parser.AddLongOption("trace",     "Write a Chrome trace of the processing stages to this file");
+	parser.AddLongOption("workwidth", "Track at this frame width, refining hard frames at full resolution",
+	                     wxCMD_LINE_VAL_NUMBER);
+	parser.AddLongOption("features", "Keypoint backend: brisk (default), orb or cuda");
+	parser.AddLongOption("encoder",  "Output video encoder, e.g. libx264 or h264_nvenc; 'auto' to prefer hardware");
+	parser.AddLongOption("device",   "Hardware device for the output video encoder");
+	parser.AddLongOption("bitrate",  "Output video bit rate, in kbit/s",  wxCMD_LINE_VAL_NUMBER);
+	parser.AddLongOption("crf",      "Output video constant quality factor, instead of a bit rate", wxCMD_LINE_VAL_NUMBER);
+	parser.AddLongOption("gop",      "Maximum number of frames between output video keyframes",    wxCMD_LINE_VAL_NUMBER);
+	parser.AddLongOption("pixfmt",   "Output video pixel format, e.g. yuv420p or nv12");
+	parser.AddLongSwitch("audio",    "Copy the audio track of the footage into the output video");
+	parser.AddLongOption("composite", "Show the footage in the output video: side (next to the slides) or pip");
+	parser.AddLongOption("inset",     "Width of the pip footage, as a fraction of the output width (default 0.3)",
+	                     wxCMD_LINE_VAL_DOUBLE);
+	parser.AddParam("shard sync files", wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL | wxCMD_LINE_PARAM_MULTIPLE);
+}
+
+/// @brief Fill the tracking and encoding settings of a job from the parsed command line arguments
+/// 
+/// @param[in] parser Command line parser.
+/// @param[out] job Job description.
+/// @returns True if the settings are valid; otherwise, false.
+static bool parse_settings(wxCmdLineParser& parser, SyncJob& job)
+{
+	long workwidth;
+	
+	job.workwidth = (parser.Found("workwidth", &workwidth) && workwidth > 0) ? (unsigned int) workwidth : 0;
+	
+	wxString features;
+	
+	job.features = "brisk";
+	
+	if (parser.Found("features", &features)) {
+		job.features = features;
+	}
+	
+	if (!backend_factory(job.features)) {
+		std::cerr << "Unknown or unavailable keypoint backend '" << job.features << "'" << std::endl;
+		return false;
+	}
+	
+	wxString encoder;
+	wxString device;
+	wxString pixfmt;
+	long     bitrate;
+	long     crf;
+	long     gop;
+	
+	if (parser.Found("encoder", &encoder)) {
+		job.encoder.codec = encoder;
+	}
+	
+	if (parser.Found("device", &device)) {
+		job.encoder.device = device;
+	}
+	
+	if (parser.Found("pixfmt", &pixfmt)) {
+		job.encoder.pixfmt = pixfmt;
+	}
+	
+	if (parser.Found("bitrate", &bitrate) && bitrate > 0) {
+		job.encoder.bitrate = (unsigned int) bitrate * 1000;
+	}
+	
+	if (parser.Found("crf", &crf) && crf >= 0) {
+		job.encoder.quality = (int) crf;
+	}
+	
+	if (parser.Found("gop", &gop) && gop > 0) {
+		job.encoder.gop = (unsigned int) gop;
+	}
+	
+	job.copyaudio = parser.Found("audio");
+	
+	wxString composite;
+	double   inset;
+	
+	if (parser.Found("composite", &composite)) {
+		if (composite == "side") {
+			job.composite.layout = CompositeLayout::SideBySide;
+		}
+		else if (composite == "pip") {
+			job.composite.layout = CompositeLayout::PictureInPicture;
+		}
+		else {
+			std::cerr << "Unknown composite layout '" << composite.ToStdString() << "', expected side or pip"
+			          << std::endl;
+			return false;
+		}
+	}
+	
+	if (parser.Found("inset", &inset)) {
+		if (inset <= 0 || inset >= 1) {
+			std::cerr << "The pip footage width must be between 0 and 1" << std::endl;
+			return false;
+		}
+		
+		job.composite.inset = inset;
+	}
+	
+	return true;
+}
+
+bool parse_cmdline(wxCmdLineParser& parser, SyncJob& job)
 {
 	wxString footage;
 	wxString slides;
 	wxString sync;
 	wxString output;
+	wxString shard;
+	
+	wxString batch;
+	wxString convert;
+	long     njobs;
+	
+	job.merge      = parser.Found("merge");
+	job.shard      = 0;
+	job.nshards    = 1;
+	job.threads    = 0;
+	job.batchfname = (parser.Found("batch", &batch)) ? batch : "";
+	job.njobs      = (parser.Found("jobs", &njobs) && njobs > 0) ? (unsigned int) njobs : 0;
+	
+	// converting only needs the input and the output
+	if (parser.Found("convert", &convert)) {
+		if (!parser.Found("sync", &sync)) {
+			return false;
+		}
+		
+		job.convertfname = convert;
+		job.outsyncfname = sync;
+		job.live         = false;
+		
+		return true;
+	}
+	
+	// merging only needs the shards and the output, plus the footage to cache the result for
+	if (job.merge) {
+		if (!parser.Found("sync", &sync) || parser.GetParamCount() == 0) {
+			return false;
+		}
+		
+		parser.Found("footage", &footage);
+		
+		job.outsyncfname    = sync;
+		job.videofname      = footage;
+		job.intermediatedir = (job.videofname.empty()) ? string() : job.videofname + ".d";
+		job.live            = false;
+		
+		for (size_t i = 0; i < parser.GetParamCount(); i++) {
+			job.shardfnames.push_back(parser.GetParam(i).ToStdString());
+		}
+		
+		return true;
+	}
 	
+	if (parser.Found("shard", &shard)) {
+		unsigned int k;
+		unsigned int n;
+		
+		if (std::sscanf(shard.c_str(), "%u/%u", &k, &n) != 2 || k < 1 || k > n) {
+			std::cerr << "Invalid shard '" << shard << "', expected k/N with 1 <= k <= N" << std::endl;
+			return false;
+		}
+		
+		job.shard   = k - 1;
+		job.nshards = n;
+	}
+	
+	// every batch job comes with its own files, so they are checked when reading the manifest
+	if (!job.batchfname.empty()) {
+		job.live          = false;
+		job.keyframesonly = parser.Found("keyframes");
+		job.verbose       = parser.Found("verbose");
+		
+		return parse_settings(parser, job);
+	}
+	
+	// a shard doesn't generate any video, so it doesn't need an output
 	if (!parser.Found("footage", &footage) ||
 	    !parser.Found("slides", &slides) ||
 	    !parser.Found("sync", &sync) ||
-	    !parser.Found("output", &output)) {
+	    (!parser.Found("output", &output) && job.nshards <= 1)) {
+		return false;
+	}
+	
+	job.videofname      = footage;
+	job.slidesfname     = slides;
+	job.outsyncfname    = sync;
+	job.outvideofname   = output;
+	job.live            = parser.Found("live");
+	job.intermediatedir = ((job.live) ? job.outsyncfname : job.videofname) + ".d";
+	job.keyframesonly   = parser.Found("keyframes") && !job.live;  // streams have no keyframe index
+	
+	if (job.live && job.nshards > 1) {
+		std::cerr << "Live streams can't be sharded" << std::endl;
+		return false;
+	}
+	
+	wxString profile;
+	wxString trace;
+	double   previewrate;
+	
+	job.verbose      = parser.Found("verbose");
+	job.previewrate  = (parser.Found("preview", &previewrate) && previewrate >= 0) ? previewrate : 5;
+	job.profilefname = (parser.Found("profile", &profile)) ? profile : "";
+	job.tracefname   = (parser.Found("trace",   &trace))   ? trace   : "";
+	
+	if (!job.profilefname.empty() || !job.tracefname.empty()) {
+		job.profiler.reset(new Profiler(!job.tracefname.empty()));
+	}
+	
+	return parse_settings(parser, job);
+}
+
+// SlideSyncApp definitions
+
+bool SlideSyncApp::OnInit()
+{
+	if (!wxApp::OnInit()) {
+		return false;
+	}
+	
+	std::cout << "Initializing..." << std::endl;
+	appstate = SyncAppState::Initializing;
+	
+	Magick::InitializeMagick(argv[0]);
+	libav::initialize_ffmpeg();
+	
+	if (!job.Load()) {
 		return false;
 	}
 	
-	videofname      = footage;
-	slidesfname     = slides;
-	outsyncfname    = sync;
-	outvideofname   = output;
-	intermediatedir = videofname + ".d";
+	unsigned int width  = job.footage->Width();
+	unsigned int height = job.footage->Height();
+	
+	looptimer = std::unique_ptr<LoopTimer>(new LoopTimer(nullptr));
+	window    = new SlideSyncWindow("SlideSync", wxDefaultPosition, looptimer.get());
+	
+	window->SetClientSize(width, height);
+	window->Show(true);
+	
+	window->canvas->Initialize(width, height);
+	looptimer->SetCanvas(window->canvas);
+	looptimer->SetPreviewRate(job.previewrate);
+	
+	processloop = job.CreateSyncLoop();
+	looptimer->SetLoop(processloop.get());
+	looptimer->Bind(LoopFinishedEvent, &SlideSyncApp::OnSyncFinished, this);
+	
+	appstate = SyncAppState::Synchronizing;
+	window->SetStatusText("Synchronizing");
+	
+	std::cout << "Synchronizing..." << std::endl;
+	
+	looptimer->Start(40);
 	
 	return true;
 }
 
+void SlideSyncApp::OnInitCmdLine(wxCmdLineParser& parser)
+{
+	configure_cmdline(parser);
+}
+
+bool SlideSyncApp::OnCmdLineParsed(wxCmdLineParser& parser)
+{
+	return parse_cmdline(parser, job);
+}
+
 void SlideSyncApp::OnSyncFinished(LoopEvent& event)
 {
 	// note that the static_cast is valid as long as only SyncLoops use this callback;
 	// any other case is an error anyway
-	processloop->Stop();
-	processloop.reset(new GenLoop(&slides_hires, static_cast<SyncLoop*>(processloop.get())->GetSyncInstructions(),
-	                              outvideofname));
-	processloop->Bind(LoopFinishedEvent, &SlideSyncApp::OnGenFinished, this);
+	SyncInstructions instructions = static_cast<SyncLoop*>(processloop.get())->GetSyncInstructions();
+	
+	job.SaveSync(instructions);
+	looptimer->SetLoop(nullptr);
+	
+	// shards only synchronize; the video comes after merging them
+	if (job.nshards > 1) {
+		processloop.reset(nullptr);
+		job.SaveProfile();
+		window->Close();
+		return;
+	}
+	
+	processloop = job.CreateGenLoop(instructions);
+	looptimer->SetLoop(processloop.get());
+	
+	looptimer->Unbind(LoopFinishedEvent, &SlideSyncApp::OnSyncFinished, this);
+	looptimer->Bind(LoopFinishedEvent, &SlideSyncApp::OnGenFinished, this);
 	
 	appstate = SyncAppState::GeneratingVideo;
 	window->SetStatusText("Generating video");
 	
 	std::cout << "Generating video..." << std::endl;
 	
-	processloop->Start(40);
+	looptimer->Start(40);
 }
 
 void SlideSyncApp::OnGenFinished(LoopEvent& event)
 {
-	processloop->Stop();
+	looptimer->SetLoop(nullptr);
 	processloop.reset(nullptr);
+	job.SaveProfile();
 	window->Close();
 }
 
+// SlideSyncConsoleApp definitions
+
+bool SlideSyncConsoleApp::OnInit()
+{
+	if (!wxAppConsole::OnInit()) {
+		return false;
+	}
+	
+	if (job.merge || !job.convertfname.empty()) {
+		return true;
+	}
+	
+	std::cout << "Initializing..." << std::endl;
+	
+	Magick::InitializeMagick(argv[0]);
+	libav::initialize_ffmpeg();
+	
+	// batch jobs load their own resources as they run
+	return !job.batchfname.empty() || job.Load();
+}
+
+int SlideSyncConsoleApp::OnRun()
+{
+	if (job.merge) {
+		return (job.MergeShards()) ? 0 : 1;
+	}
+	
+	if (!job.convertfname.empty()) {
+		return (job.ConvertSync()) ? 0 : 1;
+	}
+	
+	if (!job.batchfname.empty()) {
+		return (run_batch(job)) ? 0 : 1;
+	}
+	
+	std::cout << "Synchronizing..." << std::endl;
+	
+	std::unique_ptr<SyncLoop> syncloop = job.CreateSyncLoop();
+	
+	{
+		ScopedTimer timer(job.profiler.get(), "synchronize");
+		syncloop->Run();
+	}
+	
+	job.SaveSync(syncloop->GetSyncInstructions());
+	
+	// shards only synchronize; the video comes after merging them
+	if (job.nshards <= 1) {
+		std::cout << "Generating video..." << std::endl;
+		
+		std::unique_ptr<GenLoop> genloop = job.CreateGenLoop(syncloop->GetSyncInstructions());
+		
+		ScopedTimer timer(job.profiler.get(), "generate");
+		genloop->Run();
+	}
+	
+	job.SaveProfile();
+	
+	return 0;
+}
+
+void SlideSyncConsoleApp::OnInitCmdLine(wxCmdLineParser& parser)
+{
+	configure_cmdline(parser);
+}
+
+bool SlideSyncConsoleApp::OnCmdLineParsed(wxCmdLineParser& parser)
+{
+	return parse_cmdline(parser, job);
 }
 
+}
@@ -23,10 +23,13 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <mutex>
+#include <cstdint>
 
 #include <opencv2/opencv.hpp>
 
 #include <wx/wxprec.h>
+#include <wx/cmdline.h>
  
 #ifndef WX_PRECOMP
 	#include <wx/wx.h>
@@ -34,6 +37,13 @@
 
 #include "CVCanvas.hpp"
 #include "ProcessLoop.hpp"
+#include "LoopTimer.hpp"
+#include "SyncLoop.hpp"
+#include "GenLoop.hpp"
+#include "FrameSource.hpp"
+#include "FeatureCache.hpp"
+#include "Profiler.hpp"
+#include "avhelpers.hpp"
 
 using std::string;
 using cv::Mat;
@@ -55,6 +65,205 @@ enum class EventID
 	SlideSyncID
 };
 
+/// @brief Description of a synchronization job, shared by every front-end
+struct SyncJob
+{
+	/// @brief Filename of the recording footage
+	string videofname;
+	
+	/// @brief Filename of the presentation slides
+	string slidesfname;
+	
+	/// @brief Filename for the synchronization data that will be output
+	string outsyncfname;
+	
+	/// @brief Filename for the video data that will be output
+	string outvideofname;
+	
+	/// @brief Directory path for files contaning intermediate and cached results
+	string intermediatedir;
+	
+	/// @brief Whether the footage may be scanned coarsely through its keyframes only
+	bool keyframesonly;
+	
+	/// @brief Whether the footage is a live stream, e.g. a camera, instead of a recording
+	bool live;
+	
+	/// @brief Index of the time range of the footage to synchronize, from zero
+	unsigned int shard;
+	
+	/// @brief Number of time ranges the footage is split into; one to synchronize all of it
+	unsigned int nshards;
+	
+	/// @brief Whether to merge the synchronization files of every shard instead of synchronizing
+	bool merge;
+	
+	/// @brief Synchronization files of every shard, in order, to merge
+	std::vector<string> shardfnames;
+	
+	/// @brief Synchronization file to rewrite as the output file instead of synchronizing, if any
+	string convertfname;
+	
+	/// @brief Manifest of the recordings to process in batch; empty for a single job
+	string batchfname;
+	
+	/// @brief Number of batch jobs running at once
+	unsigned int njobs;
+	
+	/// @brief Number of threads each stage of this job may use; zero for one per core
+	unsigned int threads;
+	
+	/// @brief Whether to print a line for every processed frame and encoded segment
+	bool verbose;
+	
+	/// @brief Maximum number of tracking frames previewed per second by the graphical application;
+	///        zero to preview every frame
+	double previewrate;
+	
+	/// @brief Filename for the JSON profiling summary; empty to skip it
+	string profilefname;
+	
+	/// @brief Filename for the Chrome trace of the processing stages; empty to skip it
+	string tracefname;
+	
+	/// @brief Stage timings and counters; null unless a summary or a trace was requested
+	std::unique_ptr<Profiler> profiler;
+	
+	/// @brief Width of the working resolution for tracking; zero to track at the footage resolution
+	unsigned int workwidth;
+	
+	/// @brief Name of the keypoint detection and matching backend, see backend_factory()
+	string features;
+	
+	/// @brief Captured video of the presentation
+	std::unique_ptr<FrameSource> footage;
+	
+	/// @brief Second source of the same video, for random access while the footage is streamed
+	std::unique_ptr<FrameSource> probe;
+	
+	/// @brief Presentation slides, grayscale low resolution (for image processing)
+	std::vector<Mat> slides;
+	
+	/// @brief Presentation slides, grayscale at the footage resolution (for refining the tracking);
+	///        only read when the working resolution is lower than the footage's
+	std::vector<Mat> slides_full;
+	
+	/// @brief Presentation slides, high resolution (for output)
+	std::vector<Mat> slides_hires;
+	
+	/// @brief Hash of the contents of the presentation slides file
+	uint64_t slideshash;
+	
+	/// @brief Fingerprint of every slide, so caches can tell which ones changed
+	std::vector<uint64_t> pagehashes;
+	
+	/// @brief Settings for the output video encoder
+	libav::EncoderConfig encoder;
+	
+	/// @brief Whether to copy the audio track of the footage into the output video
+	bool copyaudio;
+	
+	/// @brief Layout of the footage and the slides in the output video
+	CompositeConfig composite;
+	
+	/// @brief Open the footage and read the slides, from the cache if possible
+	/// 
+	/// @returns True if successful; otherwise, false.
+	bool Load();
+	
+	/// @brief Open the footage, and the probe if it can be seeked
+	/// 
+	/// @returns True if successful; otherwise, false.
+	bool OpenFootage();
+	
+	/// @brief Read the slides at the footage resolution, from the cache if possible
+	/// 
+	/// @returns True if successful; otherwise, false.
+	bool LoadSlides();
+	
+	/// @brief Construct a synchronization loop for this job, using its cache files
+	std::unique_ptr<SyncLoop> CreateSyncLoop();
+	
+	/// @brief Construct a video generation loop for this job
+	/// 
+	/// @param[in] instructions Synchronization instructions.
+	std::unique_ptr<GenLoop> CreateGenLoop(const SyncInstructions& instructions);
+	
+	/// @brief Write the requested profiling summary and trace, if any
+	void SaveProfile() const;
+	
+	/// @brief Write the synchronization output file, unless it was already logged live
+	/// 
+	/// @param[in] instructions Synchronization instructions.
+	/// @returns True if successful; otherwise, false.
+	bool SaveSync(const SyncInstructions& instructions) const;
+	
+	/// @brief Merge the synchronization files of every shard into the output file
+	/// 
+	/// If the footage is known, the result is also cached in its intermediate directory,
+	/// so a regular run on it only has to generate the video.
+	/// 
+	/// @returns True if successful; otherwise, false.
+	bool MergeShards() const;
+	
+	/// @brief Rewrite a synchronization file as the output file, converting its format if needed
+	/// 
+	/// @returns True if successful; otherwise, false.
+	bool ConvertSync() const;
+};
+
+/// @brief Slides of a deck, shared by every batch job on it with the same footage resolution
+struct SharedDeck
+{
+	/// @brief Lock for every member, held while the first job loads the deck
+	std::mutex lock;
+	
+	/// @brief Whether the slides and their features are ready
+	bool loaded;
+	
+	/// @brief Tracking slides, see SyncJob::slides
+	std::vector<Mat> slides;
+	
+	/// @brief Full resolution tracking slides, see SyncJob::slides_full
+	std::vector<Mat> slides_full;
+	
+	/// @brief Output slides, see SyncJob::slides_hires
+	std::vector<Mat> slides_hires;
+	
+	/// @brief Hash of the contents of the presentation slides file
+	uint64_t slideshash;
+	
+	/// @brief Fingerprint of every slide, see SyncJob::pagehashes
+	std::vector<uint64_t> pagehashes;
+	
+	/// @brief Keypoints and descriptors of the tracking slides
+	FeatureStore features;
+};
+
+/// @brief Synchronize and generate every recording of a batch manifest
+/// 
+/// Every line of the manifest describes a job as tab-separated footage, slides, synchronization
+/// and output video filenames; the output may be left out to only synchronize. Blank lines and
+/// lines starting with '#' are ignored. Recordings of the same deck share its slides and slide
+/// features, which are only read and computed once, and jobs run concurrently.
+/// 
+/// @param[in] settings Settings for every job, e.g. the feature backend and the encoder, and the
+///                     manifest filename and number of concurrent jobs.
+/// @returns True if every job succeeded; otherwise, false.
+bool run_batch(const SyncJob& settings);
+
+/// @brief Configure the command line parser with the options common to every front-end
+/// 
+/// @param[in] parser Command line parser.
+void configure_cmdline(wxCmdLineParser& parser);
+
+/// @brief Fill a job description from the parsed command line arguments
+/// 
+/// @param[in] parser Command line parser.
+/// @param[out] job Job description.
+/// @returns True if every required argument is present; otherwise, false.
+bool parse_cmdline(wxCmdLineParser& parser, SyncJob& job);
+
 /// @brief Main synchronization window
 class SlideSyncWindow : public wxFrame
 {
@@ -63,15 +272,15 @@ public:
 	CVCanvas* canvas;
 	
 private:
-	/// @brief Observer reference to the application's processing loop
-	std::unique_ptr<ProcessLoop>* processloop;
+	/// @brief Observer reference to the timer driving the application's processing loop
+	LoopTimer* looptimer;
 	
 public:
 	/// @brief Construct a SlideSyncWindow with standard parameters
-	SlideSyncWindow(const wxString& title, const wxPoint& pos, std::unique_ptr<ProcessLoop>* processloop);
+	SlideSyncWindow(const wxString& title, const wxPoint& pos, LoopTimer* looptimer);
 	
-	/// @brief Set the internal processing loop observer
-	void SetProcessLoop(std::unique_ptr<ProcessLoop>* processloop);
+	/// @brief Set the internal loop timer observer
+	void SetLoopTimer(LoopTimer* looptimer);
 	
 	/// @brief Destroy the window and stop the timer
 	virtual bool Destroy() override;
@@ -98,33 +307,15 @@ private:
 	/// @brief Main window
 	SlideSyncWindow* window;
 	
-	/// @brief Filename of the recording footage
-	string videofname;
-	
-	/// @brief Filename of the presentation slides
-	string slidesfname;
-	
-	/// @brief Filename for the synchronization data that will be output
-	string outsyncfname;
-	
-	/// @brief Filename for the video data that will be output
-	string outvideofname;
-	
-	/// @brief Directory path for files contaning intermediate and cached results
-	string intermediatedir;
-	
-	/// @brief Captured video of the presentation
-	cv::VideoCapture footage;
+	/// @brief Input and output description
+	SyncJob job;
 	
-	/// @brief Presentation slides, grayscale low resolution (for image processing)
-	std::vector<Mat> slides;
-	
-	/// @brief Presentation slides, high resolution (for output)
-	std::vector<Mat> slides_hires;
-	
-	/// @brief Recurrent event based processing loop
+	/// @brief Current processing loop
 	std::unique_ptr<ProcessLoop> processloop;
 	
+	/// @brief Recurrent event source driving the processing loop
+	std::unique_ptr<LoopTimer> looptimer;
+	
 public:
 	/// @brief Main entry point
 	virtual bool OnInit();
@@ -146,6 +337,38 @@ public:
 	void OnGenFinished(LoopEvent& event);
 };
 
+/// @brief Headless application
+/// 
+/// Runs the synchronization and video generation stages as tight loops, without
+/// any window, canvas or timer, so it can be used on machines with no display.
+/// Selected by the --headless command line switch, and always used by --merge, --batch
+/// and --convert.
+class SlideSyncConsoleApp : public wxAppConsole
+{
+private:
+	/// @brief Input and output description
+	SyncJob job;
+	
+public:
+	/// @brief Prepare the job resources
+	virtual bool OnInit() override;
+	
+	/// @brief Main entry point. Synchronize and generate the output video
+	/// 
+	/// @returns Process exit code.
+	virtual int OnRun() override;
+	
+	/// @brief Configure command line parser
+	/// 
+	/// @param[in] parser Command line parser.
+	virtual void OnInitCmdLine(wxCmdLineParser& parser) override;
+	
+	/// @brief Process command line arguments
+	/// 
+	/// @param[in] parser Command line parser.
+	virtual bool OnCmdLineParsed(wxCmdLineParser& parser) override;
+};
+
 }
 
 #endif
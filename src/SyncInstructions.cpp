@@ -21,7 +21,12 @@
 #include <tuple>
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <memory>
+#include <cstdint>
 #include <ios>
+#include <algorithm>
+#include <stdexcept>
 
 #include "SyncInstructions.hpp"
 #include "util.hpp"
@@ -32,6 +37,55 @@ namespace slidesync
 enum {SYNC_NEXT     = -1,
       SYNC_PREVIOUS = -2};
 
+/// @brief Instruction count of a live log, whose final count is unknown while it is written
+static const string live_count = "live";
+
+// Binary layout (little endian, so files can be shared between machines):
+// 
+//     uint32_t magic
+//     uint32_t version
+//     uint32_t nslides
+//     uint32_t framerate
+//     records, until the end of the file:
+//         uint32_t timestamp
+//         uint32_t data
+//         uint8_t  code        SyncInstructionCode value
+//         uint8_t  relative    0 or 1
+//         uint8_t  padding[2]
+// 
+// There is no instruction count, so a live log is just appended to.
+
+/// @brief Magic number identifying binary synchronization files ("SSYN")
+static const uint32_t binary_magic = 0x4e595353;
+
+/// @brief Binary synchronization format version
+static const uint32_t binary_version = 1;
+
+/// @brief Size of the binary header, in bytes
+static const size_t binary_header_size = 16;
+
+/// @brief Size of every binary instruction record, in bytes
+static const size_t binary_record_size = 12;
+
+/// @brief File name extension of binary synchronization files
+static const string binary_extension = ".bsync";
+
+/// @brief Append a little endian 32-bit value
+static void put_u32(string& buffer, uint32_t value)
+{
+	buffer.push_back((char) (value         & 0xff));
+	buffer.push_back((char) ((value >> 8)  & 0xff));
+	buffer.push_back((char) ((value >> 16) & 0xff));
+	buffer.push_back((char) ((value >> 24) & 0xff));
+}
+
+/// @brief Read a little endian 32-bit value
+static uint32_t get_u32(const unsigned char* data)
+{
+	return ((uint32_t) data[0])       | ((uint32_t) data[1] << 8) |
+	       ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
 SyncInstructions::SyncInstructions(unsigned int length)
 	: instructions(), framerate(0), current_index(0), length(length) {}
 
@@ -41,72 +95,194 @@ SyncInstructions::SyncInstructions(unsigned int length, unsigned int framerate)
 SyncInstructions::SyncInstructions(std::istream& descriptor)
 	: instructions(), framerate(0), current_index(0), length(0)
 {
-	unsigned int ninstructions;
+	string count;
 	
 	descriptor.exceptions(descriptor.failbit);
 	
-	descriptor >> Skip("nslides")       >> Skip("=") >> length        >> Skip("\n");
-	descriptor >> Skip("framerate")     >> Skip("=") >> framerate     >> Skip("\n");
-	descriptor >> Skip("ninstructions") >> Skip("=") >> ninstructions >> Skip("\n");
+	descriptor >> Skip("nslides")       >> Skip("=") >> length    >> Skip("\n");
+	descriptor >> Skip("framerate")     >> Skip("=") >> framerate >> Skip("\n");
+	descriptor >> Skip("ninstructions") >> Skip("=") >> count     >> Skip("\n");
 	
-	for (unsigned int i = 0; i < ninstructions; i++) {
-		descriptor >> Skip("[");
-		descriptor >> Skip("");
-		// skipping the empty string will force the reader to discard any whitespace
-		// this is to make the format symmetrical; otherwise "[123 ]" would be allowed, but "[ 123]" would not
-		// and between allowing the left space and forbidding the right one, the lenient first option is
-		// preferred to maximize user happiness (see: HTML parsers :P)
+	// a live log doesn't know its final count, so it is read up to its end instead
+	bool         live          = (count == live_count);
+	unsigned int ninstructions = 0;
+	
+	if (!live) {
+		std::istringstream reader(count);
 		
+		reader.exceptions(reader.failbit);
+		reader >> ninstructions;
+	}
+	
+	for (unsigned int i = 0; live || i < ninstructions; i++) {
 		SyncInstruction instruction;
 		
-		instruction.relative  = (descriptor.peek() == '+');
-		instruction.timestamp = 0;
-		instruction.code      = SyncInstructionCode::Undefined;
-		instruction.data      = 0;
-		
-		if (instruction.relative) {  // discard the "+"
-			descriptor.get();
-		}
-		
-		if (framerate != 0) {
-			string timestamp(11, ' ');  // "HH:mm:ss.FF"
-			descriptor.read(&timestamp[0], 11);
+		if (live) {
+			if (descriptor.peek() == std::char_traits<char>::eof()) {
+				break;
+			}
 			
-			instruction.timestamp = timestamp2index(timestamp, framerate);
+			// the log may still be being written, so a partial last line just ends it
+			try {
+				if (!read_instruction(descriptor, instruction)) {
+					continue;
+				}
+			}
+			catch (const std::ios_base::failure& e) {
+				break;
+			}
 		}
-		else {
-			descriptor >> instruction.timestamp;
+		else if (!read_instruction(descriptor, instruction)) {
+			continue;
 		}
 		
-		descriptor >> Skip("]") >> Skip(":") >> Skip("");
+		instructions.push_back(instruction);
+		follow(instruction);
+	}
+}
+
+SyncInstructions::SyncInstructions(const void* data, size_t size)
+	: instructions(), framerate(0), current_index(0), length(0)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	
+	if (size < binary_header_size || get_u32(bytes) != binary_magic) {
+		throw std::ios_base::failure("Not a binary synchronization");
+	}
+	
+	if (get_u32(bytes + 4) != binary_version) {
+		throw std::ios_base::failure("Unsupported binary synchronization version");
+	}
+	
+	length    = get_u32(bytes + 8);
+	framerate = get_u32(bytes + 12);
+	
+	size_t count = (size - binary_header_size) / binary_record_size;
+	
+	instructions.reserve(count);
+	
+	for (size_t i = 0; i < count; i++) {
+		const unsigned char* record = bytes + binary_header_size + i * binary_record_size;
+		SyncInstruction      instruction;
 		
-		string instruction_str;
-		std::getline(descriptor, instruction_str, '\n');
+		instruction.timestamp = get_u32(record);
+		instruction.data      = get_u32(record + 4);
+		instruction.code      = static_cast<SyncInstructionCode>(record[8]);
+		instruction.relative  = (record[9] != 0);
 		
-		if (instruction_str == "next") {
-			instruction.code = SyncInstructionCode::Next;
-		}
-		else if (instruction_str == "previous") {
-			instruction.code = SyncInstructionCode::Previous;
-		}
-		else if (instruction_str == "end") {
-			instruction.code = SyncInstructionCode::End;
-		}
-		else if (instruction_str.compare(0, 6, "go to ") == 0) {
-			instruction.code = SyncInstructionCode::GoTo;
-			instruction.data = std::stoi(instruction_str.substr(6)) - 1;
-			
-			if (instruction.data < 0 || instruction.data >= length) {
-				continue;
-			}
+		// unknown or invalid instructions are skipped, as in the string representation
+		if (instruction.code != SyncInstructionCode::Next     &&
+		    instruction.code != SyncInstructionCode::Previous &&
+		    instruction.code != SyncInstructionCode::GoTo     &&
+		    instruction.code != SyncInstructionCode::End) {
+			continue;
 		}
-		else {
+		
+		if (instruction.code == SyncInstructionCode::GoTo && instruction.data >= length) {
 			continue;
 		}
 		
 		instructions.push_back(instruction);
+		follow(instruction);
+	}
+}
+
+SyncInstructions SyncInstructions::Load(const string& filename)
+{
+	size_t                      size;
+	std::shared_ptr<const void> file = map_file(filename, size);
+	
+	if (!file) {
+		throw std::ios_base::failure("Can't read " + filename);
+	}
+	
+	const char* data = static_cast<const char*>(file.get());
+	
+	if (size >= 4 && get_u32(reinterpret_cast<const unsigned char*>(data)) == binary_magic) {
+		return SyncInstructions(data, size);
+	}
+	
+	std::istringstream descriptor(string(data, size));
+	
+	return SyncInstructions(descriptor);
+}
+
+void SyncInstructions::follow(const SyncInstruction& instruction)
+{
+	// keep track of the current slide, so the instructions can be extended afterwards
+	switch (instruction.code) {
+	case SyncInstructionCode::Next:
+		current_index += 1;
+		break;
+		
+	case SyncInstructionCode::Previous:
+		current_index -= 1;
+		break;
+		
+	case SyncInstructionCode::GoTo:
+		current_index = instruction.data;
+		break;
+		
+	default:
+		break;
+	}
+}
+
+bool SyncInstructions::read_instruction(std::istream& descriptor, SyncInstruction& instruction) const
+{
+	descriptor >> Skip("[");
+	descriptor >> Skip("");
+	// skipping the empty string will force the reader to discard any whitespace
+	// this is to make the format symmetrical; otherwise "[123 ]" would be allowed, but "[ 123]" would not
+	// and between allowing the left space and forbidding the right one, the lenient first option is
+	// preferred to maximize user happiness (see: HTML parsers :P)
+	
+	instruction.relative  = (descriptor.peek() == '+');
+	instruction.timestamp = 0;
+	instruction.code      = SyncInstructionCode::Undefined;
+	instruction.data      = 0;
+	
+	if (instruction.relative) {  // discard the "+"
+		descriptor.get();
+	}
+	
+	if (framerate != 0) {
+		string timestamp(11, ' ');  // "HH:mm:ss.FF"
+		descriptor.read(&timestamp[0], 11);
+		
+		instruction.timestamp = timestamp2index(timestamp, framerate);
+	}
+	else {
+		descriptor >> instruction.timestamp;
+	}
+	
+	descriptor >> Skip("]") >> Skip(":") >> Skip("");
+	
+	string instruction_str;
+	std::getline(descriptor, instruction_str, '\n');
+	
+	if (instruction_str == "next") {
+		instruction.code = SyncInstructionCode::Next;
+	}
+	else if (instruction_str == "previous") {
+		instruction.code = SyncInstructionCode::Previous;
+	}
+	else if (instruction_str == "end") {
+		instruction.code = SyncInstructionCode::End;
+	}
+	else if (instruction_str.compare(0, 6, "go to ") == 0) {
+		instruction.code = SyncInstructionCode::GoTo;
+		instruction.data = std::stoi(instruction_str.substr(6)) - 1;
+		
+		if (instruction.data < 0 || instruction.data >= length) {
+			return false;
+		}
+	}
+	else {
+		return false;
 	}
 	
+	return true;
 }
 
 bool SyncInstructions::Next(unsigned int timestamp, bool relative)
@@ -167,6 +343,11 @@ int SyncInstructions::Framerate() const
 	return framerate;
 }
 
+unsigned int SyncInstructions::Count() const
+{
+	return instructions.size();
+}
+
 string SyncInstructions::ToString() const
 {
 	std::ostringstream writer;
@@ -175,13 +356,143 @@ string SyncInstructions::ToString() const
 	writer << "nslides = "       << length              << "\n";
 	writer << "framerate = "     << framerate           << "\n";
 	writer << "ninstructions = " << instructions.size() << "\n";
+	writer << LinesFrom(0);
+	
+	return writer.str();
+}
+
+string SyncInstructions::ToBinary() const
+{
+	return BinaryHeader() + BinaryFrom(0);
+}
+
+bool SyncInstructions::Save(const string& filename) const
+{
+	std::ofstream file(filename, std::ios::binary);
 	
-	for (unsigned int i = 0; i < instructions.size(); i++) {
+	if (!file.is_open()) {
+		return false;
+	}
+	
+	file << (IsBinary(filename) ? ToBinary() : ToString());
+	
+	return file.good();
+}
+
+bool SyncInstructions::IsBinary(const string& filename)
+{
+	return filename.size() >= binary_extension.size() &&
+	       filename.compare(filename.size() - binary_extension.size(), binary_extension.size(),
+	                        binary_extension) == 0;
+}
+
+SyncInstructions SyncInstructions::Merge(const std::vector<SyncInstructions>& shards)
+{
+	if (shards.empty()) {
+		throw std::invalid_argument("No synchronization to merge");
+	}
+	
+	SyncInstructions merged(shards[0].length, shards[0].framerate);
+	
+	unsigned int begin = 0;     // where the current shard takes over
+	bool         ended = false;
+	
+	for (unsigned int k = 0; k < shards.size(); k++) {
+		const SyncInstructions& shard = shards[k];
+		
+		if (shard.length != merged.length || shard.framerate != merged.framerate) {
+			throw std::invalid_argument("Synchronizations of different jobs can't be merged");
+		}
+		
+		unsigned int timestamp = 0;
+		unsigned int end       = begin;
+		unsigned int slide     = 0;
+		bool         joined    = (k == 0);  // whether the merged slide already agrees with the shard's
+		
+		ended = false;
+		
+		for (const SyncInstruction& instruction : shard.instructions) {
+			timestamp = (instruction.relative) ? timestamp + instruction.timestamp : instruction.timestamp;
+			end       = std::max(end, timestamp);
+			
+			if (instruction.code == SyncInstructionCode::End) {
+				ended = true;
+				break;
+			}
+			
+			if (!joined && timestamp >= begin) {
+				if (slide != merged.current_index) {
+					merged.GoTo(begin, slide);
+				}
+				
+				joined = true;
+			}
+			
+			switch (instruction.code) {
+			case SyncInstructionCode::Next:
+				slide += 1;
+				
+				if (joined) {
+					merged.Next(timestamp);
+				}
+				break;
+				
+			case SyncInstructionCode::Previous:
+				slide -= 1;
+				
+				if (joined) {
+					merged.Previous(timestamp);
+				}
+				break;
+				
+			case SyncInstructionCode::GoTo:
+				slide = instruction.data;
+				
+				if (joined) {
+					merged.GoTo(timestamp, instruction.data);
+				}
+				break;
+				
+			default:
+				break;
+			}
+		}
+		
+		if (!joined && slide != merged.current_index) {
+			merged.GoTo(begin, slide);
+		}
+		
+		begin = end;
+	}
+	
+	if (ended) {
+		merged.End(begin);
+	}
+	
+	return merged;
+}
+
+string SyncInstructions::LiveHeader() const
+{
+	std::ostringstream writer;
+	
+	writer << "nslides = "       << length     << "\n";
+	writer << "framerate = "     << framerate  << "\n";
+	writer << "ninstructions = " << live_count << "\n";
+	
+	return writer.str();
+}
+
+string SyncInstructions::LinesFrom(unsigned int first) const
+{
+	std::ostringstream writer;
+	
+	for (unsigned int i = first; i < instructions.size(); i++) {
 		SyncInstruction instruction = instructions[i];
 		
 		writer << "[";
 		
-		if (instruction.relative < 0) {
+		if (instruction.relative) {
 			writer << "+";
 		}
 		
@@ -221,4 +532,37 @@ string SyncInstructions::ToString() const
 	return writer.str();
 }
 
+string SyncInstructions::BinaryHeader() const
+{
+	string header;
+	
+	header.reserve(binary_header_size);
+	
+	put_u32(header, binary_magic);
+	put_u32(header, binary_version);
+	put_u32(header, length);
+	put_u32(header, framerate);
+	
+	return header;
+}
+
+string SyncInstructions::BinaryFrom(unsigned int first) const
+{
+	string records;
+	
+	records.reserve((instructions.size() - std::min<size_t>(first, instructions.size())) * binary_record_size);
+	
+	for (unsigned int i = first; i < instructions.size(); i++) {
+		const SyncInstruction& instruction = instructions[i];
+		
+		put_u32(records, instruction.timestamp);
+		put_u32(records, instruction.data);
+		records.push_back((char) static_cast<uint8_t>(instruction.code));
+		records.push_back((char) (instruction.relative ? 1 : 0));
+		records.append(2, '\0');
+	}
+	
+	return records;
+}
+
 }
@@ -24,6 +24,7 @@
 #include <vector>
 #include <tuple>
 #include <string>
+#include <cstddef>
 
 using std::string;
 
@@ -110,6 +111,25 @@ public:
 	/// @param[in] descriptor String representation through a stream reader.
 	SyncInstructions(std::istream& descriptor);
 	
+	/// @brief Construct a SyncInstructions object from its binary representation
+	/// 
+	/// A trailing partial record, as left by a live log still being written, is ignored.
+	/// 
+	/// @param[in] data Binary representation, e.g. a mapped file.
+	/// @param[in] size Size of the representation, in bytes.
+	/// @throws std::ios_base::failure if the data is not a binary representation.
+	SyncInstructions(const void* data, size_t size);
+	
+	/// @brief Read a synchronization file in either representation
+	/// 
+	/// Binary files are recognized by their contents, not their name, and parsed in place
+	/// from a memory mapping.
+	/// 
+	/// @param[in] filename Name of the file.
+	/// @returns Synchronization.
+	/// @throws std::ios_base::failure if the file can't be read or is malformed.
+	static SyncInstructions Load(const string& filename);
+	
 	/// @brief Add a "next slide" instruction
 	/// 
 	/// @param[in] timestamp Frame index.
@@ -155,8 +175,76 @@ public:
 	/// @brief Get the number of frame per second.
 	int Framerate() const;
 	
+	/// @brief Get the number of instructions
+	unsigned int Count() const;
+	
 	/// @brief Generate an appropriate string representation of the synchronization
 	string ToString() const;
+	
+	/// @brief Generate the compact binary representation of the synchronization
+	/// 
+	/// It holds exactly the same information as the string representation, so either can be
+	/// converted into the other without loss.
+	string ToBinary() const;
+	
+	/// @brief Write the synchronization to a file
+	/// 
+	/// @param[in] filename Name of the file; the binary representation is used if it ends
+	///                     in ".bsync", and the string representation otherwise.
+	/// @returns True if successful; otherwise, false.
+	bool Save(const string& filename) const;
+	
+	/// @brief Check if a file name calls for the binary representation, i.e. it ends in ".bsync"
+	static bool IsBinary(const string& filename);
+	
+	/// @brief Merge the synchronizations of consecutive time ranges of the same footage
+	/// 
+	/// Each shard is trusted up to its End instruction, where the next one takes over. Every shard
+	/// but the first should start a bit before the previous one ends, so it has settled by then; its
+	/// instructions before that point only establish its current slide. If both disagree on the
+	/// slide at the boundary, a GoTo reconciles them. Timestamps are made absolute.
+	/// 
+	/// @param[in] shards Synchronization of each time range, in order.
+	/// @returns Merged synchronization.
+	static SyncInstructions Merge(const std::vector<SyncInstructions>& shards);
+	
+	/// @brief Generate the header of a live log of the synchronization
+	/// 
+	/// A live log is the header followed by LinesFrom() of every new instruction as it is added,
+	/// so it can be appended to while the synchronization runs. At any point, it can be read
+	/// back like a regular representation.
+	string LiveHeader() const;
+	
+	/// @brief Generate the string representation of the instructions from a given one onwards
+	/// 
+	/// @param[in] first Index of the first instruction to represent.
+	string LinesFrom(unsigned int first) const;
+	
+	/// @brief Generate the header of a binary live log of the synchronization
+	/// 
+	/// Like LiveHeader(), but followed by BinaryFrom() of every new instruction instead. Since
+	/// records have a fixed size and there is no count, it is a complete binary representation
+	/// at any point.
+	string BinaryHeader() const;
+	
+	/// @brief Generate the binary records of the instructions from a given one onwards
+	/// 
+	/// @param[in] first Index of the first instruction to represent.
+	string BinaryFrom(unsigned int first) const;
+	
+private:
+	/// @brief Keep track of the current slide after an instruction
+	/// 
+	/// @param[in] instruction Instruction, already added to the list.
+	void follow(const SyncInstruction& instruction);
+	
+	/// @brief Read an instruction from its string representation
+	/// 
+	/// @param[in] descriptor String representation through a stream reader.
+	/// @param[out] instruction Instruction.
+	/// @returns True if successful; false if the instruction is unknown or invalid, in which case it
+	///          should be skipped. Malformed representations throw through the stream instead.
+	bool read_instruction(std::istream& descriptor, SyncInstruction& instruction) const;
 };
 
 }
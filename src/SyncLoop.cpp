@@ -18,25 +18,27 @@
 // limitations under the License.
 
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 #include <limits>
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <cstdio>
+#include <map>
 
 #include <opencv2/opencv.hpp>
 
-#include <wx/wxprec.h>
-#include <wx/timer.h>
-#include <wx/file.h>
- 
-#ifndef WX_PRECOMP
-	#include <wx/wx.h>
-#endif
-
-#include "CVCanvas.hpp"
 #include "ProcessLoop.hpp"
+#include "FeaturePipeline.hpp"
 #include "SyncLoop.hpp"
 #include "SyncInstructions.hpp"
+#include "FeatureCache.hpp"
+#include "FeatureBackend.hpp"
 #include "util.hpp"
 
 using std::vector;
@@ -46,111 +48,238 @@ using cv::Mat;
 namespace slidesync
 {
 
-SyncLoop::SyncLoop(CVCanvas* canvas, cv::VideoCapture* footage, vector<Mat>* slides,
-                   const string& cachefname)
-	: cachefname(cachefname),
-	  canvas(canvas),
+/// @brief Size of the slide region summaries used to locate slide changes
+static const cv::Size thumbnail_size(64, 48);
+
+SyncLoop::SyncLoop(FrameSource* footage, vector<Mat>* slides, const string& cachefname)
+	: ProcessLoop(),
+	  cachefname(cachefname),
+	  featurecachefname(),
+	  deckhash(0),
+	  pagehashes(),
+	  patches(),
+	  patch_index(0),
+	  livefname(),
+	  livefile(),
+	  listener(),
+	  logged(0),
+	  checkpointfname(),
+	  last_checkpoint(),
+	  profiler(nullptr),
+	  verbose(false),
+	  nthreads(0),
+	  discard(nullptr),
 	  footage(footage),
+	  probe(nullptr),
 	  frame_index(0),
 	  coarse_index(0),
-	  length(footage->get(cv::CAP_PROP_FRAME_COUNT)), 
+	  start_index(0),
+	  length(footage->Length()),
+	  coarse_frameskip(std::max<int>(fine_frameskip, (int) round(footage->Framerate() * coarse_interval) - 1)),
+	  frameskip(fine_frameskip),
+	  prev_frame_index(0),
+	  prev_thumbnail(),
 	  slides(slides),
+	  fullslides(nullptr),
+	  scale(1),
 	  slide_index(0),
-	  detector(cv::BRISK::create()),
-	  matcher(cv::DescriptorMatcher::create("BruteForce-Hamming")),
-	  slide_keypoints(),
-	  slide_descriptors(),
+	  create_backend(backend_factory("brisk")),
+	  backend(create_backend()),
+	  pipeline(),
+	  slide_features(),
+	  deck_index(),
+	  verifiers(),
+	  fullslide_keypoints(),
+	  fullslide_descriptors(),
 	  ref_frame(),
 	  ref_frame_keypoints(),
 	  ref_frame_descriptors(),
 	  ref_quad_keypoints(),
 	  ref_quad_descriptors(),
 	  ref_quad_indices(),
+	  quad_keypoints(),
+	  quad_descriptors(),
+	  quad_indices(),
+	  quad_matches(),
 	  ref_slidepose(),
 	  prev_slidepose(),
 	  nearcount(),
 	  badcount(),
-	  sync_instructions(slides->size(), (unsigned int) round(footage->get(cv::CAP_PROP_FPS))),
-	  processor(&SyncLoop::initialize),
-	  processing(false) {}
+	  steady(false),
+	  sync_instructions(slides->size(), (unsigned int) round(footage->Framerate())),
+	  processor(&SyncLoop::initialize) {}
 
-void SyncLoop::SetCanvas(CVCanvas* canvas)
+void SyncLoop::SetFootage(FrameSource* footage)
 {
-	this->canvas = canvas;
+	this->footage = footage;
 }
 
-void SyncLoop::SetFootage(cv::VideoCapture* footage)
+void SyncLoop::SetProbe(FrameSource* probe)
 {
-	this->footage = footage;
+	this->probe = probe;
+}
+
+void SyncLoop::SetWorkingResolution(double scale, vector<Mat>* fullslides)
+{
+	this->scale      = scale;
+	this->fullslides = fullslides;
+}
+
+void SyncLoop::SetFeatureBackend(const BackendFactory& create_backend)
+{
+	this->create_backend = create_backend;
+	this->backend        = create_backend();
+}
+
+void SyncLoop::SetFeatureCache(const string& filename, uint64_t deckhash)
+{
+	this->featurecachefname = filename;
+	this->deckhash          = deckhash;
+}
+
+void SyncLoop::SetPageHashes(const vector<uint64_t>& pagehashes)
+{
+	if (pagehashes.size() == slides->size()) {
+		this->pagehashes = pagehashes;
+	}
+	else {
+		this->pagehashes.clear();
+	}
+}
+
+void SyncLoop::SetSlideFeatures(const FeatureStore& features)
+{
+	this->slide_features = features;
+}
+
+FeatureStore SyncLoop::GetSlideFeatures()
+{
+	prepare_slides();
+	
+	return slide_features;
+}
+
+void SyncLoop::SetThreads(unsigned int nthreads)
+{
+	this->nthreads = nthreads;
+}
+
+void SyncLoop::SetLiveOutput(const string& filename)
+{
+	this->livefname = filename;
 }
 
-void SyncLoop::Notify()
+void SyncLoop::SetListener(const InstructionListener& listener)
 {
-	if (processing) {
+	this->listener = listener;
+}
+
+void SyncLoop::SetRange(unsigned int start, unsigned int end)
+{
+	if (footage->Live()) {
 		return;
 	}
 	
-	processing = true;
-	(this->*processor)();
-	processing = false;
+	this->start_index = start;
+	this->length      = std::min(end, footage->Length());
 }
 
-SyncInstructions SyncLoop::GetSyncInstructions()
+void SyncLoop::SetCheckpoint(const string& filename)
 {
-	return sync_instructions;
+	this->checkpointfname = filename;
+}
+
+void SyncLoop::SetProfiler(Profiler* profiler)
+{
+	this->profiler = profiler;
+}
+
+void SyncLoop::SetVerbose(bool verbose)
+{
+	this->verbose = verbose;
 }
 
-Mat SyncLoop::next_frame()
+void SyncLoop::Step()
 {
-	Mat frame;
+	(this->*processor)();
 	
-	if (frame_index >= length) {
-		return frame;
+	log_instructions();
+}
+
+std::ostream& SyncLoop::framelog()
+{
+	return (verbose) ? std::cout : discard;
+}
+
+void SyncLoop::log_instructions()
+{
+	if ((!livefile.is_open() && !listener) || logged >= sync_instructions.Count()) {
+		return;
 	}
 	
-	(*footage) >> frame;
-	
-	for (unsigned int i = 0; i < frameskip; i++) {
-		footage->grab();
+	if (livefile.is_open()) {
+		if (SyncInstructions::IsBinary(livefname)) {
+			livefile << sync_instructions.BinaryFrom(logged) << std::flush;
+		}
+		else {
+			livefile << sync_instructions.LinesFrom(logged) << std::flush;
+		}
 	}
 	
-	coarse_index += 1;
-	frame_index  += frameskip + 1;
+	if (listener) {
+		for (auto instr = sync_instructions.cbegin() + logged; instr != sync_instructions.cend(); instr++) {
+			listener(*instr);
+		}
+	}
 	
-	return frame;
+	logged = sync_instructions.Count();
+}
+
+SyncInstructions SyncLoop::GetSyncInstructions()
+{
+	return sync_instructions;
 }
 
 /// @brief Filter a list of keypoint into those keypoints inside a quad
 /// 
+/// The outputs keep their storage between calls, so steady tracking doesn't reallocate them.
+/// 
 /// @param[in] keypoints Image keypoints.
 /// @param[in] descriptors Corresponding keypoint descriptors.
 /// @param[in] quad Quad to use as a filter.
 /// @param[out] quad_keypoints Filtered image keypoints, inside the Quad.
-/// @param[out] quad_descriptors Filtered keypoint descriptors, inside the Quad.
-/// @returns Index lookup table m[i] indicating the corresponding index k for each in index i in keypoints,
-///          i.e. keypoints[m[i]] = quad_keypoints[i]. If a keypoint is not inside the quad, it will be marked
-///          with a -1.
-static vector<int> quadfilter(const vector<cv::KeyPoint>& keypoints, const Mat& descriptors,
-                               const Quad& quad, vector<cv::KeyPoint>& quad_keypoints, Mat& quad_descriptors)
+/// @param[out] quad_descriptors Filtered keypoint descriptors, inside the Quad. Must not share its data
+///                              with any other matrix.
+/// @param[out] lookup Index lookup table m[i] indicating the corresponding index k for each in index i in
+///                    keypoints, i.e. keypoints[m[i]] = quad_keypoints[i]. If a keypoint is not inside the
+///                    quad, it will be marked with a -1.
+static void quadfilter(const vector<cv::KeyPoint>& keypoints, const Mat& descriptors, const Quad& quad,
+                       vector<cv::KeyPoint>& quad_keypoints, Mat& quad_descriptors, vector<int>& lookup)
 {
-	vector<int> lookup(keypoints.size(), -1);
-	
+	lookup.assign(keypoints.size(), -1);
 	quad_keypoints.clear();
-	quad_descriptors = Mat(0, descriptors.cols, descriptors.type());
 	
-	for (unsigned int i = 0, k = 0; i < keypoints.size(); i++) {
-		bool inside = quad.Inside(keypoints[i].pt.x, keypoints[i].pt.y);
-		
-		if (inside) {
+	for (unsigned int i = 0; i < keypoints.size(); i++) {
+		if (quad.Inside(keypoints[i].pt.x, keypoints[i].pt.y)) {
+			lookup[i] = quad_keypoints.size();
 			quad_keypoints.push_back(keypoints[i]);
-			quad_descriptors.push_back(descriptors.row(i));
-			
-			lookup[i] = k;
-			k        += 1;
 		}
 	}
 	
-	return lookup;
+	if (quad_descriptors.cols != descriptors.cols || quad_descriptors.type() != descriptors.type()) {
+		quad_descriptors = Mat(0, descriptors.cols, descriptors.type());
+	}
+	
+	// resizing within the reserved rows keeps the buffer, so the block is gathered in place
+	quad_descriptors.resize(quad_keypoints.size());
+	
+	size_t rowsize = descriptors.cols * descriptors.elemSize();
+	
+	for (unsigned int i = 0; i < keypoints.size(); i++) {
+		if (lookup[i] >= 0) {
+			std::memcpy(quad_descriptors.ptr(lookup[i]), descriptors.ptr(i), rowsize);
+		}
+	}
 }
 
 /// @brief Robust version of Quad perspective which can handle degenerate cases. In particular,
@@ -219,8 +348,8 @@ static const int great_matchsize = 20;
 /// @param[in] slidepose1 Pose of the presentation slide in the first frame.
 /// @param[in] slidepose2 Pose of the presentation slide in the second frame.
 /// @returns Matching cost.
-static double matchcost(const vector<cv::KeyPoint>& keypoints1,
-                        const vector<cv::KeyPoint>& keypoints2,
+static double matchcost(const PointSet& keypoints1,
+                        const PointSet& keypoints2,
                         const vector<cv::DMatch>& matches, const Mat& homography,
                         const Quad& slidepose1, const Quad& slidepose2)
 {
@@ -230,7 +359,7 @@ static double matchcost(const vector<cv::KeyPoint>& keypoints1,
 	                                     // and after that this cost increments faster (heavy deformation
 	                                     // is a strong indicator of a wrong slide)
 	
-	if (matches.size() < min_matchsize) {
+	if (matches.size() < min_matchsize || homography.empty()) {
 		return std::numeric_limits<double>::infinity();
 	}
 	
@@ -255,17 +384,28 @@ static double matchcost(const vector<cv::KeyPoint>& keypoints1,
 	double matchcost       = 0;
 	int    matchsize       = matches.size();
 	
-	for (unsigned int i = 0; i < matches.size(); i++) {
-		cv::Point2f keypoint_f            = keypoints1[matches[i].queryIdx].pt;
-		double      keypoint[3]           = {keypoint_f.x, keypoint_f.y, 1};
-		Mat         keypoint_homogeneous(3, 1, CV_64F, keypoint);
-		Mat         projected_homogeneous = homography * keypoint_homogeneous;
-		
-		double* pjh = projected_homogeneous.ptr<double>();
-		cv::Point2f projected(pjh[0] / pjh[2], pjh[1] / pjh[2]);
+	// reused by every call on the same thread, so the reprojection doesn't allocate
+	thread_local vector<cv::Point2f> sources;
+	thread_local vector<cv::Point2f> targets;
+	
+	sources.clear();
+	targets.clear();
+	
+	for (const cv::DMatch& match : matches) {
+		sources.push_back(keypoints1[match.queryIdx]);
+		targets.push_back(keypoints2[match.trainIdx]);
+	}
+	
+	const double* h = homography.ptr<double>();
+	
+	for (unsigned int i = 0; i < sources.size(); i++) {
+		double x = sources[i].x;
+		double y = sources[i].y;
+		double w = h[6] * x + h[7] * y + h[8];
 		
-		double dx = projected.x - keypoints2[matches[i].trainIdx].pt.x;
-		double dy = projected.y - keypoints2[matches[i].trainIdx].pt.y;
+		// a point projected to infinity gives a NaN cost and is discarded below
+		double dx = (float) ((h[0] * x + h[1] * y + h[2]) / w) - targets[i].x;
+		double dy = (float) ((h[3] * x + h[4] * y + h[5]) / w) - targets[i].y;
 		
 		double cost = std::sqrt(dx * dx + dy * dy);
 		
@@ -295,7 +435,7 @@ static double matchcost(const vector<cv::KeyPoint>& keypoints1,
 /// @param[in] slidepose1 Slide pose in the first frame.
 /// @param[in] slidepose2 Slide pose in the second frame.
 /// @returns True if the matching is good enough to be considered correct; otherwise, false.
-static bool slidematch(const vector<cv::KeyPoint>& keypoints1, const vector<cv::KeyPoint>& keypoints2,
+static bool slidematch(const PointSet& keypoints1, const PointSet& keypoints2,
                        const vector<cv::DMatch>& matches, const Mat& homography,
                        const Quad& slidepose1, const Quad& slidepose2)
 {
@@ -304,8 +444,8 @@ static bool slidematch(const vector<cv::KeyPoint>& keypoints1, const vector<cv::
 	}
 	
 	const double min_ratio   = 0.1;
-	double ratio1 = ((double) matches.size()) / keypoints1.size();
-	double ratio2 = ((double) matches.size()) / keypoints2.size();
+	double ratio1 = ((double) matches.size()) / keypoints1.Size();
+	double ratio2 = ((double) matches.size()) / keypoints2.Size();
 	
 	if (homography.empty() || (matches.size() < great_matchsize && (ratio1 < min_ratio || ratio2 < min_ratio))) {
 		return false;
@@ -318,37 +458,64 @@ static bool slidematch(const vector<cv::KeyPoint>& keypoints1, const vector<cv::
 	return cost < 20.0;
 }
 
+/// @brief Keep the nearest neighbor of every keypoint, if it is clearly better than the second one
+/// 
+/// @param[in] matches Two nearest neighbors for each keypoint.
+/// @param[in] max_ratio Maximum ratio between best match and second match's distance.
+/// @returns Distinctive matches.
+static vector<cv::DMatch> ratiotest(const vector<vector<cv::DMatch>>& matches, float max_ratio)
+{
+	vector<cv::DMatch> bestmatches;
+	
+	for (unsigned int i = 0; i < matches.size(); i++) {
+		if (matches[i].size() >= 2 && matches[i][0].distance < max_ratio * matches[i][1].distance) {
+			bestmatches.push_back(matches[i][0]);
+		}
+	}
+	
+	return bestmatches;
+}
+
 vector<cv::DMatch> SyncLoop::match(const Mat& descriptors1, const Mat& descriptors2)
 {
+	ScopedTimer                timer(profiler, "match");
 	vector<vector<cv::DMatch>> matches;
-	vector<cv::DMatch>         bestmatches;
 	
 	if (descriptors1.rows < 2 || descriptors2.rows < 2) {
-		return bestmatches;
+		return vector<cv::DMatch>();
 	}
 	
-	matcher->knnMatch(descriptors1, descriptors2, matches, 2);
+	backend->KnnMatch(descriptors1, descriptors2, matches, 2);
 	
-	for (unsigned int i = 0; i < matches.size(); i++) {
-		if (matches[i][0].distance < max_matchratio * matches[i][1].distance) {
-			bestmatches.push_back(matches[i][0]);
-		}
+	return ratiotest(matches, max_matchratio);
+}
+
+vector<cv::DMatch> SyncLoop::matchslide(unsigned int slide, const Mat& descriptors)
+{
+	ScopedTimer                timer(profiler, "match");
+	vector<vector<cv::DMatch>> matches;
+	
+	if (slide_features.Count(slide) < 2 || descriptors.rows < 2) {
+		return vector<cv::DMatch>();
 	}
 	
-	return bestmatches;
+	backend->KnnMatchResident(slide, descriptors, matches, 2);
+	
+	return ratiotest(matches, max_matchratio);
 }
 
-Mat SyncLoop::refineHomography(const vector<cv::KeyPoint>& keypoints1,
-                               const vector<cv::KeyPoint>& keypoints2,
+Mat SyncLoop::refineHomography(const PointSet& keypoints1,
+                               const PointSet& keypoints2,
                                const vector<cv::DMatch>& matches,
                                vector<cv::DMatch>& inliers)
 {
+	ScopedTimer         timer(profiler, "ransac");
 	vector<cv::Point2f> keypoints1_f;
 	vector<cv::Point2f> keypoints2_f;
 	
 	for (unsigned int i = 0; i < matches.size(); i++) {
-		keypoints1_f.push_back(keypoints1[matches[i].queryIdx].pt);
-		keypoints2_f.push_back(keypoints2[matches[i].trainIdx].pt);
+		keypoints1_f.push_back(keypoints1[matches[i].queryIdx]);
+		keypoints2_f.push_back(keypoints2[matches[i].trainIdx]);
 	}
 	
 	Mat homography;
@@ -371,13 +538,17 @@ Mat SyncLoop::refineHomography(const vector<cv::KeyPoint>& keypoints1,
 
 /// @brief Draw a Quad into a OpenCV matrix
 /// 
-/// @param[in] canvas Matrix to draw the Quad in.
+/// @param[in] canvas Matrix to draw the Quad in. If empty, nothing will be drawn.
 /// @param[in] quad Quad to draw.
 /// @param[in] color Line color.
 /// @param[in] offsetx Amount that every vertex will be moved in the X coordinate.
 /// @param[in] offsety Amount that every vertex will be moved in the Y coordinate.
 void drawquad(Mat& canvas, const Quad& quad, cv::Scalar color, double offsetx = 0, double offsety = 0)
 {
+	if (canvas.empty()) {
+		return;
+	}
+	
 	cv::Point vertices[4] = {cv::Point(quad.X1() + offsetx, quad.Y1() + offsety),
 	                         cv::Point(quad.X2() + offsetx, quad.Y2() + offsety),
 	                         cv::Point(quad.X3() + offsetx, quad.Y3() + offsety),
@@ -389,252 +560,1137 @@ void drawquad(Mat& canvas, const Quad& quad, cv::Scalar color, double offsetx =
 	cv::line(canvas, vertices[3], vertices[0], color);
 }
 
-void SyncLoop::initialize()
+/// @brief Add the outline of a Quad to be drawn over an intermediate result
+/// 
+/// @param[out] outlines Outlines to add this one to.
+/// @param[in] display Intermediate result. If empty, nothing will be added.
+/// @param[in] quad Quad to outline.
+/// @param[in] color Line color, in RGBA order.
+static void outlinequad(vector<QuadOutline>& outlines, const Mat& display, const Quad& quad, cv::Scalar color)
 {
-	// preprocess slide keypoints
+	if (display.empty()) {
+		return;
+	}
 	
-	for (unsigned int i = 0; i < slides->size(); i++) {
-		vector<cv::KeyPoint> keypoints;
-		Mat                  descriptors;
+	outlines.push_back(QuadOutline{{cv::Point2f(quad.X1(), quad.Y1()), cv::Point2f(quad.X2(), quad.Y2()),
+	                                cv::Point2f(quad.X3(), quad.Y3()), cv::Point2f(quad.X4(), quad.Y4())},
+	                               color});
+}
+
+/// @brief Get the region of the frame covered by a Quad
+/// 
+/// @param[in] quad Quad.
+/// @returns Bounding box of the Quad. It may extend outside the frame.
+static cv::Rect quadregion(const Quad& quad)
+{
+	double left   = std::min(std::min(quad.X1(), quad.X2()), std::min(quad.X3(), quad.X4()));
+	double right  = std::max(std::max(quad.X1(), quad.X2()), std::max(quad.X3(), quad.X4()));
+	double top    = std::min(std::min(quad.Y1(), quad.Y2()), std::min(quad.Y3(), quad.Y4()));
+	double bottom = std::max(std::max(quad.Y1(), quad.Y2()), std::max(quad.Y3(), quad.Y4()));
+	
+	return cv::Rect(cv::Point((int) std::floor(left), (int) std::floor(top)),
+	                cv::Point((int) std::ceil(right), (int) std::ceil(bottom)));
+}
+
+/// @brief Scale every vertex of a Quad
+/// 
+/// @param[in] quad Quad.
+/// @param[in] factor Scaling factor.
+/// @returns Scaled Quad.
+static Quad scalequad(const Quad& quad, double factor)
+{
+	return Quad(quad.X1() * factor, quad.Y1() * factor,
+	            quad.X2() * factor, quad.Y2() * factor,
+	            quad.X3() * factor, quad.Y3() * factor,
+	            quad.X4() * factor, quad.Y4() * factor);
+}
+
+SlideCandidate SyncLoop::verify(const vector<unsigned int>& candidates,
+                               const vector<cv::KeyPoint>& frame_keypoints, const Mat& frame_descriptors,
+                               unsigned int& bestslide)
+{
+	vector<SlideCandidate>    results(candidates.size(), SlideCandidate{Quad(), Mat(), vector<cv::DMatch>(),
+	                                                                    std::numeric_limits<double>::infinity()});
+	std::atomic<unsigned int> settled(candidates.size());
+	
+	// only reads shared state; backends are safe to match concurrently
+	verifiers->ParallelFor(candidates.size(), [&](unsigned int i) {
+		if (i > settled) {
+			return;
+		}
 		
-		detector->detectAndCompute((*slides)[i], cv::noArray(), keypoints, descriptors);
+		unsigned int    slide  = candidates[i];
+		SlideCandidate& result = results[i];
 		
-		slide_keypoints  .push_back(keypoints);
-		slide_descriptors.push_back(descriptors);
+		double slidewidth  = (*slides)[slide].cols;
+		double slideheight = (*slides)[slide].rows;
 		
-		wxTheApp->Yield(true);
-	}
-	
-	if (wxFile::Exists(cachefname)) {
-		std::ifstream instructions(cachefname);
+		vector<cv::DMatch> matches = matchslide(slide, frame_descriptors);
 		
-		try {
-			processor         = &SyncLoop::idle;
-			sync_instructions = SyncInstructions(instructions);
+		result.homography = refineHomography(slide_features.Points(slide), frame_keypoints, matches, result.matches);
+		result.slidepose  = quadperspective(Quad(         0,           0,
+		                                                  0, slideheight,
+		                                         slidewidth, slideheight,
+		                                         slidewidth,           0), result.homography);
+		result.cost       = matchcost(slide_features.Points(slide), frame_keypoints,
+		                              result.matches, result.homography, ref_slidepose, result.slidepose);
+		
+		if (result.cost < clear_cost) {
+			unsigned int current = settled;
 			
-			LoopEvent loopfinished(LoopFinishedEvent);
-			wxPostEvent(this, loopfinished);
-			return;
+			while (i < current && !settled.compare_exchange_weak(current, i)) {}
 		}
-		catch (const std::ios_base::failure& e) {
-			std::cerr << "Can't parse instructions file" << std::endl;
+	});
+	
+	unsigned int   last = std::min<unsigned int>(settled, candidates.size() - 1);
+	SlideCandidate best = SlideCandidate{Quad(), Mat(), vector<cv::DMatch>(),
+	                                     std::numeric_limits<double>::infinity()};
+	
+	for (unsigned int i = 0; i < candidates.size() && i <= last; i++) {
+		if (results[i].cost < best.cost) {
+			bestslide = candidates[i];
+			best      = results[i];
 		}
 	}
 	
-	// match the first frame to find the slides projection or screen in the footage
+	return best;
+}
+
+Quad SyncLoop::tofootage(const Quad& quad) const
+{
+	return (scale == 1) ? quad : scalequad(quad, 1 / scale);
+}
+
+bool SyncLoop::refine(const Mat& fullframe, unsigned int slide, Quad& slidepose)
+{
+	ScopedTimer timer(profiler, "refine");
 	
-	Mat firstframe;
+	if (fullslides == nullptr || fullframe.empty() || slide >= fullslides->size()) {
+		return false;
+	}
 	
-	// peek the first frame,
-	// processing VideoCapture objects that are not rewindable
-	// is not supported (e.g. realtime camera streams)
-	(*footage) >> firstframe;
-	footage->set(cv::CAP_PROP_POS_FRAMES, 0);
+	if (fullslide_descriptors.size() != fullslides->size()) {
+		fullslide_keypoints  .assign(fullslides->size(), vector<cv::KeyPoint>());
+		fullslide_descriptors.assign(fullslides->size(), Mat());
+	}
 	
-	cv::cvtColor(firstframe, firstframe, cv::COLOR_BGR2GRAY);
+	if (fullslide_descriptors[slide].empty()) {
+		backend->Detect((*fullslides)[slide], fullslide_keypoints[slide], fullslide_descriptors[slide]);
+	}
 	
-	vector<cv::KeyPoint> frame_keypoints;
-	Mat                  frame_descriptors;
+	vector<cv::KeyPoint> keypoints;
+	Mat                  descriptors;
 	
-	detector->detectAndCompute(firstframe, cv::noArray(), frame_keypoints, frame_descriptors);
+	backend->Detect(fullframe, keypoints, descriptors);
 	
-	wxTheApp->Yield(true);
+	yield();
 	
-	vector<cv::DMatch> matches = match(slide_descriptors[0], frame_descriptors);
+	vector<cv::DMatch> matches = match(fullslide_descriptors[slide], descriptors);
 	vector<cv::DMatch> filtered;
 	
-	wxTheApp->Yield(true);
-	
-	Mat homography = refineHomography(slide_keypoints[0], frame_keypoints, matches, filtered);
+	Mat homography = refineHomography(fullslide_keypoints[slide], keypoints, matches, filtered);
 	
-	wxTheApp->Yield(true);
+	yield();
 	
 	if (homography.empty()) {
-		std::cerr << "Can't find a robust matching" << std::endl;
-		processor = &SyncLoop::idle;
-		
-		return;
+		return false;
 	}
 	
-	// locate the presentation in the footage frame
+	double slidewidth  = (*fullslides)[slide].cols;
+	double slideheight = (*fullslides)[slide].rows;
 	
-	double slidewidth  = (*slides)[0].cols;
-	double slideheight = (*slides)[0].rows;
+	slidepose = scalequad(quadperspective(Quad(         0,           0,
+	                                                    0, slideheight,
+	                                           slidewidth, slideheight,
+	                                           slidewidth,           0), homography), scale);
 	
-	Quad slidepose = quadperspective(Quad(         0,           0,
-	                                               0, slideheight,
-	                                      slidewidth, slideheight,
-	                                      slidewidth,           0), homography);
+	return true;
+}
+
+Mat SyncLoop::thumbnail(const Mat& image) const
+{
+	cv::Rect region = quadregion(tofootage(ref_slidepose)) & cv::Rect(0, 0, image.cols, image.rows);
 	
-	//  DEBUG The next section is only for visual inspection purposes, it is not executed in production
-	// Mat display;
-	// 
-	// cv::drawMatches((*slides)[0], slide_keypoints[0], firstframe, frame_keypoints, filtered,
-	//                 display, cv::Scalar(255, 0, 0), cv::Scalar(0, 0, 255));
-	// 
-	// drawquad(display, slidepose, cv::Scalar(125, 255, 42), footage->get(cv::CAP_PROP_FRAME_WIDTH), 0);
-	// cv::imwrite("display_init.png", display);
-	// END DEBUG
+	if (region.area() == 0) {
+		region = cv::Rect(0, 0, image.cols, image.rows);
+	}
 	
-	ref_frame             = firstframe;
-	ref_frame_keypoints   = frame_keypoints;
-	ref_frame_descriptors = frame_descriptors;
-	ref_slidepose         = slidepose;
-	prev_slidepose        = slidepose;
-	ref_quad_indices      = quadfilter(frame_keypoints, frame_descriptors, slidepose,
-	                                   ref_quad_keypoints, ref_quad_descriptors);
+	Mat small;
+	
+	cv::resize(image(region), small, thumbnail_size, 0, 0, cv::INTER_AREA);
 	
-	processor = &SyncLoop::track;
+	if (small.channels() == 3) {
+		cv::cvtColor(small, small, cv::COLOR_BGR2GRAY);
+	}
+	
+	return small;
 }
 
-void SyncLoop::track()
+unsigned int SyncLoop::locate_change(const Mat& current)
 {
-	const double largedeviation   = 10;
-	const double largedeformation = 7;
-	const double largecost        = 1000;
-	const double reasonablecost   = 40;
+	ScopedTimer timer(profiler, "locate_change");
 	
-	std::cout << "Frame " << coarse_index << " (" << frame_index << " / "
-	                                              << index2timestamp(frame_index, 24) << ")";
+	unsigned int before = prev_frame_index;
+	unsigned int after  = frame_index;
 	
-	Mat  frame     = next_frame();
-	Quad slidepose = ref_slidepose;  // approximate the current Quad with the reference one, which should be
-	                                 // close, and therefore, have most of the slide keypoints inside; if it
-	                                 // turns out the real one is too far away from the reference one, the
-	                                 // reference will be updated to point to this one to reduce future errors
-	Mat  display;
-	bool hardframe     = false;
-	bool make_keyframe = false;  // make this the reference frame
-	bool goodmatch     = true;   // the match is good enough to be a keyframe (it will become one if other
-	                             // conditions also apply such as slide change or a large camera movement)
+	if (probe == nullptr || prev_thumbnail.empty() || after <= before + 1) {
+		return after;
+	}
 	
-	if (frame.empty()) {
-		std::cout << std::endl;
-		
-		sync_instructions.End(frame_index);
+	// if the slide region looks the same (less than a gray level apart on average),
+	// there is nothing visual to search for
+	if (cv::norm(prev_thumbnail, current, cv::NORM_L1) < thumbnail_size.area()) {
+		return after;
+	}
+	
+	// invariant: the frame at before shows the old slide, the one at after shows the new one
+	while (after - before > 1) {
+		unsigned int middle = before + (after - before) / 2;
+		Mat          image;
 		
-		processor = &SyncLoop::idle;
+		// a probe that can't seek is dropped, so the tracking goes back to the fine stride
+		if (!probe->Seek(middle) || !probe->Read(image)) {
+			std::cerr << "Can't seek the footage probe; locating slide changes at the frame stride" << std::endl;
+			probe = nullptr;
+			break;
+		}
 		
-		std::ofstream file(cachefname);
-		file << sync_instructions.ToString();
+		Mat probed = thumbnail(image);
 		
-		LoopEvent loopfinished(LoopFinishedEvent);
-		wxPostEvent(this, loopfinished);
+		if (cv::norm(probed, prev_thumbnail, cv::NORM_L1) <= cv::norm(probed, current, cv::NORM_L1)) {
+			before = middle;
+		}
+		else {
+			after = middle;
+		}
 		
-		return;
+		yield();
 	}
 	
-	cv::cvtColor(frame, display, cv::COLOR_BGR2RGBA);
-	cv::cvtColor(frame, frame,   cv::COLOR_BGR2GRAY);
+	return after;
+}
+
+/// @brief Write a Quad to a checkpoint
+static void writequad(cv::FileStorage& storage, const string& name, const Quad& quad)
+{
+	storage << cv::String(name) << vector<double>{quad.X1(), quad.Y1(), quad.X2(), quad.Y2(),
+	                                  quad.X3(), quad.Y3(), quad.X4(), quad.Y4()};
+}
+
+/// @brief Read a Quad from a checkpoint
+/// 
+/// @returns True if successful; otherwise, false.
+static bool readquad(const cv::FileNode& node, Quad& quad)
+{
+	vector<double> v;
+	
+	cv::read(node, v, vector<double>());
 	
-	vector<cv::KeyPoint> frame_keypoints;
-	Mat                  frame_descriptors;
+	if (v.size() != 8) {
+		return false;
+	}
 	
-	detector->detectAndCompute(frame, cv::noArray(), frame_keypoints, frame_descriptors);
+	quad = Quad(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
 	
-	wxTheApp->Yield(true);
+	return true;
+}
+
+void SyncLoop::identify(const vector<cv::KeyPoint>& frame_keypoints, const Mat& frame_descriptors,
+                        unsigned int& slide, Mat& homography)
+{
+	vector<unsigned int> candidates = deck_index.Rank(frame_descriptors, retrieval_candidates);
 	
-	vector<cv::DMatch> matches   = match(ref_frame_descriptors, frame_descriptors);
-	vector<cv::DMatch> filtered;
+	if (candidates.empty()) {
+		for (unsigned int i = 0; i < slides->size(); i++) {
+			candidates.push_back(i);
+		}
+	}
 	
-	wxTheApp->Yield(true);
+	// there is no pose to compare with, so the candidates are only ranked by their RANSAC inliers
+	vector<Mat>    homographies(candidates.size());
+	vector<size_t> inliers     (candidates.size(), 0);
 	
-	Mat homography = refineHomography(ref_frame_keypoints, frame_keypoints, matches, filtered);
-	slidepose      = quadperspective(ref_slidepose, homography);
+	verifiers->ParallelFor(candidates.size(), [&](unsigned int i) {
+		vector<cv::DMatch> matches = matchslide(candidates[i], frame_descriptors);
+		vector<cv::DMatch> filtered;
+		
+		homographies[i] = refineHomography(slide_features.Points(candidates[i]), frame_keypoints, matches, filtered);
+		inliers[i]      = (homographies[i].empty()) ? 0 : filtered.size();
+	});
 	
-	vector<cv::KeyPoint> quad_keypoints;
-	Mat                  quad_descriptors;
-	vector<cv::DMatch>   quad_matches;
+	homography = Mat();
 	
-	vector<int> quad_indices = quadfilter(frame_keypoints, frame_descriptors, slidepose,
-	                                      quad_keypoints, quad_descriptors);
+	size_t best = min_matchsize - 1;
 	
-	for (unsigned int i = 0; i < matches.size(); i++) {
-		int ref_index  = ref_quad_indices[matches[i].queryIdx];
-		int quad_index = quad_indices    [matches[i].trainIdx];
-		if (ref_index >= 0 && quad_index >= 0) {
-			quad_matches.push_back(cv::DMatch(ref_index, quad_index, matches[i].distance));
+	for (unsigned int i = 0; i < candidates.size(); i++) {
+		if (inliers[i] > best) {
+			best       = inliers[i];
+			slide      = candidates[i];
+			homography = homographies[i];
 		}
 	}
+}
+
+uint64_t SyncLoop::feature_key() const
+{
+	uint32_t size[3] = {(uint32_t) slides->size(), (uint32_t) (*slides)[0].cols, (uint32_t) (*slides)[0].rows};
 	
-	drawquad(display, ref_slidepose, cv::Scalar(20, 40, 255, 255));
+	uint64_t key = hash_bytes(&deckhash, sizeof (deckhash));
+	key          = hash_bytes(size, sizeof (size), key);
+	key          = hash_string(backend->Key(), key);
 	
-	wxTheApp->Yield(true);
+	return key;
+}
+
+uint64_t SyncLoop::feature_config() const
+{
+	uint32_t size[2] = {(uint32_t) (*slides)[0].cols, (uint32_t) (*slides)[0].rows};
 	
-	unsigned int new_slide_index = slide_index;
+	return hash_string(backend->Key(), hash_bytes(size, sizeof (size)));
+}
+
+void SyncLoop::prepare_slides()
+{
+	if (slides->size() > 0 && slide_features.Size() == slides->size()) {
+		return;
+	}
 	
-	if (homography.empty() ||
-	    !slidematch(ref_quad_keypoints, quad_keypoints,
-	                quad_matches, homography,
-	                ref_slidepose, slidepose)) {
-		// the match is weak, check if other slides work better
-		
-		hardframe = true;
-		
-		unsigned int         candidate_indices[7] = {slide_index, slide_index + 1, slide_index - 1,
-		                                             slide_index + 2, slide_index - 2,
-		                                             slide_index + 3, slide_index - 3};
-		vector<unsigned int> candidates;
-		
-		unsigned int         bestslide = slide_index;
-		Mat                  besthomography;
-		vector<cv::DMatch>   bestmatches;
-		Quad                 bestslidepose;
-		double               bestcost = std::numeric_limits<double>::infinity();
+	ScopedTimer timer(profiler, "prepare_slides");
+	
+	FeatureStore cached;
+	
+	if (!featurecachefname.empty() && cached.Load(featurecachefname, feature_key()) &&
+	    cached.Size() == slides->size()) {
+		slide_features = cached;
+		return;
+	}
+	
+	// a changed deck keeps the keypoints of the slides which didn't change; the fingerprints file holds the
+	// key of the cached keypoints, the keypoint configuration and the fingerprint of every cached slide
+	string                           pagesfname = featurecachefname + ".pages";
+	vector<uint64_t>                 index;
+	FeatureStore                     previous;
+	std::map<uint64_t, unsigned int> reusable;  // cached slide by fingerprint
+	
+	if (!featurecachefname.empty() && !pagehashes.empty() && read_hashes(pagesfname, index) && index.size() > 2 &&
+	    index[1] == feature_config() && previous.Load(featurecachefname, index[0]) &&
+	    previous.Size() + 2 == index.size()) {
+		for (unsigned int i = 0; i < previous.Size(); i++) {
+			reusable.insert({index[i + 2], i});
+		}
+	}
+	
+	vector<vector<cv::KeyPoint>> slide_keypoints;
+	vector<Mat>                  slide_descriptors;
+	unsigned int                 nreused = 0;
+	
+	for (unsigned int i = 0; i < slides->size(); i++) {
+		vector<cv::KeyPoint> keypoints;
+		Mat                  descriptors;
 		
-		double slidewidth  = (*slides)[bestslide].cols;
-		double slideheight = (*slides)[bestslide].rows;
+		auto cached_slide = (reusable.empty()) ? reusable.end() : reusable.find(pagehashes[i]);
 		
-		if (badcount < 7) {
-			for (unsigned int i = 0; i < 7; i++) {
-				if (candidate_indices[i] >= 0 && candidate_indices[i] < slides->size()) {
-					candidates.push_back(candidate_indices[i]);
-				}
+		if (cached_slide != reusable.end()) {
+			// only the positions are kept, which is all the tracker uses
+			PointSet points = previous.Points(cached_slide->second);
+			
+			for (size_t k = 0; k < points.Size(); k++) {
+				keypoints.push_back(cv::KeyPoint(points[k], 1));
 			}
+			
+			descriptors = previous.Descriptors(cached_slide->second);
+			nreused    += 1;
 		}
 		else {
-			for (unsigned int i = 0; i < slides->size(); i++) {
-				candidates.push_back(i);
+			backend->Detect((*slides)[i], keypoints, descriptors);
+		}
+		
+		slide_keypoints  .push_back(keypoints);
+		slide_descriptors.push_back(descriptors);
+		
+		yield();
+	}
+	
+	if (nreused > 0) {
+		std::cout << "Slides changed, reusing the keypoints of " << nreused << " of " << slides->size()
+		          << " slides" << std::endl;
+	}
+	
+	// packing copies the reused keypoints, so the previous cache can be replaced
+	slide_features = FeatureStore(slide_keypoints, slide_descriptors);
+	
+	if (featurecachefname.empty()) {
+		return;
+	}
+	
+	if (!slide_features.Save(featurecachefname, feature_key())) {
+		std::cerr << "Can't write slide features cache" << std::endl;
+	}
+	
+	if (pagehashes.empty()) {
+		std::remove(pagesfname.c_str());
+	}
+	else {
+		index.assign({feature_key(), feature_config()});
+		index.insert(index.end(), pagehashes.begin(), pagehashes.end());
+		
+		if (!write_hashes(pagesfname, index)) {
+			std::cerr << "Can't write slide features fingerprints" << std::endl;
+		}
+	}
+}
+
+bool SyncLoop::save_checkpoint() const
+{
+	// written to memory first and then moved over the last checkpoint,
+	// so an interruption at any point leaves a valid checkpoint behind
+	cv::FileStorage storage(".yml", cv::FileStorage::WRITE | cv::FileStorage::MEMORY | cv::FileStorage::FORMAT_YAML);
+	
+	// 64-bit integers are not supported, so the key is kept as text
+	storage << "key"              << std::to_string(feature_key());
+	storage << "length"           << (int) length;
+	storage << "frame_index"      << (int) frame_index;
+	storage << "coarse_index"     << (int) coarse_index;
+	storage << "prev_frame_index" << (int) prev_frame_index;
+	storage << "frameskip"        << (int) frameskip;
+	storage << "slide_index"      << (int) slide_index;
+	storage << "nearcount"        << (int) nearcount;
+	storage << "badcount"         << (int) badcount;
+	storage << "steady"           << (int) steady;
+	storage << "prev_thumbnail"   << prev_thumbnail;
+	
+	cv::write(storage, "ref_frame_keypoints", ref_frame_keypoints);
+	storage << "ref_frame_descriptors" << ref_frame_descriptors;
+	
+	writequad(storage, "ref_slidepose",  ref_slidepose);
+	writequad(storage, "prev_slidepose", prev_slidepose);
+	
+	storage << "instructions" << sync_instructions.ToString();
+	
+	string        contents  = storage.releaseAndGetString();
+	string        tempfname = checkpointfname + ".tmp";
+	std::ofstream file(tempfname, std::ios::binary);
+	
+	file << contents;
+	file.close();
+	
+	if (!file) {
+		return false;
+	}
+	
+	// rename replaces the previous checkpoint atomically on POSIX; only where it can't replace
+	// files (Windows) is the old one removed first, which briefly leaves no checkpoint
+	if (std::rename(tempfname.c_str(), checkpointfname.c_str()) == 0) {
+		return true;
+	}
+	
+	std::remove(checkpointfname.c_str());
+	
+	return std::rename(tempfname.c_str(), checkpointfname.c_str()) == 0;
+}
+
+bool SyncLoop::load_checkpoint()
+{
+	cv::FileStorage storage;
+	
+	try {
+		if (!storage.open(checkpointfname, cv::FileStorage::READ)) {
+			return false;
+		}
+	}
+	catch (const cv::Exception& e) {
+		std::cerr << "Can't parse checkpoint file" << std::endl;
+		return false;
+	}
+	
+	string key = (cv::String) storage["key"];
+	
+	if (key != std::to_string(feature_key()) || (int) storage["length"] != (int) length) {
+		std::cerr << "Checkpoint is from a different job, starting over" << std::endl;
+		return false;
+	}
+	
+	vector<cv::KeyPoint> keypoints;
+	Mat                  descriptors;
+	Mat                  thumbnail;
+	Quad                 refpose;
+	Quad                 prevpose;
+	string               instructions_str = (cv::String) storage["instructions"];
+	
+	cv::read(storage["ref_frame_keypoints"],   keypoints);
+	cv::read(storage["ref_frame_descriptors"], descriptors);
+	cv::read(storage["prev_thumbnail"],        thumbnail);
+	
+	if (keypoints.empty() || (int) keypoints.size() != descriptors.rows ||
+	    !readquad(storage["ref_slidepose"], refpose) || !readquad(storage["prev_slidepose"], prevpose)) {
+		std::cerr << "Can't parse checkpoint file" << std::endl;
+		return false;
+	}
+	
+	SyncInstructions instructions(slides->size());
+	
+	try {
+		std::istringstream reader(instructions_str);
+		instructions = SyncInstructions(reader);
+	}
+	catch (const std::ios_base::failure& e) {
+		std::cerr << "Can't parse checkpoint file" << std::endl;
+		return false;
+	}
+	
+	unsigned int resume_index = (unsigned int) (int) storage["frame_index"] + 1;
+	
+	if (resume_index >= length || !footage->Seek(resume_index)) {
+		return false;
+	}
+	
+	frame_index           = (int) storage["frame_index"];
+	coarse_index          = (int) storage["coarse_index"];
+	prev_frame_index      = (int) storage["prev_frame_index"];
+	frameskip             = (int) storage["frameskip"];
+	slide_index           = (int) storage["slide_index"];
+	nearcount             = (int) storage["nearcount"];
+	badcount              = (int) storage["badcount"];
+	steady                = (int) storage["steady"] != 0;
+	prev_thumbnail        = thumbnail;
+	ref_frame             = Mat();  // only needed for debugging
+	ref_frame_keypoints   = keypoints;
+	ref_frame_descriptors = descriptors;
+	ref_slidepose         = refpose;
+	prev_slidepose        = prevpose;
+	sync_instructions     = instructions;
+	
+	quadfilter(ref_frame_keypoints, ref_frame_descriptors, ref_slidepose,
+	           ref_quad_keypoints, ref_quad_descriptors, ref_quad_indices);
+	
+	return true;
+}
+
+void SyncLoop::start_tracking()
+{
+	// from now on, the footage belongs to the pipeline
+	pipeline = std::unique_ptr<FeaturePipeline>(new FeaturePipeline(footage, length, frameskip,
+	                                                                observed(), create_backend,
+	                                                                gate_threshold, scale, nthreads, profiler));
+	pipeline->SetGateRegion(quadregion(tofootage(ref_slidepose)));
+	
+	last_checkpoint = std::chrono::steady_clock::now();
+	processor       = &SyncLoop::track;
+}
+
+bool SyncLoop::plan_patches(SyncInstructions& previous, const vector<uint64_t>& previous_hashes)
+{
+	unsigned int nslides = slides->size();
+	
+	if (previous_hashes.empty()) {
+		return false;
+	}
+	
+	// the k-th previous slide with some fingerprint is the k-th new slide with it, if there is one
+	
+	std::map<uint64_t, vector<unsigned int>> byhash;
+	
+	for (unsigned int i = nslides; i > 0; i--) {
+		byhash[pagehashes[i - 1]].push_back(i - 1);
+	}
+	
+	vector<int>  mapping(previous_hashes.size(), -1);
+	vector<bool> inserted(nslides, true);
+	
+	for (unsigned int i = 0; i < previous_hashes.size(); i++) {
+		auto same = byhash.find(previous_hashes[i]);
+		
+		if (same != byhash.end() && !same->second.empty()) {
+			mapping[i]           = same->second.back();
+			inserted[mapping[i]] = false;
+			
+			same->second.pop_back();
+		}
+	}
+	
+	// a changed slide may have been matched anywhere; an inserted one was missing from the deck, so
+	// the previous tracker probably stayed on the slide before it, unless it replaces a changed one
+	
+	vector<bool> changed(mapping.size());
+	
+	for (unsigned int i = 0; i < mapping.size(); i++) {
+		bool replacing = i + 1 < mapping.size() && mapping[i + 1] < 0;
+		
+		changed[i] = mapping[i] < 0 ||
+		             ((unsigned int) mapping[i] + 1 < nslides && inserted[mapping[i] + 1] && !replacing);
+	}
+	
+	// where each previous slide is now; a changed one probably still follows the slide before it
+	vector<unsigned int> moved(mapping.size());
+	
+	for (unsigned int i = 0; i < mapping.size(); i++) {
+		if (mapping[i] >= 0) {
+			moved[i] = mapping[i];
+		}
+		else {
+			moved[i] = (i > 0) ? std::min(moved[i - 1] + 1, nslides - 1) : 0;
+		}
+	}
+	
+	// follow the previous instructions to find which slide was shown when
+	
+	vector<unsigned int> starts(1, 0);
+	vector<unsigned int> shown(1, 0);
+	unsigned int         timestamp = 0;
+	unsigned int         end       = 0;
+	bool                 ended     = false;
+	
+	for (auto instruction = previous.cbegin(); instruction != previous.cend() && !ended; instruction++) {
+		unsigned int slide = shown.back();
+		
+		timestamp = (instruction->relative) ? timestamp + instruction->timestamp : instruction->timestamp;
+		
+		switch (instruction->code) {
+		case SyncInstructionCode::Next:
+			slide += 1;
+			break;
+			
+		case SyncInstructionCode::Previous:
+			slide -= 1;
+			break;
+			
+		case SyncInstructionCode::GoTo:
+			slide = instruction->data;
+			break;
+			
+		case SyncInstructionCode::End:
+			end   = timestamp;
+			ended = true;
+			continue;
+			
+		default:
+			continue;
+		}
+		
+		// a slide the fingerprints don't know means they don't describe this synchronization
+		if (slide >= mapping.size()) {
+			return false;
+		}
+		
+		if (timestamp <= starts.back()) {
+			shown.back() = slide;
+		}
+		else {
+			starts.push_back(timestamp);
+			shown .push_back(slide);
+		}
+	}
+	
+	if (!ended) {
+		return false;
+	}
+	
+	// consecutive slides which changed, or didn't, make up a patch
+	
+	unsigned int framerate = sync_instructions.Framerate();
+	unsigned int nclean    = 0;
+	
+	patches.clear();
+	
+	for (unsigned int k = 0; k < starts.size() && starts[k] < end; k++) {
+		unsigned int slide   = moved[shown[k]];
+		bool         retrack = changed[shown[k]];
+		
+		if (patches.empty() || patches.back().retrack != retrack) {
+			SyncInstructions instructions(nslides, framerate);
+			
+			// like a shard, the patch only establishes its slide before it takes over
+			if (slide != 0) {
+				instructions.GoTo(0, slide);
 			}
 			
-			// the first time, 7 bad frames are required. If there is still nothing good enough
-			// repeat this process every 4 bad frames
-			badcount -= 4;
+			patches.push_back(SyncPatch{starts[k], starts[k], retrack, instructions});
+			nclean += (retrack) ? 0 : 1;
+		}
+		else {
+			unsigned int last = moved[shown[k - 1]];
+			
+			if (slide == last + 1) {
+				patches.back().instructions.Next(starts[k]);
+			}
+			else if (slide + 1 == last) {
+				patches.back().instructions.Previous(starts[k]);
+			}
+			else if (slide != last) {
+				patches.back().instructions.GoTo(starts[k], slide);
+			}
 		}
 		
-		wxTheApp->Yield(true);
+		patches.back().end = (k + 1 < starts.size()) ? std::min(starts[k + 1], end) : end;
+	}
+	
+	for (SyncPatch& patch : patches) {
+		patch.instructions.End(patch.end);
+	}
+	
+	if (nclean == 0) {
+		patches.clear();
+		return false;
+	}
+	
+	return true;
+}
+
+bool SyncLoop::next_patch(unsigned int first)
+{
+	unsigned int overlap = (unsigned int) round(footage->Framerate() * patch_overlap);
+	
+	for (patch_index = first; patch_index < patches.size(); patch_index++) {
+		const SyncPatch& patch = patches[patch_index];
+		
+		if (!patch.retrack) {
+			continue;
+		}
 		
-		for (unsigned int i = 0; i < candidates.size(); i++) {
-			matches    = match           (slide_descriptors[candidates[i]], frame_descriptors);
+		// every patch is tracked from scratch, like a shard, and merged afterwards
+		start_index       = (patch.begin > overlap) ? patch.begin - overlap : 0;
+		length            = patch.end;
+		frameskip         = fine_frameskip;
+		nearcount         = 0;
+		badcount          = 0;
+		prev_thumbnail    = Mat();
+		sync_instructions = SyncInstructions(slides->size(), sync_instructions.Framerate());
+		
+		if (begin_range()) {
+			return true;
+		}
+		
+		std::cerr << "Can't track frames " << patch.begin << " to " << patch.end
+		          << " again, keeping their previous slides" << std::endl;
+	}
+	
+	vector<SyncInstructions> pieces;
+	
+	for (const SyncPatch& patch : patches) {
+		pieces.push_back(patch.instructions);
+	}
+	
+	sync_instructions = SyncInstructions::Merge(pieces);
+	
+	patches.clear();
+	
+	return false;
+}
+
+void SyncLoop::save_cache() const
+{
+	if (cachefname.empty()) {
+		return;
+	}
+	
+	sync_instructions.Save(cachefname);
+	
+	// the fingerprints of the slides it was tracked with tell a later run which of them changed
+	string pagesfname = cachefname + ".pages";
+	
+	if (pagehashes.empty()) {
+		std::remove(pagesfname.c_str());
+	}
+	else if (!write_hashes(pagesfname, pagehashes)) {
+		std::cerr << "Can't write instructions fingerprints" << std::endl;
+	}
+}
+
+void SyncLoop::initialize()
+{
+	// the slide keypoints are only needed to track, so a cached result skips them altogether
+	
+	// a live stream is never the same twice, so a cached result can't apply to it
+	bool cached = !footage->Live() && !cachefname.empty() && std::ifstream(cachefname).is_open();
+	
+	if (cached) {
+		try {
+			SyncInstructions previous = SyncInstructions::Load(cachefname);
+			vector<uint64_t> previous_hashes;
 			
-			wxTheApp->Yield(true);
+			// without fingerprints on both sides, the cache can't tell if the deck changed
+			if (pagehashes.empty() || !read_hashes(cachefname + ".pages", previous_hashes) ||
+			    previous_hashes == pagehashes) {
+				processor         = &SyncLoop::idle;
+				sync_instructions = previous;
+				
+				finish();
+				return;
+			}
 			
-			homography = refineHomography(slide_keypoints  [candidates[i]], frame_keypoints,
-			                              matches, filtered);
+			// a range is short enough to track again altogether
+			if (start_index == 0 && length == footage->Length() && plan_patches(previous, previous_hashes)) {
+				unsigned int nretrack = 0;
+				
+				for (const SyncPatch& patch : patches) {
+					nretrack += (patch.retrack) ? 1 : 0;
+				}
+				
+				std::cout << "Slides changed, tracking " << nretrack << " of " << patches.size()
+				          << " time ranges again" << std::endl;
+				
+				if (nretrack == 0) {
+					next_patch(0);
+					
+					processor = &SyncLoop::idle;
+					save_cache();
+					
+					finish();
+					return;
+				}
+			}
+			else {
+				std::cout << "Slides changed, synchronizing again" << std::endl;
+			}
+		}
+		catch (const std::ios_base::failure& e) {
+			std::cerr << "Can't parse instructions file" << std::endl;
+		}
+	}
+	
+	// preprocess slide keypoints
+	
+	prepare_slides();
+	
+	vector<Mat> resident;
+	
+	for (unsigned int i = 0; i < slide_features.Size(); i++) {
+		resident.push_back(slide_features.Descriptors(i));
+	}
+	
+	backend->SetResident(resident);
+	deck_index.Build(slide_features);
+	
+	// hard frames have at most 7 candidates, unless the whole deck has to be scanned
+	unsigned int ncores = (nthreads > 0) ? nthreads : std::thread::hardware_concurrency();
+	
+	verifiers.reset(new ThreadPool(std::min(ncores, 7u)));
+	
+	// matchings from every verifier share these threads, so the tracker stays within its budget
+	backend->SetThreads(ncores);
+	
+	yield();
+	
+	// only the changed ranges are tracked, one after the other
+	if (!patches.empty()) {
+		if (!next_patch(0)) {
+			processor = &SyncLoop::idle;
+			save_cache();
+			
+			finish();
+		}
+		
+		return;
+	}
+	
+	// an interrupted run picks the tracking up where it was left
+	if (!checkpointfname.empty() && !footage->Live() && load_checkpoint()) {
+		std::cout << "Resuming from frame " << (frame_index + 1) << std::endl;
+		
+		start_tracking();
+		return;
+	}
+	
+	if (!begin_range()) {
+		processor = &SyncLoop::idle;
+		
+		finish();
+		return;
+	}
+	
+	if (!livefname.empty()) {
+		bool binary = SyncInstructions::IsBinary(livefname);
+		
+		livefile.open(livefname, std::ios::binary);
+		
+		if (livefile.is_open()) {
+			livefile << ((binary) ? sync_instructions.BinaryHeader() : sync_instructions.LiveHeader()) << std::flush;
+		}
+		else {
+			std::cerr << "Can't open live output file " << livefname << std::endl;
+		}
+	}
+}
+
+bool SyncLoop::begin_range()
+{
+	// match the first frame to find the slides projection or screen in the footage
+	
+	Mat firstframe;
+	
+	// peek the first frame; live streams can't rewind, so they
+	// start tracking on the frame right after it instead
+	if ((start_index > 0 && !footage->Seek(start_index)) || !footage->Read(firstframe) ||
+	    (!footage->Live() && !footage->Seek(start_index))) {
+		std::cerr << "Can't read the first frame" << std::endl;
+		return false;
+	}
+	
+	FrameFeatures first;
+	
+	first.frame = firstframe;
+	FeaturePipeline::Extract(first, *backend, scale);
+	
+	firstframe = first.gray;
+	
+	vector<cv::KeyPoint>& frame_keypoints   = first.keypoints;
+	Mat&                  frame_descriptors = first.descriptors;
+	
+	yield();
+	
+	// a presentation starts on its first slide, but a range may start anywhere
+	unsigned int firstslide = 0;
+	Mat          homography;
+	
+	if (start_index == 0) {
+		vector<cv::DMatch> matches = match(slide_features.Descriptors(0), frame_descriptors);
+		vector<cv::DMatch> filtered;
+		
+		yield();
+		
+		homography = refineHomography(slide_features.Points(0), frame_keypoints, matches, filtered);
+	}
+	else {
+		identify(frame_keypoints, frame_descriptors, firstslide, homography);
+	}
+	
+	yield();
+	
+	if (homography.empty()) {
+		std::cerr << "Can't find a robust matching" << std::endl;
+		return false;
+	}
+	
+	// locate the presentation in the footage frame
+	
+	double slidewidth  = (*slides)[firstslide].cols;
+	double slideheight = (*slides)[firstslide].rows;
+	
+	Quad slidepose = quadperspective(Quad(         0,           0,
+	                                               0, slideheight,
+	                                      slidewidth, slideheight,
+	                                      slidewidth,           0), homography);
+	
+	refine(first.fullgray, firstslide, slidepose);
+	
+	//  DEBUG The next section is only for visual inspection purposes, it is not executed in production
+	// Mat display;
+	// 
+	// cv::drawMatches((*slides)[0], slide_keypoints[0], firstframe, frame_keypoints, filtered,
+	//                 display, cv::Scalar(255, 0, 0), cv::Scalar(0, 0, 255));
+	// 
+	// drawquad(display, slidepose, cv::Scalar(125, 255, 42), footage->Width(), 0);
+	// cv::imwrite("display_init.png", display);
+	// END DEBUG
+	
+	ref_frame             = firstframe;
+	ref_frame_keypoints   = frame_keypoints;
+	ref_frame_descriptors = frame_descriptors;
+	ref_slidepose         = slidepose;
+	prev_slidepose        = slidepose;
+	quadfilter(frame_keypoints, frame_descriptors, slidepose,
+	           ref_quad_keypoints, ref_quad_descriptors, ref_quad_indices);
+	
+	slide_index      = firstslide;
+	frame_index      = start_index;
+	prev_frame_index = start_index;
+	
+	if (start_index > 0) {
+		sync_instructions.GoTo(start_index, firstslide);
+	}
+	
+	steady = true;
+	
+	start_tracking();
+	
+	return true;
+}
+
+void SyncLoop::track()
+{
+	const double largedeviation   = 10;
+	const double largedeformation = 7;
+	const double largecost        = 1000;
+	const double reasonablecost   = 40;
+	
+	ScopedTimer   timer(profiler, "frame");
+	FrameFeatures features;
+	
+	{
+		// time spent here means the pipeline can't keep up with the tracking
+		ScopedTimer wait(profiler, "wait");
+		pipeline->Pop(features);
+	}
+	
+	framelog() << "Frame " << features.coarse_index << " (" << features.frame_index << " / "
+	                                                       << index2timestamp(features.frame_index, 24) << ")";
+	
+	coarse_index = features.coarse_index + 1;
+	frame_index  = features.frame_index;
+	
+	Mat  frame     = features.gray;
+	Quad slidepose = ref_slidepose;  // approximate the current Quad with the reference one, which should be
+	                                 // close, and therefore, have most of the slide keypoints inside; if it
+	                                 // turns out the real one is too far away from the reference one, the
+	                                 // reference will be updated to point to this one to reduce future errors
+	Mat  display;                // shares the frame, so the outlines are drawn by the observer instead
+	bool hardframe     = false;
+	bool make_keyframe = false;  // make this the reference frame
+	bool goodmatch     = true;   // the match is good enough to be a keyframe (it will become one if other
+	                             // conditions also apply such as slide change or a large camera movement)
+	
+	vector<QuadOutline> outlines;
+	
+	if (features.last) {
+		framelog() << "\n";
+		
+		// the marker is past the last frame read, which may be past the end of the range
+		sync_instructions.End(std::min(frame_index, length));
+		
+		pipeline.reset(nullptr);
+		
+		if (!patches.empty()) {
+			patches[patch_index].instructions = sync_instructions;
 			
-			wxTheApp->Yield(true);
+			if (next_patch(patch_index + 1)) {
+				return;
+			}
+		}
+		
+		processor = &SyncLoop::idle;
+		save_cache();
+		
+		if (!checkpointfname.empty()) {
+			std::remove(checkpointfname.c_str());
+		}
+		
+		finish();
+		return;
+	}
+	
+	// the display is only useful to the observer; skip it altogether when running unobserved
+	// (in which case the pipeline doesn't keep the original frames, unless they are unchanged)
+	// or when the observer wouldn't show this frame anyway
+	if (watched() && !features.frame.empty()) {
+		display = features.frame;
+	}
+	
+	if (features.unchanged) {
+		if (steady) {
+			// the slide looks the same as in the last processed frame, so its result still holds
+			outlinequad(outlines, display, tofootage(prev_slidepose), cv::Scalar(125, 255, 42, 255));
 			
-			slidepose = quadperspective(Quad(         0,           0,
-			                                          0, slideheight,
-			                                 slidewidth, slideheight,
-			                                 slidewidth,           0), homography);
+			if (!display.empty()) {
+				show(display, outlines);
+			}
 			
-			double cost = matchcost(slide_keypoints[candidates[i]], frame_keypoints,
-			                        filtered, homography, ref_slidepose, slidepose);
+			prev_frame_index = frame_index;
 			
-			if (cost < bestcost) {
-				bestslide      = candidates[i];
-				bestslidepose  = slidepose;
-				besthomography = homography;
-				bestmatches    = filtered;
-				bestcost       = cost;
+			framelog() << " -- Slide " << (slide_index + 1) << "    U\n";
+			profile_count(profiler, "unchanged_frames");
+			return;
+		}
+		
+		// the last result was not trustworthy, so this frame needs a fresh look anyway
+		FeaturePipeline::Extract(features, *backend, scale);
+		
+		frame = features.gray;
+	}
+	
+	// used wherever the working resolution is not enough: refinement and change location
+	Mat fullframe = (features.fullgray.empty()) ? frame : features.fullgray;
+	
+	vector<cv::KeyPoint>& frame_keypoints   = features.keypoints;
+	Mat&                  frame_descriptors = features.descriptors;
+	
+	vector<cv::DMatch> matches   = match(ref_frame_descriptors, frame_descriptors);
+	vector<cv::DMatch> filtered;
+	
+	yield();
+	
+	Mat homography = refineHomography(ref_frame_keypoints, frame_keypoints, matches, filtered);
+	slidepose      = quadperspective(ref_slidepose, homography);
+	
+	quadfilter(frame_keypoints, frame_descriptors, slidepose, quad_keypoints, quad_descriptors, quad_indices);
+	quad_matches.clear();
+	
+	for (unsigned int i = 0; i < matches.size(); i++) {
+		int ref_index  = ref_quad_indices[matches[i].queryIdx];
+		int quad_index = quad_indices    [matches[i].trainIdx];
+		if (ref_index >= 0 && quad_index >= 0) {
+			quad_matches.push_back(cv::DMatch(ref_index, quad_index, matches[i].distance));
+		}
+	}
+	
+	outlinequad(outlines, display, tofootage(ref_slidepose), cv::Scalar(20, 40, 255, 255));
+	
+	yield();
+	
+	unsigned int new_slide_index = slide_index;
+	
+	if (homography.empty() ||
+	    !slidematch(ref_quad_keypoints, quad_keypoints,
+	                quad_matches, homography,
+	                ref_slidepose, slidepose)) {
+		// the match is weak, check if other slides work better
+		
+		hardframe = true;
+		
+		unsigned int         candidate_indices[7] = {slide_index, slide_index + 1, slide_index - 1,
+		                                             slide_index + 2, slide_index - 2,
+		                                             slide_index + 3, slide_index - 3};
+		vector<unsigned int> candidates;
+		
+		unsigned int         bestslide = slide_index;
+		bool                 fullscan  = false;
+		
+		if (badcount < 7) {
+			for (unsigned int i = 0; i < 7; i++) {
+				if (candidate_indices[i] >= 0 && candidate_indices[i] < slides->size()) {
+					candidates.push_back(candidate_indices[i]);
+				}
+			}
+		}
+		else {
+			// only the most promising slides of the deck are worth a geometric verification
+			{
+				ScopedTimer retrieval(profiler, "retrieval");
+				candidates = deck_index.Rank(frame_descriptors, retrieval_candidates);
+			}
+			
+			
+			if (candidates.empty()) {
+				for (unsigned int i = 0; i < slides->size(); i++) {
+					candidates.push_back(i);
+				}
 			}
 			
-			wxTheApp->Yield(true);
+			// the first time, 7 bad frames are required. If there is still nothing good enough
+			// repeat this process every 4 bad frames
+			badcount -= 4;
+			fullscan  = true;
+			
+			profile_count(profiler, "full_scans");
 		}
 		
+		yield();
+		
+		SlideCandidate best;
+		
+		{
+			ScopedTimer verification(profiler, "verify");
+			best = verify(candidates, frame_keypoints, frame_descriptors, bestslide);
+		}
+		
+		Mat                besthomography = best.homography;
+		vector<cv::DMatch> bestmatches    = best.matches;
+		Quad               bestslidepose  = best.slidepose;
+		double             bestcost       = best.cost;
+		
+		yield();
+		
 		if (bestcost >= largecost) {
-			double cost_alt = matchcost(slide_keypoints[bestslide], frame_keypoints,
+			double cost_alt = matchcost(slide_features.Points(bestslide), frame_keypoints,
 			                            bestmatches, besthomography, prev_slidepose, bestslidepose);
 			
 			if (cost_alt < reasonablecost) {
@@ -666,27 +1722,37 @@ void SyncLoop::track()
 			badcount     += 1;
 		}
 		
+		// the working resolution is enough to tell the slides apart, but a new
+		// reference pose deserves the full detail of the footage
+		if (goodmatch && (bestslide != slide_index || fullscan)) {
+			refine(fullframe, bestslide, bestslidepose);
+		}
+		
 		new_slide_index = bestslide;
 		slidepose       = bestslidepose;
 		
 		if (goodmatch && bestslide != slide_index) {
 			make_keyframe = true;
 			
+			unsigned int change_index = locate_change(thumbnail(fullframe));
+			
+			profile_count(profiler, "slide_changes");
+			
 			if (bestslide == slide_index + 1) {
-				sync_instructions.Next(frame_index);
+				sync_instructions.Next(change_index);
 			}
 			else if (bestslide == slide_index - 1) {
-				sync_instructions.Previous(frame_index);
+				sync_instructions.Previous(change_index);
 			}
 			else {
-				sync_instructions.GoTo(frame_index, bestslide);
+				sync_instructions.GoTo(change_index, bestslide);
 			}
 		}
 		
 		// TODO make these HUDs interactive so the user can edit them if necessary
-		drawquad(display, bestslidepose, linecolor);
+		outlinequad(outlines, display, tofootage(bestslidepose), linecolor);
 		
-		wxTheApp->Yield(true);
+		yield();
 		
 		//DEBUG
 		//Mat display2;
@@ -700,7 +1766,7 @@ void SyncLoop::track()
 		badcount  = 0;
 		nearcount = 0;
 		
-		drawquad(display, slidepose, cv::Scalar(125, 255, 42, 255));
+		outlinequad(outlines, display, tofootage(slidepose), cv::Scalar(125, 255, 42, 255));
 		
 		//DEBUG
 		//Mat display2;
@@ -711,10 +1777,8 @@ void SyncLoop::track()
 		// END DEBUG
 	}
 	
-	if (IsRunning()) {
-		// if someone stopped the timer, it is probable the window has been destroyed in one of the Yield()
-		// calls above, so canvas is no longer valid and this would segfault; bail out
-		canvas->UpdateGL(display);
+	if (!display.empty()) {
+		show(display, outlines);
 	}
 	
 	double deformation;
@@ -724,27 +1788,60 @@ void SyncLoop::track()
 		make_keyframe = true;
 	}
 	
-	std::cout << " -- Slide " << (slide_index + 1);
+	framelog() << " -- Slide " << (slide_index + 1);
+	profile_count(profiler, "frames");
 	
 	if (make_keyframe) {
-		std::cout << "    KF";
+		framelog() << "    KF";
+		profile_count(profiler, "keyframes");
 		
 		slide_index           = new_slide_index;
 		ref_frame             = frame;
 		ref_frame_keypoints   = frame_keypoints;
 		ref_frame_descriptors = frame_descriptors;
 		ref_slidepose         = slidepose;
-		ref_quad_indices      = quadfilter(frame_keypoints, frame_descriptors, slidepose,
-		                                   ref_quad_keypoints, ref_quad_descriptors);
+		quadfilter(frame_keypoints, frame_descriptors, slidepose,
+		           ref_quad_keypoints, ref_quad_descriptors, ref_quad_indices);
+		
+		pipeline->SetGateRegion(quadregion(tofootage(ref_slidepose)));
+	}
+	
+	// unsettled results, e.g. while lost or confirming a new location, must be redone on every frame
+	// and sampled finely; once settled, only the change search needs the skipped frames
+	steady = goodmatch && badcount == 0 && nearcount == 0;
+	
+	// without a seekable probe, a slide change is only found at the frame stride, so the coarse
+	// stride would leave it up to a whole stride late
+	bool         probed        = probe != nullptr && !footage->Live();
+	unsigned int new_frameskip = (steady && probed) ? coarse_frameskip : fine_frameskip;
+	
+	if (new_frameskip != frameskip) {
+		frameskip = new_frameskip;
+		pipeline->SetFrameskip(frameskip);
 	}
 	
+	prev_frame_index = frame_index;
+	prev_thumbnail   = thumbnail(fullframe);
+	
 	if (hardframe) {
-		std::cout << "    H";
+		framelog() << "    H";
+		profile_count(profiler, "hard_frames");
 	}
 	
 	prev_slidepose = slidepose;
 	
-	std::cout << std::endl;
+	framelog() << "\n";
+	
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - last_checkpoint;
+	
+	// patches are quick to track again, and a checkpoint could only hold one of them
+	if (!checkpointfname.empty() && !footage->Live() && patches.empty() && elapsed.count() >= checkpoint_period) {
+		if (!save_checkpoint()) {
+			std::cerr << "Can't write checkpoint file" << std::endl;
+		}
+		
+		last_checkpoint = std::chrono::steady_clock::now();
+	}
 }
 
 void SyncLoop::idle() {}
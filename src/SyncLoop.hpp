@@ -20,11 +20,24 @@
 #ifndef SYNCLOOP_HPP
 #define SYNCLOOP_HPP 1
 
+#include <memory>
+#include <fstream>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
 #include <opencv2/opencv.hpp>
 
 #include "ProcessLoop.hpp"
-#include "CVCanvas.hpp"
+#include "FeaturePipeline.hpp"
+#include "FeatureBackend.hpp"
+#include "FeatureCache.hpp"
+#include "FrameSource.hpp"
 #include "Quad.hpp"
+#include "SlideIndex.hpp"
+#include "Profiler.hpp"
+#include "ThreadPool.hpp"
 #include "SyncInstructions.hpp"
 
 using std::string;
@@ -38,6 +51,42 @@ class SyncLoop;
 /// @brief Internal synchronization processor function pointer
 typedef void (SyncLoop::*SyncProcessorFn)();
 
+/// @brief Receiver of every synchronization instruction as soon as it is found
+typedef std::function<void(const SyncInstruction&)> InstructionListener;
+
+/// @brief Result of matching a frame against a candidate slide
+struct SlideCandidate
+{
+	/// @brief Slide pose in the frame
+	Quad slidepose;
+	
+	/// @brief Homography from the slide to the frame; empty if none was found
+	Mat homography;
+	
+	/// @brief Matching keypoints, after RANSAC
+	std::vector<cv::DMatch> matches;
+	
+	/// @brief Matching cost; infinite if the candidate was not evaluated
+	double cost;
+};
+
+/// @brief Time range of a previous synchronization, when a changed deck only requires tracking part of it again
+struct SyncPatch
+{
+	/// @brief Index of the first frame of the range
+	unsigned int begin;
+	
+	/// @brief Index past the last frame of the range
+	unsigned int end;
+	
+	/// @brief Whether the range shows a changed slide, so it must be tracked again
+	bool retrack;
+	
+	/// @brief Instructions for the range; remapped to the new deck from the previous
+	///        synchronization, or the result of tracking it again
+	SyncInstructions instructions;
+};
+
 /// @brief Generate a synchronization file from a footage file and a slides file. Core loop
 /// 
 /// Match the slides in the slides file to the frames in the footage file and discover
@@ -47,11 +96,17 @@ typedef void (SyncLoop::*SyncProcessorFn)();
 class SyncLoop : public ProcessLoop
 {
 private:
-	/// @brief Number of frames to skip between keyframes
+	/// @brief Number of frames to skip between processed frames while the tracking is not settled
 	///
 	/// Presentation are very static so processing them at 30 fps would be incredibly wasteful.
 	/// Hence, the video is subsampled, i.e. the effective framecount is framecount / (frameskip + 1).
-	static const unsigned int frameskip = 7;
+	static const unsigned int fine_frameskip = 7;
+	
+	/// @brief Time between processed frames while the slide is steady, in seconds
+	/// 
+	/// Slide changes found at this coarse rate are then pinned to the exact frame
+	/// with a binary search through the skipped interval.
+	static constexpr double coarse_interval = 2.0;
 	
 	/// @brief Maximum ratio between best match and second match's distance to consider
 	///        a keypoint pair a good match
@@ -60,44 +115,149 @@ private:
 	/// @brief RANSAC threshold to decide a point is within the inlier group
 	static constexpr float RANSAC_threshold = 2.5;
 	
+	/// @brief Largest change, in gray levels, of any cell of a slide thumbnail for a frame to
+	///        be considered unchanged and reuse the previous result
+	static constexpr float gate_threshold = 10;
+	
+	/// @brief Number of slides verified geometrically when the tracker is lost and
+	///        the whole deck has to be searched
+	static const unsigned int retrieval_candidates = 5;
+	
+	/// @brief Cost below which a candidate slide is clearly right, so the
+	///        candidates after it are not worth evaluating
+	static constexpr double clear_cost = 20;
+	
+	/// @brief Minimum number of seconds between checkpoints
+	static constexpr double checkpoint_period = 60;
+	
+	/// @brief Seconds of footage tracked before every range tracked again, so it has settled by then
+	static constexpr double patch_overlap = 30;
+	
 	/// @brief Name of the cache file for the synchronization instructions
 	string cachefname;
 	
-	/// @brief OpenGL canvas observer reference
-	CVCanvas* canvas;
+	/// @brief Name of the cache file for the slide keypoints; empty to disable it
+	string featurecachefname;
+	
+	/// @brief Hash identifying the source of the slides, e.g. the contents of the PDF file
+	uint64_t deckhash;
+	
+	/// @brief Fingerprint of every slide; empty if unknown
+	std::vector<uint64_t> pagehashes;
+	
+	/// @brief Time ranges of the cached synchronization, when the deck changed and only some of
+	///        them are tracked again; empty while tracking the whole range
+	std::vector<SyncPatch> patches;
+	
+	/// @brief Index of the patch being tracked again
+	unsigned int patch_index;
+	
+	/// @brief Name of the live instructions log; empty to disable it
+	string livefname;
+	
+	/// @brief Live instructions log, appended to as instructions are found
+	std::ofstream livefile;
+	
+	/// @brief Receiver of every new instruction; empty for none
+	InstructionListener listener;
+	
+	/// @brief Number of instructions already written to the live log or given to the listener
+	unsigned int logged;
+	
+	/// @brief Name of the tracker state checkpoint file; empty to disable checkpoints
+	string checkpointfname;
+	
+	/// @brief Time of the last checkpoint, or of the start of the tracking
+	std::chrono::steady_clock::time_point last_checkpoint;
+	
+	/// @brief Profiler observer reference; null to disable profiling
+	Profiler* profiler;
+	
+	/// @brief Whether to print a line for every processed frame
+	bool verbose;
+	
+	/// @brief Number of threads for keypoint extraction and verification; zero for one per core
+	unsigned int nthreads;
+	
+	/// @brief Stream without a buffer, which fails every write before formatting anything
+	std::ostream discard;
 	
 	/// @brief Video input observer reference
-	cv::VideoCapture* footage;
+	FrameSource* footage;
 	
-	/// @brief Frame index for the next Notify() call
+	/// @brief Seekable video input observer reference, from the same file as the footage; null if
+	///        unavailable
+	/// 
+	/// Used to locate slide changes between processed frames, since the
+	/// footage itself is streamed by the pipeline.
+	FrameSource* probe;
+	
+	/// @brief Frame index of the frame being processed
 	unsigned int frame_index;
 	
-	/// @brief Coarse frame index for the next Notify() call
+	/// @brief Coarse frame index for the next Step() call
 	/// 
 	/// The canvas will skip frames; this index represents the effective
 	/// frame as seen by the user, but not the real one in the video file.
 	unsigned int coarse_index;
 	
-	/// @brief Footage length
+	/// @brief Frame index where the synchronization starts
+	unsigned int start_index;
+	
+	/// @brief Footage length, or end of the synchronized range
 	unsigned int length;
 	
-	/// @brief Slides image array observer reference
+	/// @brief Number of frames to skip between processed frames while the slide is steady
+	unsigned int coarse_frameskip;
+	
+	/// @brief Number of frames currently skipped between processed frames
+	unsigned int frameskip;
+	
+	/// @brief Frame index of the previously processed frame
+	unsigned int prev_frame_index;
+	
+	/// @brief Thumbnail of the slide region in the previously processed frame
+	Mat prev_thumbnail;
+	
+	/// @brief Slides image array observer reference, at the working resolution
 	std::vector<Mat>* slides;
 	
+	/// @brief Slides image array observer reference, at the footage resolution; null to disable refinement
+	std::vector<Mat>* fullslides;
+	
+	/// @brief Ratio between the working resolution, where frames are tracked, and the footage resolution
+	/// 
+	/// Every Quad is kept in working resolution coordinates and only scaled for display.
+	double scale;
+	
 	/// @brief Slide index
 	unsigned int slide_index;
 	
-	/// @brief Keypoint detector
-	cv::Ptr<cv::Feature2D> detector;
+	/// @brief Feature backend constructor, also used by the pipeline workers
+	BackendFactory create_backend;
+	
+	/// @brief Keypoint detector and matcher
+	std::unique_ptr<FeatureBackend> backend;
+	
+	/// @brief Background decoding and keypoint extraction of the upcoming frames
+	/// 
+	/// Started once the first frame has been matched; null before that and after the end of the footage.
+	std::unique_ptr<FeaturePipeline> pipeline;
+	
+	/// @brief Precomputed keypoints and descriptors for each slide, packed
+	FeatureStore slide_features;
+	
+	/// @brief Index over the slide descriptors, to shortlist slides when the tracker is lost
+	SlideIndex deck_index;
 	
-	/// @brief Keypoint matcher
-	cv::Ptr<cv::DescriptorMatcher> matcher;
+	/// @brief Workers evaluating the candidate slides of hard frames
+	std::unique_ptr<ThreadPool> verifiers;
 	
-	/// @brief Precomputed keypoints for each slide
-	std::vector<std::vector<cv::KeyPoint>> slide_keypoints;
+	/// @brief Keypoints for each slide at the footage resolution, computed when first needed
+	std::vector<std::vector<cv::KeyPoint>> fullslide_keypoints;
 	
-	/// @brief Precomputed keypoint descriptors for each slide
-	std::vector<Mat> slide_descriptors;
+	/// @brief Keypoint descriptors for each slide at the footage resolution, computed when first needed
+	std::vector<Mat> fullslide_descriptors;
 	
 	/// @brief Reference frame (for differential processing)
 	Mat ref_frame;
@@ -120,6 +280,21 @@ private:
 	/// A value of -1 indicates the particular keypoint is not inside the presentation Quad.
 	std::vector<int> ref_quad_indices;
 	
+	/// @brief Keypoints of the current frame inside its approximate slide pose
+	/// 
+	/// This and the following quad_* members only live for a single frame; they're
+	/// kept around to reuse their storage.
+	std::vector<cv::KeyPoint> quad_keypoints;
+	
+	/// @brief Corresponding keypoint descriptors of the current frame inside its approximate slide pose
+	Mat quad_descriptors;
+	
+	/// @brief Index lookup table, indicating the index in quad_keypoints for every keypoint in the current frame
+	std::vector<int> quad_indices;
+	
+	/// @brief Matches between ref_quad_keypoints and quad_keypoints
+	std::vector<cv::DMatch> quad_matches;
+	
 	/// @brief Description of the slide pose in the reference frame
 	/// 
 	/// The quad's vertices can be outside the frame region, since the slides
@@ -139,6 +314,10 @@ private:
 	///        of being totally lost and requiring a full scan through the slides)
 	unsigned int badcount;
 	
+	/// @brief Whether the last processed frame was matched well enough for the following
+	///        unchanged frames to reuse its result without processing them
+	bool steady;
+	
 	/// @brief Synchronization instructions to match the slides with the footage
 	SyncInstructions sync_instructions;
 	
@@ -150,34 +329,151 @@ private:
 	/// (and function delegates are nicer than big switches).
 	SyncProcessorFn processor;
 	
-	/// @brief Flag indicating if the loop is currently processing a frame or not
-	bool processing;
-	
 public:
 	/// @brief Construct a SyncLoop
 	/// 
-	/// @param[in] canvas OpenGL canvas to draw user interactive interface.
+	/// The loop runs unobserved by default; attach a LoopObserver to visualize the tracking.
+	/// 
 	/// @param[in] footage Recording of the presentation.
 	/// @param[in] slides Array of slide images.
-	/// @param[in] cachefname Name of the SyncInstructions cache file.
-	SyncLoop(CVCanvas* canvas, cv::VideoCapture* footage, std::vector<Mat>* slides,
-	         const string& cachefname);
-	
-	/// @brief Set the internal canvas
-	void SetCanvas(CVCanvas* canvas);
+	/// @param[in] cachefname Name of the SyncInstructions cache file; empty for none.
+	SyncLoop(FrameSource* footage, std::vector<Mat>* slides, const string& cachefname);
 	
 	/// @brief Set the internal footage
-	void SetFootage(cv::VideoCapture* footage);
+	void SetFootage(FrameSource* footage);
+	
+	/// @brief Set the seekable footage used to locate slide changes precisely
+	/// 
+	/// Without it, slide changes are located at the first processed frame showing the new slide.
+	/// 
+	/// @param[in] probe Another source of the footage file, which must support seeking; null to disable.
+	void SetProbe(FrameSource* probe);
+	
+	/// @brief Track at a lower working resolution than the footage's
+	/// 
+	/// Routine tracking runs on downscaled frames against the given slides, while hard frames,
+	/// such as slide changes and full scans, are refined at the footage resolution.
+	/// Must be called before the first Step().
+	/// 
+	/// @param[in] scale Ratio between the working resolution and the footage resolution.
+	/// @param[in] fullslides Slide images at the footage resolution.
+	void SetWorkingResolution(double scale, std::vector<Mat>* fullslides);
+	
+	/// @brief Choose the keypoint detector, descriptor and matcher
+	/// 
+	/// The default is BRISK with brute force matching on the CPU. Must be called before the first Step().
+	/// 
+	/// @param[in] create_backend Feature backend constructor, see backend_factory().
+	void SetFeatureBackend(const BackendFactory& create_backend);
+	
+	/// @brief Enable the persistent slide keypoint cache
+	/// 
+	/// The cache is keyed on the slides source, their resolution and the keypoint detector
+	/// configuration, so it is recomputed whenever any of them changes.
+	/// 
+	/// @param[in] filename Name of the cache file.
+	/// @param[in] deckhash Hash identifying the source of the slides, e.g. the contents of the PDF file.
+	void SetFeatureCache(const string& filename, uint64_t deckhash);
+	
+	/// @brief Tell the caches which slides changed since they were written
+	/// 
+	/// With fingerprints, the feature cache keeps the keypoints of the slides which didn't change,
+	/// and a cached synchronization of a changed deck only tracks again the time ranges which showed
+	/// a changed slide, or the slide before an inserted one, remapping the rest of its instructions to
+	/// the new slide order. Without them, any change to the deck invalidates the feature cache,
+	/// while the instructions cache is trusted as is. Must be called before the first Step().
+	/// 
+	/// @param[in] pagehashes Fingerprint of every slide, e.g. the hash of its pixels, so equal
+	///                       slides have equal fingerprints; ignored unless there is one per slide.
+	void SetPageHashes(const std::vector<uint64_t>& pagehashes);
+	
+	/// @brief Use slide keypoints and descriptors prepared by another loop
+	/// 
+	/// They must come from the same slides, feature backend and working resolution, e.g. from
+	/// GetSlideFeatures() on a loop tracking another recording of the same deck. The store is
+	/// shared, not copied. Must be called before the first Step().
+	/// 
+	/// @param[in] features Keypoints and descriptors of every slide.
+	void SetSlideFeatures(const FeatureStore& features);
+	
+	/// @brief Get the slide keypoints and descriptors, computing them (or loading them from the
+	///        feature cache) if that hasn't happened yet
+	FeatureStore GetSlideFeatures();
+	
+	/// @brief Limit the number of threads this loop starts
+	/// 
+	/// Useful when many loops run at once. Must be called before the first Step().
+	/// 
+	/// @param[in] nthreads Number of threads for keypoint extraction and verification; zero for one
+	///                     per core.
+	void SetThreads(unsigned int nthreads);
+	
+	/// @brief Enable the live instructions log
+	/// 
+	/// Every instruction is appended and flushed to the log as soon as it is found, so other programs
+	/// can follow the synchronization while it runs, e.g. on a live camera stream. The log can be
+	/// read as a regular instructions file at any time. Live footage never reuses the instructions
+	/// cache. Must be called before the first Step().
+	/// 
+	/// @param[in] filename Name of the log file.
+	void SetLiveOutput(const string& filename);
+	
+	/// @brief Give every instruction to a function as soon as it is found
+	/// 
+	/// The listener is called from the thread running the loop, right after the Step() which found
+	/// the instruction. Must be called before the first Step().
+	/// 
+	/// @param[in] listener Instruction receiver.
+	void SetListener(const InstructionListener& listener);
+	
+	/// @brief Synchronize a time range of the footage only
+	/// 
+	/// Unless the range starts at the first frame, the slide on screen is searched for in the whole
+	/// deck and the instructions start with a GoTo to it, instead of assuming the first slide. The
+	/// instructions of consecutive ranges can be joined with SyncInstructions::Merge(). Ignored for
+	/// live footage. Must be called before the first Step().
+	/// 
+	/// @param[in] start Index of the first frame.
+	/// @param[in] end Index past the last frame.
+	void SetRange(unsigned int start, unsigned int end);
+	
+	/// @brief Enable periodic checkpoints of the tracker state
+	/// 
+	/// While tracking, the state is saved at most every checkpoint_period seconds. If the
+	/// file holds a checkpoint for the same footage, slides and keypoint backend when the
+	/// loop starts, tracking resumes from it instead of the first frame. The file is
+	/// removed once the footage is done. Ignored for live footage. Must be called before
+	/// the first Step().
+	/// 
+	/// @param[in] filename Name of the checkpoint file.
+	void SetCheckpoint(const string& filename);
+	
+	/// @brief Measure the processing stages and count the notable frames
+	/// 
+	/// Must be called before the first Step().
+	/// 
+	/// @param[in] profiler Profiler observer reference; null to disable profiling.
+	void SetProfiler(Profiler* profiler);
+	
+	/// @brief Print a line for every processed frame, or only the important messages
+	/// 
+	/// Off by default, since printing every frame is measurable on long runs.
+	/// 
+	/// @param[in] verbose Whether to print every frame.
+	void SetVerbose(bool verbose);
 	
-	/// @brief Recurrent action. Updates the canvas
-	virtual void Notify();
+	/// @brief Process the next frame
+	virtual void Step() override;
 	
 	/// @brief Get the internal synchronization instructions
 	SyncInstructions GetSyncInstructions();
 	
 private:
-	/// @brief Get the next frame on the footage
-	Mat next_frame();
+	/// @brief Append the new instructions to the live log, if enabled
+	void log_instructions();
+	
+	/// @brief Get the stream for the per-frame messages, which discards them unless verbose
+	std::ostream& framelog();
 	
 	/// @brief Compute a matching between two images given their keypoints
 	/// 
@@ -186,6 +482,15 @@ private:
 	/// @returns Matching keypoints
 	std::vector<cv::DMatch> match(const Mat& descriptors1, const Mat& descriptors2);
 	
+	/// @brief Compute a matching between a slide and an image given their keypoints
+	/// 
+	/// Same as match(), but the slide descriptors are already resident in the backend.
+	/// 
+	/// @param[in] slide Slide index.
+	/// @param[in] descriptors Corresponding descriptors in the image.
+	/// @returns Matching keypoints
+	std::vector<cv::DMatch> matchslide(unsigned int slide, const Mat& descriptors);
+	
 	/// @brief Refine a matching using RANSAC and get an appropriate homography matrix
 	/// 
 	/// @param[in] keypoints1 Matching keypoints in the first image.
@@ -193,9 +498,111 @@ private:
 	/// @param[in] matches Original matching keypoints.
 	/// @param[out] inliers Filtered matching keypoints, after RANSAC.
 	/// @returns Homography matrix.
-	Mat refineHomography(const std::vector<cv::KeyPoint>& keypoints1, const std::vector<cv::KeyPoint>& keypoints2,
+	Mat refineHomography(const PointSet& keypoints1, const PointSet& keypoints2,
 	                     const std::vector<cv::DMatch>& matches, std::vector<cv::DMatch>& inliers);
 	
+	/// @brief Match a frame against several candidate slides in parallel and keep the best
+	/// 
+	/// Candidates are given in order of preference. As soon as one of them is clearly right, the
+	/// ones after it are skipped, and the result only considers those up to it, so it doesn't
+	/// depend on thread timing.
+	/// 
+	/// @param[in] candidates Candidate slide indices.
+	/// @param[in] frame_keypoints Keypoints of the frame.
+	/// @param[in] frame_descriptors Corresponding keypoint descriptors of the frame.
+	/// @param[out] bestslide Index of the best candidate slide; unchanged if none could be evaluated.
+	/// @returns Best candidate.
+	SlideCandidate verify(const std::vector<unsigned int>& candidates,
+	                      const std::vector<cv::KeyPoint>& frame_keypoints, const Mat& frame_descriptors,
+	                      unsigned int& bestslide);
+	
+	/// @brief Convert a Quad from working resolution coordinates to footage coordinates
+	Quad tofootage(const Quad& quad) const;
+	
+	/// @brief Recompute a slide pose at the footage resolution
+	/// 
+	/// @param[in] fullframe Grayscale frame at the footage resolution.
+	/// @param[in] slide Slide index.
+	/// @param[inout] slidepose Slide pose in working resolution coordinates. Only
+	///                         updated if the refinement succeeds.
+	/// @returns True if successful; otherwise, false.
+	bool refine(const Mat& fullframe, unsigned int slide, Quad& slidepose);
+	
+	/// @brief Get a small grayscale summary of the slide region of a frame
+	/// 
+	/// @param[in] image Frame at the footage resolution, in color or grayscale.
+	/// @returns Thumbnail.
+	Mat thumbnail(const Mat& image) const;
+	
+	/// @brief Find the first frame showing the new slide after a slide change
+	/// 
+	/// Binary search over the frames skipped between the previous and the current processed
+	/// frames, classifying each probed frame by its likeness to either of them.
+	/// 
+	/// @param[in] current Thumbnail of the current frame, which shows the new slide.
+	/// @returns Frame index of the slide change.
+	unsigned int locate_change(const Mat& current);
+	
+	/// @brief Find the slide in a frame without any previous pose, e.g. at the start of a range
+	/// 
+	/// Only the slides shortlisted by the deck index are verified, or every one if the index is empty.
+	/// 
+	/// @param[in] frame_keypoints Keypoints of the frame.
+	/// @param[in] frame_descriptors Corresponding keypoint descriptors of the frame.
+	/// @param[out] slide Index of the slide with the most consistent matches.
+	/// @param[out] homography Homography from the slide to the frame; empty if no slide was found.
+	void identify(const std::vector<cv::KeyPoint>& frame_keypoints, const Mat& frame_descriptors,
+	              unsigned int& slide, Mat& homography);
+	
+	/// @brief Get the identifier of the slide keypoints that the cache must match
+	uint64_t feature_key() const;
+	
+	/// @brief Get the identifier of the keypoint configuration, i.e. feature_key() without the deck,
+	///        that the keypoints of a single slide must match to be reused
+	uint64_t feature_config() const;
+	
+	/// @brief Compute the slide keypoints and descriptors, or load them from the cache,
+	///        unless they are already available
+	void prepare_slides();
+	
+	/// @brief Save the tracker state to the checkpoint file
+	/// 
+	/// @returns True if successful; otherwise, false.
+	bool save_checkpoint() const;
+	
+	/// @brief Restore the tracker state from the checkpoint file
+	/// 
+	/// Leaves the state untouched unless the whole checkpoint is valid.
+	/// 
+	/// @returns True if successful; otherwise, false.
+	bool load_checkpoint();
+	
+	/// @brief Start the pipeline on the footage from its current position, with the current references
+	void start_tracking();
+	
+	/// @brief Match the first frame of the range and start tracking from it
+	/// 
+	/// @returns True if successful; false if the first frame can't be read or matched.
+	bool begin_range();
+	
+	/// @brief Split the cached synchronization of a changed deck into patches
+	/// 
+	/// @param[in] previous Cached synchronization.
+	/// @param[in] previous_hashes Fingerprint of every slide it was tracked with.
+	/// @returns True if some of it still applies; false if everything must be tracked again.
+	bool plan_patches(SyncInstructions& previous, const std::vector<uint64_t>& previous_hashes);
+	
+	/// @brief Start tracking the next patch which must be tracked again, if there is one
+	/// 
+	/// Once every patch is done, they are merged into the synchronization instructions.
+	/// 
+	/// @param[in] first Index of the first patch to consider.
+	/// @returns True if tracking goes on; false if there was nothing left to track.
+	bool next_patch(unsigned int first);
+	
+	/// @brief Write the synchronization instructions to the cache, if enabled
+	void save_cache() const;
+	
 	/// @brief First processing stage. Initializes the required internal resources
 	/// 
 	/// Pre-processes the slide images and matches them to the first frame.
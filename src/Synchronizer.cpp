@@ -0,0 +1,202 @@
+/// @file Synchronizer.cpp
+/// @brief Embeddable synchronization and video generation API
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+
+#include "Synchronizer.hpp"
+#include "FeatureBackend.hpp"
+#include "GenLoop.hpp"
+
+using std::string;
+using std::vector;
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Convert slides to grayscale and fit them inside a frame, as the tracker expects
+/// 
+/// @param[in] slides Slide images, grayscale or in 8-8-8-bit BGR format.
+/// @param[in] width Frame width.
+/// @param[in] height Frame height.
+/// @returns Tracking slides.
+static vector<Mat> trackingslides(const vector<Mat>& slides, unsigned int width, unsigned int height)
+{
+	if (slides.empty()) {
+		throw std::invalid_argument("There must be at least one slide");
+	}
+	
+	vector<Mat> gray(slides.size());
+	
+	for (unsigned int i = 0; i < slides.size(); i++) {
+		double scale = std::min(((double) width)  / slides[i].cols,
+		                        ((double) height) / slides[i].rows);
+		
+		cv::Size size((int) std::round(slides[i].cols * scale), (int) std::round(slides[i].rows * scale));
+		Mat      resized;
+		
+		cv::resize(slides[i], resized, size, 0, 0, cv::INTER_AREA);
+		
+		if (resized.channels() == 1) {
+			gray[i] = resized;
+		}
+		else {
+			cv::cvtColor(resized, gray[i], cv::COLOR_BGR2GRAY);
+		}
+	}
+	
+	return gray;
+}
+
+Synchronizer::Synchronizer(const vector<Mat>& slides, unsigned int width, unsigned int height, double framerate,
+                           const string& features)
+	: slides(trackingslides(slides, width, height)),
+	  footage(width, height, framerate),
+	  loop(&footage, &this->slides, ""),
+	  timestamps(),
+	  found(),
+	  last_timestamp(0),
+	  error(),
+	  lock(),
+	  worker()
+{
+	BackendFactory create_backend = backend_factory(features);
+	
+	if (!create_backend) {
+		throw std::invalid_argument("Unknown feature backend " + features);
+	}
+	
+	loop.SetFeatureBackend(create_backend);
+	loop.SetListener([this](const SyncInstruction& instruction) { receive(instruction); });
+	
+	worker = std::thread(&Synchronizer::run, this);
+}
+
+Synchronizer::~Synchronizer()
+{
+	footage.Close();
+	
+	if (worker.joinable()) {
+		worker.join();
+	}
+}
+
+vector<SyncEvent> Synchronizer::Feed(const Mat& frame, double pts)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		check();
+		timestamps.push_back(pts);
+	}
+	
+	footage.Push(frame);
+	
+	std::lock_guard<std::mutex> guard(lock);
+	vector<SyncEvent>           events;
+	
+	check();
+	events.swap(found);
+	
+	return events;
+}
+
+SyncInstructions Synchronizer::Finish()
+{
+	footage.Close();
+	
+	if (worker.joinable()) {
+		worker.join();
+	}
+	
+	std::lock_guard<std::mutex> guard(lock);
+	
+	check();
+	
+	return loop.GetSyncInstructions();
+}
+
+void Synchronizer::run()
+{
+	try {
+		loop.Run();
+	}
+	catch (...) {
+		std::lock_guard<std::mutex> guard(lock);
+		error = std::current_exception();
+	}
+	
+	// nobody reads the footage anymore, so feeding must not block
+	footage.Close();
+}
+
+void Synchronizer::receive(const SyncInstruction& instruction)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	SyncEvent                   event = {instruction, 0};
+	
+	if (instruction.relative) {
+		event.instruction.timestamp += last_timestamp;
+		event.instruction.relative   = false;
+	}
+	
+	last_timestamp = event.instruction.timestamp;
+	
+	unsigned int index = event.instruction.timestamp;
+	
+	// the end marker may be past the last frame
+	if (!timestamps.empty()) {
+		event.pts = timestamps[std::min<size_t>(index, timestamps.size() - 1)];
+	}
+	
+	found.push_back(event);
+}
+
+void Synchronizer::check()
+{
+	if (error) {
+		std::exception_ptr thrown = error;
+		
+		error = nullptr;
+		std::rethrow_exception(thrown);
+	}
+}
+
+void generate_video(const vector<Mat>& slides, const SyncInstructions& instructions, const string& filename,
+                    const libav::EncoderConfig& config, unsigned int nthreads)
+{
+	libav::initialize_ffmpeg();
+	
+	// the loop releases its slides as it goes, which only has to drop these shallow copies
+	vector<Mat> frames(slides);
+	GenLoop     loop(&frames, instructions, filename, config, nthreads);
+	
+	loop.Run();
+}
+
+}
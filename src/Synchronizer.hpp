@@ -0,0 +1,159 @@
+/// @file Synchronizer.hpp
+/// @brief Embeddable synchronization and video generation API header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SYNCHRONIZER_HPP
+#define SYNCHRONIZER_HPP 1
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <exception>
+
+#include <opencv2/opencv.hpp>
+
+#include "FrameSource.hpp"
+#include "SyncLoop.hpp"
+#include "SyncInstructions.hpp"
+#include "avhelpers.hpp"
+
+using std::string;
+using cv::Mat;
+
+namespace slidesync
+{
+
+/// @brief Synchronization instruction found by a Synchronizer
+struct SyncEvent
+{
+	/// @brief Instruction, with an absolute frame index as timestamp
+	SyncInstruction instruction;
+	
+	/// @brief Presentation time of the frame the instruction refers to, as given to Feed()
+	double pts;
+};
+
+/// @brief Slide synchronizer fed with in-memory frames
+/// 
+/// Tracks the slides on a frame sequence given by the caller, e.g. frames decoded by an ingestion
+/// service, with no user interface and no files involved. Every synchronizer owns its threads and
+/// shares no state with any other, so a process can run as many of them concurrently as it likes.
+/// 
+///     Synchronizer sync(slides, 1280, 720, 30);
+/// 
+///     while (decoder.read(frame)) {
+///         for (const SyncEvent& event : sync.Feed(frame, pts)) {
+///             ...
+///         }
+///     }
+/// 
+///     SyncInstructions instructions = sync.Finish();
+class Synchronizer
+{
+private:
+	/// @brief Grayscale slides, fit inside a frame
+	std::vector<Mat> slides;
+	
+	/// @brief Frames given by the caller
+	FeedSource footage;
+	
+	/// @brief Tracker
+	SyncLoop loop;
+	
+	/// @brief Presentation time of every frame fed so far
+	std::vector<double> timestamps;
+	
+	/// @brief Instructions found but not yet returned by Feed()
+	std::vector<SyncEvent> found;
+	
+	/// @brief Absolute timestamp of the last instruction found
+	unsigned int last_timestamp;
+	
+	/// @brief Error thrown by the tracker, if any
+	std::exception_ptr error;
+	
+	/// @brief Lock for timestamps, found, last_timestamp and error
+	std::mutex lock;
+	
+	/// @brief Thread running the tracker
+	std::thread worker;
+	
+public:
+	/// @brief Construct a Synchronizer and start waiting for frames
+	/// 
+	/// @param[in] slides Slide images, grayscale or in 8-8-8-bit BGR format.
+	/// @param[in] width Frame width.
+	/// @param[in] height Frame height.
+	/// @param[in] framerate Number of frames per second, for the instructions timestamps.
+	/// @param[in] features Name of the keypoint detection and matching backend, see backend_factory().
+	/// @throws std::invalid_argument if there are no slides or the backend is unknown.
+	Synchronizer(const std::vector<Mat>& slides, unsigned int width, unsigned int height, double framerate,
+	             const string& features = "brisk");
+	
+	/// @brief Copy constructor. Deleted
+	Synchronizer(const Synchronizer& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	Synchronizer& operator=(const Synchronizer& that) = delete;
+	
+	/// @brief Stop tracking and destruct this Synchronizer
+	~Synchronizer();
+	
+	/// @brief Give the next frame to the tracker
+	/// 
+	/// Blocks while the tracker is a few frames behind. Tracking runs concurrently, so an
+	/// instruction is usually returned a few calls after the frame where it happens.
+	/// 
+	/// @param[in] frame Frame, in 8-8-8-bit BGR format; it must not be modified afterwards.
+	/// @param[in] pts Presentation time of the frame, in any unit the caller likes.
+	/// @returns Instructions found since the previous call, in order.
+	std::vector<SyncEvent> Feed(const Mat& frame, double pts);
+	
+	/// @brief Signal the end of the footage and wait for the tracker to finish
+	/// 
+	/// @returns Every instruction found, closed by an End instruction.
+	SyncInstructions Finish();
+	
+private:
+	/// @brief Tracker thread routine
+	void run();
+	
+	/// @brief Keep a new instruction until the next call to Feed()
+	void receive(const SyncInstruction& instruction);
+	
+	/// @brief Rethrow the tracker error, if any; the lock must be held
+	void check();
+};
+
+/// @brief Generate a video showing the slides following some instructions
+/// 
+/// Runs the whole generation in the calling thread (and the encoder threads it starts), with
+/// no user interface.
+/// 
+/// @param[in] slides Slide images, in 8-8-8-bit BGR format, with the size of the output video.
+/// @param[in] instructions Synchronization instructions.
+/// @param[in] filename Name of the output video file.
+/// @param[in] config Video encoder settings.
+/// @param[in] nthreads Number of segment encoders running concurrently; zero for one per core.
+void generate_video(const std::vector<Mat>& slides, const SyncInstructions& instructions, const string& filename,
+                    const libav::EncoderConfig& config = libav::EncoderConfig(), unsigned int nthreads = 0);
+
+}
+
+#endif
@@ -0,0 +1,112 @@
+/// @file ThreadPool.cpp
+/// @brief Fixed-size worker thread pool
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <algorithm>
+
+#include "ThreadPool.hpp"
+
+namespace slidesync
+{
+
+ThreadPool::ThreadPool(unsigned int nthreads)
+	: workers(), tasks(), stopped(false), lock(), changed()
+{
+	if (nthreads == 0) {
+		nthreads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	
+	for (unsigned int i = 0; i < nthreads; i++) {
+		workers.push_back(std::thread(&ThreadPool::work, this));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopped = true;
+	}
+	
+	changed.notify_all();
+	
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+unsigned int ThreadPool::Size() const
+{
+	return workers.size();
+}
+
+void ThreadPool::ParallelFor(unsigned int n, const std::function<void(unsigned int)>& body)
+{
+	std::atomic<unsigned int>      next(0);
+	std::vector<std::future<void>> results;
+	
+	unsigned int nchunks = std::min(n, Size());
+	
+	for (unsigned int i = 0; i < nchunks; i++) {
+		results.push_back(Submit([&next, &body, n] {
+			for (unsigned int k = next++; k < n; k = next++) {
+				body(k);
+			}
+		}));
+	}
+	
+	// wait for every chunk before rethrowing, since they all reference this stack frame
+	for (unsigned int i = 0; i < results.size(); i++) {
+		results[i].wait();
+	}
+	
+	for (unsigned int i = 0; i < results.size(); i++) {
+		results[i].get();
+	}
+}
+
+void ThreadPool::work()
+{
+	while (true) {
+		std::function<void()> task;
+		
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			changed.wait(guard, [this] { return stopped || !tasks.empty(); });
+			
+			// the queue is drained before stopping
+			if (tasks.empty()) {
+				return;
+			}
+			
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		
+		task();
+	}
+}
+
+}
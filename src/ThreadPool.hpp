@@ -0,0 +1,110 @@
+/// @file ThreadPool.hpp
+/// @brief Fixed-size worker thread pool header file
+// 
+// Part of SlideSync
+// 
+// Copyright 2017 Angelo Falchetti Pareja
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP 1
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+namespace slidesync
+{
+
+/// @brief Fixed-size pool of worker threads executing queued tasks
+class ThreadPool
+{
+private:
+	/// @brief Worker threads
+	std::vector<std::thread> workers;
+	
+	/// @brief Queued tasks
+	std::deque<std::function<void()>> tasks;
+	
+	/// @brief Whether the pool is being torn down
+	bool stopped;
+	
+	/// @brief Lock for tasks and stopped
+	std::mutex lock;
+	
+	/// @brief Signal for changes in tasks or stopped
+	std::condition_variable changed;
+	
+public:
+	/// @brief Construct a ThreadPool and start its workers
+	/// 
+	/// @param[in] nthreads Number of worker threads; zero to use one per core.
+	ThreadPool(unsigned int nthreads = 0);
+	
+	/// @brief Copy constructor. Deleted
+	ThreadPool(const ThreadPool& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	ThreadPool& operator=(const ThreadPool& that) = delete;
+	
+	/// @brief Finish every queued task and destruct this ThreadPool
+	~ThreadPool();
+	
+	/// @brief Get the number of worker threads
+	unsigned int Size() const;
+	
+	/// @brief Queue a task for execution
+	/// 
+	/// @param[in] task Callable object with no arguments.
+	/// @returns Future result of the task. Exceptions thrown by the task are rethrown by its get().
+	template <typename F>
+	std::future<typename std::result_of<F()>::type> Submit(F task)
+	{
+		typedef typename std::result_of<F()>::type R;
+		
+		std::shared_ptr<std::packaged_task<R()>> packaged(new std::packaged_task<R()>(std::move(task)));
+		std::future<R>                           result = packaged->get_future();
+		
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			tasks.push_back([packaged] { (*packaged)(); });
+		}
+		
+		changed.notify_one();
+		
+		return result;
+	}
+	
+	/// @brief Execute body(i) for every i in [0, n), distributed over the workers, and wait for them
+	/// 
+	/// If any call throws, the first exception is rethrown after every worker stops.
+	/// Must not be called from inside a task of this same pool.
+	/// 
+	/// @param[in] n Number of iterations.
+	/// @param[in] body Loop body. Must be safe to call concurrently.
+	void ParallelFor(unsigned int n, const std::function<void(unsigned int)>& body);
+	
+private:
+	/// @brief Worker thread routine
+	void work();
+};
+
+}
+
+#endif
@@ -19,11 +19,19 @@
 
 #include <memory>
 #include <string>
+#include <vector>
+#include <iostream>
+#include <initializer_list>
+#include <algorithm>
+#include <mutex>
+#include <new>
 #include <stdexcept>
 
 extern "C" {
 
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/dict.h>
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
@@ -38,13 +46,384 @@ using cv::Mat;
 namespace libav
 {
 
+// AudioPassthrough declarations
+
+/// @brief Non-public stream copy of the audio track of a file into an output being written
+/// 
+/// Packets are copied as the video they go with is written, so the muxer only has to
+/// interleave a short stretch of them at any time.
+class AudioPassthrough
+{
+private:
+	/// @brief Context for the source file; null once the audio is over or if there is none
+	AVFormatContext* input;
+	
+	/// @brief Context for the output file
+	AVFormatContext* output;
+	
+	/// @brief Audio stream in the source file
+	AVStream* istream;
+	
+	/// @brief Audio stream in the output file
+	AVStream* ostream;
+	
+	/// @brief Source timestamp of the first output frame, in the source audio time base
+	int64_t origin;
+	
+	/// @brief Packet read but not yet copied, since it starts after the video written so far
+	AVPacket packet;
+	
+	/// @brief Whether there is a packet waiting to be copied
+	bool pending;
+	
+public:
+	/// @brief Construct an AudioPassthrough, adding an audio stream to the output
+	/// 
+	/// Must be called before the output header is written.
+	/// 
+	/// @param[in] filename Name of the source file.
+	/// @param[inout] output Output file context.
+	AudioPassthrough(const string& filename, AVFormatContext* output);
+	
+	/// @brief Copy constructor. Deleted
+	AudioPassthrough(const AudioPassthrough& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	AudioPassthrough& operator=(const AudioPassthrough& that) = delete;
+	
+	/// @brief Destruct this AudioPassthrough, closing the source file
+	~AudioPassthrough();
+	
+	/// @brief Copy every audio packet starting before a point of the output timeline
+	/// 
+	/// @param[in] timestamp Output timestamp.
+	/// @param[in] time_base Time base of the timestamp.
+	void CopyUntil(int64_t timestamp, AVRational time_base);
+	
+private:
+	/// @brief Close the source file
+	void release();
+	
+	/// @brief Release every resource and throw an avexception
+	/// 
+	/// @param[in] message Explanatory message.
+	void fail(const string& message);
+};
+
 // Global functions
 
+/// @brief Lock callback for libav, which serializes codec opening and closing
+/// 
+/// @param[inout] mutex Lock handle.
+/// @param[in] op Operation to perform on the lock.
+/// @returns Zero on success; otherwise, nonzero.
+static int lockmanager(void** mutex, enum AVLockOp op)
+{
+	switch (op) {
+	case AV_LOCK_CREATE:
+		*mutex = new (std::nothrow) std::mutex();
+		return (*mutex == nullptr) ? 1 : 0;
+		
+	case AV_LOCK_OBTAIN:
+		static_cast<std::mutex*>(*mutex)->lock();
+		return 0;
+		
+	case AV_LOCK_RELEASE:
+		static_cast<std::mutex*>(*mutex)->unlock();
+		return 0;
+		
+	case AV_LOCK_DESTROY:
+		delete static_cast<std::mutex*>(*mutex);
+		*mutex = nullptr;
+		return 0;
+	}
+	
+	return 1;
+}
+
 void initialize_ffmpeg()
 {
-	av_register_all();
+	static std::once_flag initialized;
+	
+	std::call_once(initialized, [] {
+		av_register_all();
+		av_lockmgr_register(&lockmanager);
+	});
+}
+
+/// @brief Check if an encoder name refers to a hardware encoder
+/// 
+/// @param[in] name Encoder name.
+/// @returns True if it is a hardware encoder; otherwise, false.
+static bool hardware_codec(const string& name)
+{
+	return name.find("nvenc") != string::npos || name.find("qsv") != string::npos ||
+	       name.find("vaapi") != string::npos;
+}
+
+/// @brief Name of the private option setting the constant quality factor of an encoder
+/// 
+/// @param[in] name Encoder name.
+/// @returns Option name.
+static const char* quality_option(const string& name)
+{
+	if (name.find("nvenc") != string::npos) {
+		return "cq";
+	}
+	else if (name.find("qsv") != string::npos) {
+		return "global_quality";
+	}
+	
+	return "crf";
+}
+
+bool hardware_encoder(const EncoderConfig& config)
+{
+	return config.codec == "auto" || hardware_codec(config.codec);
+}
+
+bool video_framerate(const string& filename, FrameRate& framerate)
+{
+	AVFormatContext* context = nullptr;
+	
+	if (avformat_open_input(&context, filename.c_str(), nullptr, nullptr) < 0) {
+		return false;
+	}
+	
+	int  index = -1;
+	bool found = false;
+	
+	if (avformat_find_stream_info(context, nullptr) >= 0) {
+		index = av_find_best_stream(context, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+	}
+	
+	// same choice as VideoDecoder, so frame indices agree
+	if (index >= 0) {
+		AVStream* stream = context->streams[index];
+		
+		if (stream->avg_frame_rate.num > 0 && stream->avg_frame_rate.den > 0) {
+			framerate = FrameRate{stream->avg_frame_rate.num, stream->avg_frame_rate.den};
+			found     = true;
+		}
+		else if (stream->r_frame_rate.num > 0 && stream->r_frame_rate.den > 0) {
+			framerate = FrameRate{stream->r_frame_rate.num, stream->r_frame_rate.den};
+			found     = true;
+		}
+	}
+	
+	avformat_close_input(&context);
+	
+	return found;
+}
+
+void concatenate(const std::vector<string>& inputs, const std::vector<unsigned int>& lengths,
+                 const FrameRate& framerate, const string& output, const string& audio)
+{
+	if (inputs.size() == 0 || inputs.size() != lengths.size()) {
+		throw std::invalid_argument("there must be one length for every input");
+	}
+	
+	AVOutputFormat* format = av_guess_format(nullptr, output.c_str(), nullptr);
+	
+	if (format == nullptr) {
+		throw avexception("Can't find suitable output format");
+	}
+	
+	AVFormatContext* ocontext = avformat_alloc_context();
+	
+	if (ocontext == nullptr) {
+		throw avexception("Can't allocate format context");
+	}
+	
+	ocontext->oformat = format;
+	snprintf(ocontext->filename, sizeof (ocontext->filename), "%s", output.c_str());
+	
+	AVFormatContext*                  icontext = nullptr;
+	AVStream*                         ostream  = nullptr;
+	std::unique_ptr<AudioPassthrough> passthrough;
+	bool                              header   = false;
+	int64_t                           offset   = 0;
+	int64_t                           last_dts = AV_NOPTS_VALUE;
+	
+	// releases every resource; used both on success and on error
+	auto cleanup = [&] {
+		if (icontext != nullptr) {
+			avformat_close_input(&icontext);
+		}
+		
+		passthrough.reset(nullptr);
+		
+		if (header) {
+			av_write_trailer(ocontext);
+		}
+		
+		if (ocontext->pb != nullptr) {
+			avio_closep(&ocontext->pb);
+		}
+		
+		avformat_free_context(ocontext);
+	};
+	
+	try {
+		for (unsigned int i = 0; i < inputs.size(); i++) {
+			if (avformat_open_input(&icontext, inputs[i].c_str(), nullptr, nullptr) < 0) {
+				throw avexception(("Can't open video file '" + inputs[i] + "'").c_str());
+			}
+			
+			if (avformat_find_stream_info(icontext, nullptr) < 0) {
+				throw avexception(("Can't read streams in '" + inputs[i] + "'").c_str());
+			}
+			
+			int index = av_find_best_stream(icontext, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+			
+			if (index < 0) {
+				throw avexception(("No video stream in '" + inputs[i] + "'").c_str());
+			}
+			
+			AVStream* istream = icontext->streams[index];
+			
+			// the first input defines the stream parameters for the whole output
+			if (ostream == nullptr) {
+				ostream = avformat_new_stream(ocontext, nullptr);
+				
+				if (ostream == nullptr) {
+					throw avexception("Can't create video stream");
+				}
+				
+				if (avcodec_copy_context(ostream->codec, istream->codec) < 0) {
+					throw avexception("Can't copy codec parameters");
+				}
+				
+				ostream->codec->codec_tag = 0;
+				ostream->time_base        = istream->time_base;
+				ostream->avg_frame_rate   = AVRational{framerate.num, framerate.den};
+				ostream->r_frame_rate     = ostream->avg_frame_rate;
+				
+				if (format->flags & AVFMT_GLOBALHEADER) {
+					ostream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+				}
+				
+				if (!audio.empty()) {
+					passthrough.reset(new AudioPassthrough(audio, ocontext));
+				}
+				
+				if (avio_open(&ocontext->pb, output.c_str(), AVIO_FLAG_WRITE) < 0) {
+					throw avexception("Can't open file for video writing");
+				}
+				
+				if (avformat_write_header(ocontext, nullptr) < 0) {
+					throw avexception("Can't write video header");
+				}
+				
+				header = true;
+			}
+			
+			AVPacket packet;
+			
+			while (av_read_frame(icontext, &packet) >= 0) {
+				if (packet.stream_index == index) {
+					// move the packet to its place in the joint timeline
+					if (packet.pts != (int64_t) AV_NOPTS_VALUE) {
+						packet.pts = av_rescale_q(packet.pts, istream->time_base, ostream->time_base) + offset;
+					}
+					
+					if (packet.dts != (int64_t) AV_NOPTS_VALUE) {
+						packet.dts = av_rescale_q(packet.dts, istream->time_base, ostream->time_base) + offset;
+						
+						// encoder delay makes each input start with slightly negative timestamps,
+						// which may overlap the end of the previous one
+						if (last_dts != (int64_t) AV_NOPTS_VALUE && packet.dts <= last_dts) {
+							packet.dts = last_dts + 1;
+							
+							if (packet.pts != (int64_t) AV_NOPTS_VALUE && packet.pts < packet.dts) {
+								packet.pts = packet.dts;
+							}
+						}
+						
+						last_dts = packet.dts;
+					}
+					
+					if (packet.duration > 0) {
+						packet.duration = av_rescale_q(packet.duration, istream->time_base, ostream->time_base);
+					}
+					
+					packet.stream_index = ostream->index;
+					packet.pos          = -1;
+					
+					int64_t written = packet.dts;
+					
+					if (av_interleaved_write_frame(ocontext, &packet) < 0) {
+						av_free_packet(&packet);
+						throw avexception("Can't write video packet");
+					}
+					
+					// the audio keeps up with the video, so the muxer only buffers a little of it
+					if (passthrough != nullptr && written != (int64_t) AV_NOPTS_VALUE) {
+						passthrough->CopyUntil(written, ostream->time_base);
+					}
+				}
+				
+				av_free_packet(&packet);
+			}
+			
+			avformat_close_input(&icontext);
+			
+			offset += av_rescale_q(lengths[i], AVRational{framerate.den, framerate.num}, ostream->time_base);
+		}
+		
+		if (passthrough != nullptr) {
+			passthrough->CopyUntil(offset, ostream->time_base);
+		}
+	}
+	catch (...) {
+		cleanup();
+		throw;
+	}
+	
+	cleanup();
 }
 
+// EncoderImageInternal declarations
+
+/// @brief Non-public image buffer in a libav pixel format
+class EncoderImageInternal
+{
+public:
+	/// @brief Plane pointers
+	uint8_t* data[4];
+	
+	/// @brief Row size of every plane, in bytes
+	int linesize[4];
+	
+	/// @brief Pixel format
+	AVPixelFormat format;
+	
+	/// @brief Image width
+	unsigned int width;
+	
+	/// @brief Image height
+	unsigned int height;
+	
+	/// @brief Size of the buffer, in bytes
+	size_t size;
+	
+	/// @brief Allocate an EncoderImageInternal
+	/// 
+	/// @param[in] width Image width.
+	/// @param[in] height Image height.
+	/// @param[in] format Pixel format.
+	EncoderImageInternal(unsigned int width, unsigned int height, AVPixelFormat format);
+	
+	/// @brief Copy constructor. Deleted
+	EncoderImageInternal(const EncoderImageInternal& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	EncoderImageInternal& operator=(const EncoderImageInternal& that) = delete;
+	
+	/// @brief Destruct this EncoderImageInternal
+	~EncoderImageInternal();
+};
+
 // VideoEncoderInternal declarations
 
 /// @brief Non-public encoder which directly uses the FFMPEG library
@@ -63,9 +442,21 @@ private:
 	/// @brief Reference to the output frame image
 	AVFrame* frame;
 	
+	/// @brief Color converter from OpenCV's packed BGR to the frame's pixel format
+	SwsContext* converter;
+	
 	/// @brief Current frame index
 	unsigned frame_index;
 	
+	/// @brief Whether to hold each frame on screen instead of re-encoding it when repeated
+	bool holdframes;
+	
+	/// @brief Whether the current frame has changed since it was last encoded
+	bool dirty;
+	
+	/// @brief First frame index not yet covered by an encoded frame
+	unsigned next_pts;
+	
 	/// @brief Output video width
 	unsigned int width;
 	
@@ -75,15 +466,19 @@ private:
 	/// @brief Whether this encoder is ready to write frames
 	bool ready;
 	
+	/// @brief Audio track copied into the output; null for a video-only output
+	std::unique_ptr<AudioPassthrough> audio;
+	
 public:
 	/// @brief Construct a VideoEncoder pointing to the file with the given name
 	/// 
 	/// @param[in] filename Name of the file to save the video to.
 	/// @param[in] width Width of the output video.
 	/// @param[in] height Height of the output video.
-	/// @param[in] framerate Number of frames per second.
+	/// @param[in] framerate Number of frames per second, unless the settings give an exact one.
+	/// @param[in] config Encoder settings.
 	VideoEncoderInternal(const string& filename, unsigned int width, unsigned int height,
-	                     unsigned int framerate);
+	                     unsigned int framerate, const EncoderConfig& config);
 	
 	/// @brief Copy constructor. Deleted
 	VideoEncoderInternal(const VideoEncoderInternal& that) = delete;
@@ -100,17 +495,55 @@ public:
 	/// @brief Destruct this VideoEncoder
 	~VideoEncoderInternal();
 	
+	/// @brief Convert a BGR frame to the pixel format of the stream, without encoding it
+	/// 
+	/// @param[in] image Frame, in 8-8-8-bit BGR format.
+	/// @returns Converted frame.
+	std::shared_ptr<const EncoderImageInternal> convert(const Mat& image);
+	
+private:
+	/// @brief Check that a frame has the size of the video and 8-8-8-bit BGR format
+	/// 
+	/// @param[in] image Frame.
+	void check_image(const Mat& image) const;
+	
+	/// @brief Configure the stream's codec context and open the encoder
+	/// 
+	/// @param[in] codec Encoder.
+	/// @param[in] config Encoder settings.
+	/// @param[in] framerate Number of frames per second.
+	/// @returns True if successful; otherwise, false, and the codec context is left closed.
+	bool open_codec(AVCodec* codec, const EncoderConfig& config, AVRational framerate);
+	
+	/// @brief Encode a frame and write any packet the encoder produces
+	/// 
+	/// @param[in] frame Frame to encode, or null to drain the encoder's delayed frames.
+	/// @returns True if a packet was written; otherwise, false.
+	bool encode(AVFrame* frame);
+	
+	/// @brief Finish the stream, writing any pending or delayed frames
+	void flush();
+	
+public:
 	friend VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, const Mat& image);
+	friend VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, const EncoderImageInternal& image);
 	friend VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, unsigned int repeat);
 };
 
-/// @brief Encode a RGB frame to video file
+/// @brief Encode a BGR frame to video file
 /// 
 /// @param[inout] stream Video encoder stream.
 /// @param[in] image New frame to append to the encoder stream.
 /// @returns Reference to the stream.
 VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, const Mat& image);
 
+/// @brief Encode an already converted frame to video file
+/// 
+/// @param[inout] stream Video encoder stream.
+/// @param[in] image New frame to append to the encoder stream.
+/// @returns Reference to the stream.
+VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, const EncoderImageInternal& image);
+
 /// @brief Repeat the encoding of the last frame a number of times
 /// 
 /// @param[inout] stream Video encoder stream.
@@ -118,11 +551,227 @@ VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, const Mat& image)
 /// @returns Reference to the stream.
 VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, unsigned int repeat);
 
+// AudioPassthrough definitions
+
+AudioPassthrough::AudioPassthrough(const string& filename, AVFormatContext* output)
+	: input(nullptr),
+	  output(output),
+	  istream(nullptr),
+	  ostream(nullptr),
+	  origin(0),
+	  packet(),
+	  pending(false)
+{
+	if (avformat_open_input(&input, filename.c_str(), nullptr, nullptr) < 0) {
+		fail("Can't open audio source '" + filename + "'");
+	}
+	
+	if (avformat_find_stream_info(input, nullptr) < 0) {
+		fail("Can't read streams in '" + filename + "'");
+	}
+	
+	int index = av_find_best_stream(input, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+	
+	if (index < 0) {
+		std::cerr << "No audio track in '" << filename << "', the output will be silent" << std::endl;
+		release();
+		return;
+	}
+	
+	istream = input->streams[index];
+	
+	// frame indices count from the first video frame, and so must the audio
+	int video = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+	
+	if (video >= 0 && input->streams[video]->start_time != (int64_t) AV_NOPTS_VALUE) {
+		origin = av_rescale_q(input->streams[video]->start_time, input->streams[video]->time_base,
+		                      istream->time_base);
+	}
+	else if (istream->start_time != (int64_t) AV_NOPTS_VALUE) {
+		origin = istream->start_time;
+	}
+	
+	ostream = avformat_new_stream(output, nullptr);
+	
+	if (ostream == nullptr) {
+		fail("Can't create audio stream");
+	}
+	
+	if (avcodec_copy_context(ostream->codec, istream->codec) < 0) {
+		fail("Can't copy audio codec parameters");
+	}
+	
+	ostream->codec->codec_tag = 0;
+	ostream->time_base        = istream->time_base;
+	
+	if (output->oformat->flags & AVFMT_GLOBALHEADER) {
+		ostream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+	}
+}
+
+AudioPassthrough::~AudioPassthrough()
+{
+	release();
+}
+
+void AudioPassthrough::release()
+{
+	if (pending) {
+		av_free_packet(&packet);
+		pending = false;
+	}
+	
+	if (input != nullptr) {
+		avformat_close_input(&input);
+	}
+}
+
+void AudioPassthrough::fail(const string& message)
+{
+	release();
+	throw avexception(message.c_str());
+}
+
+void AudioPassthrough::CopyUntil(int64_t timestamp, AVRational time_base)
+{
+	if (input == nullptr) {
+		return;
+	}
+	
+	int64_t limit = av_rescale_q(timestamp, time_base, istream->time_base) + origin;
+	
+	while (true) {
+		if (!pending) {
+			if (av_read_frame(input, &packet) < 0) {
+				release();
+				return;
+			}
+			
+			if (packet.stream_index != istream->index) {
+				av_free_packet(&packet);
+				continue;
+			}
+			
+			pending = true;
+		}
+		
+		int64_t start = (packet.pts != (int64_t) AV_NOPTS_VALUE) ? packet.pts : packet.dts;
+		
+		// kept until the video reaches it
+		if (start != (int64_t) AV_NOPTS_VALUE && start >= limit) {
+			return;
+		}
+		
+		pending = false;
+		
+		// the audio before the first video frame is dropped
+		if (start == (int64_t) AV_NOPTS_VALUE || start < origin) {
+			av_free_packet(&packet);
+			continue;
+		}
+		
+		if (packet.pts != (int64_t) AV_NOPTS_VALUE) {
+			packet.pts = av_rescale_q(packet.pts - origin, istream->time_base, ostream->time_base);
+		}
+		
+		if (packet.dts != (int64_t) AV_NOPTS_VALUE) {
+			packet.dts = av_rescale_q(packet.dts - origin, istream->time_base, ostream->time_base);
+		}
+		
+		if (packet.duration > 0) {
+			packet.duration = av_rescale_q(packet.duration, istream->time_base, ostream->time_base);
+		}
+		
+		packet.stream_index = ostream->index;
+		packet.pos          = -1;
+		
+		if (av_interleaved_write_frame(output, &packet) < 0) {
+			av_free_packet(&packet);
+			throw avexception("Can't write audio packet");
+		}
+		
+		av_free_packet(&packet);
+	}
+}
+
+// EncoderImageInternal definitions
+
+EncoderImageInternal::EncoderImageInternal(unsigned int width, unsigned int height, AVPixelFormat format)
+	: data(),
+	  linesize(),
+	  format(format),
+	  width(width),
+	  height(height),
+	  size(0)
+{
+	int allocated = av_image_alloc(data, linesize, width, height, format, 32);
+	
+	if (allocated < 0) {
+		throw avexception("Can't allocate image");
+	}
+	
+	size = allocated;
+}
+
+EncoderImageInternal::~EncoderImageInternal()
+{
+	av_freep(&data[0]);
+}
+
+// EncoderImage definitions
+
+EncoderImage::EncoderImage()
+	: image(nullptr) {}
+
+bool EncoderImage::Empty() const
+{
+	return image == nullptr;
+}
+
+size_t EncoderImage::Size() const
+{
+	return (image != nullptr) ? image->size : 0;
+}
+
+// EncoderConfig definitions
+
+EncoderConfig::EncoderConfig()
+	: codec(),
+	  device(),
+	  bitrate(2 * 1024 * 1024),
+	  quality(-1),
+	  gop(0),
+	  pixfmt(),
+	  holdframes(false),
+	  averagechroma(true),
+	  framerate{0, 1},
+	  audio() {}
+
 // VideoEncoder definitions
 
+/// @brief Build an encoder configuration with the default settings but for the given flags
+/// 
+/// @param[in] holdframes Encode repeated frames once and hold them on screen.
+/// @param[in] averagechroma Average the chroma over each subsampled block.
+/// @returns Encoder configuration.
+static EncoderConfig default_config(bool holdframes, bool averagechroma)
+{
+	EncoderConfig config;
+	
+	config.holdframes    = holdframes;
+	config.averagechroma = averagechroma;
+	
+	return config;
+}
+
+VideoEncoder::VideoEncoder(const string& filename, unsigned int width, unsigned int height,
+                           unsigned int framerate, bool holdframes, bool averagechroma)
+	: encoder(new VideoEncoderInternal(filename, width, height, framerate,
+	                                   default_config(holdframes, averagechroma))) {}
+
 VideoEncoder::VideoEncoder(const string& filename, unsigned int width, unsigned int height,
-                           unsigned int framerate)
-	: encoder(new VideoEncoderInternal(filename, width, height, framerate)) {}
+                           unsigned int framerate, const EncoderConfig& config)
+	: encoder(new VideoEncoderInternal(filename, width, height, framerate, config)) {}
 
 VideoEncoder::~VideoEncoder() = default;
 
@@ -138,6 +787,26 @@ VideoEncoder& operator<<(VideoEncoder& stream, const Mat& image)
 	return stream;
 }
 
+EncoderImage VideoEncoder::Convert(const Mat& image)
+{
+	EncoderImage converted;
+	
+	converted.image = encoder->convert(image);
+	
+	return converted;
+}
+
+VideoEncoder& operator<<(VideoEncoder& stream, const EncoderImage& image)
+{
+	if (image.Empty()) {
+		throw std::invalid_argument("the frame must not be empty");
+	}
+	
+	(*stream.encoder) << *image.image;
+	
+	return stream;
+}
+
 VideoEncoder& operator<<(VideoEncoder& stream, unsigned int repeat)
 {
 	(*stream.encoder) << repeat;
@@ -148,15 +817,20 @@ VideoEncoder& operator<<(VideoEncoder& stream, unsigned int repeat)
 // VideoEncoderInternal definitions
 
 VideoEncoderInternal::VideoEncoderInternal(const string& filename, unsigned int width, unsigned int height,
-                                           unsigned int framerate)
+                                           unsigned int framerate, const EncoderConfig& config)
 	: format(nullptr),
 	  context(nullptr),
 	  stream(nullptr),
 	  frame(nullptr),
+	  converter(nullptr),
 	  frame_index(0),
+	  holdframes(config.holdframes),
+	  dirty(false),
+	  next_pts(0),
 	  width(width),
 	  height(height),
-	  ready(false)
+	  ready(false),
+	  audio(nullptr)
 {
 	format = av_guess_format(nullptr, filename.c_str(), nullptr);
 	
@@ -179,49 +853,62 @@ VideoEncoderInternal::VideoEncoderInternal(const string& filename, unsigned int
 	
 	// defining codec settings
 	
-	AVCodec* codec = avcodec_find_encoder(format->video_codec);
-	
-	if (codec == nullptr) {
-		throw avexception("Can't find suitable codec for encoding");
-	}
-	
-	stream = avformat_new_stream(context, codec);
+	stream = avformat_new_stream(context, nullptr);
 	
 	if (stream == nullptr) {
 		throw avexception("Can't create video stream");
 	}
 	
-	AVCodecContext* cctx = stream->codec;
-	stream->id           = 0;
+	stream->id = 0;
 	
-	cctx->bit_rate = 2 * 1024 * 1024;
-	cctx->width    = width;
-	cctx->height   = height;
-	cctx->gop_size = 18;
-	cctx->pix_fmt  = PIX_FMT_YUV420P;
-	
-	// FFMPEG bug: when encoding MP4/H.264, it does not respect this framerate;
-	// it only uses the denominator, so 23.976 fps becomes 23976 fps
-	// 
-	// So, for the time being, output at 24 fps, which will not be correctly aligned,
-	// but which can be quickly fixed manually using ffmpeg itself (the program, not
-	// the library) or another video editor
-	if (false) {
-	//if (framerate == 24 || framerate == 30) {
-		cctx->time_base = AVRational{1001, 1000 * (int) framerate};
+	// the requested encoder goes first, the hardware ones if it is "auto", and the
+	// container's default software encoder is always the last resort
+	std::vector<AVCodec*> candidates;
+	
+	if (config.codec == "auto") {
+		if (format->video_codec == CODEC_ID_H264) {
+			for (const char* name : {"h264_nvenc", "nvenc_h264", "nvenc", "h264_qsv"}) {
+				candidates.push_back(avcodec_find_encoder_by_name(name));
+			}
+		}
 	}
-	else {
-		cctx->time_base = AVRational{1, (int) framerate};
+	else if (!config.codec.empty()) {
+		AVCodec* requested = avcodec_find_encoder_by_name(config.codec.c_str());
+		
+		if (requested == nullptr) {
+			std::cerr << "Can't find encoder '" << config.codec << "', using the default one" << std::endl;
+		}
+		
+		candidates.push_back(requested);
 	}
 	
-	if (format->flags & AVFMT_GLOBALHEADER) {
-		cctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+	candidates.push_back(avcodec_find_encoder(format->video_codec));
+	
+	AVRational rate = (config.framerate.num > 0 && config.framerate.den > 0) ?
+	                  AVRational{config.framerate.num, config.framerate.den} : AVRational{(int) framerate, 1};
+	AVCodec*   codec = nullptr;
+	
+	for (AVCodec* candidate : candidates) {
+		if (candidate == nullptr) {
+			continue;
+		}
+		
+		if (open_codec(candidate, config, rate)) {
+			codec = candidate;
+			break;
+		}
+		
+		if (!config.codec.empty() && config.codec != "auto") {
+			std::cerr << "Can't open encoder '" << candidate->name << "', using the default one" << std::endl;
+		}
 	}
 	
-	if (avcodec_open2(cctx, codec, nullptr) < 0) {
-		throw avexception("Can't open codec");
+	if (codec == nullptr) {
+		throw avexception("Can't find suitable codec for encoding");
 	}
 	
+	AVCodecContext* cctx = stream->codec;
+	
 	// opening the video file for writing
 	
 	frame = avcodec_alloc_frame();
@@ -236,6 +923,22 @@ VideoEncoderInternal::VideoEncoderInternal(const string& filename, unsigned int
 	
 	av_image_alloc(frame->data, frame->linesize, frame->width, frame->height, cctx->pix_fmt, 32);
 	
+	// swscale also outputs the limited (video) range the codec expects, unlike OpenCV's YCrCb.
+	// Area filtering averages the chroma of each 2x2 block; point sampling with full horizontal
+	// input keeps the plain decimation
+	int swsflags = (config.averagechroma) ? (SWS_AREA | SWS_ACCURATE_RND) : (SWS_POINT | SWS_FULL_CHR_H_INP);
+	
+	converter = sws_getContext(width, height, PIX_FMT_BGR24, width, height, cctx->pix_fmt,
+	                           swsflags, nullptr, nullptr, nullptr);
+	
+	if (converter == nullptr) {
+		throw avexception("Can't create color converter");
+	}
+	
+	if (!config.audio.empty()) {
+		audio.reset(new AudioPassthrough(config.audio, context));
+	}
+	
 	if (avio_open(&context->pb, filename.c_str(), AVIO_FLAG_WRITE) < 0) {
 		throw avexception("Can't open file for video writing");
 	}
@@ -248,14 +951,33 @@ VideoEncoderInternal::~VideoEncoderInternal()
 {
 	if (context != nullptr) {
 		if (ready) {
+			try {
+				flush();
+				
+				// the audio goes on up to the end of the last frame
+				if (audio != nullptr) {
+					audio->CopyUntil(frame_index, stream->codec->time_base);
+				}
+			}
+			catch (const avexception& e) {
+				// destructors can't throw; the last frames are lost, but the file will still be closed properly
+			}
+			
 			av_write_trailer(context);
 			ready = false;
 		}
 		
+		audio.reset(nullptr);
+		
 		if (context->pb != nullptr) {
 			avio_closep(&context->pb);
 		}
 		
+		if (converter != nullptr) {
+			sws_freeContext(converter);
+			converter = nullptr;
+		}
+		
 		if (stream != nullptr) {
 			if (frame != nullptr) {
 				av_freep(&frame->data[0]);
@@ -270,68 +992,745 @@ VideoEncoderInternal::~VideoEncoderInternal()
 	
 }
 
-VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, const Mat& image)
+void VideoEncoderInternal::check_image(const Mat& image) const
 {
-	if ((unsigned int) image.cols != stream.width  ||
-	    (unsigned int) image.rows != stream.height ||
+	if ((unsigned int) image.cols != width  ||
+	    (unsigned int) image.rows != height ||
 	    image.type() != CV_8UC3) {
-		throw std::invalid_argument("the frame must be in 8-8-8-bit RGB format (CV_8UC3 in OpenCV)");
+		throw std::invalid_argument("the frame must be in 8-8-8-bit BGR format (CV_8UC3 in OpenCV)");
+	}
+}
+
+std::shared_ptr<const EncoderImageInternal> VideoEncoderInternal::convert(const Mat& image)
+{
+	check_image(image);
+	
+	std::shared_ptr<EncoderImageInternal> converted(new EncoderImageInternal(width, height,
+	                                                                         (AVPixelFormat) frame->format));
+	
+	const uint8_t* source[1] = {image.data};
+	int            stride[1] = {(int) image.step};
+	
+	sws_scale(converter, source, stride, 0, height, converted->data, converted->linesize);
+	
+	return converted;
+}
+
+VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, const Mat& image)
+{
+	stream.check_image(image);
+	
+	// converted straight into the frame planes, honoring the row padding of both sides
+	const uint8_t* source[1] = {image.data};
+	int            stride[1] = {(int) image.step};
+	
+	sws_scale(stream.converter, source, stride, 0, stream.height, stream.frame->data, stream.frame->linesize);
+	
+	stream.dirty = true;
+	
+	return stream;
+}
+
+VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, const EncoderImageInternal& image)
+{
+	if (image.width != stream.width || image.height != stream.height || image.format != stream.frame->format) {
+		throw std::invalid_argument("the frame must be converted for an encoder with the same settings");
 	}
 	
-	Mat yuv;
-	cvtColor(image, yuv, CV_RGB2YCrCb);
+	// a plain copy of the planes, since the encoder writes its own timestamps into the frame
+	av_image_copy(stream.frame->data, stream.frame->linesize, const_cast<const uint8_t**>(image.data),
+	              image.linesize, image.format, image.width, image.height);
+	
+	stream.dirty = true;
+	
+	return stream;
+}
+
+VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, unsigned int repeat)
+{
+	if (repeat == 0) {
+		return stream;
+	}
 	
-	for (unsigned int k = 0; k < stream.height; k++) {
-		cv::Vec3b* row = yuv.ptr<cv::Vec3b>(k);
+	if (stream.holdframes) {
+		// encode the frame once, as a keyframe, and let its timestamp hold it on screen
+		// until the next frame is encoded
+		if (stream.dirty) {
+			stream.frame->pict_type = AV_PICTURE_TYPE_I;
+			stream.frame->pts       = stream.frame_index;
+			
+			stream.encode(stream.frame);
+			
+			stream.dirty    = false;
+			stream.next_pts = stream.frame_index + 1;
+		}
+		
+		stream.frame_index += repeat;
+		
+		return stream;
+	}
+	
+	stream.frame->pict_type = AV_PICTURE_TYPE_NONE;
+	
+	for (unsigned int i = 0; i < repeat; i++) {
+		stream.frame->pts = stream.frame_index;
+		stream.encode(stream.frame);
 		
-		for (unsigned int i = 0; i < stream.width; i++) {
-			stream.frame->data[0][k * stream.frame->linesize[0] + i] = row[i][0];
+		stream.frame_index += 1;
+	}
+	
+	stream.dirty    = false;
+	stream.next_pts = stream.frame_index;
+	
+	return stream;
+}
+
+bool VideoEncoderInternal::open_codec(AVCodec* codec, const EncoderConfig& config, AVRational framerate)
+{
+	AVCodecContext* cctx = stream->codec;
+	
+	// a failed attempt leaves the context in an unknown state
+	avcodec_get_context_defaults3(cctx, codec);
+	
+	cctx->bit_rate = config.bitrate;
+	cctx->width    = width;
+	cctx->height   = height;
+	cctx->gop_size = 18;
+	
+	// held frames carry their own timestamps, so the output has a variable frame rate and
+	// every slide change is forced into a keyframe; there is no need for periodic ones
+	if (holdframes) {
+		cctx->gop_size = 1 << 16;
+	}
+	
+	if (config.gop > 0) {
+		cctx->gop_size = config.gop;
+	}
+	
+	// keep the requested pixel format if the encoder supports it, or fall back to its preferred one
+	AVPixelFormat pixfmt = (config.pixfmt.empty()) ? PIX_FMT_YUV420P : av_get_pix_fmt(config.pixfmt.c_str());
+	
+	if (codec->pix_fmts != nullptr) {
+		const AVPixelFormat* supported = codec->pix_fmts;
+		
+		while (*supported != PIX_FMT_NONE && *supported != pixfmt) {
+			supported++;
+		}
+		
+		if (*supported == PIX_FMT_NONE) {
+			pixfmt = codec->pix_fmts[0];
 		}
 	}
 	
-	for (unsigned int k = 0, k2 = 0; k2 < stream.height; k++, k2 += 2) {
-		cv::Vec3b* row = yuv.ptr<cv::Vec3b>(k2);
+	if (pixfmt == PIX_FMT_NONE) {
+		pixfmt = PIX_FMT_YUV420P;
+	}
+	
+	cctx->pix_fmt = pixfmt;
+	
+	// frame indices are the encoder timestamps. The muxer is free to pick its own stream time base
+	// (MP4 does, from the denominator), which is why every packet is rescaled to it in encode();
+	// the stream frame rate tells the container the exact rate, e.g. 24000/1001 instead of 24
+	cctx->time_base        = av_inv_q(framerate);
+	stream->time_base      = cctx->time_base;
+	stream->avg_frame_rate = framerate;
+	stream->r_frame_rate   = framerate;
+	
+	if (format->flags & AVFMT_GLOBALHEADER) {
+		cctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+	}
+	
+	AVDictionary* options = nullptr;
+	
+	if (config.quality >= 0) {
+		cctx->bit_rate = 0;
+		av_dict_set(&options, quality_option(codec->name), std::to_string(config.quality).c_str(), 0);
+	}
+	
+	// older libavcodec versions only expose device selection for NVENC; the others use
+	// the default device (VAAPI would need hardware frames, which are not supported here)
+	if (!config.device.empty() && string(codec->name).find("nvenc") != string::npos) {
+		av_dict_set(&options, "gpu", config.device.c_str(), 0);
+	}
+	
+	int open_ret = avcodec_open2(cctx, codec, &options);
+	
+	// the encoder removes every option it recognized
+	AVDictionaryEntry* ignored = nullptr;
+	
+	while (open_ret >= 0 && (ignored = av_dict_get(options, "", ignored, AV_DICT_IGNORE_SUFFIX)) != nullptr) {
+		std::cerr << "Encoder '" << codec->name << "' ignores option '" << ignored->key << "'" << std::endl;
+	}
+	
+	av_dict_free(&options);
+	
+	if (open_ret < 0) {
+		avcodec_close(cctx);
+		return false;
+	}
+	
+	return true;
+}
+
+bool VideoEncoderInternal::encode(AVFrame* frame)
+{
+	AVCodecContext* cctx = stream->codec;
+	AVPacket        packet;
+	
+	av_init_packet(&packet);
+	packet.data = nullptr;
+	packet.size = 0;
+	
+	int gotpacket;
+	int encode_ret = avcodec_encode_video2(cctx, &packet, frame, &gotpacket);
+	
+	if (encode_ret < 0) {
+		throw avexception(("Can't write video frame (" + std::to_string(-encode_ret) + ")").c_str());
+	}
+	
+	if (!gotpacket) {
+		return false;
+	}
+	
+	// the encoder works in its own time base, which the muxer is free to change
+	packet.stream_index = stream->index;
+	
+	if (packet.pts != (int64_t) AV_NOPTS_VALUE) {
+		packet.pts = av_rescale_q(packet.pts, cctx->time_base, stream->time_base);
+	}
+	
+	if (packet.dts != (int64_t) AV_NOPTS_VALUE) {
+		packet.dts = av_rescale_q(packet.dts, cctx->time_base, stream->time_base);
+	}
+	
+	if (packet.duration > 0) {
+		packet.duration = av_rescale_q(packet.duration, cctx->time_base, stream->time_base);
+	}
+	
+	int64_t written = packet.dts;
+	
+	av_interleaved_write_frame(context, &packet);
+	av_free_packet(&packet);
+	
+	// the audio keeps up with the video, so the muxer only buffers a little of it
+	if (audio != nullptr && written != (int64_t) AV_NOPTS_VALUE) {
+		audio->CopyUntil(written, stream->time_base);
+	}
+	
+	return true;
+}
+
+void VideoEncoderInternal::flush()
+{
+	// a held frame must be shown until the end of the stream, which is marked by encoding it
+	// once more right at the last frame index (mostly skip blocks, so it is cheap).
+	// A frame which was never repeated has no duration and is dropped
+	if (holdframes && frame_index > next_pts) {
+		frame->pict_type = (dirty) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+		frame->pts       = frame_index - 1;
+		
+		encode(frame);
+		
+		dirty    = false;
+		next_pts = frame_index;
+	}
+	
+	if (stream->codec->codec->capabilities & CODEC_CAP_DELAY) {
+		while (encode(nullptr)) {}
+	}
+}
+
+// VideoDecoderInternal declarations
+
+/// @brief Non-public decoder which directly uses the FFMPEG library
+class VideoDecoderInternal
+{
+private:
+	/// @brief Context for the video file
+	AVFormatContext* context;
+	
+	/// @brief Internal libav video stream
+	AVStream* stream;
+	
+	/// @brief Index of the video stream in the file
+	int stream_index;
+	
+	/// @brief Last decoded frame
+	AVFrame* frame;
+	
+	/// @brief Whether the last decoded frame has not been returned yet
+	bool buffered;
+	
+	/// @brief Index of the last decoded frame
+	unsigned int frame_index;
+	
+	/// @brief Index of the frame the next Read() will return
+	unsigned int position;
+	
+	/// @brief Whether the whole file has been read and the decoder is flushing its delayed frames
+	bool draining;
+	
+	/// @brief Color converter from the decoded pixel format to OpenCV's packed BGR
+	SwsContext* converter;
+	
+	/// @brief Timestamp of the first frame, in stream time base
+	int64_t start_time;
+	
+	/// @brief Nominal frame rate
+	AVRational framerate;
+	
+	/// @brief Number of frames in the video
+	unsigned int length;
+	
+	/// @brief Indices of every keyframe, in order
+	std::vector<unsigned int> keyframes;
+	
+public:
+	/// @brief Construct a VideoDecoderInternal reading from the file with the given name
+	/// 
+	/// @param[in] filename Name of the video file.
+	VideoDecoderInternal(const string& filename);
+	
+	/// @brief Copy constructor. Deleted
+	VideoDecoderInternal(const VideoDecoderInternal& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	VideoDecoderInternal& operator=(const VideoDecoderInternal& that) = delete;
+	
+	/// @brief Destruct this VideoDecoderInternal
+	~VideoDecoderInternal();
+	
+	/// @brief Get the number of frames in the video
+	unsigned int Length() const;
+	
+	/// @brief Get the nominal number of frames per second
+	double Framerate() const;
+	
+	/// @brief Get the frame width
+	unsigned int Width() const;
+	
+	/// @brief Get the frame height
+	unsigned int Height() const;
+	
+	/// @brief Get the index of the frame the next call to Read() will return
+	unsigned int Position() const;
+	
+	/// @brief Get the indices of every keyframe, in order
+	const std::vector<unsigned int>& Keyframes() const;
+	
+	/// @brief Get the index of the last keyframe at or before a frame
+	unsigned int KeyframeBefore(unsigned int index) const;
+	
+	/// @brief Decode and convert the next frame
+	bool Read(Mat& image);
+	
+	/// @brief Discard a number of frames, decoding but not converting them
+	bool Skip(unsigned int n);
+	
+	/// @brief Move to a frame, exactly or to its last keyframe
+	bool Seek(unsigned int index, bool exact);
+	
+private:
+	/// @brief Release every resource
+	void release();
+	
+	/// @brief Release every resource and throw an avexception
+	/// 
+	/// @param[in] message Explanatory message.
+	[[noreturn]] void fail(const char* message);
+	
+	/// @brief Read the keyframe positions, from the container index if available or else by
+	///        demuxing (but not decoding) the whole file
+	void build_index();
+	
+	/// @brief Decode the next frame into the internal frame
+	/// 
+	/// @returns True if a frame was decoded; otherwise (at the end of the video), false.
+	bool decode();
+	
+	/// @brief Convert a stream timestamp to a frame index
+	unsigned int ts2index(int64_t timestamp) const;
+	
+	/// @brief Convert a frame index to a stream timestamp
+	int64_t index2ts(unsigned int index) const;
+};
+
+// VideoDecoder definitions
+
+VideoDecoder::VideoDecoder(const string& filename)
+	: decoder(new VideoDecoderInternal(filename)) {}
+
+VideoDecoder::~VideoDecoder() = default;
+
+unsigned int VideoDecoder::Length() const
+{
+	return decoder->Length();
+}
+
+double VideoDecoder::Framerate() const
+{
+	return decoder->Framerate();
+}
+
+unsigned int VideoDecoder::Width() const
+{
+	return decoder->Width();
+}
+
+unsigned int VideoDecoder::Height() const
+{
+	return decoder->Height();
+}
+
+unsigned int VideoDecoder::Position() const
+{
+	return decoder->Position();
+}
+
+const std::vector<unsigned int>& VideoDecoder::Keyframes() const
+{
+	return decoder->Keyframes();
+}
+
+unsigned int VideoDecoder::KeyframeBefore(unsigned int index) const
+{
+	return decoder->KeyframeBefore(index);
+}
+
+bool VideoDecoder::Read(Mat& frame)
+{
+	return decoder->Read(frame);
+}
+
+bool VideoDecoder::Skip(unsigned int n)
+{
+	return decoder->Skip(n);
+}
+
+bool VideoDecoder::Seek(unsigned int index, bool exact)
+{
+	return decoder->Seek(index, exact);
+}
+
+// VideoDecoderInternal definitions
+
+VideoDecoderInternal::VideoDecoderInternal(const string& filename)
+	: context(nullptr),
+	  stream(nullptr),
+	  stream_index(-1),
+	  frame(nullptr),
+	  buffered(false),
+	  frame_index(0),
+	  position(0),
+	  draining(false),
+	  converter(nullptr),
+	  start_time(0),
+	  framerate(AVRational{25, 1}),
+	  length(0),
+	  keyframes()
+{
+	if (avformat_open_input(&context, filename.c_str(), nullptr, nullptr) < 0) {
+		fail("Can't open video file");
+	}
+	
+	if (avformat_find_stream_info(context, nullptr) < 0) {
+		fail("Can't read video streams");
+	}
+	
+	AVCodec* codec = nullptr;
+	stream_index   = av_find_best_stream(context, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+	
+	if (stream_index < 0 || codec == nullptr) {
+		fail("Can't find a decodable video stream");
+	}
+	
+	stream = context->streams[stream_index];
+	
+	if (avcodec_open2(stream->codec, codec, nullptr) < 0) {
+		stream = nullptr;
+		fail("Can't open codec");
+	}
+	
+	frame = avcodec_alloc_frame();
+	
+	if (frame == nullptr) {
+		fail("Can't allocate frame");
+	}
+	
+	if (stream->start_time != (int64_t) AV_NOPTS_VALUE) {
+		start_time = stream->start_time;
+	}
+	
+	if (stream->avg_frame_rate.num > 0 && stream->avg_frame_rate.den > 0) {
+		framerate = stream->avg_frame_rate;
+	}
+	else if (stream->r_frame_rate.num > 0 && stream->r_frame_rate.den > 0) {
+		framerate = stream->r_frame_rate;
+	}
+	
+	if (stream->nb_frames > 0) {
+		length = stream->nb_frames;
+	}
+	else if (stream->duration != (int64_t) AV_NOPTS_VALUE) {
+		length = ts2index(start_time + stream->duration);
+	}
+	else if (context->duration != (int64_t) AV_NOPTS_VALUE) {
+		length = av_rescale_q(context->duration, AVRational{1, AV_TIME_BASE}, av_inv_q(framerate));
+	}
+	
+	build_index();
+}
+
+VideoDecoderInternal::~VideoDecoderInternal()
+{
+	release();
+}
+
+void VideoDecoderInternal::release()
+{
+	if (converter != nullptr) {
+		sws_freeContext(converter);
+		converter = nullptr;
+	}
+	
+	if (frame != nullptr) {
+		av_freep(&frame);
+	}
+	
+	if (stream != nullptr) {
+		avcodec_close(stream->codec);
+		stream = nullptr;
+	}
+	
+	if (context != nullptr) {
+		avformat_close_input(&context);
+	}
+}
+
+void VideoDecoderInternal::fail(const char* message)
+{
+	release();
+	throw avexception(message);
+}
+
+void VideoDecoderInternal::build_index()
+{
+	keyframes.clear();
+	
+	// most containers (e.g. MP4) carry a sample index already
+	if (stream->nb_index_entries > 0) {
+		for (int i = 0; i < stream->nb_index_entries; i++) {
+			if (stream->index_entries[i].flags & AVINDEX_KEYFRAME) {
+				keyframes.push_back(ts2index(stream->index_entries[i].timestamp));
+			}
+		}
+		
+		if (length == 0) {
+			length = stream->nb_index_entries;
+		}
+	}
+	else {
+		AVPacket     packet;
+		unsigned int count = 0;
+		
+		while (av_read_frame(context, &packet) >= 0) {
+			if (packet.stream_index == stream_index) {
+				count += 1;
+				
+				if (packet.flags & AV_PKT_FLAG_KEY) {
+					keyframes.push_back(ts2index((packet.pts != (int64_t) AV_NOPTS_VALUE) ? packet.pts : packet.dts));
+				}
+			}
+			
+			av_free_packet(&packet);
+		}
 		
-		for (unsigned int i = 0, i2 = 0; i2 < stream.width; i++, i2 += 2) {
-			stream.frame->data[1][k * stream.frame->linesize[1] + i] = row[i2][1];
-			stream.frame->data[2][k * stream.frame->linesize[2] + i] = row[i2][2];
+		if (length == 0) {
+			length = count;
 		}
+		
+		av_seek_frame(context, stream_index, start_time, AVSEEK_FLAG_BACKWARD);
+		avcodec_flush_buffers(stream->codec);
 	}
 	
-	return stream;
+	std::sort(keyframes.begin(), keyframes.end());
+	keyframes.erase(std::unique(keyframes.begin(), keyframes.end()), keyframes.end());
+	
+	if (keyframes.empty() || keyframes[0] != 0) {
+		keyframes.insert(keyframes.begin(), 0);
+	}
 }
 
-VideoEncoderInternal& operator<<(VideoEncoderInternal& stream, unsigned int repeat)
+unsigned int VideoDecoderInternal::Length() const
+{
+	return length;
+}
+
+double VideoDecoderInternal::Framerate() const
 {
-	AVCodecContext* cctx = stream.stream->codec;
+	return av_q2d(framerate);
+}
+
+unsigned int VideoDecoderInternal::Width() const
+{
+	return stream->codec->width;
+}
+
+unsigned int VideoDecoderInternal::Height() const
+{
+	return stream->codec->height;
+}
+
+unsigned int VideoDecoderInternal::Position() const
+{
+	return position;
+}
+
+const std::vector<unsigned int>& VideoDecoderInternal::Keyframes() const
+{
+	return keyframes;
+}
+
+unsigned int VideoDecoderInternal::KeyframeBefore(unsigned int index) const
+{
+	auto after = std::upper_bound(keyframes.begin(), keyframes.end(), index);
 	
-	for (unsigned int i = 0; i < repeat; i++) {
-		AVPacket* packet  = static_cast<AVPacket*>(av_mallocz(sizeof (AVPacket)));
-		av_init_packet(packet);
-		packet->data = nullptr;
-		packet->size = 0;
+	return (after == keyframes.begin()) ? 0 : *(after - 1);
+}
+
+bool VideoDecoderInternal::Read(Mat& image)
+{
+	if (!buffered && !decode()) {
+		return false;
+	}
+	
+	buffered = false;
+	position = frame_index + 1;
+	
+	image.create(frame->height, frame->width, CV_8UC3);
+	
+	converter = sws_getCachedContext(converter, frame->width, frame->height, (AVPixelFormat) frame->format,
+	                                 frame->width, frame->height, PIX_FMT_BGR24,
+	                                 SWS_BILINEAR, nullptr, nullptr, nullptr);
+	
+	if (converter == nullptr) {
+		throw avexception("Can't create color converter");
+	}
+	
+	uint8_t* target[1] = {image.data};
+	int      stride[1] = {(int) image.step};
+	
+	sws_scale(converter, frame->data, frame->linesize, 0, frame->height, target, stride);
+	
+	return true;
+}
+
+bool VideoDecoderInternal::Skip(unsigned int n)
+{
+	unsigned int target = position + n;
+	
+	while (true) {
+		if (!buffered && !decode()) {
+			return false;
+		}
 		
-		stream.frame->pts = stream.frame_index;
+		buffered = true;
+		position = frame_index;
 		
-		if (packet == nullptr) {
-			throw avexception("Can't allocate packet");
+		if (frame_index >= target) {
+			return true;
 		}
 		
-		int gotpacket;
-		int encode_ret = avcodec_encode_video2(cctx, packet, stream.frame, &gotpacket);
+		buffered = false;
+	}
+}
+
+bool VideoDecoderInternal::Seek(unsigned int index, bool exact)
+{
+	unsigned int keyframe = KeyframeBefore(index);
+	
+	if (av_seek_frame(context, stream_index, index2ts((exact) ? index : keyframe), AVSEEK_FLAG_BACKWARD) < 0) {
+		return false;
+	}
+	
+	avcodec_flush_buffers(stream->codec);
+	
+	draining = false;
+	buffered = false;
+	
+	if (!decode()) {
+		return false;
+	}
+	
+	buffered = true;
+	position = frame_index;
+	
+	if (!exact || frame_index >= index) {
+		return true;
+	}
+	
+	return Skip(index - frame_index);
+}
+
+bool VideoDecoderInternal::decode()
+{
+	AVCodecContext* cctx = stream->codec;
+	
+	while (true) {
+		AVPacket packet;
+		
+		av_init_packet(&packet);
+		packet.data = nullptr;
+		packet.size = 0;
 		
-		if (encode_ret < 0) {
-			throw avexception(("Can't write video frame (" + std::to_string(-encode_ret) + ")").c_str());
+		if (!draining) {
+			if (av_read_frame(context, &packet) < 0) {
+				// an empty packet makes the decoder return its delayed frames
+				draining = true;
+				
+				av_init_packet(&packet);
+				packet.data = nullptr;
+				packet.size = 0;
+			}
+			else if (packet.stream_index != stream_index) {
+				av_free_packet(&packet);
+				continue;
+			}
 		}
 		
-		if (gotpacket) {
-			av_interleaved_write_frame(stream.context, packet);
+		int gotframe  = 0;
+		int decode_ret = avcodec_decode_video2(cctx, frame, &gotframe, &packet);
+		
+		av_free_packet(&packet);
+		
+		// corrupt packets are skipped, the decoder recovers at the next keyframe
+		if (decode_ret >= 0 && gotframe) {
+			int64_t timestamp = av_frame_get_best_effort_timestamp(frame);
+			
+			frame_index = (timestamp != (int64_t) AV_NOPTS_VALUE) ? ts2index(timestamp) : position;
+			return true;
 		}
 		
-		stream.frame_index += 1;
+		if (draining) {
+			return false;
+		}
+	}
+}
+
+unsigned int VideoDecoderInternal::ts2index(int64_t timestamp) const
+{
+	if (timestamp == (int64_t) AV_NOPTS_VALUE) {
+		return 0;
 	}
 	
-	return stream;
+	int64_t index = av_rescale_q(timestamp - start_time, stream->time_base, av_inv_q(framerate));
+	
+	return (index > 0) ? (unsigned int) index : 0;
+}
+
+int64_t VideoDecoderInternal::index2ts(unsigned int index) const
+{
+	return start_time + av_rescale_q(index, av_inv_q(framerate), stream->time_base);
 }
 
 // avexception definitions
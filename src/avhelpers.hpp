@@ -30,6 +30,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #include <stdexcept>
 
 #include <opencv2/opencv.hpp>
@@ -41,12 +42,138 @@ namespace libav
 {
 
 /// @brief Initialize the FFMPEG library
+/// 
+/// Also registers a lock manager, so encoders can be used concurrently from different threads.
+/// Only the first call has any effect, so every user of the library can call it.
 void initialize_ffmpeg();
 
+/// @brief Exact number of frames per second, as a fraction
+struct FrameRate
+{
+	/// @brief Numerator, e.g. 24000 for NTSC film
+	int num;
+	
+	/// @brief Denominator, e.g. 1001 for NTSC film
+	int den;
+};
+
+/// @brief Read the nominal frame rate of the video stream of a file, exactly
+/// 
+/// @param[in] filename Name of the video file.
+/// @param[out] framerate Frame rate, as declared by the video stream.
+/// @returns True if successful; otherwise, false.
+bool video_framerate(const string& filename, FrameRate& framerate);
+
+/// @brief Join video files into one, copying their streams without re-encoding
+/// 
+/// The inputs must share the same encoding parameters, e.g. written by VideoEncoders with
+/// identical settings, and each of them must start with a keyframe.
+/// 
+/// @param[in] inputs Names of the video files to join, in order.
+/// @param[in] lengths Duration of each input, in frames.
+/// @param[in] framerate Number of frames per second.
+/// @param[in] output Name of the joint video file.
+/// @param[in] audio Name of a file whose audio track is copied into the output along the way,
+///                  see EncoderConfig::audio; empty for a video-only output.
+void concatenate(const std::vector<string>& inputs, const std::vector<unsigned int>& lengths,
+                 const FrameRate& framerate, const string& output, const string& audio = "");
+
+/// @brief Video encoder settings
+struct EncoderConfig
+{
+	/// @brief Name of the libavcodec encoder, e.g. "libx264" or "h264_nvenc"
+	/// 
+	/// Empty to use the default encoder of the container format; "auto" to try the
+	/// hardware encoders first. Whenever the encoder can't be opened, e.g. there is
+	/// no such device, the default software encoder is used instead.
+	string codec;
+	
+	/// @brief Hardware device to encode on, e.g. the GPU index for NVENC; empty for the default one
+	string device;
+	
+	/// @brief Target bit rate, in bits per second; zero to use the quality setting instead
+	unsigned int bitrate;
+	
+	/// @brief Constant quality factor, e.g. x264's CRF, where lower is better; negative to use the bit rate
+	int quality;
+	
+	/// @brief Maximum number of frames between keyframes; zero for the default
+	unsigned int gop;
+	
+	/// @brief Name of the pixel format, e.g. "yuv420p" or "nv12"; empty for YUV420P
+	/// 
+	/// If the encoder doesn't support it, its own preferred format is used.
+	string pixfmt;
+	
+	/// @brief If true, repeated frames are encoded once and held on screen through
+	///        their timestamps (variable frame rate), so the encoding cost depends on
+	///        the number of distinct frames rather than the video duration; otherwise,
+	///        every repetition is encoded
+	bool holdframes;
+	
+	/// @brief If true, each chroma sample averages the 2x2 pixels it covers; otherwise,
+	///        it is taken from a single pixel, which is slightly faster but aliases thin
+	///        colored lines and text
+	bool averagechroma;
+	
+	/// @brief Exact frame rate, e.g. 24000/1001 for 23.976 fps footage; a zero numerator to use the
+	///        integer frame rate given to the encoder
+	FrameRate framerate;
+	
+	/// @brief Name of a file whose audio track is copied into the output without re-encoding, e.g.
+	///        the footage; empty for a video-only output
+	/// 
+	/// The audio is aligned so the first frame of the file's video stream is the first frame of the
+	/// output, and cut where the output ends. A file without audio gives a video-only output.
+	string audio;
+	
+	/// @brief Construct an EncoderConfig for the default software encoder at 2 Mbit/s
+	EncoderConfig();
+};
+
+/// @brief Check if an encoder configuration may use a hardware encoder
+/// 
+/// Hardware encoders usually support a handful of simultaneous sessions at most,
+/// so they are not suited to parallel encoding.
+/// 
+/// @param[in] config Encoder configuration.
+/// @returns True if the configured encoder is, or may resolve to, a hardware encoder; otherwise, false.
+bool hardware_encoder(const EncoderConfig& config);
+
 // Opaque reference to libav-using encoder. Separated to avoid exposing the
 // libav internals to the rest of the project.
 class VideoEncoderInternal;
 
+// Opaque reference to a libav image buffer.
+class EncoderImageInternal;
+
+class VideoEncoder;
+
+/// @brief Image already converted to the pixel format of a VideoEncoder
+/// 
+/// The color conversion is most of the cost of encoding a held frame, so an image shown several
+/// times can be converted once and then given to any encoder with the same size and pixel format.
+/// Copies share the same buffer, which is released with the last of them.
+class EncoderImage
+{
+private:
+	/// @brief Internal image buffer; null if empty
+	std::shared_ptr<const EncoderImageInternal> image;
+	
+public:
+	/// @brief Construct an empty EncoderImage
+	EncoderImage();
+	
+	/// @brief Check if there is no image
+	bool Empty() const;
+	
+	/// @brief Get the size of the image buffer, in bytes
+	size_t Size() const;
+	
+	friend class VideoEncoder;
+	friend VideoEncoder& operator<<(VideoEncoder& stream, const EncoderImage& image);
+};
+
 /// @brief Video encoder stream
 /// 
 /// This objects acts similarly to std::ofstream, but takes OpenCV frames and outputs them
@@ -65,7 +192,25 @@ public:
 	/// @param[in] width Width of the output video.
 	/// @param[in] height Height of the output video.
 	/// @param[in] framerate Number of frames per seconds.
-	VideoEncoder(const string& filename, unsigned int width, unsigned int height, unsigned int framerate);
+	/// @param[in] holdframes If true, repeated frames are encoded once and held on screen through
+	///                       their timestamps (variable frame rate), so the encoding cost depends on
+	///                       the number of distinct frames rather than the video duration; otherwise,
+	///                       every repetition is encoded.
+	/// @param[in] averagechroma If true, each chroma sample averages the 2x2 pixels it covers;
+	///                          otherwise, it is taken from a single pixel, which is slightly faster
+	///                          but aliases thin colored lines and text.
+	VideoEncoder(const string& filename, unsigned int width, unsigned int height, unsigned int framerate,
+	             bool holdframes = false, bool averagechroma = true);
+	
+	/// @brief Construct a VideoEncoder pointing to the file with the given name and custom settings
+	/// 
+	/// @param[in] filename Name of the file to save the video to.
+	/// @param[in] width Width of the output video.
+	/// @param[in] height Height of the output video.
+	/// @param[in] framerate Number of frames per seconds.
+	/// @param[in] config Encoder settings.
+	VideoEncoder(const string& filename, unsigned int width, unsigned int height, unsigned int framerate,
+	             const EncoderConfig& config);
 	
 	/// @brief Copy constructor. Deleted
 	VideoEncoder(const VideoEncoder& that) = delete;
@@ -87,26 +232,119 @@ public:
 	/// Trying to operate on the object after closing will result in an exception.
 	void Close();
 	
+	/// @brief Convert a BGR frame to the pixel format of this encoder, without encoding it
+	/// 
+	/// @param[in] image Frame, in 8-8-8-bit BGR format, with the size of the video.
+	/// @returns Converted frame, to be given to this or any identically configured encoder.
+	EncoderImage Convert(const Mat& image);
+	
 	friend VideoEncoder& operator<<(VideoEncoder& stream, const Mat& image);
+	friend VideoEncoder& operator<<(VideoEncoder& stream, const EncoderImage& image);
 	friend VideoEncoder& operator<<(VideoEncoder& stream, unsigned int repeat);
 };
 
-/// @brief Encode a RGB frame to video file
+/// @brief Encode a BGR frame to video file
 /// 
 /// @param[inout] stream Video encoder stream.
 /// @param[in] image New frame to append to the encoder stream.
 /// @returns Reference to the stream.
 VideoEncoder& operator<<(VideoEncoder& stream, const Mat& image);
 
+/// @brief Encode an already converted frame to video file
+/// 
+/// @param[inout] stream Video encoder stream.
+/// @param[in] image New frame to append to the encoder stream; it must have been converted
+///                  to the size and pixel format of this stream.
+/// @returns Reference to the stream.
+VideoEncoder& operator<<(VideoEncoder& stream, const EncoderImage& image);
+
 /// @brief Repeat the encoding of the last frame a number of times
 /// 
+/// If the stream holds frames, the last frame is only encoded once and
+/// the repetitions just extend its duration.
+/// 
 /// @param[inout] stream Video encoder stream.
 /// @param[in] repeat Number of times to re-encode the last frame into the stream.
 /// @returns Reference to the stream.
 VideoEncoder& operator<<(VideoEncoder& stream, unsigned int repeat);
 
+// Opaque reference to libav-using decoder.
+class VideoDecoderInternal;
+
+/// @brief Video decoder stream with random access
+/// 
+/// This object acts similarly to cv::VideoCapture, but it indexes the keyframes of the video
+/// once when opened, so it can seek directly to any frame, decoding only from the closest
+/// keyframe, and skip frames without converting them. Frames are numbered by their timestamp
+/// in the nominal frame rate, starting from zero.
+class VideoDecoder
+{
+private:
+	/// @brief Internal decoder
+	std::unique_ptr<VideoDecoderInternal> decoder;
+	
+public:
+	/// @brief Construct a VideoDecoder reading from the file with the given name
+	/// 
+	/// @param[in] filename Name of the video file.
+	VideoDecoder(const string& filename);
+	
+	/// @brief Copy constructor. Deleted
+	VideoDecoder(const VideoDecoder& that) = delete;
+	
+	/// @brief Copy assignment. Deleted
+	VideoDecoder& operator=(const VideoDecoder& that) = delete;
+	
+	/// @brief Destruct this VideoDecoder
+	~VideoDecoder();
+	
+	/// @brief Get the number of frames in the video
+	unsigned int Length() const;
+	
+	/// @brief Get the nominal number of frames per second
+	double Framerate() const;
+	
+	/// @brief Get the frame width
+	unsigned int Width() const;
+	
+	/// @brief Get the frame height
+	unsigned int Height() const;
+	
+	/// @brief Get the index of the frame the next call to Read() will return
+	unsigned int Position() const;
+	
+	/// @brief Get the indices of every keyframe, in order
+	const std::vector<unsigned int>& Keyframes() const;
+	
+	/// @brief Get the index of the last keyframe at or before a frame
+	/// 
+	/// @param[in] index Frame index.
+	/// @returns Keyframe index.
+	unsigned int KeyframeBefore(unsigned int index) const;
+	
+	/// @brief Decode the next frame
+	/// 
+	/// @param[out] frame Decoded frame, in 8-8-8-bit BGR format.
+	/// @returns True if successful; otherwise (e.g. at the end of the video), false.
+	bool Read(Mat& frame);
+	
+	/// @brief Discard a number of frames, decoding but not converting them
+	/// 
+	/// @param[in] n Number of frames to discard.
+	/// @returns True if there are frames left; otherwise, false.
+	bool Skip(unsigned int n);
+	
+	/// @brief Move to a frame
+	/// 
+	/// @param[in] index Frame index.
+	/// @param[in] exact If true, the next frame read is the requested one, decoded from its last
+	///                  keyframe; otherwise, it is just that keyframe, which is much faster.
+	/// @returns True if successful; otherwise, false.
+	bool Seek(unsigned int index, bool exact = true);
+};
+
 /// @brief Exception generated inside the FFMPEG library
-class avexception : std::runtime_error
+class avexception : public std::runtime_error
 {
 public:
 	/// @brief Construct an avexception with the given message
@@ -21,11 +21,18 @@
 #include <sstream>
 #include <ios>
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <algorithm>
+#include <iomanip>
 
-#include <wx/wxprec.h>
- 
-#ifndef WX_PRECOMP
-	#include <wx/wx.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 #include "util.hpp"
@@ -38,7 +45,7 @@ bool isnumeric(int c)
 	return '0' <= c && c <= '9';
 }
 
-int compare_lexiconumerical(const wxString& a, const wxString& b)
+int compare_lexiconumerical(const string& a, const string& b)
 {
 	unsigned int i;
 	unsigned int k;
@@ -228,4 +235,142 @@ int timestamp2index(string timestamp, unsigned int framerate)
 	return ((hours * 60 + minutes) * 60 + seconds) * framerate + frames;
 }
 
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+	const uint64_t       prime = 1099511628211ULL;
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	uint64_t             hash  = seed;
+	
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= prime;
+	}
+	
+	return hash;
+}
+
+uint64_t hash_string(const string& text, uint64_t seed)
+{
+	return hash_bytes(text.data(), text.size(), seed);
+}
+
+bool hash_file(const string& filename, uint64_t& hash)
+{
+	std::ifstream file(filename, std::ios::binary);
+	
+	if (!file.is_open()) {
+		return false;
+	}
+	
+	std::vector<char> buffer(1 << 20);
+	
+	hash = hash_seed;
+	
+	while (file) {
+		file.read(&buffer[0], buffer.size());
+		hash = hash_bytes(&buffer[0], file.gcount(), hash);
+	}
+	
+	return file.eof();
+}
+
+std::shared_ptr<const void> map_file(const string& filename, size_t& size)
+{
+#if defined(_WIN32)
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	
+	if (!file.is_open()) {
+		return nullptr;
+	}
+	
+	size = file.tellg();
+	
+	std::shared_ptr<char> buffer(new char[std::max<size_t>(size, 1)], std::default_delete<char[]>());
+	
+	file.seekg(0);
+	
+	if (!file.read(buffer.get(), size)) {
+		return nullptr;
+	}
+	
+	return buffer;
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	
+	if (fd < 0) {
+		return nullptr;
+	}
+	
+	struct stat status;
+	
+	if (fstat(fd, &status) != 0 || status.st_size == 0) {
+		close(fd);
+		return nullptr;
+	}
+	
+	size = status.st_size;
+	
+	void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	
+	// the mapping keeps its own reference to the file
+	close(fd);
+	
+	if (mapping == MAP_FAILED) {
+		return nullptr;
+	}
+	
+	size_t mapsize = size;
+	
+	return std::shared_ptr<const void>(mapping, [mapsize] (const void* data) {
+		munmap(const_cast<void*>(data), mapsize);
+	});
+#endif
+}
+
+string hash_hex(uint64_t hash)
+{
+	std::ostringstream text;
+	
+	text << std::hex << std::setw(16) << std::setfill('0') << hash;
+	
+	return text.str();
+}
+
+bool read_hashes(const string& filename, std::vector<uint64_t>& hashes)
+{
+	std::ifstream file(filename);
+	
+	if (!file.is_open()) {
+		return false;
+	}
+	
+	std::vector<uint64_t> read;
+	string                line;
+	
+	while (std::getline(file, line)) {
+		if (line.size() != 16 || line.find_first_not_of("0123456789abcdef") != string::npos) {
+			return false;
+		}
+		
+		read.push_back(std::stoull(line, nullptr, 16));
+	}
+	
+	hashes = read;
+	
+	return true;
+}
+
+bool write_hashes(const string& filename, const std::vector<uint64_t>& hashes)
+{
+	std::ofstream file(filename, std::ios::trunc);
+	
+	for (uint64_t hash : hashes) {
+		file << hash_hex(hash) << "\n";
+	}
+	
+	file.close();
+	
+	return (bool) file;
+}
+
 }
@@ -23,12 +23,10 @@
 #include <string>
 #include <sstream>
 #include <ios>
-
-#include <wx/wxprec.h>
- 
-#ifndef WX_PRECOMP
-	#include <wx/wx.h>
-#endif
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
 
 using std::string;
 
@@ -59,7 +57,7 @@ bool isnumeric(int c);
 /// @param[in] a First string
 /// @param[in] b Second string
 /// @returns Zero if a == b; < 0 if a < b; > 0 if a > b
-int compare_lexiconumerical(const wxString& a, const wxString& b);
+int compare_lexiconumerical(const string& a, const string& b);
 
 /// @brief std::istream skip-literal target
 /// 
@@ -132,6 +130,58 @@ string index2timestamp(unsigned int index, unsigned int framerate);
 /// @returns Frame index.
 int timestamp2index(string timestamp, unsigned int framerate);
 
+/// @brief Initial value for the hash functions
+const uint64_t hash_seed = 14695981039346656037ULL;
+
+/// @brief Compute a (non-cryptographic) 64-bit FNV-1a hash of a memory block
+/// 
+/// @param[in] data Start of the memory block.
+/// @param[in] size Size of the memory block, in bytes.
+/// @param[in] seed Previous hash value to continue from, for hashing several blocks as one.
+/// @returns Hash value.
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = hash_seed);
+
+/// @brief Compute a (non-cryptographic) 64-bit FNV-1a hash of a string
+/// 
+/// @param[in] text Input string.
+/// @param[in] seed Previous hash value to continue from.
+/// @returns Hash value.
+uint64_t hash_string(const string& text, uint64_t seed = hash_seed);
+
+/// @brief Compute a (non-cryptographic) 64-bit FNV-1a hash of the contents of a file
+/// 
+/// @param[in] filename Name of the file.
+/// @param[out] hash Hash value.
+/// @returns True if successful; false if the file couldn't be read.
+bool hash_file(const string& filename, uint64_t& hash);
+
+/// @brief Map a whole file into memory, read-only
+/// 
+/// Pages are private copy-on-write, so writing to them never changes the file. Where memory
+/// mapping isn't available, the file is read into a buffer instead.
+/// 
+/// @param[in] filename Name of the file.
+/// @param[out] size Size of the file, in bytes.
+/// @returns Owner of the mapped memory; null if the file couldn't be read.
+std::shared_ptr<const void> map_file(const string& filename, size_t& size);
+
+/// @brief Format a hash value as 16 hexadecimal digits, e.g. for a content-addressed file name
+string hash_hex(uint64_t hash);
+
+/// @brief Read a list of hash values from a text file, one per line
+/// 
+/// @param[in] filename Name of the file.
+/// @param[out] hashes Hash values.
+/// @returns True if successful; false if the file couldn't be read or is malformed.
+bool read_hashes(const string& filename, std::vector<uint64_t>& hashes);
+
+/// @brief Write a list of hash values to a text file, one per line
+/// 
+/// @param[in] filename Name of the file.
+/// @param[in] hashes Hash values.
+/// @returns True if successful; otherwise, false.
+bool write_hashes(const string& filename, const std::vector<uint64_t>& hashes);
+
 }
 
 #endif